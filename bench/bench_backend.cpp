@@ -0,0 +1,247 @@
+#include <math.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bench_common.h"
+#include "scanner.h"
+#include "parser.h"
+#include "vm.h"
+
+// 对比栈式后端(打开超级指令)和寄存器后端的执行耗时，以及两种字节码的静态指令条数
+// 用法: ./bench_backend [prog.js ...]，不带参数时跑内置脚本和js/目录下的样例
+// 脚本里print的输出被丢弃，不影响计时
+
+using aankaa::Scanner;
+using aankaa::Parser;
+using aankaa::VM;
+using aankaa::ObjFunction;
+using aankaa::InterpretResult;
+
+struct BenchScript {
+    std::string name;
+    std::string source;
+    int ops; // 每次执行的循环次数，用来折算单次迭代的耗时
+};
+
+static const int LOOP_COUNT = 200000;
+
+std::vector<BenchScript> builtin_scripts() {
+    std::vector<BenchScript> scripts;
+    scripts.push_back({"arith_loop",
+        "fun loop(n) {\n"
+        "    var i = 0;\n"
+        "    var sum = 0;\n"
+        "    while (i < n) {\n"
+        "        var t = i * 2;\n"
+        "        sum = sum + t - i / 4;\n"
+        "        i = i + 1;\n"
+        "    }\n"
+        "    return sum;\n"
+        "}\n"
+        "var result = loop(" + std::to_string(LOOP_COUNT) + ");\n",
+        LOOP_COUNT});
+    scripts.push_back({"global_loop",
+        "var i = 0;\n"
+        "var sum = 0;\n"
+        "while (i < " + std::to_string(LOOP_COUNT) + ") {\n"
+        "    sum = sum + i * 2 - 1;\n"
+        "    i = i + 1;\n"
+        "}\n",
+        LOOP_COUNT});
+    // 原生函数：sqrt走类型化入口，sqrt_value走通用入口
+    for (std::string native : {"sqrt", "sqrt_value"}) {
+        scripts.push_back({"native_loop_" + native,
+            "fun loop(n) {\n"
+            "    var i = 0;\n"
+            "    var sum = 0;\n"
+            "    while (i < n) {\n"
+            "        sum = sum + " + native + "(i);\n"
+            "        i = i + 1;\n"
+            "    }\n"
+            "    return sum;\n"
+            "}\n"
+            "var result = loop(" + std::to_string(LOOP_COUNT) + ");\n",
+            LOOP_COUNT});
+    }
+    // 尾递归，每层一次OP_TAIL_CALL
+    scripts.push_back({"tail_count",
+        "fun count(n, acc) {\n"
+        "    if (n < 1) return acc;\n"
+        "    return count(n - 1, acc + 1);\n"
+        "}\n"
+        "var i = 0;\n"
+        "var result = 0;\n"
+        "while (i < 20) {\n"
+        "    result = count(" + std::to_string(LOOP_COUNT / 20) + ", 0);\n"
+        "    i = i + 1;\n"
+        "}\n",
+        LOOP_COUNT});
+    // 回调：each对每个元素调用一次f。global不捕获变量(不创建闭包)，
+    // flat只读捕获(值直接在闭包里)，boxed累加到被捕获的变量(经过ObjUpvalue)
+    const std::string each =
+        "fun each(n, f) {\n"
+        "    var i = 0;\n"
+        "    while (i < n) { f(i); i = i + 1; }\n"
+        "}\n";
+    const std::string n = std::to_string(LOOP_COUNT);
+    scripts.push_back({"callback_global", each +
+        "var scale = 3;\n"
+        "var sum = 0;\n"
+        "fun add(x) { sum = sum + x * scale; }\n"
+        "each(" + n + ", add);\n",
+        LOOP_COUNT});
+    scripts.push_back({"callback_flat", each +
+        "fun run(n, scale) {\n"
+        "    fun scaled(x) { return x * scale; }\n"
+        "    each(n, scaled);\n"
+        "    return scaled(n);\n"
+        "}\n"
+        "var result = run(" + n + ", 3);\n",
+        LOOP_COUNT});
+    scripts.push_back({"callback_boxed", each +
+        "fun run(n, scale) {\n"
+        "    var sum = 0;\n"
+        "    fun add(x) { sum = sum + x * scale; }\n"
+        "    each(n, add);\n"
+        "    return sum;\n"
+        "}\n"
+        "var result = run(" + n + ", 3);\n",
+        LOOP_COUNT});
+    scripts.push_back({"fib",
+        "fun fib(n) {\n"
+        "    if (n < 2) return n;\n"
+        "    return fib(n - 2) + fib(n - 1);\n"
+        "}\n"
+        "var result = fib(20);\n",
+        21891}); // fib(20)的调用次数
+    return scripts;
+}
+
+std::vector<BenchScript> load_scripts(const std::vector<std::string>& paths) {
+    std::vector<BenchScript> scripts;
+    for (const std::string& path : paths) {
+        std::ifstream t(path);
+        if (!t) {
+            continue;
+        }
+        std::string content((std::istreambuf_iterator<char>(t)),
+                            std::istreambuf_iterator<char>());
+        scripts.push_back({path, content, 1});
+    }
+    return scripts;
+}
+
+static double native_sqrt(double x) {
+    return sqrt(x);
+}
+
+static aankaa::Value native_sqrt_value(int, aankaa::Value* args) {
+    if (!args[0].is_numeric()) {
+        return aankaa::Value::undefined();
+    }
+    return aankaa::Value(sqrt(args[0].to_double()));
+}
+
+// 函数和它常量表里嵌套的函数的指令条数之和
+void count_instructions(ObjFunction* function, size_t* stack_count, size_t* reg_count) {
+    std::vector<uint8_t>& code = function->chunk->code;
+    for (size_t i = 0; i < code.size(); i += aankaa::op_size(code[i])) {
+        (*stack_count)++;
+    }
+    if (function->reg_chunk != nullptr) {
+        *reg_count += function->reg_chunk->code.size();
+    }
+    for (const aankaa::Value& constant : function->chunk->constants) {
+        if (constant.is_obj_type(aankaa::OBJ_FUNCTION)) {
+            count_instructions(constant.as_function(), stack_count, reg_count);
+        }
+    }
+}
+
+void bench_script(const BenchScript& script, int times) {
+    std::ostringstream counts;
+    for (aankaa::Backend backend : {aankaa::BACKEND_STACK, aankaa::BACKEND_REGISTER}) {
+        VM vm;
+        vm.backend = backend;
+        vm.define_native<native_sqrt>("sqrt", aankaa::NATIVE_PURE);
+        vm.define_native("sqrt_value", native_sqrt_value, 1);
+        Scanner s;
+        s.reset(script.source);
+        Parser parser(&s, &vm);
+        parser.advance();
+        ObjFunction* function = parser.compile();
+        if (function == nullptr) {
+            std::cout << script.name << " compile failed" << std::endl;
+            return;
+        }
+        bool use_register = function->reg_chunk != nullptr;
+        if (backend == aankaa::BACKEND_REGISTER && !use_register) {
+            std::cout << script.name << " fallback to stack backend" << std::endl;
+            return;
+        }
+        auto run_once = [&] {
+            std::streambuf* out = std::cout.rdbuf();
+            std::ostringstream discard;
+            std::cout.rdbuf(discard.rdbuf());
+            InterpretResult result = aankaa::INTERPRET_OK;
+            uint64_t cost = run_single([&] {
+                vm.reset_stack();
+                if (use_register) {
+                    vm.enter_register_script(function);
+                } else {
+                    vm.enter_script(function);
+                }
+            }, [&] {
+                result = use_register ? vm.run_register() : vm.run();
+            }, [] {});
+            std::cout.rdbuf(out);
+            return result == aankaa::INTERPRET_OK ? cost : 0;
+        };
+        // 先试跑一次，运行出错的脚本不参与对比
+        if (run_once() == 0) {
+            std::cout << script.name << " runtime error" << std::endl;
+            return;
+        }
+        std::string name = script.name + (use_register ? "/register" : "/stack");
+        bench_many_times(name, run_once, script.ops, times);
+
+        size_t stack_count = 0;
+        size_t reg_count = 0;
+        count_instructions(function, &stack_count, &reg_count);
+        if (use_register) {
+            counts << " register:" << reg_count;
+        } else {
+            counts << "    instructions stack:" << stack_count;
+        }
+    }
+    std::cout << counts.str() << std::endl;
+}
+
+std::vector<BenchScript> scripts;
+
+int32_t run_bench() {
+    std::cout << std::left << std::setw(45) << "name"
+              << "    max(ns/op)  avg(ns/op)  min(ns/op)" << std::endl;
+    for (auto& script : scripts) {
+        bench_script(script, 10);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> paths(argv + 1, argv + argc);
+    if (paths.empty()) {
+        scripts = builtin_scripts();
+        // 其余样例会运行出错或者sleep，不适合计时
+        for (const char* name : {"prog1_1", "prog2_1", "prog3_1", "prog3_2",
+                                 "prog4_0", "prog4_2", "prog4_3", "prog5_1"}) {
+            paths.push_back(std::string("js/") + name + ".js");
+        }
+    }
+    for (auto& script : load_scripts(paths)) {
+        scripts.push_back(std::move(script));
+    }
+    return run_bench();
+}
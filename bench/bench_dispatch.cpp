@@ -0,0 +1,120 @@
+#include <assert.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "bench_common.h"
+#include "scanner.h"
+#include "parser.h"
+#include "vm.h"
+
+// 对比threaded dispatch和switch两种分发方式的解释器主循环，以及有没有融合超级指令(nofuse)
+// 用法: ./bench_dispatch [prog.js ...]，不带参数时只跑内置的循环脚本
+
+using aankaa::Scanner;
+using aankaa::Parser;
+using aankaa::VM;
+using aankaa::ObjFunction;
+using aankaa::InterpretResult;
+
+struct BenchScript {
+    std::string name;
+    std::string source;
+    int ops; // 每次执行的循环次数，用来折算单次迭代的耗时
+};
+
+static const int LOOP_COUNT = 200000;
+
+std::vector<BenchScript> builtin_scripts() {
+    std::vector<BenchScript> scripts;
+    scripts.push_back({"while_loop",
+        "var i = 0;\n"
+        "var sum = 0;\n"
+        "while (i < " + std::to_string(LOOP_COUNT) + ") {\n"
+        "    sum = sum + i * 2 - 1;\n"
+        "    i = i + 1;\n"
+        "}\n",
+        LOOP_COUNT});
+    scripts.push_back({"call_loop",
+        "fun add(a, b) {\n"
+        "    return a + b;\n"
+        "}\n"
+        "var i = 0;\n"
+        "var sum = 0;\n"
+        "while (i < " + std::to_string(LOOP_COUNT) + ") {\n"
+        "    sum = add(sum, i);\n"
+        "    i = i + 1;\n"
+        "}\n",
+        LOOP_COUNT});
+    scripts.push_back({"local_loop",
+        "fun loop(n) {\n"
+        "    var i = 0;\n"
+        "    var sum = 0;\n"
+        "    while (i < n) {\n"
+        "        sum = sum + i * 2 - 1;\n"
+        "        i = i + 1;\n"
+        "    }\n"
+        "    return sum;\n"
+        "}\n"
+        "var result = loop(" + std::to_string(LOOP_COUNT) + ");\n",
+        LOOP_COUNT});
+    return scripts;
+}
+
+template <typename RunFunc>
+uint64_t run_once(VM& vm, ObjFunction* function, RunFunc run) {
+    return run_single([&] {
+        vm.reset_stack();
+        vm.enter_script(function);
+    }, [&] {
+        InterpretResult result = run(vm);
+        assert(result == aankaa::INTERPRET_OK);
+        (void)result;
+    }, [] {});
+}
+
+void bench_script(const BenchScript& script, bool peephole, int times) {
+    VM vm;
+    Scanner s;
+    s.reset(script.source);
+    Parser parser(&s, &vm);
+    parser.enable_peephole = peephole;
+    parser.advance();
+    ObjFunction* function = parser.compile();
+    if (function == nullptr) {
+        std::cout << script.name << " compile failed" << std::endl;
+        return;
+    }
+    std::string name = script.name + (peephole ? "" : "/nofuse");
+    bench_many_times(name + "/switch", [&] {
+        return run_once(vm, function, [](VM& v) { return v.run_switch(); });
+    }, script.ops, times);
+#if AANKAA_COMPUTED_GOTO
+    bench_many_times(name + "/threaded", [&] {
+        return run_once(vm, function, [](VM& v) { return v.run_threaded(); });
+    }, script.ops, times);
+#endif
+}
+
+std::vector<BenchScript> scripts;
+
+int32_t run_bench() {
+    std::cout << std::left << std::setw(45) << "name"
+              << "    max(ns/op)  avg(ns/op)  min(ns/op)" << std::endl;
+    for (auto& script : scripts) {
+        bench_script(script, false, 10);
+        bench_script(script, true, 10);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    scripts = builtin_scripts();
+    for (int i = 1; i < argc; ++i) {
+        std::ifstream t(argv[i]);
+        std::string content((std::istreambuf_iterator<char>(t)),
+                            std::istreambuf_iterator<char>());
+        scripts.push_back({argv[i], content, 1});
+    }
+    return run_bench();
+}
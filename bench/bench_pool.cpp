@@ -0,0 +1,171 @@
+#include <string>
+#include <vector>
+
+#include "bench_common.h"
+#include "pool.h"
+#include "object.h"
+#include "chunk.h"
+
+// 对比slab对象池、原来的数组+链表对象池和直接new/delete
+//   alloc_all: 连续分配N个对象，最后统一回收(编译期分配函数对象的场景)
+//   churn:     保持一个固定大小的活跃窗口，不停地分配和释放(GC回收对象的场景)，
+//              原来的对象池不支持单个回收，只能一直分配到最后
+// 用法: ./bench_pool
+
+using aankaa::ObjectPool;
+using aankaa::ObjNative;
+
+static const int OBJECT_COUNT = 100000;
+static const int WINDOW = 1024;
+
+namespace legacy {
+
+using Allocator = std::allocator<uint8_t>;
+
+// 原来的ObjectPool: 先用一个固定大小的数组，用完之后每个对象单独分配并挂到链表上
+template<typename T>
+class ObjectPool {
+public:
+    ObjectPool(size_t num) {
+        _elements = (T*)Allocator().allocate(sizeof(T) * num);
+        _capacity = num;
+    }
+
+    template<class... Args>
+    T* get(Args&&... args) {
+        if (_size < _capacity) {
+            new(_elements + _size) T(std::forward<Args>(args)...);
+            return (_elements + _size++);
+        }
+        Node* node = (Node*)Allocator().allocate(sizeof(Node));
+        new(&node->value) T(std::forward<Args>(args)...);
+        node->next = nullptr;
+        if (_tail) {
+            _tail->next = node;
+        } else {
+            _head = node;
+        }
+        _tail = node;
+        return &node->value;
+    }
+
+    void clear() {
+        for (size_t k = 0; k < _size; ++k) {
+            _elements[k].~T();
+        }
+        _size = 0;
+        while (_head != nullptr) {
+            Node* next = _head->next;
+            _head->value.~T();
+            Allocator().deallocate((uint8_t*)_head, sizeof(Node));
+            _head = next;
+        }
+        _tail = nullptr;
+    }
+
+    ~ObjectPool() {
+        clear();
+        Allocator().deallocate((uint8_t*)_elements, sizeof(T) * _capacity);
+    }
+private:
+    struct Node {
+        T value;
+        Node* next;
+    };
+    T* _elements = nullptr;
+    size_t _size = 0;
+    size_t _capacity = 0;
+    Node* _head = nullptr;
+    Node* _tail = nullptr;
+};
+
+} // namespace legacy
+
+static aankaa::Value dummy_native(int, aankaa::Value*) {
+    return aankaa::Value();
+}
+
+template <typename Pool>
+uint64_t pool_alloc_all() {
+    Pool pool(DEFAULT_POOL_NUM);
+    return run_single([] {}, [&] {
+        for (int i = 0; i < OBJECT_COUNT; ++i) {
+            pool.get(dummy_native);
+        }
+        pool.clear();
+    }, [] {});
+}
+
+uint64_t new_alloc_all() {
+    std::vector<ObjNative*> objs;
+    objs.reserve(OBJECT_COUNT);
+    return run_single([] {}, [&] {
+        for (int i = 0; i < OBJECT_COUNT; ++i) {
+            objs.push_back(new ObjNative(dummy_native));
+        }
+        for (ObjNative* obj : objs) {
+            delete obj;
+        }
+        objs.clear();
+    }, [] {});
+}
+
+uint64_t slab_churn() {
+    ObjectPool<ObjNative> pool;
+    std::vector<ObjNative*> window(WINDOW, nullptr);
+    uint64_t ns = run_single([] {}, [&] {
+        for (int i = 0; i < OBJECT_COUNT; ++i) {
+            ObjNative*& slot = window[i % WINDOW];
+            if (slot != nullptr) {
+                pool.release(slot);
+            }
+            slot = pool.get(dummy_native);
+        }
+    }, [] {});
+    static bool printed = false;
+    if (!printed) {
+        printed = true;
+        pool.stats().print();
+    }
+    return ns;
+}
+
+uint64_t legacy_churn() {
+    legacy::ObjectPool<ObjNative> pool(DEFAULT_POOL_NUM);
+    return run_single([] {}, [&] {
+        for (int i = 0; i < OBJECT_COUNT; ++i) {
+            pool.get(dummy_native);
+        }
+    }, [] {});
+}
+
+uint64_t new_churn() {
+    std::vector<ObjNative*> window(WINDOW, nullptr);
+    uint64_t ns = run_single([] {}, [&] {
+        for (int i = 0; i < OBJECT_COUNT; ++i) {
+            ObjNative*& slot = window[i % WINDOW];
+            delete slot;
+            slot = new ObjNative(dummy_native);
+        }
+    }, [] {});
+    for (ObjNative* obj : window) {
+        delete obj;
+    }
+    return ns;
+}
+
+int32_t run_bench() {
+    std::cout << std::left << std::setw(45) << "name"
+              << "    max(ns/op)  avg(ns/op)  min(ns/op)" << std::endl;
+    bench_many_times("alloc_all/slab_pool", pool_alloc_all<ObjectPool<ObjNative>>, OBJECT_COUNT, 10);
+    bench_many_times("alloc_all/legacy_pool", pool_alloc_all<legacy::ObjectPool<ObjNative>>, OBJECT_COUNT, 10);
+    bench_many_times("alloc_all/new", new_alloc_all, OBJECT_COUNT, 10);
+    bench_many_times("churn/slab_pool", slab_churn, OBJECT_COUNT, 10);
+    bench_many_times("churn/legacy_pool", legacy_churn, OBJECT_COUNT, 10);
+    bench_many_times("churn/new", new_churn, OBJECT_COUNT, 10);
+    return 0;
+}
+
+int main() {
+    return run_bench();
+}
@@ -0,0 +1,224 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bench_common.h"
+#include "scanner.h"
+#include "parser.h"
+#include "vm.h"
+
+// 字段读写和方法调用循环的耗时，以及属性访问点内联缓存的命中率
+// 单态、多态(不超过PROPERTY_CACHE_WAYS个shape)和超出缓存路数的访问点各跑一组
+// 用法: ./bench_property [-v] [prog.js ...]，-v时打印每个访问点的缓存统计
+
+using aankaa::Scanner;
+using aankaa::Parser;
+using aankaa::VM;
+using aankaa::ObjFunction;
+using aankaa::InterpretResult;
+
+struct BenchScript {
+    std::string name;
+    std::string source;
+    int ops; // 每次执行的循环次数，用来折算单次迭代的耗时
+};
+
+static const int LOOP_COUNT = 200000;
+
+// 构造count种不同shape的实例：第k个实例先加k个占位字段，再加被读取的字段v
+static std::string shape_makers(int count) {
+    std::string source = "class S {}\n"
+                         "fun make(n) {\n"
+                         "    var o = S();\n";
+    for (int k = 0; k < count - 1; ++k) {
+        source += "    if (n > " + std::to_string(k) + ") o.f" + std::to_string(k) + " = 0;\n";
+    }
+    source += "    o.v = 1;\n"
+              "    return o;\n"
+              "}\n"
+              "fun read(o) { return o.v; }\n";
+    return source;
+}
+
+static std::string poly_loop(int count) {
+    std::string source = shape_makers(count) + "fun loop(n) {\n";
+    std::string sum = "sum";
+    for (int k = 0; k < count; ++k) {
+        source += "    var o" + std::to_string(k) + " = make(" + std::to_string(k) + ");\n";
+        sum += " + read(o" + std::to_string(k) + ")";
+    }
+    source += "    var i = 0;\n"
+              "    var sum = 0;\n"
+              "    while (i < n) {\n"
+              "        sum = " + sum + ";\n"
+              "        i = i + 1;\n"
+              "    }\n"
+              "    return sum;\n"
+              "}\n"
+              "var result = loop(" + std::to_string(LOOP_COUNT / count) + ");\n";
+    return source;
+}
+
+std::vector<BenchScript> builtin_scripts() {
+    std::vector<BenchScript> scripts;
+    scripts.push_back({"field_loop",
+        "class Counter { init() { this.count = 0; this.step = 1; } }\n"
+        "fun loop(n) {\n"
+        "    var c = Counter();\n"
+        "    var i = 0;\n"
+        "    while (i < n) {\n"
+        "        c.count = c.count + c.step;\n"
+        "        i = i + 1;\n"
+        "    }\n"
+        "    return c.count;\n"
+        "}\n"
+        "var result = loop(" + std::to_string(LOOP_COUNT) + ");\n",
+        LOOP_COUNT});
+    scripts.push_back({"method_loop",
+        "class Counter {\n"
+        "    init() { this.count = 0; }\n"
+        "    add(k) { this.count = this.count + k; return this.count; }\n"
+        "}\n"
+        "fun loop(n) {\n"
+        "    var c = Counter();\n"
+        "    var i = 0;\n"
+        "    while (i < n) {\n"
+        "        c.add(i);\n"
+        "        i = i + 1;\n"
+        "    }\n"
+        "    return c.count;\n"
+        "}\n"
+        "var result = loop(" + std::to_string(LOOP_COUNT) + ");\n",
+        LOOP_COUNT});
+    // 和method_loop相同的调用拆成取属性和调用两步，每次都要创建绑定方法
+    scripts.push_back({"bound_method_loop",
+        "class Counter {\n"
+        "    init() { this.count = 0; }\n"
+        "    add(k) { this.count = this.count + k; return this.count; }\n"
+        "}\n"
+        "fun loop(n) {\n"
+        "    var c = Counter();\n"
+        "    var i = 0;\n"
+        "    while (i < n) {\n"
+        "        var m = c.add;\n"
+        "        m(i);\n"
+        "        i = i + 1;\n"
+        "    }\n"
+        "    return c.count;\n"
+        "}\n"
+        "var result = loop(" + std::to_string(LOOP_COUNT) + ");\n",
+        LOOP_COUNT});
+    scripts.push_back({"inherited_method_loop",
+        "class Base { get() { return this.v; } }\n"
+        "class Derived < Base { init() { this.v = 1; } }\n"
+        "fun loop(n) {\n"
+        "    var d = Derived();\n"
+        "    var i = 0;\n"
+        "    var sum = 0;\n"
+        "    while (i < n) {\n"
+        "        sum = sum + d.get();\n"
+        "        i = i + 1;\n"
+        "    }\n"
+        "    return sum;\n"
+        "}\n"
+        "var result = loop(" + std::to_string(LOOP_COUNT) + ");\n",
+        LOOP_COUNT});
+    scripts.push_back({"poly_field_loop/4", poly_loop(aankaa::PROPERTY_CACHE_WAYS), LOOP_COUNT});
+    scripts.push_back({"mega_field_loop/8", poly_loop(aankaa::PROPERTY_CACHE_WAYS * 2), LOOP_COUNT});
+    return scripts;
+}
+
+static void sum_property_caches(ObjFunction* function, uint64_t* hits, uint64_t* misses) {
+    for (const aankaa::PropertyCache& cache : function->chunk->property_caches) {
+        *hits += cache.hits;
+        *misses += cache.misses;
+    }
+    for (const aankaa::Value& constant : function->chunk->constants) {
+        if (constant.is_obj_type(aankaa::OBJ_FUNCTION)) {
+            sum_property_caches(constant.as_function(), hits, misses);
+        }
+    }
+}
+
+static bool verbose = false;
+
+void bench_script(const BenchScript& script, int times) {
+    // 每次执行用新的VM重新编译，缓存从空开始，命中率包含每次执行填充缓存的未命中
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    bool print_stats = verbose;
+    auto run_once = [&] {
+        VM vm;
+        Scanner s;
+        s.reset(script.source);
+        Parser parser(&s, &vm);
+        parser.advance();
+        ObjFunction* function = parser.compile();
+        if (function == nullptr) {
+            return uint64_t(0);
+        }
+        std::streambuf* out = std::cout.rdbuf();
+        std::ostringstream discard;
+        std::cout.rdbuf(discard.rdbuf());
+        InterpretResult result = aankaa::INTERPRET_OK;
+        uint64_t cost = run_single([&] {
+            vm.enter_script(function);
+        }, [&] {
+            result = vm.run();
+        }, [] {});
+        std::cout.rdbuf(out);
+        sum_property_caches(function, &hits, &misses);
+        if (print_stats) {
+            aankaa::print_call_site_stats(function, std::cout);
+            print_stats = false;
+        }
+        return result == aankaa::INTERPRET_OK ? cost : 0;
+    };
+    // 先试跑一次，编译或者运行出错的脚本不参与对比
+    if (run_once() == 0) {
+        std::cout << script.name << " compile failed or runtime error" << std::endl;
+        return;
+    }
+    bench_many_times(script.name, run_once, script.ops, times);
+
+    uint64_t total = hits + misses;
+    std::cout << "    property cache hits:" << hits << " misses:" << misses;
+    if (total > 0) {
+        std::cout << " hit rate:" << std::fixed << std::setprecision(2)
+                  << 100.0 * hits / total << "%" << std::defaultfloat;
+    }
+    std::cout << std::endl;
+}
+
+std::vector<BenchScript> scripts;
+
+int32_t run_bench() {
+    std::cout << std::left << std::setw(45) << "name"
+              << "    max(ns/op)  avg(ns/op)  min(ns/op)" << std::endl;
+    for (auto& script : scripts) {
+        bench_script(script, 10);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "-v") {
+            verbose = true;
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+    if (paths.empty()) {
+        scripts = builtin_scripts();
+    }
+    for (auto& path : paths) {
+        std::ifstream t(path);
+        std::string content((std::istreambuf_iterator<char>(t)),
+                            std::istreambuf_iterator<char>());
+        scripts.push_back({path, content, 1});
+    }
+    return run_bench();
+}
@@ -0,0 +1,222 @@
+#include <assert.h>
+#include <unistd.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "bench_common.h"
+#include "scanner.h"
+#include "source_buffer.h"
+#include "keywords.h"
+
+// 扫描吞吐: 扫描几MB到几十MB的源码，输出MB/s和每秒的token数
+// copy   读文件到std::string再复制一份交给扫描器(原来main.cpp的做法)
+// borrow 扫描器直接借用内存里的std::string
+// mmap   mmap源码文件，扫描器直接读映射的内存
+// borrow再分别用标量、SSE2、AVX2的扫描kernel各跑一遍(CPU不支持的级别跳过)
+// 最后对标识符很多的源码里的每个标识符查关键字，对比完美哈希和原来按字母展开的switch
+// 用法: ./bench_scan [prog.js ...]
+
+using aankaa::Scanner;
+using aankaa::SourceBuffer;
+using aankaa::Token;
+
+struct BenchSource {
+    std::string name;
+    std::string source;
+};
+
+// code: 普通的代码，token都很短
+// text: 大段的注释、长字符串和深缩进，向量kernel一次能跳过很多字节
+static const char* CODE_BLOCK =
+    "// 一段有注释、字符串和各种运算符的代码\n"
+    "fun fib(n) {\n"
+    "    if (n < 2) return n;\n"
+    "    return fib(n - 2) + fib(n - 1);\n"
+    "}\n"
+    "var message = \"hello world, this is a string literal\";\n"
+    "var total = 0;\n"
+    "for (var i = 0; i <= 100; i = i + 1) {\n"
+    "    total = total + i * 2.5 / 3 - fib(10);\n"
+    "    if (total >= 1000 and i != 50) { print message; } else { total = -total; }\n"
+    "}\n";
+
+static const char* TEXT_BLOCK =
+    "// ------------------------------------------------------------------------------------------\n"
+    "// The scanner skips this comment line with the line-end kernel and never looks at the words.\n"
+    "// ------------------------------------------------------------------------------------------\n"
+    "var doc = \"A long string literal that spans many bytes, keeps going for a while, and then\n"
+    "continues on the next line so that the quote kernel also has to count the newlines inside.\";\n"
+    "                                    var deeply_indented_identifier_name = 1234567890123456;\n";
+
+// ident: 大量和关键字首字母相同、长度相近的标识符
+static const char* IDENT_BLOCK =
+    "var fortune = falsehood or classic and this_value or thistle;\n"
+    "while (total) { print returned; fun_count = fun_count + forest; }\n"
+    "if (nilly and superb) { supper = truth or variance; } else { elsewhere = whilst; }\n"
+    "for (var index = 0; index < count; index = index + 1) { return andante; }\n";
+
+static std::string generate_source(const char* block, size_t bytes) {
+    std::string source;
+    source.reserve(bytes + 1024);
+    while (source.size() < bytes) {
+        source += block;
+    }
+    return source;
+}
+
+static size_t scan_all(Scanner* s, SourceBuffer source) {
+    s->reset(std::move(source));
+    size_t count = 0;
+    for (Token token = s->scan_token(); token.type != aankaa::EEOF; token = s->scan_token()) {
+        assert(token.type != aankaa::ERROR);
+        count++;
+    }
+    return count;
+}
+
+static std::string read_file(const std::string& path) {
+    std::ifstream t(path.c_str());
+    return std::string((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
+}
+
+template <typename Func>
+static void bench_throughput(const std::string& name, size_t bytes, Func&& fn, int times) {
+    uint64_t min = UINTMAX_MAX;
+    uint64_t sum = 0;
+    size_t tokens = 0;
+    for (int i = 0; i < times; ++i) {
+        uint64_t cost = run_single([] {}, [&] { tokens = fn(); }, [] {});
+        sum += cost;
+        min = std::min(cost, min);
+    }
+    double mb = bytes / (1024.0 * 1024.0);
+    double avg_seconds = sum / times / 1e9;
+    std::cout << std::left << std::setw(45) << name << std::fixed << std::setprecision(1)
+              << "    " << std::right << std::setw(8) << mb / avg_seconds << " MB/s"
+              << "    " << std::right << std::setw(8) << mb / (min / 1e9) << " MB/s"
+              << "    " << std::right << std::setw(8) << tokens / avg_seconds / 1e6 << " Mtok/s"
+              << std::endl;
+}
+
+// 原来Scanner::identifier_type的写法，只用来对比
+static int check_keyword(const char* start, int size, int offset, int length, const char* rest, int type) {
+    if (size == offset + length && memcmp(start + offset, rest, length) == 0) {
+        return type;
+    }
+    return aankaa::IDENTIFIER;
+}
+
+static int switch_keyword_type(const char* start, int size) {
+    switch (start[0]) {
+    case 'a': return check_keyword(start, size, 1, 2, "nd", aankaa::AND);
+    case 'c': return check_keyword(start, size, 1, 4, "lass", aankaa::CLASS);
+    case 'e': return check_keyword(start, size, 1, 3, "lse", aankaa::ELSE);
+    case 'f':
+        if (size > 1) {
+            switch (start[1]) {
+            case 'a': return check_keyword(start, size, 2, 3, "lse", aankaa::FALSE);
+            case 'o': return check_keyword(start, size, 2, 1, "r", aankaa::FOR);
+            case 'u': return check_keyword(start, size, 2, 1, "n", aankaa::FUN);
+            }
+        }
+        break;
+    case 'i': return check_keyword(start, size, 1, 1, "f", aankaa::IF);
+    case 'n': return check_keyword(start, size, 1, 2, "il", aankaa::NIL);
+    case 'o': return check_keyword(start, size, 1, 1, "r", aankaa::OR);
+    case 'p': return check_keyword(start, size, 1, 4, "rint", aankaa::PRINT);
+    case 'r': return check_keyword(start, size, 1, 5, "eturn", aankaa::RETURN);
+    case 's': return check_keyword(start, size, 1, 4, "uper", aankaa::SUPER);
+    case 't':
+        if (size > 1) {
+            switch (start[1]) {
+            case 'h': return check_keyword(start, size, 2, 2, "is", aankaa::THIS);
+            case 'r': return check_keyword(start, size, 2, 2, "ue", aankaa::TRUE);
+            }
+        }
+        break;
+    case 'v': return check_keyword(start, size, 1, 2, "ar", aankaa::VAR);
+    case 'w': return check_keyword(start, size, 1, 4, "hile", aankaa::WHILE);
+    }
+    return aankaa::IDENTIFIER;
+}
+
+template <typename Lookup>
+static void bench_keyword_lookup(const std::string& name, const std::vector<Token>& idents, Lookup&& lookup) {
+    bench_many_times(name + "/" + std::to_string(idents.size()), [&] {
+        size_t keywords = 0;
+        uint64_t ns = run_single([] {}, [&] {
+            for (const Token& token : idents) {
+                keywords += lookup(token.start, token.length) != aankaa::IDENTIFIER;
+            }
+        }, [] {});
+        assert(keywords > 0);
+        (void)keywords;
+        return ns;
+    }, idents.size(), 10);
+}
+
+std::vector<BenchSource> sources;
+
+int32_t run_bench() {
+    std::cout << std::left << std::setw(45) << "name"
+              << "    avg(MB/s)      max(MB/s)      avg(Mtok/s)" << std::endl;
+    std::string path = "/tmp/aankaa_bench_scan_" + std::to_string(getpid()) + ".js";
+    for (auto& item : sources) {
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << item.source;
+        size_t bytes = item.source.size();
+        std::string size = "/" + std::to_string(bytes / 1024) + "KB";
+        Scanner s;
+        bench_throughput("copy/" + item.name + size, bytes, [&] {
+            std::string content = read_file(path);
+            return scan_all(&s, SourceBuffer::copy(content));
+        }, 10);
+        for (int level = aankaa::SIMD_SCALAR; level <= aankaa::detect_simd_level(); ++level) {
+            Scanner simd;
+            simd.set_simd_level(static_cast<aankaa::SimdLevel>(level));
+            std::string name = aankaa::simd_level_name(static_cast<aankaa::SimdLevel>(level));
+            bench_throughput("borrow_" + name + "/" + item.name + size, bytes, [&] {
+                return scan_all(&simd, item.source);
+            }, 10);
+        }
+        bench_throughput("mmap/" + item.name + size, bytes, [&] {
+            SourceBuffer buffer;
+            std::string error;
+            bool ok = buffer.map_file(path, &error);
+            assert(ok);
+            (void)ok;
+            return scan_all(&s, std::move(buffer));
+        }, 10);
+    }
+    unlink(path.c_str());
+
+    // 标识符和关键字的token，扫描时它们都要查一次关键字表
+    std::string source = generate_source(IDENT_BLOCK, 8 << 20);
+    Scanner s;
+    s.reset(source);
+    std::vector<Token> idents;
+    for (Token token = s.scan_token(); token.type != aankaa::EEOF; token = s.scan_token()) {
+        if (token.type == aankaa::IDENTIFIER || aankaa::keyword_type(token.start, token.length) != aankaa::IDENTIFIER) {
+            idents.push_back(token);
+        }
+    }
+    std::cout << std::left << std::setw(45) << "keyword lookup"
+              << "    max(ns)     avg(ns)     min(ns)" << std::endl;
+    bench_keyword_lookup("switch", idents, switch_keyword_type);
+    bench_keyword_lookup("perfect_hash", idents, [](const char* start, int length) {
+        return aankaa::keyword_type(start, length);
+    });
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    for (int mb : {1, 8, 32}) {
+        sources.push_back({"code_" + std::to_string(mb) + "MB", generate_source(CODE_BLOCK, mb << 20)});
+    }
+    sources.push_back({"text_8MB", generate_source(TEXT_BLOCK, 8 << 20)});
+    sources.push_back({"ident_8MB", generate_source(IDENT_BLOCK, 8 << 20)});
+    for (int i = 1; i < argc; ++i) {
+        sources.push_back({argv[i], read_file(argv[i])});
+    }
+    return run_bench();
+}
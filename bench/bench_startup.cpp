@@ -0,0 +1,133 @@
+#include <assert.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "bench_common.h"
+#include "scanner.h"
+#include "parser.h"
+#include "vm.h"
+
+// 启动耗时: 扫描+编译一份源码需要的时间，按每KB源码折算
+// 生成的脚本由很多函数组成，每个函数的body重复若干次，用来得到不同大小的源码。
+// 最后输出每份源码编译出的字节码大小和行号表占用的内存，和每个字节记一个int的做法对比
+// 用法: ./bench_startup [prog.js ...]
+
+using aankaa::Scanner;
+using aankaa::Parser;
+using aankaa::VM;
+using aankaa::ObjFunction;
+
+struct BenchSource {
+    std::string name;
+    std::string source;
+};
+
+static const int FUNCTION_COUNT = 200;
+
+static std::string generate_source(int repeat) {
+    std::string source;
+    for (int i = 0; i < FUNCTION_COUNT; ++i) {
+        std::string name = "f" + std::to_string(i);
+        source += "fun " + name + "(a, b) {\n";
+        source += "    var sum = 0;\n";
+        for (int k = 0; k < repeat; ++k) {
+            source += "    {\n"
+                      "        var x = a + b;\n"
+                      "        var y = a * b - x;\n"
+                      "        while (x < b) {\n"
+                      "            x = x + 1;\n"
+                      "            y = y - x / 2;\n"
+                      "        }\n"
+                      "        if (x > y) { sum = sum + x; } else { sum = sum - y; }\n"
+                      "    }\n";
+        }
+        if (i > 0) {
+            source += "    sum = sum + f" + std::to_string(i - 1) + "(a, b);\n";
+        }
+        source += "    return sum;\n";
+        source += "}\n";
+    }
+    source += "var result = f" + std::to_string(FUNCTION_COUNT - 1) + "(1, 2);\n";
+    return source;
+}
+
+static uint64_t compile_once(const std::string& source) {
+    VM vm;
+    Scanner s;
+    s.reset(source);
+    Parser parser(&s, &vm);
+    ObjFunction* function = nullptr;
+    uint64_t ns = run_single([] {}, [&] {
+        parser.advance();
+        function = parser.compile();
+    }, [] {});
+    assert(function != nullptr);
+    (void)function;
+    return ns;
+}
+
+struct ChunkMemory {
+    size_t code = 0;
+    size_t lines = 0;
+    size_t lines_per_byte = 0; // 每个字节一个int时行号表的大小
+};
+
+// 函数和它常量表里嵌套的函数
+static void chunk_memory(ObjFunction* function, ChunkMemory* memory) {
+    aankaa::Chunk* chunk = function->chunk;
+    memory->code += chunk->code.size();
+    memory->lines += chunk->lines.memory_bytes();
+    memory->lines_per_byte += chunk->code.size() * sizeof(int);
+    for (const aankaa::Value& constant : chunk->constants) {
+        if (constant.is_obj_type(aankaa::OBJ_FUNCTION)) {
+            chunk_memory(constant.as_function(), memory);
+        }
+    }
+}
+
+static void print_chunk_memory(const BenchSource& item) {
+    VM vm;
+    Scanner s;
+    s.reset(item.source);
+    Parser parser(&s, &vm);
+    parser.advance();
+    ObjFunction* function = parser.compile();
+    assert(function != nullptr);
+    ChunkMemory memory;
+    chunk_memory(function, &memory);
+    std::cout << std::left << std::setw(45) << item.name
+              << "    code:" << memory.code << "B"
+              << " lines:" << memory.lines << "B"
+              << " (int per byte:" << memory.lines_per_byte << "B)" << std::endl;
+}
+
+std::vector<BenchSource> sources;
+
+int32_t run_bench() {
+    std::cout << std::left << std::setw(45) << "name"
+              << "    max(ns/KB)  avg(ns/KB)  min(ns/KB)" << std::endl;
+    for (auto& item : sources) {
+        int kb = std::max<int>(1, item.source.size() / 1024);
+        bench_many_times(item.name + "/" + std::to_string(kb) + "KB", [&] {
+            return compile_once(item.source);
+        }, kb, 10);
+    }
+    for (auto& item : sources) {
+        print_chunk_memory(item);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    for (int repeat : {1, 8, 64}) {
+        sources.push_back({"generated_x" + std::to_string(repeat), generate_source(repeat)});
+    }
+    for (int i = 1; i < argc; ++i) {
+        std::ifstream t(argv[i]);
+        std::string content((std::istreambuf_iterator<char>(t)),
+                            std::istreambuf_iterator<char>());
+        sources.push_back({argv[i], content});
+    }
+    return run_bench();
+}
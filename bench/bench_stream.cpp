@@ -0,0 +1,125 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "bench_common.h"
+#include "scanner.h"
+#include "parser.h"
+#include "source_buffer.h"
+#include "vm.h"
+
+// 流式编译执行: 生成几十到几百MB的数据加载脚本(大量var x = ...;语句)，
+// whole  mmap整个文件，一次编译完再执行
+// stream 从fd按块读，分批编译执行顶层声明
+// 每次在子进程里运行，输出耗时和子进程的峰值RSS，stream的峰值内存应该不随源码变大
+// 用法: ./bench_stream [最大MB数，默认256]
+
+using aankaa::Scanner;
+using aankaa::Parser;
+using aankaa::VM;
+using aankaa::ObjFunction;
+
+static void generate_source(const std::string& path, size_t bytes) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << "var total = 0;\nvar names = \"\";\n";
+    std::string block;
+    size_t written = 0;
+    for (size_t i = 0; written < bytes; ++i) {
+        block.clear();
+        for (int k = 0; k < 100; ++k) {
+            std::string n = std::to_string(i * 100 + k);
+            block += "var x" + std::to_string(k) + " = " + n + ";\n";
+            block += "var name" + std::to_string(k % 10) + " = \"record-" + n + "\";\n";
+            block += "total = total + x" + std::to_string(k) + " * 2;\n";
+        }
+        out << block;
+        written += block.size();
+    }
+}
+
+static int run_whole(const std::string& path) {
+    VM vm;
+    aankaa::SourceBuffer source;
+    std::string error;
+    if (!source.map_file(path, &error)) {
+        return 1;
+    }
+    Scanner s;
+    s.reset(std::move(source));
+    Parser parser(&s, &vm);
+    parser.advance();
+    ObjFunction* function = parser.compile();
+    return function != nullptr && vm.interpret(function) == aankaa::INTERPRET_OK ? 0 : 1;
+}
+
+static int run_stream(const std::string& path) {
+    VM vm;
+    int fd = open(path.c_str(), O_RDONLY);
+    Scanner s;
+    s.reset_stream(fd);
+    Parser parser(&s, &vm);
+    parser.advance();
+    while (ObjFunction* function = parser.compile_next()) {
+        if (vm.interpret(function) != aankaa::INTERPRET_OK) {
+            return 1;
+        }
+    }
+    close(fd);
+    return parser.had_error ? 1 : 0;
+}
+
+// 在子进程里运行，返回耗时(ns)，peak_kb是子进程的峰值RSS
+template <typename Func>
+static uint64_t run_child(Func&& fn, long* peak_kb) {
+    auto start_time = Clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(fn());
+    }
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    *peak_kb = usage.ru_maxrss;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_time).count();
+}
+
+int max_mb = 256;
+
+int32_t run_bench() {
+    std::cout << std::left << std::setw(45) << "name"
+              << "    time(ms)     MB/s    peak RSS(MB)" << std::endl;
+    std::string path = "/tmp/aankaa_bench_stream_" + std::to_string(getpid()) + ".js";
+    for (int mb = 16; mb <= max_mb; mb *= 4) {
+        generate_source(path, static_cast<size_t>(mb) << 20);
+        for (const char* mode : {"whole", "stream"}) {
+            // 一次编译整个文件时字节码和常量都在内存里，最大的输入只跑流式
+            if (mode == std::string("whole") && mb > 64) {
+                continue;
+            }
+            long peak_kb = 0;
+            uint64_t ns = run_child([&] {
+                return mode == std::string("whole") ? run_whole(path) : run_stream(path);
+            }, &peak_kb);
+            std::cout << std::left << std::setw(45) << std::string(mode) + "/" + std::to_string(mb) + "MB"
+                      << std::fixed << std::setprecision(1)
+                      << "    " << std::right << std::setw(8) << ns / 1e6
+                      << "    " << std::right << std::setw(6) << mb / (ns / 1e9)
+                      << "    " << std::right << std::setw(8) << peak_kb / 1024.0 << std::endl;
+        }
+    }
+    unlink(path.c_str());
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        max_mb = atoi(argv[1]);
+    }
+    return run_bench();
+}
@@ -0,0 +1,129 @@
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <deque>
+#include <string>
+
+#include "bench_common.h"
+#include "scanner.h"
+#include "parser.h"
+#include "vm.h"
+
+// 对比字符串拼接场景下三种分配方式的耗时和峰值内存
+//   pool:    模拟原来的ObjectPool，每次拼接new一个带std::string的对象，直到VM销毁才释放
+//   tenured: 关闭nursery，拼接结果直接分配到老年代，由标记-清除回收
+//   nursery: 拼接结果先分配在nursery里，minor回收时只晋升活着的字符串
+// 每种方式在单独的子进程里跑，父进程通过wait4拿到子进程的峰值RSS
+// 用法: ./bench_string_alloc
+
+using aankaa::Scanner;
+using aankaa::Parser;
+using aankaa::VM;
+using aankaa::ObjFunction;
+
+static const int LOOP_COUNT = 100000;
+static const int RESET_LENGTH = 64;
+
+static std::string concat_script() {
+    // 字符串长到一定长度就丢掉重新开始，绝大部分中间结果都是马上就死的。
+    // 每轮的起点prefix都不一样，保证拼接结果不会因为驻留而复用已有的字符串
+    return "var prefix = \"\";\n"
+           "var s = \"\";\n"
+           "var n = 0;\n"
+           "var i = 0;\n"
+           "while (i < " + std::to_string(LOOP_COUNT) + ") {\n"
+           "    s = s + \"ab\";\n"
+           "    n = n + 1;\n"
+           "    if (n > " + std::to_string(RESET_LENGTH) + ") {\n"
+           "        prefix = prefix + \"x\";\n"
+           "        s = prefix;\n"
+           "        n = 0;\n"
+           "    }\n"
+           "    i = i + 1;\n"
+           "}\n";
+}
+
+// 原来的字符串对象: 对象头 + std::string，内容单独分配在堆上
+struct PoolString {
+    aankaa::ObjType type;
+    bool is_marked;
+    PoolString* next;
+    std::string buffer;
+};
+
+static uint64_t bench_pool() {
+    std::deque<PoolString> pool;
+    return run_single([] {}, [&] {
+        std::string prefix;
+        std::string s;
+        int n = 0;
+        for (int i = 0; i < LOOP_COUNT; ++i) {
+            pool.push_back(PoolString{aankaa::OBJ_STRING, false, nullptr, s + "ab"});
+            s = pool.back().buffer;
+            if (++n > RESET_LENGTH) {
+                pool.push_back(PoolString{aankaa::OBJ_STRING, false, nullptr, prefix + "x"});
+                prefix = pool.back().buffer;
+                s = prefix;
+                n = 0;
+            }
+        }
+    }, [&] {
+        std::cout << "strings_allocated:" << pool.size() << std::endl;
+    });
+}
+
+static uint64_t bench_vm(bool use_nursery) {
+    VM vm;
+    vm.use_nursery = use_nursery;
+    Scanner s;
+    std::string source = concat_script();
+    s.reset(source);
+    Parser parser(&s, &vm);
+    parser.advance();
+    ObjFunction* function = parser.compile();
+    assert(function != nullptr);
+    return run_single([&] {
+        vm.reset_stack();
+        vm.enter_script(function);
+    }, [&] {
+        aankaa::InterpretResult result = vm.run();
+        assert(result == aankaa::INTERPRET_OK);
+        (void)result;
+    }, [&] {
+        vm.gc_stats.print();
+    });
+}
+
+static void run_mode(const std::string& mode) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        uint64_t ns = 0;
+        if (mode == "pool") {
+            ns = bench_pool();
+        } else {
+            ns = bench_vm(mode == "nursery");
+        }
+        std::cout << std::left << std::setw(20) << mode
+                  << "    " << ns / LOOP_COUNT << " ns/concat" << std::endl;
+        _exit(0);
+    }
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    wait4(pid, &status, 0, &usage);
+    std::cout << std::left << std::setw(20) << mode
+              << "    peak_rss: " << usage.ru_maxrss << " KB" << std::endl << std::endl;
+}
+
+int32_t run_bench() {
+    run_mode("pool");
+    run_mode("tenured");
+    run_mode("nursery");
+    return 0;
+}
+
+int main() {
+    return run_bench();
+}
@@ -5,11 +5,127 @@
 #include "com_log.h"
 #include "cronoapd.h"
 
+#include <memory>
 #include <random>
+#include <unistd.h>
+
+#include "bench_common.h"
+#include "value.h"
+#include "vm.h"
+
+// Value的两种内存布局分别编译成两个程序来对比：
+//   bench_value         tagged union，16字节
+//   bench_value_nanbox  -DAANKAA_NAN_BOXING，8字节
+
+using aankaa::Value;
+using aankaa::VM;
+
+#ifdef AANKAA_NAN_BOXING
+static const char* LAYOUT = "nanbox";
+#else
+static const char* LAYOUT = "tagged";
+#endif
+
+static const int OPS = 1000000;
+static const int DEPTH = 200;
+// 单次操作只有几个ns，按每100次操作汇报耗时
+static const int REPORT_UNIT = 100;
+
+// 防止编译器把整个循环优化掉
+static volatile double sink;
+
+uint64_t bench_push_pop(VM& vm) {
+    return run_single([&] { vm.reset_stack(); }, [&] {
+        double sum = 0;
+        for (int i = 0; i < OPS / DEPTH; ++i) {
+            for (int k = 0; k < DEPTH; ++k) {
+                vm.push(Value((double)k));
+            }
+            for (int k = 0; k < DEPTH; ++k) {
+                sum += vm.pop().as_number();
+            }
+        }
+        sink = sum;
+    }, [] {});
+}
+
+// 模拟OP_ADD/OP_LESS：类型检查 + 出栈 + 计算 + 入栈
+uint64_t bench_arithmetic(VM& vm) {
+    return run_single([&] { vm.reset_stack(); vm.push(Value(0.0)); }, [&] {
+        for (int i = 0; i < OPS; ++i) {
+            vm.push(Value(1.5));
+            if (vm.peek(0).is_number() && vm.peek(1).is_number()) {
+                double b = vm.pop().as_number();
+                double a = vm.pop().as_number();
+                vm.push(Value(a + b));
+            }
+            vm.push(Value(1e9));
+            if (vm.peek(0).is_number() && vm.peek(1).is_number()) {
+                double b = vm.peek(0).as_number();
+                double a = vm.peek(1).as_number();
+                vm.pop();
+                vm.push(Value(a < b));
+            }
+            if (!vm.pop().is_falsey()) {
+                continue;
+            }
+        }
+        sink = vm.pop().as_number();
+    }, [] {});
+}
+
+uint64_t bench_integer(VM& vm) {
+    return run_single([&] { vm.reset_stack(); vm.push(Value(0)); }, [&] {
+        for (int i = 0; i < OPS; ++i) {
+            vm.push(Value(i & 0xff));
+            if (vm.peek(0).is_integer() && vm.peek(1).is_integer()) {
+                int b = vm.pop().as_integer();
+                int a = vm.pop().as_integer();
+                vm.push(Value(a + b));
+            }
+        }
+        sink = vm.pop().as_integer();
+    }, [] {});
+}
+
+// 当前进程的常驻内存
+static size_t resident_bytes() {
+    size_t pages = 0;
+    size_t resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm != nullptr) {
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// 一个进程里同时开很多VM时，每个VM实际占用的内存
+void bench_many_vms() {
+    const int count = 1000;
+    std::vector<std::unique_ptr<VM>> vms;
+    size_t before = resident_bytes();
+    for (int i = 0; i < count; ++i) {
+        vms.emplace_back(new VM());
+    }
+    size_t after = resident_bytes();
+    std::cout << count << " VMs, resident per VM:" << (after - before) / count << " bytes"
+              << ", reserved per VM:" << vms[0]->stack.max_capacity() * sizeof(Value) << " bytes" << std::endl;
+}
 
-// 分别用多少种并发来压测
-std::vector<int> concurrent_list = {1, 10, 20};
 int32_t run_bench() {
+    VM vm;
+    std::cout << "layout:" << LAYOUT << " sizeof(Value):" << sizeof(Value)
+              << " sizeof(VM):" << sizeof(VM) << std::endl;
+    bench_many_vms();
+    std::cout << std::left << std::setw(45) << "name"
+              << "    max/avg/min (ns per " << REPORT_UNIT << " ops)" << std::endl;
+    std::string prefix = std::string(LAYOUT) + "/";
+    bench_many_times(prefix + "push_pop", [&] { return bench_push_pop(vm); }, OPS / REPORT_UNIT, 20);
+    bench_many_times(prefix + "arithmetic", [&] { return bench_arithmetic(vm); }, OPS / REPORT_UNIT, 20);
+    bench_many_times(prefix + "integer_add", [&] { return bench_integer(vm); }, OPS / REPORT_UNIT, 20);
     return 0;
 }
 
@@ -27,7 +143,5 @@ int main(int argc, char** argv) {
     //     return -1;
     // }
 
-    // return run_bench();
-
-    return 0;
+    return run_bench();
 }
@@ -1,5 +1,9 @@
 #include <iostream>
-#include <fstream>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 // #include "scanner.h"
 // #include "token.h"
@@ -12,49 +16,180 @@
 #include "parser.h"
 #include "vm.h"
 #include "object.h"
+#include "trace.h"
+#include "bytecode_cache.h"
+#include "source_buffer.h"
+#include "defer.h"
 
 using aankaa::Scanner;
 using aankaa::Token;
 using aankaa::Parser;
 
-std::string read_file(std::string file_path) {
-    std::ifstream t(file_path.c_str());
-    std::string content;
-    t.seekg(0, std::ios::end);
-    content.reserve(t.tellg());
-    t.seekg(0, std::ios::beg);
-    content.assign((std::istreambuf_iterator<char>(t)),
-                std::istreambuf_iterator<char>());
-    return content;
+// --stream: 一边读源码一边按批编译执行顶层声明，内存占用和源码大小无关，适合很大的生成脚本。
+// path是"-"时从标准输入读。流式执行不使用字节码缓存
+static int run_stream(aankaa::VM* vm, const std::string& path, bool compile_stats) {
+    int fd = path == "-" ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "cannot open " << path << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    DEFER({
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+    });
+    Scanner s;
+    s.reset_stream(fd);
+    Parser parser(&s, vm);
+    parser.advance();
+    while (aankaa::ObjFunction* function = parser.compile_next()) {
+        if (vm->interpret(function) != aankaa::INTERPRET_OK) {
+            return -1;
+        }
+    }
+    if (compile_stats) {
+        parser.fold_stats.print(std::cerr);
+        parser.peephole_stats.print(std::cerr);
+    }
+    if (!s.stream_error().empty()) {
+        std::cerr << s.stream_error() << std::endl;
+        return -1;
+    }
+    return parser.had_error ? -1 : 0;
 }
 
-
 int main(int argc, char* argv[]) {
-    int i = 0;
     std::string file_path;
-    if (argc > 1) {
-        std::string arg1(argv[1]);
-        file_path = arg1;
-    } else {
-        std::cout << "example: ./aankaa prog.js" << std::endl;
+    bool profile_patterns = false;
+    bool compile_stats = false;
+    bool compile_only = false;
+    bool stream = false;
+    bool call_stats = false;
+    uint32_t max_frames = aankaa::DEFAULT_MAX_FRAMES;
+    aankaa::Backend backend = aankaa::BACKEND_STACK;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg.compare(0, 8, "--trace=") == 0) {
+            if (!aankaa::parse_trace_flags(arg.c_str() + 8, &aankaa::trace_flags)) {
+                std::cerr << "unknown trace category in " << arg
+                          << ", expect compile,chunk,exec,gc or all" << std::endl;
+                return -1;
+            }
+#if !AANKAA_TRACE
+            if (aankaa::trace_flags & ~aankaa::TRACE_GC) {
+                std::cerr << "built without AANKAA_TRACE, only --trace=gc is available" << std::endl;
+            }
+#endif
+        } else if (arg == "--backend=register") {
+            backend = aankaa::BACKEND_REGISTER;
+        } else if (arg == "--backend=stack") {
+            backend = aankaa::BACKEND_STACK;
+        } else if (arg == "--compile-stats") {
+            compile_stats = true;
+        } else if (arg == "--compile-only") {
+            compile_only = true;
+        } else if (arg.compare(0, 13, "--max-frames=") == 0) {
+            max_frames = strtoul(arg.c_str() + 13, nullptr, 10);
+            if (max_frames == 0) {
+                std::cerr << "invalid " << arg << ", expect a positive call depth" << std::endl;
+                return -1;
+            }
+        } else if (arg == "--call-stats") {
+            call_stats = true;
+        } else if (arg == "--stream") {
+            stream = true;
+        } else if (arg == "--profile-patterns") {
+#if AANKAA_TRACE
+            profile_patterns = true;
+#else
+            std::cerr << "built without AANKAA_TRACE, --profile-patterns is ignored" << std::endl;
+#endif
+        } else {
+            file_path = arg;
+        }
+    }
+    if (file_path.empty()) {
+        std::cout << "example: ./aankaa [--trace=compile,chunk,exec,gc] [--profile-patterns] [--compile-stats] [--compile-only] [--call-stats] [--stream] [--max-frames=N] [--backend=stack|register] prog.js" << std::endl;
         return -1;
     }
 
-    std::string source = read_file(file_path);
+    if (stream) {
+        aankaa::VM vm(max_frames);
+        vm.backend = backend;
+        int ret = run_stream(&vm, file_path, compile_stats);
+        if (aankaa::trace_enabled(aankaa::TRACE_GC)) {
+            vm.gc_stats.print();
+        }
+        return ret;
+    }
 
-    Scanner s;
-    s.reset(source);        
-    Parser parser(&s);
+    // 源码文件直接mmap进来交给扫描器，不复制
+    aankaa::SourceBuffer source;
+    std::string read_error;
+    if (!source.map_file(file_path, &read_error)) {
+        std::cerr << read_error << std::endl;
+        return -1;
+    }
 
-    std::cout << "\n=================== compiler =========================" << std::endl;
-    parser.current_chunk().clear();
-    parser.advance();
-    aankaa::ObjFunction* function = parser.compile();
+    aankaa::VM vm(max_frames);
+    vm.backend = backend;
+
+    // --compile-only把字节码写到prog.js.bc；之后运行prog.js时，缓存和源码一致就直接加载缓存，
+    // 源码改过了就重新编译并更新缓存。寄存器字节码不进缓存，选择寄存器后端或者要看编译统计时总是编译源码
+    uint64_t source_hash = aankaa::hash_source(source.data(), source.size());
+    std::string cache_path = aankaa::bytecode_cache_path(file_path);
+    bool use_cache = backend == aankaa::BACKEND_STACK && !compile_stats;
+    bool write_cache = compile_only;
+    aankaa::ObjFunction* function = nullptr;
+    if (use_cache && !compile_only && access(cache_path.c_str(), F_OK) == 0) {
+        std::string error;
+        function = aankaa::load_bytecode(&vm, cache_path, source_hash, &error);
+        write_cache = function == nullptr;
+    }
+
+    if (function == nullptr) {
+        // Parser构造时就会分配main函数，只在需要编译时构造，避免触发回收
+        Scanner s;
+        Parser parser(&s, &vm);
+        s.reset(std::move(source));
+        parser.current_chunk().clear();
+        parser.advance();
+        function = parser.compile();
+        if (compile_stats) {
+            parser.fold_stats.print(std::cerr);
+            parser.peephole_stats.print(std::cerr);
+        }
+        if (function == nullptr) {
+            return -1;
+        }
+        std::string error;
+        if (use_cache && write_cache
+                && !aankaa::write_bytecode(&vm, function, source_hash, cache_path, &error)) {
+            std::cerr << "write bytecode cache failed: " << error << std::endl;
+        }
+    }
+    if (compile_only) {
+        return 0;
+    }
+    // 从缓存加载的main函数不在任何根上，编译出来的main函数随parser析构也不再是根，
+    // 执行结束之前都要保护起来
+    vm.push_root(function);
 
-    std::cout << "\n=================== vm run =========================" << std::endl;
-    aankaa::VM vm;
+    aankaa::OpcodeProfiler profiler;
+    if (profile_patterns) {
+        vm.profiler = &profiler;
+    }
     vm.interpret(function);
+    if (call_stats) {
+        aankaa::print_call_site_stats(function, std::cerr);
+    }
+    vm.remove_root(function);
+    if (profile_patterns) {
+        profiler.report(std::cerr);
+    }
 
-    std::cout << "\n=================== gc =========================" << std::endl;
+    if (aankaa::trace_enabled(aankaa::TRACE_GC)) {
+        vm.gc_stats.print();
+    }
     return 0;
 }
@@ -0,0 +1,569 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "bytecode_cache.h"
+#include "chunk.h"
+#include "object.h"
+#include "vm.h"
+#include "defer.h"
+#include "trace.h"
+
+namespace aankaa {
+
+namespace {
+
+const char MAGIC[4] = {'A', 'K', 'B', 'C'};
+
+struct CacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_hash;
+    uint32_t string_count;
+    uint32_t global_count;
+    uint32_t function_count;
+    uint32_t reserved;
+    uint64_t checksum;      // header之后所有内容的FNV-1a哈希
+};
+
+// 常量的类型标记，后面跟8字节的内容
+enum ConstantTag : uint8_t {
+    CONST_NIL,
+    CONST_TRUE,
+    CONST_FALSE,
+    CONST_INTEGER,  // int32
+    CONST_NUMBER,   // double的位模式
+    CONST_STRING,   // 字符串下标
+    CONST_FUNCTION, // 函数下标，一定在引用它的函数之前
+};
+
+class BytecodeWriter {
+public:
+    bool write(VM* vm, ObjFunction* script, uint64_t source_hash, std::string* error) {
+        for (ObjString* name : vm->globals.names) {
+            _globals.push_back(string_index(name));
+        }
+        if (!add_function(script, error)) {
+            return false;
+        }
+
+        CacheHeader header;
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = BYTECODE_VERSION;
+        header.source_hash = source_hash;
+        header.string_count = _strings.size();
+        header.global_count = _globals.size();
+        header.function_count = _function_count;
+        header.reserved = 0;
+        std::string payload;
+        for (ObjString* str : _strings) {
+            put<uint32_t>(str->length, &payload);
+            payload.append(str->chars, str->length);
+        }
+        for (uint32_t index : _globals) {
+            put<uint32_t>(index, &payload);
+        }
+        payload.append(_functions);
+        header.checksum = hash_source(payload.data(), payload.size());
+        out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.append(payload);
+        return true;
+    }
+
+public:
+    std::string out;
+
+private:
+    template <typename T>
+    void put(T value, std::string* to = nullptr) {
+        (to == nullptr ? &out : to)->append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    uint32_t string_index(ObjString* str) {
+        auto result = _string_index.emplace(str, _strings.size());
+        if (result.second) {
+            _strings.push_back(str);
+        }
+        return result.first->second;
+    }
+
+    // 先写常量表里嵌套的函数，返回function的下标
+    bool add_function(ObjFunction* function, std::string* error) {
+        Chunk* chunk = function->chunk;
+        std::vector<std::pair<uint8_t, uint64_t>> constants;
+        for (const Value& value : chunk->constants) {
+            if (value.is_obj_type(OBJ_FUNCTION)) {
+                if (!add_function(value.as_function(), error)) {
+                    return false;
+                }
+                constants.emplace_back(CONST_FUNCTION, _function_count - 1);
+            } else if (value.is_string()) {
+                constants.emplace_back(CONST_STRING, string_index(value.as_string()));
+            } else if (value.is_integer()) {
+                constants.emplace_back(CONST_INTEGER, static_cast<uint32_t>(value.as_integer()));
+            } else if (value.is_number()) {
+                double number = value.as_number();
+                uint64_t bits;
+                memcpy(&bits, &number, sizeof(bits));
+                constants.emplace_back(CONST_NUMBER, bits);
+            } else if (value.is_nil()) {
+                constants.emplace_back(CONST_NIL, 0);
+            } else if (value.is_bool()) {
+                constants.emplace_back(value.as_bool() ? CONST_TRUE : CONST_FALSE, 0);
+            } else {
+                *error = "unsupported constant " + value.to_string();
+                return false;
+            }
+        }
+
+        put<int32_t>(function->arity, &_functions);
+        put<int32_t>(function->name == nullptr ? -1 : string_index(function->name), &_functions);
+        put<uint32_t>(function->upvalues.size(), &_functions);
+        for (const UpvalueDesc& upvalue : function->upvalues) {
+            put<uint8_t>(upvalue.index, &_functions);
+            put<uint8_t>(upvalue.is_local, &_functions);
+            put<uint8_t>(upvalue.boxed, &_functions);
+        }
+        put<uint32_t>(chunk->code.size(), &_functions);
+        size_t code_start = _functions.size();
+        _functions.append(reinterpret_cast<const char*>(chunk->code.data()), chunk->code.size());
+        // 调用点缓存是运行时的状态，不进字节码缓存：OP_CALL_CACHED写回OP_CALL，加载后重新建立
+        for (size_t pos = 0; pos < chunk->code.size(); pos += op_size(chunk->code[pos])) {
+            if (chunk->code[pos] == OP_CALL_CACHED) {
+                _functions[code_start + pos] = OP_CALL;
+            }
+        }
+        put<uint32_t>(constants.size(), &_functions);
+        for (const auto& constant : constants) {
+            put<uint8_t>(constant.first, &_functions);
+            put<uint64_t>(constant.second, &_functions);
+        }
+        chunk->lines.save(&_functions);
+        _function_count++;
+        return true;
+    }
+
+private:
+    std::vector<ObjString*> _strings;
+    std::unordered_map<ObjString*, uint32_t> _string_index;
+    std::vector<uint32_t> _globals;
+    std::string _functions;
+    uint32_t _function_count = 0;
+};
+
+class BytecodeReader {
+public:
+    BytecodeReader(VM* vm, const uint8_t* data, size_t size)
+            : _vm(vm), _pos(data), _end(data + size) {}
+
+    ~BytecodeReader() {
+        // 按压入的相反顺序移除，remove_root从后往前找，每次都是O(1)
+        for (auto it = _rooted.rbegin(); it != _rooted.rend(); ++it) {
+            _vm->remove_root(*it);
+        }
+    }
+
+    ObjFunction* load(uint64_t source_hash, std::string* error) {
+        CacheHeader header;
+        if (!get(&header) || memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+            return fail("not a bytecode cache", error);
+        }
+        if (header.version != BYTECODE_VERSION) {
+            return fail("bytecode version " + std::to_string(header.version) + " is stale", error);
+        }
+        if (header.source_hash != source_hash) {
+            return fail("source changed", error);
+        }
+        if (header.checksum != hash_source(reinterpret_cast<const char*>(_pos), _end - _pos)) {
+            return fail("checksum mismatch", error);
+        }
+        for (uint32_t i = 0; i < header.string_count; ++i) {
+            uint32_t length = 0;
+            const uint8_t* chars = nullptr;
+            if (!get(&length) || (chars = bytes(length)) == nullptr) {
+                return fail("truncated string table", error);
+            }
+            ObjString* str = _vm->copy_string(reinterpret_cast<const char*>(chars), length);
+            root(str);
+            _strings.push_back(str);
+        }
+        if (!load_globals(header.global_count, error)) {
+            return nullptr;
+        }
+        for (uint32_t i = 0; i < header.function_count; ++i) {
+            if (!load_function(error)) {
+                return nullptr;
+            }
+        }
+        if (_functions.empty() || _pos != _end) {
+            return fail("corrupted function table", error);
+        }
+        return _functions.back();
+    }
+
+private:
+    ObjFunction* fail(const std::string& message, std::string* error) {
+        *error = message;
+        return nullptr;
+    }
+
+    template <typename T>
+    bool get(T* value) {
+        const uint8_t* data = bytes(sizeof(T));
+        if (data == nullptr) {
+            return false;
+        }
+        memcpy(value, data, sizeof(T));
+        return true;
+    }
+
+    const uint8_t* bytes(size_t size) {
+        if (static_cast<size_t>(_end - _pos) < size) {
+            return nullptr;
+        }
+        const uint8_t* data = _pos;
+        _pos += size;
+        return data;
+    }
+
+    void root(Obj* obj) {
+        _vm->push_root(obj);
+        _rooted.push_back(obj);
+    }
+
+    // 编译时的槽位 -> 当前VM的槽位，大多数情况下两者相同
+    bool load_globals(uint32_t count, std::string* error) {
+        _identity_slots = true;
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t index = 0;
+            if (!get(&index) || index >= _strings.size()) {
+                fail("corrupted global table", error);
+                return false;
+            }
+            int slot = _vm->globals.resolve(_strings[index]);
+            _identity_slots &= slot == static_cast<int>(i);
+            _slots.push_back(slot);
+        }
+        return true;
+    }
+
+    // 槽位变了时改写全局变量指令的操作数，短格式放不下新槽位时放弃缓存
+    bool relocate_globals(std::vector<uint8_t>* code, std::string* error) {
+        for (size_t pos = 0; pos < code->size(); pos += op_size((*code)[pos])) {
+            uint8_t op = (*code)[pos];
+            uint8_t* operand = code->data() + pos + 1;
+            if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL) {
+                if (*operand >= _slots.size() || _slots[*operand] > UINT8_MAX) {
+                    fail("global slots changed", error);
+                    return false;
+                }
+                *operand = _slots[*operand];
+            } else if (op == OP_GET_GLOBAL_LONG || op == OP_SET_GLOBAL_LONG || op == OP_DEFINE_GLOBAL_LONG) {
+                uint32_t slot = (operand[0] << 16) | (operand[1] << 8) | operand[2];
+                if (slot >= _slots.size()) {
+                    fail("global slots changed", error);
+                    return false;
+                }
+                slot = _slots[slot];
+                operand[0] = (slot >> 16) & 0xff;
+                operand[1] = (slot >> 8) & 0xff;
+                operand[2] = slot & 0xff;
+            }
+        }
+        return true;
+    }
+
+    bool load_function(std::string* error) {
+        int32_t arity = 0;
+        int32_t name = 0;
+        uint32_t upvalue_count = 0;
+        if (!get(&arity) || arity < 0 || arity > UINT8_MAX
+                || !get(&name) || name >= static_cast<int32_t>(_strings.size())
+                || !get(&upvalue_count) || upvalue_count > UINT8_MAX + 1) {
+            fail("corrupted function", error);
+            return false;
+        }
+        std::vector<UpvalueDesc> upvalues(upvalue_count);
+        for (UpvalueDesc& upvalue : upvalues) {
+            uint8_t is_local = 0;
+            uint8_t boxed = 0;
+            if (!get(&upvalue.index) || !get(&is_local) || !get(&boxed)) {
+                fail("corrupted function", error);
+                return false;
+            }
+            upvalue.is_local = is_local != 0;
+            upvalue.boxed = boxed != 0;
+        }
+        uint32_t code_size = 0;
+        const uint8_t* code = nullptr;
+        if (!get(&code_size) || (code = bytes(code_size)) == nullptr) {
+            fail("corrupted function", error);
+            return false;
+        }
+
+        ObjFunction* function = _vm->allocate<ObjFunction>();
+        root(function);
+        function->arity = arity;
+        function->name = name < 0 ? nullptr : _strings[name];
+        function->upvalues = std::move(upvalues);
+        Chunk* chunk = function->chunk;
+        // Chunk自己持有字节码，快速化执行时还会原地改写，所以这里拷贝一次
+        chunk->code.assign(code, code + code_size);
+        chunk->count = code_size;
+
+        uint32_t constant_count = 0;
+        if (!get(&constant_count)) {
+            fail("corrupted constant table", error);
+            return false;
+        }
+        for (uint32_t i = 0; i < constant_count; ++i) {
+            uint8_t tag = 0;
+            uint64_t payload = 0;
+            if (!get(&tag) || !get(&payload)) {
+                fail("corrupted constant table", error);
+                return false;
+            }
+            if (tag > CONST_FUNCTION) {
+                fail("unknown constant tag " + std::to_string(tag), error);
+                return false;
+            }
+            if ((tag == CONST_STRING && payload >= _strings.size())
+                    || (tag == CONST_FUNCTION && payload >= _functions.size())) {
+                fail("corrupted constant table", error);
+                return false;
+            }
+            const Value value = constant_value(tag, payload);
+            // 写的时候常量已经去过重，按顺序加回去下标不变
+            if (chunk->add_constant(value) != static_cast<int>(i)) {
+                fail("duplicated constant", error);
+                return false;
+            }
+            _vm->write_barrier(function, value);
+        }
+
+        size_t consumed = chunk->lines.load(_pos, _end - _pos);
+        if (consumed == 0 || chunk->lines.size() != static_cast<int>(code_size)) {
+            fail("corrupted line table", error);
+            return false;
+        }
+        _pos += consumed;
+        if (!validate_code(function, error)) {
+            return false;
+        }
+        if (!_identity_slots && !relocate_globals(&chunk->code, error)) {
+            return false;
+        }
+        _functions.push_back(function);
+        return true;
+    }
+
+    // 标记已经检查过、payload是对应表里的下标
+    Value constant_value(uint8_t tag, uint64_t payload) const {
+        switch (tag) {
+        case CONST_NIL: return Value(nullptr);
+        case CONST_TRUE: return Value(true);
+        case CONST_FALSE: return Value(false);
+        case CONST_INTEGER: return Value(static_cast<int>(static_cast<uint32_t>(payload)));
+        case CONST_NUMBER: {
+            double number;
+            memcpy(&number, &payload, sizeof(number));
+            return Value(number);
+        }
+        case CONST_STRING: return Value(_strings[payload]);
+        default: return Value(_functions[payload]);
+        }
+    }
+
+    // 校验和只能发现意外的损坏，执行之前还要逐条检查字节码：指令完整、常量/全局变量/upvalue的下标在范围内、
+    // 名字是字符串、闭包指令引用的是函数、跳转目标是某条指令的开头、各条路径的栈深度一致。
+    // 通过之后VM执行时不会越界，栈深度也在这里算出来(缓存里不保存)
+    bool validate_code(ObjFunction* function, std::string* error) {
+        Chunk* chunk = function->chunk;
+        const std::vector<uint8_t>& code = chunk->code;
+        size_t constant_count = chunk->constants.size();
+        auto invalid = [&](const std::string& what, size_t pos) {
+            fail("invalid bytecode: " + what + " at " + std::to_string(pos), error);
+            return false;
+        };
+        std::vector<bool> starts(code.size(), false);
+        for (size_t pos = 0; pos < code.size(); pos += op_size(code[pos])) {
+            uint8_t op = code[pos];
+            // 调用点缓存是运行时建立的，写缓存时已经把OP_CALL_CACHED写回了OP_CALL
+            if (op >= OP_COUNT || op == OP_CALL_CACHED) {
+                return invalid("unknown opcode " + std::to_string(op), pos);
+            }
+            if (pos + op_size(op) > code.size()) {
+                return invalid("truncated instruction", pos);
+            }
+            starts[pos] = true;
+            switch (op) {
+            case OP_CONSTANT:
+                if (code[pos + 1] >= constant_count) {
+                    return invalid("constant out of range", pos);
+                }
+                break;
+            case OP_CONSTANT_LONG:
+                if (static_cast<size_t>(chunk->read_long(pos + 1)) >= constant_count) {
+                    return invalid("constant out of range", pos);
+                }
+                break;
+            case OP_ADD_LOCAL_CONST:
+            case OP_INC_LOCAL:
+            case OP_LESS_LOCAL_CONST_JUMP:
+                if (code[pos + 2] >= constant_count) {
+                    return invalid("constant out of range", pos);
+                }
+                break;
+            case OP_CLOSURE:
+            case OP_CLOSURE_LONG: {
+                size_t index = op == OP_CLOSURE ? code[pos + 1] : chunk->read_long(pos + 1);
+                if (index >= constant_count || !chunk->constants[index].is_obj_type(OBJ_FUNCTION)) {
+                    return invalid("closure of a non-function constant", pos);
+                }
+                // 从外层闭包捕获的变量要在外层的upvalue范围内，局部变量在栈深度算出来之后检查
+                for (const UpvalueDesc& upvalue : chunk->constants[index].as_function()->upvalues) {
+                    if (!upvalue.is_local && upvalue.index >= function->upvalues.size()) {
+                        return invalid("captured upvalue out of range", pos);
+                    }
+                }
+                break;
+            }
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_DEFINE_GLOBAL:
+                if (code[pos + 1] >= _slots.size()) {
+                    return invalid("global slot out of range", pos);
+                }
+                break;
+            case OP_GET_GLOBAL_LONG:
+            case OP_SET_GLOBAL_LONG:
+            case OP_DEFINE_GLOBAL_LONG:
+                if (static_cast<size_t>(chunk->read_long(pos + 1)) >= _slots.size()) {
+                    return invalid("global slot out of range", pos);
+                }
+                break;
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+            case OP_GET_UPVALUE_CELL:
+                if (code[pos + 1] >= function->upvalues.size()) {
+                    return invalid("upvalue out of range", pos);
+                }
+                break;
+            default:
+                break;
+            }
+            if (is_property_site(op) || op == OP_GET_SUPER || op == OP_GET_SUPER_LONG
+                    || op == OP_SUPER_INVOKE || op == OP_SUPER_INVOKE_LONG
+                    || op == OP_CLASS || op == OP_CLASS_LONG || op == OP_METHOD || op == OP_METHOD_LONG) {
+                size_t index = chunk->name_operand(pos);
+                if (index >= constant_count || !chunk->constants[index].is_string()) {
+                    return invalid("name is not a string constant", pos);
+                }
+            }
+        }
+        for (size_t pos = 0; pos < code.size(); pos += op_size(code[pos])) {
+            uint8_t op = code[pos];
+            bool is_jump = long_jump_op(op) >= 0 || op == OP_JUMP_LONG || op == OP_JUMP_IF_FALSE_LONG
+                || op == OP_LOOP_LONG || op == OP_LESS_LOCAL_CONST_JUMP;
+            int target = jump_target(code, pos);
+            if (is_jump && (target < 0 || static_cast<size_t>(target) >= code.size() || !starts[target])) {
+                return invalid("jump target out of range", pos);
+            }
+        }
+        chunk->max_stack = max_stack_depth(*chunk, function->arity + 1);
+        if (chunk->max_stack < 0) {
+            return invalid("inconsistent stack depth", 0);
+        }
+        for (const Value& constant : chunk->constants) {
+            if (!constant.is_obj_type(OBJ_FUNCTION)) {
+                continue;
+            }
+            for (const UpvalueDesc& upvalue : constant.as_function()->upvalues) {
+                if (upvalue.is_local && upvalue.index >= chunk->max_stack) {
+                    return invalid("captured local out of range", 0);
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    VM* _vm;
+    const uint8_t* _pos;
+    const uint8_t* _end;
+    std::vector<ObjString*> _strings;
+    std::vector<ObjFunction*> _functions;
+    std::vector<int> _slots;
+    bool _identity_slots = true;
+    std::vector<Obj*> _rooted;
+};
+
+} // namespace
+
+uint64_t hash_source(const char* source, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= static_cast<uint8_t>(source[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool write_bytecode(VM* vm, ObjFunction* script, uint64_t source_hash,
+                    const std::string& path, std::string* error) {
+    BytecodeWriter writer;
+    if (!writer.write(vm, script, source_hash, error)) {
+        return false;
+    }
+    std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr) {
+        *error = "cannot open " + tmp_path + ": " + strerror(errno);
+        return false;
+    }
+    bool ok = fwrite(writer.out.data(), 1, writer.out.size(), file) == writer.out.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        *error = "cannot write " + path + ": " + strerror(errno);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    TRACE(TRACE_COMPILE, "wrote bytecode cache " << path << " bytes:" << writer.out.size());
+    return true;
+}
+
+ObjFunction* load_bytecode(VM* vm, const std::string& path, uint64_t source_hash, std::string* error) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *error = "cannot open " + path + ": " + strerror(errno);
+        return nullptr;
+    }
+    DEFER({
+        close(fd);
+    });
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        *error = "empty bytecode cache " + path;
+        return nullptr;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        *error = "cannot mmap " + path + ": " + strerror(errno);
+        return nullptr;
+    }
+    DEFER({
+        munmap(data, st.st_size);
+    });
+    BytecodeReader reader(vm, static_cast<const uint8_t*>(data), st.st_size);
+    ObjFunction* script = reader.load(source_hash, error);
+    TRACE(TRACE_COMPILE, "load bytecode cache " << path << (script != nullptr ? " ok" : " failed: " + *error));
+    return script;
+}
+
+} // namespace
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+namespace aankaa {
+
+class VM;
+struct ObjFunction;
+
+// 字节码缓存文件
+// 把编译好的script函数和它嵌套的所有函数写到磁盘，下次运行同一份源码时mmap进来直接执行，省掉扫描和编译。
+// 文件里没有指针，对象之间都用下标引用，可以加载到任意VM里：
+//   header     magic、格式版本、源码哈希、各段的数量、后面所有内容的校验和
+//   strings    所有用到的字符串(常量、函数名、全局变量名)，加载时经过VM的驻留表
+//   globals    编译时GlobalTable每个槽位的名字，加载时重新解析，槽位变了就改写字节码里的操作数
+//   functions  先写嵌套的函数再写外层函数，script最后；每个函数是arity、名字、字节码、常量表和行号表
+// 整数按本机字节序写，缓存文件只在生成它的机器上使用。
+// 指令集或者文件格式有变化时必须增加BYTECODE_VERSION，旧的缓存文件会被当作过期重新生成。
+constexpr uint32_t BYTECODE_VERSION = 5;
+
+// 源码的64位FNV-1a哈希，缓存文件用它判断是否过期
+uint64_t hash_source(const char* source, size_t length);
+
+// 源码文件对应的缓存文件路径
+inline std::string bytecode_cache_path(const std::string& source_path) {
+    return source_path + ".bc";
+}
+
+// 把script写到path，先写临时文件再rename，中途失败不会留下不完整的缓存。
+// 必须在执行之前调用，执行过的字节码里有快速化改写过的指令
+bool write_bytecode(VM* vm, ObjFunction* script, uint64_t source_hash,
+                    const std::string& path, std::string* error);
+
+// mmap并加载path，返回script函数。文件不存在、格式版本或者源码哈希不一致、校验和不对，
+// 或者字节码通不过检查(见BytecodeReader::validate_code)时返回nullptr，
+// 调用方应该重新编译源码。和Parser::compile一样，返回的函数没有挂到GC的根上，要马上交给VM执行
+ObjFunction* load_bytecode(VM* vm, const std::string& path, uint64_t source_hash, std::string* error);
+
+} // namespace
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "chunk.h"
 
 namespace aankaa {
@@ -13,11 +15,11 @@ const char* op_name[] = {
     [OP_GET_GLOBAL] = "get_global",
     [OP_DEFINE_GLOBAL] = "def_global",
     [OP_SET_GLOBAL] = "set_global",
-    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
-    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
-    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
-    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
-    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_GET_UPVALUE] = "get_upvalue",
+    [OP_SET_UPVALUE] = "set_upvalue",
+    [OP_GET_PROPERTY] = "get_property",
+    [OP_SET_PROPERTY] = "set_property",
+    [OP_GET_SUPER] = "get_super",
     [OP_EQUAL] = "==",
     [OP_GREATER] = ">",
     [OP_LESS] = "<",
@@ -32,14 +34,335 @@ const char* op_name[] = {
     [OP_JUMP_IF_FALSE] = "jmp_if_false",
     [OP_LOOP] = "loop",
     [OP_CALL] = "call",
-    [OP_INVOKE] = "OP_INVOKE",
-    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
-    [OP_CLOSURE] = "OP_CLOSURE",
-    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_INVOKE] = "invoke",
+    [OP_SUPER_INVOKE] = "super_invoke",
+    [OP_CLOSURE] = "closure",
     [OP_RETURN] = "return",
-    [OP_CLASS] = "OP_CLASS",
-    [OP_INHERIT] = "OP_INHERIT",
-    [OP_METHOD] = "OP_METHOD"
+    [OP_CLASS] = "class",
+    [OP_INHERIT] = "inherit",
+    [OP_METHOD] = "method",
+    [OP_ADD_LOCAL_CONST] = "add_local_const",
+    [OP_INC_LOCAL] = "inc_local",
+    [OP_LESS_LOCAL_CONST_JUMP] = "less_local_const_jmp",
+    [OP_ADD_INT] = "+int",
+    [OP_ADD_NUM] = "+num",
+    [OP_SUBTRACT_INT] = "-int",
+    [OP_SUBTRACT_NUM] = "-num",
+    [OP_MULTIPLY_INT] = "*int",
+    [OP_MULTIPLY_NUM] = "*num",
+    [OP_LESS_INT] = "<int",
+    [OP_LESS_NUM] = "<num",
+    [OP_GREATER_INT] = ">int",
+    [OP_GREATER_NUM] = ">num",
+    [OP_CONSTANT_LONG] = "constant_long",
+    [OP_GET_GLOBAL_LONG] = "get_global_long",
+    [OP_DEFINE_GLOBAL_LONG] = "def_global_long",
+    [OP_SET_GLOBAL_LONG] = "set_global_long",
+    [OP_JUMP_LONG] = "jmp_long",
+    [OP_JUMP_IF_FALSE_LONG] = "jmp_if_false_long",
+    [OP_LOOP_LONG] = "loop_long",
+    [OP_CALL_NATIVE] = "call_native",
+    [OP_CALL_CACHED] = "call_cached",
+    [OP_TAIL_CALL] = "tail_call",
+    [OP_GET_UPVALUE_CELL] = "get_upvalue_cell",
+    [OP_GET_LOCAL_CELL] = "get_local_cell",
+    [OP_SET_LOCAL_CELL] = "set_local_cell",
+    [OP_CLOSURE_LONG] = "closure_long",
+    [OP_GET_PROPERTY_LONG] = "get_property_long",
+    [OP_SET_PROPERTY_LONG] = "set_property_long",
+    [OP_GET_SUPER_LONG] = "get_super_long",
+    [OP_INVOKE_LONG] = "invoke_long",
+    [OP_SUPER_INVOKE_LONG] = "super_invoke_long",
+    [OP_CLASS_LONG] = "class_long",
+    [OP_METHOD_LONG] = "method_long",
 };
 
-} // namespace
\ No newline at end of file
+int op_size(uint8_t op) {
+    switch (op) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_CALL_NATIVE:
+    case OP_CALL_CACHED:
+    case OP_TAIL_CALL:
+    case OP_GET_UPVALUE_CELL:
+    case OP_GET_LOCAL_CELL:
+    case OP_SET_LOCAL_CELL:
+    case OP_CLOSURE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CLASS:
+    case OP_METHOD:
+        return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_ADD_LOCAL_CONST:
+    case OP_INC_LOCAL:
+        return 3;
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_LOOP_LONG:
+    case OP_CLOSURE_LONG:
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+    case OP_GET_SUPER_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+        return 4;
+    case OP_LESS_LOCAL_CONST_JUMP:
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE_LONG:
+        return 5;
+    default:
+        return 1;
+    }
+}
+
+static inline uint16_t read_short(const std::vector<uint8_t>& code, int pos) {
+    return static_cast<uint16_t>((code[pos] << 8) | code[pos + 1]);
+}
+
+static inline int read_long(const std::vector<uint8_t>& code, int pos) {
+    return (code[pos] << 16) | (code[pos + 1] << 8) | code[pos + 2];
+}
+
+int jump_target(const std::vector<uint8_t>& code, int pos) {
+    int size = op_size(code[pos]);
+    switch (code[pos]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+        return pos + size + read_short(code, pos + 1);
+    case OP_LESS_LOCAL_CONST_JUMP:
+        return pos + size + read_short(code, pos + 3);
+    case OP_LOOP:
+        return pos + size - read_short(code, pos + 1);
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+        return pos + size + read_long(code, pos + 1);
+    case OP_LOOP_LONG:
+        return pos + size - read_long(code, pos + 1);
+    default:
+        return -1;
+    }
+}
+
+int long_jump_op(uint8_t op) {
+    switch (op) {
+    case OP_JUMP: return OP_JUMP_LONG;
+    case OP_JUMP_IF_FALSE: return OP_JUMP_IF_FALSE_LONG;
+    case OP_LOOP: return OP_LOOP_LONG;
+    default: return -1;
+    }
+}
+
+// 除了跳转之外，指令执行后栈深度的变化
+static int stack_effect(const std::vector<uint8_t>& code, int pos) {
+    switch (code[pos]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_CELL:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_CELL:
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+    case OP_ADD_LOCAL_CONST:
+        return 1;
+    case OP_POP:
+    case OP_RETURN:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_PROPERTY:
+    case OP_SET_PROPERTY_LONG:
+    case OP_GET_SUPER:
+    case OP_GET_SUPER_LONG:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_ADD_INT:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT_INT:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_INT:
+    case OP_MULTIPLY_NUM:
+    case OP_LESS_INT:
+    case OP_LESS_NUM:
+    case OP_GREATER_INT:
+    case OP_GREATER_NUM:
+    case OP_PRINT:
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+        return -1;
+    case OP_CALL:
+    case OP_CALL_NATIVE:
+    case OP_CALL_CACHED:
+    case OP_TAIL_CALL:
+        // 被调函数和参数换成返回值
+        return -code[pos + 1];
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+        return -code[pos + op_size(code[pos]) - 1];
+    case OP_SUPER_INVOKE:
+    case OP_SUPER_INVOKE_LONG:
+        // 父类也被弹出
+        return -code[pos + op_size(code[pos]) - 1] - 1;
+    default:
+        return 0;
+    }
+}
+
+int max_stack_depth(const Chunk& chunk, int base) {
+    const std::vector<uint8_t>& code = chunk.code;
+    int size = code.size();
+    // 每个指令位置的入口栈深度，-1表示还没有到达
+    std::vector<int> depth(size, -1);
+    std::vector<int> pending;
+    bool consistent = true;
+    auto reach = [&](int pos, int d) {
+        if (pos < 0 || pos >= size) {
+            consistent = false;
+        } else if (depth[pos] < 0) {
+            depth[pos] = d;
+            pending.push_back(pos);
+        } else if (depth[pos] != d) {
+            consistent = false;
+        }
+    };
+    int max_depth = base;
+    if (size > 0) {
+        reach(0, base);
+    }
+    while (consistent && !pending.empty()) {
+        int pos = pending.back();
+        pending.pop_back();
+        uint8_t op = code[pos];
+        int next = pos + op_size(op);
+        if (op >= OP_COUNT || next > size) {
+            return -1;
+        }
+        int d = depth[pos];
+        switch (op) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_LOCAL_CELL:
+        case OP_SET_LOCAL_CELL:
+        case OP_ADD_LOCAL_CONST:
+        case OP_INC_LOCAL:
+        case OP_LESS_LOCAL_CONST_JUMP:
+            // 读写的局部变量必须已经在栈上
+            if (code[pos + 1] >= d) {
+                return -1;
+            }
+            break;
+        default:
+            break;
+        }
+        int after = d + stack_effect(code, pos);
+        // 读写局部变量的超级指令在慢速路径上会把两个操作数压栈再相加
+        int peak = op == OP_ADD_LOCAL_CONST || op == OP_INC_LOCAL ? d + 2 : std::max(d, after);
+        if (after < base) {
+            return -1;
+        }
+        max_depth = std::max(max_depth, peak);
+        switch (op) {
+        case OP_RETURN:
+            break;
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+            reach(jump_target(code, pos), after);
+            break;
+        case OP_TAIL_CALL:
+            // 后面总是OP_RETURN
+            if (next >= size || code[next] != OP_RETURN) {
+                return -1;
+            }
+            reach(next, after);
+            break;
+        case OP_LESS_LOCAL_CONST_JUMP:
+            // 不跳转时比较结果被融合的pop弹掉，跳转时比较结果留给目标处的pop
+            reach(next, after);
+            reach(jump_target(code, pos), after + 1);
+            max_depth = std::max(max_depth, after + 1);
+            break;
+        default:
+            if (jump_target(code, pos) >= 0) {
+                reach(jump_target(code, pos), after);
+            }
+            reach(next, after);
+            break;
+        }
+    }
+    return consistent ? max_depth : -1;
+}
+
+ConstantKey constant_key(const Value& value) {
+    if (value.is_integer()) {
+        return {1, static_cast<uint32_t>(value.as_integer())};
+    }
+    if (value.is_number()) {
+        double number = value.as_number();
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return {2, bits};
+    }
+    if (value.is_obj()) {
+        return {3, reinterpret_cast<uintptr_t>(value.as_obj())};
+    }
+    if (value.is_bool()) {
+        return {4, value.as_bool()};
+    }
+    return {value.is_nil() ? 5 : 6, 0};
+}
+
+void Chunk::build_call_caches() {
+    // 按指令偏移量索引，只有执行过调用指令的chunk才会建立
+    call_site_index.assign(code.size(), 0);
+    call_caches.clear();
+    for (size_t pos = 0; pos < code.size(); pos += op_size(code[pos])) {
+        if (code[pos] == OP_CALL || code[pos] == OP_CALL_NATIVE || code[pos] == OP_CALL_CACHED) {
+            call_site_index[pos] = call_caches.size();
+            call_caches.emplace_back();
+        }
+    }
+}
+
+void Chunk::build_property_caches() {
+    property_site_index.assign(code.size(), 0);
+    property_caches.clear();
+    for (size_t pos = 0; pos < code.size(); pos += op_size(code[pos])) {
+        if (is_property_site(code[pos])) {
+            property_site_index[pos] = property_caches.size();
+            property_caches.emplace_back();
+        }
+    }
+}
+
+} // namespace
@@ -2,8 +2,12 @@
 #pragma once
 
 #include <string>
+#include <unordered_map>
 #include <vector>
+#include <iostream>
+#include <iomanip>
 #include "value.h"
+#include "line_table.h"
 
 namespace aankaa {
 
@@ -18,11 +22,12 @@ enum OpCode {
     OP_GET_GLOBAL,
     OP_DEFINE_GLOBAL,
     OP_SET_GLOBAL,
-    OP_GET_UPVALUE,
-    OP_SET_UPVALUE,
-    OP_GET_PROPERTY,
-    OP_SET_PROPERTY,
-    OP_GET_SUPER,
+    OP_GET_UPVALUE,           // 读闭包直接复制进来的变量
+    OP_SET_UPVALUE,           // 写被捕获的变量，被赋值过的变量总是在ObjUpvalue里
+    // 属性和方法的名字是1字节的常量下标，放不下时用对应的宽格式。属性访问和OP_INVOKE按实例的shape走内联缓存，见PropertyCache
+    OP_GET_PROPERTY,          // 读字段，没有同名字段时取方法，得到绑定了receiver的方法
+    OP_SET_PROPERTY,          // 写字段，没有这个字段时添加，实例换到下一个shape
+    OP_GET_SUPER,             // 栈：this, 父类。取父类的方法绑定到this
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
@@ -37,18 +42,156 @@ enum OpCode {
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
-    OP_INVOKE,
-    OP_SUPER_INVOKE,
-    OP_CLOSURE,
-    OP_CLOSE_UPVALUE,
+    OP_INVOKE,                // receiver.name(args)：查找和调用合成一条指令，调用方法时不创建绑定方法
+    OP_SUPER_INVOKE,          // super.name(args)，栈：this, args, 父类
+    OP_CLOSURE,               // 用常量表里的函数创建闭包，按函数的upvalues捕获变量
     OP_RETURN,
     OP_CLASS,
-    OP_INHERIT,
-    OP_METHOD
+    OP_INHERIT,               // 栈：父类, 子类。把父类的方法复制到子类，弹出子类
+    OP_METHOD,                // 栈：类, 方法。加到类的方法表，弹出方法
+    // 超级指令，由peephole优化把常见的指令序列融合而成，编译器不会直接生成
+    OP_ADD_LOCAL_CONST,       // get_local slot, constant k, add
+    OP_INC_LOCAL,             // get_local slot, constant k, add, set_local slot, pop
+    OP_LESS_LOCAL_CONST_JUMP, // get_local slot, constant k, less, jmp_if_false off, pop
+    // 快速化(quickening)指令：通用的算术和比较指令第一次执行时按操作数类型把自己改写成下面的特化版本，
+    // 特化版本只检查一次类型，类型不符时改写回通用指令重新执行。编译器不会直接生成
+    OP_ADD_INT,
+    OP_ADD_NUM,
+    OP_SUBTRACT_INT,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_INT,
+    OP_MULTIPLY_NUM,
+    OP_LESS_INT,
+    OP_LESS_NUM,
+    OP_GREATER_INT,
+    OP_GREATER_NUM,
+    // 宽操作数指令：常量下标、全局变量槽位、跳转偏移量放不进短格式时由编译器自动选用，操作数是3字节大端
+    OP_CONSTANT_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_JUMP_LONG,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_LOOP_LONG,
+    // 快速化指令：OP_CALL发现调用的是原生函数时改写成它，直接调用原生函数，不创建栈帧
+    OP_CALL_NATIVE,
+    // 快速化指令：OP_CALL发现调用的是脚本函数时改写成它，按调用点缓存直接建立栈帧，见CallSiteCache
+    OP_CALL_CACHED,
+    // return f(...)：复用当前的栈帧调用f，后面总是跟着一条OP_RETURN
+    OP_TAIL_CALL,
+    // 被捕获并且被赋值过的变量通过ObjUpvalue读写。编译器先生成普通的局部变量和upvalue指令，
+    // 变量的作用域结束、确定它需要放到堆上之后再原地改写成下面的指令，指令长度不变
+    OP_GET_UPVALUE_CELL,
+    OP_GET_LOCAL_CELL,
+    OP_SET_LOCAL_CELL,
+    OP_CLOSURE_LONG,
+    // 属性、方法和类名指令的宽格式，名字是3字节的常量下标
+    OP_GET_PROPERTY_LONG,
+    OP_SET_PROPERTY_LONG,
+    OP_GET_SUPER_LONG,
+    OP_INVOKE_LONG,
+    OP_SUPER_INVOKE_LONG,
+    OP_CLASS_LONG,
+    OP_METHOD_LONG,
+    OP_COUNT
 };
 
+// 宽操作数的上限
+constexpr int MAX_LONG_OPERAND = (1 << 24) - 1;
+
 extern const char* op_name[];
 
+// 指令的字节数(opcode加上操作数)
+int op_size(uint8_t op);
+
+// 以pos开头的跳转指令的目标位置，不是跳转指令返回-1
+int jump_target(const std::vector<uint8_t>& code, int pos);
+
+// 短跳转指令对应的宽跳转指令，不是短跳转指令返回-1
+int long_jump_op(uint8_t op);
+
+class Chunk;
+
+// 执行chunk时值栈最多用到的槽位数，从栈帧的0号槽位算起，base是进入时已经占用的槽位(被调函数和参数)。
+// 沿着所有跳转分支模拟每条指令的出入栈，同一位置从不同路径到达时栈深度必须相同；
+// 指令不认识、越界、栈深度对不上、弹出了base以下的值或者访问了栈上还没有的局部变量时返回-1
+int max_stack_depth(const Chunk& chunk, int base);
+
+// 有属性缓存的指令：读写属性和OP_INVOKE，包括宽格式
+inline bool is_property_site(uint8_t op) {
+    return op == OP_GET_PROPERTY || op == OP_SET_PROPERTY || op == OP_INVOKE
+        || op == OP_GET_PROPERTY_LONG || op == OP_SET_PROPERTY_LONG || op == OP_INVOKE_LONG;
+}
+
+// 名字是3字节常量下标的宽格式名字指令
+inline bool is_long_name_op(uint8_t op) {
+    return op >= OP_GET_PROPERTY_LONG && op <= OP_METHOD_LONG;
+}
+
+// 跳转指令偏移量的字节数
+inline int jump_operand_size(uint8_t op) {
+    return op == OP_JUMP_LONG || op == OP_JUMP_IF_FALSE_LONG || op == OP_LOOP_LONG ? 3 : 2;
+}
+
+// 常量去重的key：值的类型加上原始的位模式。1和1.0、0.0和-0.0是不同的常量；
+// 字符串已经驻留，相同内容的字符串是同一个对象，比较指针就够了
+struct ConstantKey {
+    int type;
+    uint64_t bits;
+
+    bool operator==(const ConstantKey& other) const {
+        return type == other.type && bits == other.bits;
+    }
+};
+
+struct ConstantKeyHash {
+    size_t operator()(const ConstantKey& key) const {
+        return std::hash<uint64_t>()(key.bits * 31 + key.type);
+    }
+};
+
+ConstantKey constant_key(const Value& value);
+
+// 调用点的内联缓存
+// 记录这个调用点调用过的函数和它们的入口ip。缓存里的函数参数个数都和调用点的参数个数一致，
+// 命中时不用再检查类型和参数个数，直接建立栈帧。第一个位置是单态缓存，
+// 其余的位置是多态的退路，都占满之后新的函数不再缓存，走通用的call_value
+constexpr int CALL_CACHE_WAYS = 4;
+
+struct CallSiteCache {
+    ObjFunction* functions[CALL_CACHE_WAYS] = {};
+    uint8_t* entries[CALL_CACHE_WAYS] = {};
+    int count = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+struct Shape;
+
+// 属性访问点(OP_GET_PROPERTY/OP_SET_PROPERTY/OP_INVOKE)的内联缓存，以实例的shape为key。
+// shape确定了字段的下标，也确定了类，所以查找结果可以一直复用：
+// 读：slot >= 0是字段下标，否则method是类的方法；
+// 写：已有的字段写到slot；新字段的transition是添加之后的shape，值追加到字段数组末尾(slot)。
+// 和调用点缓存一样，第一个位置是单态缓存，都占满之后不再缓存。
+// 缓存不保留类，类被回收时GC把它的shape从缓存里去掉(prune_property_caches)
+constexpr int PROPERTY_CACHE_WAYS = 4;
+
+struct PropertyCacheEntry {
+    Shape* shape = nullptr;
+    Shape* transition = nullptr;
+    int slot = -1;
+    // 方法的值和它的函数(闭包取它的函数)，调用时不用再判断类型
+    Obj* method = nullptr;
+    ObjFunction* function = nullptr;
+};
+
+struct PropertyCache {
+    PropertyCacheEntry entries[PROPERTY_CACHE_WAYS];
+    int count = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
 // 1 + 2 * 3 - 4的解析结果：
 // code -> OP_CONSTANT,1,OP_CONSTANT,2,OP_CONSTANT,3,OP_MULTIPLY,OP_ADD,OP_CONSTANT,4,OP_SUBTRACT,
 // constants -> 1,2,3,4,
@@ -59,66 +202,145 @@ public:
     ~Chunk() {}
     void write(uint8_t byte, int line) {
         code.emplace_back(byte);
-        lines.emplace_back(line);
+        lines.add(line);
         count++;
     }
 
-    // 添加一个常量，返回常量所在的下标
+    // 添加一个常量，返回常量所在的下标。同一个值只保存一份
     int add_constant(Value value) {
-        constants.emplace_back(value);
-        return constants.size() - 1;
+        auto result = _constant_index.emplace(constant_key(value), constants.size());
+        if (result.second) {
+            constants.emplace_back(value);
+        }
+        return result.first->second;
     }
-    void print() {
-
-                
-        std::cout << "chunk:" << this << " code[" << code.size() << "] -> \n";
+    void print(std::ostream& out = std::cout) {
+        out << "chunk:" << this << " code[" << code.size() << "] -> \n";
         for (int i = 0; i < code.size();) {
-            printf("%3d    ", i);
-            if (code[i] == OP_GET_LOCAL || code[i] == OP_SET_LOCAL || code[i] == OP_CALL) {
-                std::cout << op_name[code[i]];
-                std::cout << "(" << static_cast<int>(code[i+1]) << ")\n";
+            out << std::setw(3) << i << "    ";
+            if (code[i] == OP_GET_LOCAL || code[i] == OP_SET_LOCAL || code[i] == OP_CALL
+                    || code[i] == OP_CALL_NATIVE || code[i] == OP_CALL_CACHED
+                    || code[i] == OP_TAIL_CALL || code[i] == OP_GET_UPVALUE || code[i] == OP_SET_UPVALUE
+                    || code[i] == OP_GET_UPVALUE_CELL || code[i] == OP_GET_LOCAL_CELL
+                    || code[i] == OP_SET_LOCAL_CELL) {
+                out << op_name[code[i]];
+                out << "(" << static_cast<int>(code[i+1]) << ")\n";
                 i += 2;
             } else if (code[i] == OP_JUMP_IF_FALSE || code[i] == OP_JUMP || code[i] == OP_LOOP) {
-                std::cout << op_name[code[i]];
+                out << op_name[code[i]];
                 uint16_t offset = (static_cast<uint16_t>(code[i+1]) << 8) | static_cast<uint16_t>(code[i+2]);
-                printf("(%hu)\n", offset);
+                out << "(" << offset << ")\n";
                 i += 3;
+            } else if (code[i] == OP_JUMP_IF_FALSE_LONG || code[i] == OP_JUMP_LONG || code[i] == OP_LOOP_LONG) {
+                out << op_name[code[i]];
+                out << "(" << read_long(i + 1) << ")\n";
+                i += 4;
             } else if (code[i] == OP_CONSTANT) {
                 int cons_idx = code[i+1];
                 Value& v = constants.at(cons_idx);
-                std::cout << "[" << v.to_string() << "]\n";
+                out << "[" << v.to_string() << "]\n";
                 i += 2;
+            } else if (code[i] == OP_CONSTANT_LONG) {
+                Value& v = constants.at(read_long(i + 1));
+                out << "[" << v.to_string() << "]\n";
+                i += 4;
+            } else if (code[i] == OP_CLOSURE || code[i] == OP_CLOSURE_LONG) {
+                bool is_long = code[i] == OP_CLOSURE_LONG;
+                Value& v = constants.at(is_long ? read_long(i + 1) : code[i + 1]);
+                out << "closure[" << v.to_string() << "]\n";
+                i += is_long ? 4 : 2;
+            } else if (code[i] == OP_ADD_LOCAL_CONST || code[i] == OP_INC_LOCAL) {
+                out << op_name[code[i]];
+                out << "(" << static_cast<int>(code[i+1]) << ", " << constants.at(code[i+2]).to_string() << ")\n";
+                i += 3;
+            } else if (code[i] == OP_LESS_LOCAL_CONST_JUMP) {
+                uint16_t offset = (static_cast<uint16_t>(code[i+3]) << 8) | static_cast<uint16_t>(code[i+4]);
+                out << op_name[code[i]];
+                out << "(" << static_cast<int>(code[i+1]) << ", " << constants.at(code[i+2]).to_string()
+                    << ", " << offset << ")\n";
+                i += 5;
+            } else if (code[i] == OP_GET_PROPERTY || code[i] == OP_SET_PROPERTY || code[i] == OP_GET_SUPER
+                       || code[i] == OP_CLASS || code[i] == OP_METHOD
+                       || code[i] == OP_INVOKE || code[i] == OP_SUPER_INVOKE || is_long_name_op(code[i])) {
+                int size = op_size(code[i]);
+                out << op_name[code[i]];
+                out << "(" << constants.at(name_operand(i)).to_string();
+                if (code[i] == OP_INVOKE || code[i] == OP_SUPER_INVOKE
+                        || code[i] == OP_INVOKE_LONG || code[i] == OP_SUPER_INVOKE_LONG) {
+                    // 参数个数在名字后面
+                    out << ", " << static_cast<int>(code[i + size - 1]);
+                }
+                out << ")\n";
+                i += size;
             } else if ((code[i] == OP_DEFINE_GLOBAL
                         || code[i] == OP_SET_GLOBAL
                         || code[i] == OP_GET_GLOBAL)) {
-                std::cout << op_name[code[i]];
-                int cons_idx = code[i+1];
-                Value& v = constants[cons_idx];
-                std::cout << "(" << v.to_string() << ")\n";
+                // 全局变量的操作数是GlobalTable的槽位
+                out << op_name[code[i]];
+                out << "(#" << static_cast<int>(code[i+1]) << ")\n";
                 i += 2;
+            } else if ((code[i] == OP_DEFINE_GLOBAL_LONG
+                        || code[i] == OP_SET_GLOBAL_LONG
+                        || code[i] == OP_GET_GLOBAL_LONG)) {
+                out << op_name[code[i]];
+                out << "(#" << read_long(i + 1) << ")\n";
+                i += 4;
             } else {
-                std::cout << op_name[code[i]] << "\n";
+                out << op_name[code[i]] << "\n";
                 i += 1;
             }
         }
-        std::cout << "constants -> ";
+        out << "constants -> ";
         for (int i = 0; i < constants.size(); ++i) {
-            std::cout << constants[i].to_string() << ",";
+            out << constants[i].to_string() << ",";
         }
-        std::cout << std::endl << std::flush;
+        out << std::endl << std::flush;
     }
     void clear() {
         count = 0;
         code.clear();
         lines.clear();
         constants.clear();
+        _constant_index.clear();
+        call_caches.clear();
+        call_site_index.clear();
+        property_caches.clear();
+        property_site_index.clear();
+    }
+    // 指令偏移量为offset的调用点的缓存，要先build_call_caches
+    CallSiteCache* call_cache(size_t offset) {
+        return &call_caches[call_site_index[offset]];
+    }
+    // 给每个调用点分配一个缓存，在第一次执行调用指令时建立，之后code不能再修改
+    void build_call_caches();
+    // 属性访问点的缓存，用法和调用点缓存一样
+    PropertyCache* property_cache(size_t offset) {
+        return &property_caches[property_site_index[offset]];
+    }
+    void build_property_caches();
+    // pos处名字指令(属性、方法、类名)的常量下标
+    int name_operand(int pos) const {
+        return is_long_name_op(code[pos]) ? read_long(pos + 1) : code[pos + 1];
+    }
+    // pos开始的3字节宽操作数
+    int read_long(int pos) const {
+        return (code[pos] << 16) | (code[pos + 1] << 8) | code[pos + 2];
     }
 public:
     int count = 0;
     int capacity = 0;
+    // max_stack_depth的结果，编译器在end_compiler里算好，进入栈帧时按它保证栈空间
+    int max_stack = 0;
     std::vector<uint8_t> code;
-    std::vector<int> lines;
+    LineTable lines;
     std::vector<Value> constants;
+    // 调用点缓存的side table：call_site_index按指令偏移量找到call_caches里的下标
+    std::vector<CallSiteCache> call_caches;
+    std::vector<uint32_t> call_site_index;
+    std::vector<PropertyCache> property_caches;
+    std::vector<uint32_t> property_site_index;
+private:
+    std::unordered_map<ConstantKey, int, ConstantKeyHash> _constant_index;
 };
 
 } //namespace
\ No newline at end of file
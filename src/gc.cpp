@@ -0,0 +1,418 @@
+#include <assert.h>
+#include <chrono>
+#include <algorithm>
+#include <stdlib.h>
+
+#include "vm.h"
+#include "object.h"
+#include "chunk.h"
+#include "trace.h"
+
+// 标记-清除垃圾回收
+// 标记：从栈、frame、全局变量表和编译期的临时根出发，用gray_stack做广度遍历，
+//      函数对象继续标记自己的名字和常量表，闭包标记函数和捕获的变量，
+//      类标记方法表和所有shape的字段名，实例标记类(通过shape)和字段。
+// 清除：驻留表是弱引用，先删掉没有标记的字符串，再遍历objects链表释放没有标记的对象。
+//      属性缓存也是弱引用：类只被缓存引用时照常回收，清除之前把它的shape从缓存里去掉。
+//
+// 运行时拼接出来的字符串大多马上就死了，这部分字符串分配在nursery里(分代)：
+// nursery满了做一次minor回收，从栈、全局变量表、临时根和remembered set出发，
+// 把还活着的字符串复制到老年代，原对象的next字段记录新地址(转发指针)，然后整块nursery重置。
+// 完整回收之前总是先做一次minor回收，所以标记-清除只需要处理老年代。
+
+namespace aankaa {
+
+VM::~VM() {
+    Obj* obj = objects;
+    while (obj != nullptr) {
+        Obj* next = obj->next;
+        free_object(obj);
+        obj = next;
+    }
+    objects = nullptr;
+}
+
+void VM::remove_root(Obj* obj) {
+    for (auto iter = roots.rbegin(); iter != roots.rend(); ++iter) {
+        if (*iter == obj) {
+            roots.erase(std::next(iter).base());
+            return;
+        }
+    }
+}
+
+size_t VM::object_size(Obj* obj) {
+    switch (obj->type) {
+    case OBJ_STRING:
+        return ObjString::alloc_size(static_cast<ObjString*>(obj)->length);
+    case OBJ_FUNCTION:
+        return sizeof(ObjFunction) + sizeof(Chunk);
+    case OBJ_NATIVE:
+        return sizeof(ObjNative);
+    case OBJ_CLOSURE:
+        return ObjClosure::alloc_size(static_cast<ObjClosure*>(obj)->count);
+    case OBJ_UPVALUE:
+        return sizeof(ObjUpvalue);
+    case OBJ_CLASS:
+        return sizeof(ObjClass);
+    case OBJ_INSTANCE:
+        // 字段数组会增长，分配和释放时按同一个大小记账，不计入字段数组
+        return sizeof(ObjInstance);
+    case OBJ_BOUND_METHOD:
+        return sizeof(ObjBoundMethod);
+    default:
+        return sizeof(Obj);
+    }
+}
+
+// 对象都是从对应类型的pool里分配的，释放失败说明对象的类型或者链表被破坏了
+template <typename T>
+static void release_to(ObjectPool<T>& pool, Obj* obj) {
+    bool released = pool.release(static_cast<T*>(obj));
+    assert(released);
+    (void)released;
+}
+
+void VM::free_object(Obj* obj) {
+    bytes_allocated -= object_size(obj);
+    object_count--;
+    switch (obj->type) {
+    case OBJ_STRING:
+        // 老年代的字符串由allocate_string/promote用malloc分配
+        static_cast<ObjString*>(obj)->~ObjString();
+        free(obj);
+        break;
+    case OBJ_FUNCTION:
+        release_to(std::get<ObjectPool<ObjFunction>>(pools), obj);
+        break;
+    case OBJ_NATIVE:
+        release_to(std::get<ObjectPool<ObjNative>>(pools), obj);
+        break;
+    case OBJ_CLOSURE:
+        // 和字符串一样由allocate_closure用malloc分配
+        static_cast<ObjClosure*>(obj)->~ObjClosure();
+        free(obj);
+        break;
+    case OBJ_UPVALUE:
+        release_to(std::get<ObjectPool<ObjUpvalue>>(pools), obj);
+        break;
+    case OBJ_CLASS:
+        release_to(std::get<ObjectPool<ObjClass>>(pools), obj);
+        break;
+    case OBJ_INSTANCE:
+        release_to(std::get<ObjectPool<ObjInstance>>(pools), obj);
+        break;
+    case OBJ_BOUND_METHOD:
+        release_to(std::get<ObjectPool<ObjBoundMethod>>(pools), obj);
+        break;
+    default:
+        break;
+    }
+}
+
+void VM::mark_object(Obj* obj) {
+    if (obj == nullptr || obj->is_marked) {
+        return;
+    }
+    obj->is_marked = true;
+    gray_stack.push_back(obj);
+}
+
+void VM::mark_value(const Value& value) {
+    if (value.is_obj()) {
+        mark_object(value.as_obj());
+    }
+}
+
+void VM::mark_roots() {
+    for (Value* slot = stack_bottom; slot < stack_top; slot++) {
+        mark_value(*slot);
+    }
+    for (int i = 0; i < frames.frame_count(); i++) {
+        mark_object(frames.at(i)->function);
+        // 方法调用时0号槽位是this，闭包只在这里
+        mark_object(frames.at(i)->closure);
+    }
+    for (size_t i = 0; i < globals.values.size(); i++) {
+        mark_object(globals.names[i]);
+        mark_value(globals.values[i]);
+    }
+    for (Obj* obj : roots) {
+        mark_object(obj);
+    }
+}
+
+void VM::blacken_object(Obj* obj) {
+    switch (obj->type) {
+    case OBJ_FUNCTION: {
+        ObjFunction* function = static_cast<ObjFunction*>(obj);
+        mark_object(function->name);
+        for (const Value& constant : function->chunk->constants) {
+            mark_value(constant);
+        }
+        // 调用点缓存里的函数也要保留，否则回收后地址被复用会命中一个错误的入口
+        for (const CallSiteCache& cache : function->chunk->call_caches) {
+            for (int i = 0; i < cache.count; ++i) {
+                mark_object(cache.functions[i]);
+            }
+        }
+        // 属性缓存不标记类：同一段代码每次执行都创建新的类，强引用会让旧的shape一直占着缓存
+        if (!function->chunk->property_caches.empty()) {
+            property_cache_owners.push_back(function);
+        }
+        break;
+    }
+    case OBJ_NATIVE:
+        mark_object(static_cast<ObjNative*>(obj)->name);
+        break;
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = static_cast<ObjClosure*>(obj);
+        mark_object(closure->function);
+        for (int i = 0; i < closure->count; ++i) {
+            mark_value(closure->captures()[i]);
+        }
+        break;
+    }
+    case OBJ_UPVALUE:
+        mark_value(static_cast<ObjUpvalue*>(obj)->value);
+        break;
+    case OBJ_CLASS: {
+        ObjClass* klass = static_cast<ObjClass*>(obj);
+        mark_object(klass->name);
+        for (const auto& method : klass->methods) {
+            mark_object(method.first);
+            mark_value(method.second);
+        }
+        // 字段名只被shape引用时也要保留，否则同名的字符串重新驻留后地址不同，按指针查找不到字段
+        klass->shape.for_each([this](const Shape& shape) {
+            for (ObjString* key : shape.keys) {
+                mark_object(key);
+            }
+        });
+        break;
+    }
+    case OBJ_INSTANCE: {
+        ObjInstance* instance = static_cast<ObjInstance*>(obj);
+        mark_object(instance->klass());
+        for (const Value& field : instance->fields) {
+            mark_value(field);
+        }
+        break;
+    }
+    case OBJ_BOUND_METHOD: {
+        ObjBoundMethod* bound = static_cast<ObjBoundMethod*>(obj);
+        mark_value(bound->receiver);
+        mark_value(bound->method);
+        break;
+    }
+    case OBJ_STRING:
+    default:
+        break;
+    }
+}
+
+void VM::trace_references() {
+    while (!gray_stack.empty()) {
+        Obj* obj = gray_stack.back();
+        gray_stack.pop_back();
+        blacken_object(obj);
+    }
+}
+
+// shape属于它的类，类被回收后shape的地址可能被复用，缓存里留着会命中一个错误的槽位。
+// 方法属于类的方法表，类还活着方法就还活着。
+void VM::prune_property_caches() {
+    for (ObjFunction* function : property_cache_owners) {
+        for (PropertyCache& cache : function->chunk->property_caches) {
+            int count = 0;
+            for (int i = 0; i < cache.count; ++i) {
+                if (cache.entries[i].shape->klass->is_marked) {
+                    cache.entries[count++] = cache.entries[i];
+                }
+            }
+            for (int i = count; i < cache.count; ++i) {
+                cache.entries[i] = PropertyCacheEntry();
+            }
+            cache.count = count;
+        }
+    }
+    property_cache_owners.clear();
+}
+
+void VM::sweep() {
+    Obj* previous = nullptr;
+    Obj* obj = objects;
+    while (obj != nullptr) {
+        if (obj->is_marked) {
+            obj->is_marked = false;
+            previous = obj;
+            obj = obj->next;
+            continue;
+        }
+        Obj* unreached = obj;
+        obj = obj->next;
+        if (previous != nullptr) {
+            previous->next = obj;
+        } else {
+            objects = obj;
+        }
+        gc_stats.objects_reclaimed++;
+        free_object(unreached);
+    }
+}
+
+ObjString* VM::allocate_string(const char* chars, int length, uint32_t hash, bool young) {
+    size_t size = ObjString::alloc_size(length);
+    gc_stats.strings_allocated++;
+    if (young && use_nursery && size <= NURSERY_MAX_OBJECT) {
+        if (gc_stress) {
+            collect_garbage();
+        }
+        void* memory = nursery.allocate(size);
+        if (memory == nullptr) {
+            minor_collect();
+            if (bytes_allocated > next_gc) {
+                collect_garbage();
+            }
+            memory = nursery.allocate(size);
+        }
+        gc_stats.nursery_bytes_allocated += size;
+        return ObjString::init(memory, chars, length, hash);
+    }
+
+    if (gc_stress || bytes_allocated + size > next_gc) {
+        collect_garbage();
+    }
+    ObjString* str = ObjString::init(malloc(size), chars, length, hash);
+    str->next = objects;
+    objects = str;
+    bytes_allocated += size;
+    object_count++;
+    return str;
+}
+
+ObjClosure* VM::allocate_closure(ObjFunction* function) {
+    int count = function->upvalues.size();
+    size_t size = ObjClosure::alloc_size(count);
+    if (gc_stress || bytes_allocated + size > next_gc) {
+        collect_garbage();
+    }
+    ObjClosure* closure = new (malloc(size)) ObjClosure(function, count);
+    closure->next = objects;
+    objects = closure;
+    bytes_allocated += size;
+    object_count++;
+    return closure;
+}
+
+// 把nursery里的字符串复制到老年代，已经复制过的直接返回新地址
+ObjString* VM::promote(ObjString* str) {
+    if (str->is_marked) {
+        return static_cast<ObjString*>(str->next);
+    }
+    size_t size = ObjString::alloc_size(str->length);
+    ObjString* old = ObjString::init(malloc(size), str->chars, str->length, str->hash);
+    old->next = objects;
+    objects = old;
+    bytes_allocated += size;
+    object_count++;
+    gc_stats.bytes_promoted += size;
+
+    str->is_marked = true;
+    str->next = old;
+    return old;
+}
+
+void VM::forward_value(Value& value) {
+    if (value.is_obj() && nursery.contains(value.as_obj())) {
+        value = Value(promote(static_cast<ObjString*>(value.as_obj())));
+    }
+}
+
+void VM::minor_collect() {
+    if (nursery.used() == 0) {
+        return;
+    }
+    auto start_time = std::chrono::steady_clock::now();
+
+    for (Value* slot = stack_bottom; slot < stack_top; slot++) {
+        forward_value(*slot);
+    }
+    for (size_t i = 0; i < globals.values.size(); i++) {
+        forward_value(globals.values[i]);
+        if (nursery.contains(globals.names[i])) {
+            // 名字第一次驻留时是运行时拼出来的字符串，晋升之后按名字的索引也要跟着换
+            globals.rename(i, promote(globals.names[i]));
+        }
+    }
+    for (Obj*& obj : roots) {
+        if (nursery.contains(obj)) {
+            obj = promote(static_cast<ObjString*>(obj));
+        }
+    }
+    for (Obj* obj : remembered) {
+        obj->is_remembered = false;
+        if (obj->type == OBJ_FUNCTION) {
+            ObjFunction* function = static_cast<ObjFunction*>(obj);
+            if (nursery.contains(function->name)) {
+                function->name = promote(function->name);
+            }
+            for (Value& constant : function->chunk->constants) {
+                forward_value(constant);
+            }
+        } else if (obj->type == OBJ_CLOSURE) {
+            ObjClosure* closure = static_cast<ObjClosure*>(obj);
+            for (int i = 0; i < closure->count; ++i) {
+                forward_value(closure->captures()[i]);
+            }
+        } else if (obj->type == OBJ_UPVALUE) {
+            forward_value(static_cast<ObjUpvalue*>(obj)->value);
+        } else if (obj->type == OBJ_INSTANCE) {
+            for (Value& field : static_cast<ObjInstance*>(obj)->fields) {
+                forward_value(field);
+            }
+        }
+    }
+    remembered.clear();
+    // 驻留表是弱引用：晋升了的换成新地址，没晋升的就是死掉了
+    strings.rewrite([this](ObjString* str) -> ObjString* {
+        if (!nursery.contains(str)) {
+            return str;
+        }
+        return str->is_marked ? static_cast<ObjString*>(str->next) : nullptr;
+    });
+    nursery.reset();
+
+    uint64_t pause_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - start_time).count();
+    gc_stats.minor_collections++;
+    gc_stats.minor_pause_ns += pause_ns;
+    TRACE(TRACE_GC, "minor promoted:" << gc_stats.bytes_promoted << " pause:" << pause_ns / 1000 << "us");
+}
+
+void VM::collect_garbage() {
+    minor_collect();
+
+    auto start_time = std::chrono::steady_clock::now();
+    size_t before = bytes_allocated;
+
+    mark_roots();
+    trace_references();
+    prune_property_caches();
+    strings.remove_if([](ObjString* str) { return !str->is_marked; });
+    sweep();
+
+    next_gc = std::max(bytes_allocated * GC_HEAP_GROW_FACTOR, GC_INITIAL_THRESHOLD);
+
+    uint64_t pause_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - start_time).count();
+    gc_stats.collections++;
+    gc_stats.last_pause_ns = pause_ns;
+    gc_stats.total_pause_ns += pause_ns;
+    gc_stats.max_pause_ns = std::max(gc_stats.max_pause_ns, pause_ns);
+    gc_stats.bytes_reclaimed += before - bytes_allocated;
+    TRACE(TRACE_GC, "collect reclaimed:" << before - bytes_allocated << " live:" << bytes_allocated
+          << " next_gc:" << next_gc << " pause:" << pause_ns / 1000 << "us");
+}
+
+} // namespace
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <iostream>
+#include <memory>
+
+namespace aankaa {
+
+// 第一次垃圾回收的触发阈值
+constexpr size_t GC_INITIAL_THRESHOLD = 1024 * 1024;
+// 回收之后，下一次触发阈值 = 存活字节数 * GC_HEAP_GROW_FACTOR
+constexpr size_t GC_HEAP_GROW_FACTOR = 2;
+// nursery的大小，运行时拼接出来的字符串先分配在这里
+constexpr size_t NURSERY_SIZE = 256 * 1024;
+// 超过nursery 1/4的大字符串直接分配到老年代
+constexpr size_t NURSERY_MAX_OBJECT = NURSERY_SIZE / 4;
+
+struct GCStats {
+    uint64_t collections = 0;
+    uint64_t total_pause_ns = 0;
+    uint64_t max_pause_ns = 0;
+    uint64_t last_pause_ns = 0;
+    uint64_t bytes_reclaimed = 0;
+    uint64_t objects_reclaimed = 0;
+    uint64_t minor_collections = 0;
+    uint64_t minor_pause_ns = 0;
+    uint64_t nursery_bytes_allocated = 0;
+    uint64_t strings_allocated = 0;
+    uint64_t bytes_promoted = 0;
+
+    void print() const {
+        std::cout << "gc collections:" << collections
+                  << " total_pause:" << total_pause_ns / 1000 << "us"
+                  << " max_pause:" << max_pause_ns / 1000 << "us"
+                  << " avg_pause:" << (collections == 0 ? 0 : total_pause_ns / collections / 1000) << "us"
+                  << " bytes_reclaimed:" << bytes_reclaimed
+                  << " objects_reclaimed:" << objects_reclaimed << std::endl;
+        std::cout << "gc minor_collections:" << minor_collections
+                  << " minor_pause:" << minor_pause_ns / 1000 << "us"
+                  << " strings_allocated:" << strings_allocated
+                  << " nursery_bytes:" << nursery_bytes_allocated
+                  << " bytes_promoted:" << bytes_promoted << std::endl;
+    }
+};
+
+// 新生代：一块连续内存上的bump-pointer分配器，只存放字符串。
+// 字符串不引用其他对象，minor回收时只需要扫描根，把活着的字符串复制(晋升)到老年代，
+// 然后整块nursery直接重置，死掉的字符串不需要任何处理。
+class Nursery {
+public:
+    explicit Nursery(size_t capacity = NURSERY_SIZE) : _capacity(capacity) {}
+    Nursery(Nursery const&) = delete;
+    Nursery& operator=(Nursery const&) = delete;
+
+    // 空间不够返回nullptr，由调用方触发minor回收
+    void* allocate(size_t size) {
+        size = (size + 7) & ~size_t(7);
+        if (_begin == nullptr) {
+            // 第一次使用时才申请内存，不用nursery的VM没有额外开销
+            _memory.reset(new char[_capacity]);
+            _begin = _memory.get();
+            _top = _begin;
+            _end = _begin + _capacity;
+        }
+        if (size > static_cast<size_t>(_end - _top)) {
+            return nullptr;
+        }
+        void* ptr = _top;
+        _top += size;
+        return ptr;
+    }
+    bool contains(const void* ptr) const {
+        return ptr >= _begin && ptr < _end;
+    }
+    void reset() {
+        _top = _begin;
+    }
+    size_t used() const {
+        return _top - _begin;
+    }
+    size_t capacity() const {
+        return _capacity;
+    }
+private:
+    std::unique_ptr<char[]> _memory;
+    char* _begin = nullptr;
+    char* _top = nullptr;
+    char* _end = nullptr;
+    size_t _capacity = 0;
+};
+
+} // namespace
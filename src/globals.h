@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "value.h"
+#include "object.h"
+
+namespace aankaa {
+
+// 全局变量表
+// 编译期把全局变量名解析成稠密的槽位下标，字节码里直接携带槽位，
+// 运行时OP_GET_GLOBAL/OP_SET_GLOBAL/OP_DEFINE_GLOBAL按下标访问values，不再需要哈希字符串。
+// 还没执行过定义语句的槽位存放Value::undefined()哨兵，用来报"Undefined variable"错误。
+// 按名字查找(find/define/get)只给native函数注册和宿主程序嵌入使用，不在热路径上。
+// 名字都是驻留过的ObjString，直接用指针比较，哈希使用ObjString缓存的hash。
+class GlobalTable {
+public:
+    // 返回name对应的槽位，不存在则分配一个新的未定义槽位
+    int resolve(ObjString* name) {
+        auto iter = _index.find(name);
+        if (iter != _index.end()) {
+            return iter->second;
+        }
+        int slot = static_cast<int>(values.size());
+        _index.emplace(name, slot);
+        names.emplace_back(name);
+        values.emplace_back(Value::undefined());
+        return slot;
+    }
+
+    // 返回name对应的槽位，不存在返回-1
+    int find(ObjString* name) const {
+        auto iter = _index.find(name);
+        return iter == _index.end() ? -1 : iter->second;
+    }
+
+    void define(ObjString* name, const Value& value) {
+        values[resolve(name)] = value;
+    }
+
+    bool get(ObjString* name, Value* value) const {
+        int slot = find(name);
+        if (slot < 0 || values[slot].is_undefined()) {
+            return false;
+        }
+        *value = values[slot];
+        return true;
+    }
+
+    // 槽位的名字换成内容相同的另一个对象：名字从nursery晋升之后，按名字查找要用晋升后的对象
+    void rename(int slot, ObjString* name) {
+        _index.erase(names[slot]);
+        names[slot] = name;
+        _index.emplace(name, slot);
+    }
+
+    ObjString* name_of(int slot) const {
+        return names[slot];
+    }
+
+    int size() const {
+        return static_cast<int>(values.size());
+    }
+
+public:
+    std::vector<Value> values;
+    std::vector<ObjString*> names;
+private:
+    struct NameHash {
+        size_t operator()(const ObjString* name) const {
+            return name->hash;
+        }
+    };
+    std::unordered_map<ObjString*, int, NameHash> _index;
+};
+
+} // namespace
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <initializer_list>
+
+#include "token.h"
+
+namespace aankaa {
+
+// 关键字表，新增关键字只需要加在这里：完美哈希和字符分类表都在编译期由它生成，
+// 生成不出无冲突的哈希时static_assert会报错
+struct Keyword {
+    const char* name;
+    int length;
+    TokenType type;
+
+    constexpr Keyword(const char* name, TokenType type) : name(name), length(0), type(type) {
+        while (name[length] != '\0') {
+            ++length;
+        }
+    }
+};
+
+constexpr Keyword KEYWORDS[] = {
+    {"and", AND},
+    {"class", CLASS},
+    {"else", ELSE},
+    {"false", FALSE},
+    {"for", FOR},
+    {"fun", FUN},
+    {"if", IF},
+    {"nil", NIL},
+    {"or", OR},
+    {"print", PRINT},
+    {"return", RETURN},
+    {"super", SUPER},
+    {"this", THIS},
+    {"true", TRUE},
+    {"var", VAR},
+    {"while", WHILE},
+};
+
+constexpr int KEYWORD_COUNT = sizeof(KEYWORDS) / sizeof(KEYWORDS[0]);
+
+// ---------------- 字符分类表 ----------------
+
+enum CharClass : uint8_t {
+    CHAR_ALPHA = 1 << 0,         // [A-Za-z_]
+    CHAR_DIGIT = 1 << 1,         // [0-9]
+    CHAR_BLANK = 1 << 2,         // 空格 \t \r \n
+    CHAR_KEYWORD_START = 1 << 3, // 某个关键字的首字母，其他字母开头的标识符不用查关键字
+    CHAR_IDENT = CHAR_ALPHA | CHAR_DIGIT,
+};
+
+struct CharClassTable {
+    uint8_t classes[256] = {};
+
+    constexpr CharClassTable() {
+        for (int ch = 'a'; ch <= 'z'; ++ch) {
+            classes[ch] |= CHAR_ALPHA;
+            classes[ch - 'a' + 'A'] |= CHAR_ALPHA;
+        }
+        classes['_'] |= CHAR_ALPHA;
+        for (int ch = '0'; ch <= '9'; ++ch) {
+            classes[ch] |= CHAR_DIGIT;
+        }
+        for (char ch : {' ', '\t', '\r', '\n'}) {
+            classes[static_cast<uint8_t>(ch)] |= CHAR_BLANK;
+        }
+        for (const Keyword& keyword : KEYWORDS) {
+            classes[static_cast<uint8_t>(keyword.name[0])] |= CHAR_KEYWORD_START;
+        }
+    }
+};
+
+constexpr CharClassTable CHAR_CLASS_TABLE;
+
+inline bool char_is(char ch, uint8_t char_class) {
+    return (CHAR_CLASS_TABLE.classes[static_cast<uint8_t>(ch)] & char_class) != 0;
+}
+
+// ---------------- 关键字的完美哈希 ----------------
+// hash = (首字母 * a + 末字母 * b + 长度) % KEYWORD_TABLE_SIZE，
+// 编译期枚举a和b，找出让所有关键字落在不同槽位的一组
+
+constexpr int KEYWORD_TABLE_SIZE = 64;
+static_assert((KEYWORD_TABLE_SIZE & (KEYWORD_TABLE_SIZE - 1)) == 0, "table size must be a power of 2");
+
+constexpr uint32_t keyword_hash(uint32_t first, uint32_t last, uint32_t length, uint32_t a, uint32_t b) {
+    return (first * a + last * b + length) & (KEYWORD_TABLE_SIZE - 1);
+}
+
+struct KeywordTable {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    int8_t slots[KEYWORD_TABLE_SIZE] = {}; // KEYWORDS的下标，-1表示空
+    int max_length = 0;
+
+    constexpr KeywordTable() {
+        for (const Keyword& keyword : KEYWORDS) {
+            max_length = keyword.length > max_length ? keyword.length : max_length;
+        }
+        for (uint32_t try_a = 1; try_a < 256; ++try_a) {
+            for (uint32_t try_b = 0; try_b < 256; ++try_b) {
+                if (fill(try_a, try_b)) {
+                    a = try_a;
+                    b = try_b;
+                    return;
+                }
+            }
+        }
+    }
+
+    constexpr bool fill(uint32_t try_a, uint32_t try_b) {
+        for (int8_t& slot : slots) {
+            slot = -1;
+        }
+        for (int i = 0; i < KEYWORD_COUNT; ++i) {
+            const Keyword& keyword = KEYWORDS[i];
+            uint32_t h = keyword_hash(static_cast<uint8_t>(keyword.name[0]),
+                                      static_cast<uint8_t>(keyword.name[keyword.length - 1]),
+                                      keyword.length, try_a, try_b);
+            if (slots[h] != -1) {
+                return false;
+            }
+            slots[h] = i;
+        }
+        return true;
+    }
+};
+
+constexpr KeywordTable KEYWORD_TABLE;
+static_assert(KEYWORD_TABLE.a != 0, "no perfect hash for KEYWORDS, enlarge KEYWORD_TABLE_SIZE");
+
+// start开头、长度为length的标识符是关键字时返回关键字的类型，否则返回IDENTIFIER
+inline TokenType keyword_type(const char* start, int length) {
+    if (length > KEYWORD_TABLE.max_length || !char_is(start[0], CHAR_KEYWORD_START)) {
+        return IDENTIFIER;
+    }
+    uint32_t h = keyword_hash(static_cast<uint8_t>(start[0]), static_cast<uint8_t>(start[length - 1]),
+                              length, KEYWORD_TABLE.a, KEYWORD_TABLE.b);
+    int index = KEYWORD_TABLE.slots[h];
+    if (index < 0) {
+        return IDENTIFIER;
+    }
+    const Keyword& keyword = KEYWORDS[index];
+    if (keyword.length != length || memcmp(keyword.name, start, length) != 0) {
+        return IDENTIFIER;
+    }
+    return keyword.type;
+}
+
+} // namespace
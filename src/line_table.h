@@ -0,0 +1,259 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace aankaa {
+
+// 字节码的行号表
+// 一行源码通常生成好几条指令，连续相同行号的一段字节只记一条：这一段的字节数和相对上一段的行号增量，
+// 两个数都用变长整数编码(行号增量先做zigzag)，一段通常只占两个字节。
+// 每CHECKPOINT_INTERVAL段记一个检查点(起始偏移、行号、编码位置)，查询时先二分查找检查点，
+// 再从检查点往后最多解码CHECKPOINT_INTERVAL段。
+// 最后一段还在增长，单独保存不编码，编译时连续写同一行的字节只是一次加法。
+class LineTable {
+public:
+    // 追加count个字节，它们都属于line这一行
+    void add(int line, int count = 1) {
+        if (_open_count > 0 && line == _open_line) {
+            _open_count += count;
+        } else {
+            close_run();
+            _open_start = _size;
+            _open_line = line;
+            _open_count = count;
+        }
+        _size += count;
+    }
+
+    // offset处的字节所在的行号，offset越界时返回最后一行
+    int line_for_offset(int offset) const {
+        if (offset >= _open_start) {
+            return _open_line;
+        }
+        Cursor cursor = find(offset);
+        return cursor.line;
+    }
+
+    // 只保留前size个字节
+    void truncate(int size) {
+        if (size >= _size) {
+            return;
+        }
+        if (size <= 0) {
+            clear();
+            return;
+        }
+        if (size <= _open_start) {
+            // 重新打开size-1所在的那一段，它和后面的段从编码里去掉
+            Cursor cursor = find(size - 1);
+            _bytes.resize(cursor.pos);
+            _runs = cursor.run;
+            _checkpoints.resize((_runs + CHECKPOINT_INTERVAL - 1) / CHECKPOINT_INTERVAL);
+            _prev_line = cursor.base;
+            _open_start = cursor.start;
+            _open_line = cursor.line;
+        }
+        _open_count = size - _open_start;
+        _size = size;
+    }
+
+    void clear() {
+        _bytes.clear();
+        _checkpoints.clear();
+        _runs = 0;
+        _prev_line = 0;
+        _open_start = 0;
+        _open_line = 0;
+        _open_count = 0;
+        _size = 0;
+    }
+
+    int size() const {
+        return _size;
+    }
+
+    size_t run_count() const {
+        return _runs + (_open_count > 0 ? 1 : 0);
+    }
+
+    size_t memory_bytes() const {
+        return _bytes.capacity() + _checkpoints.capacity() * sizeof(Checkpoint);
+    }
+
+    // 字节码缓存(bytecode_cache.h)直接保存编码后的内部状态，加载时不需要重新编码
+    void save(std::string* out) const {
+        const int32_t fields[] = {_runs, _prev_line, _open_start, _open_line, _open_count, _size,
+                                  static_cast<int32_t>(_bytes.size()),
+                                  static_cast<int32_t>(_checkpoints.size())};
+        out->append(reinterpret_cast<const char*>(fields), sizeof(fields));
+        out->append(reinterpret_cast<const char*>(_bytes.data()), _bytes.size());
+        out->append(reinterpret_cast<const char*>(_checkpoints.data()),
+                    _checkpoints.size() * sizeof(Checkpoint));
+    }
+
+    // 从data恢复，返回读取的字节数，数据不完整或者不一致时返回0
+    size_t load(const uint8_t* data, size_t size) {
+        int32_t fields[8];
+        if (size < sizeof(fields)) {
+            return 0;
+        }
+        memcpy(fields, data, sizeof(fields));
+        size_t bytes_size = static_cast<uint32_t>(fields[6]);
+        size_t checkpoints_size = static_cast<uint32_t>(fields[7]) * sizeof(Checkpoint);
+        if (size - sizeof(fields) < bytes_size + checkpoints_size
+                || fields[7] != (int64_t(fields[0]) + CHECKPOINT_INTERVAL - 1) / CHECKPOINT_INTERVAL) {
+            return 0;
+        }
+        _runs = fields[0];
+        _prev_line = fields[1];
+        _open_start = fields[2];
+        _open_line = fields[3];
+        _open_count = fields[4];
+        _size = fields[5];
+        const uint8_t* bytes = data + sizeof(fields);
+        _bytes.assign(bytes, bytes + bytes_size);
+        _checkpoints.resize(fields[7]);
+        if (checkpoints_size > 0) {
+            memcpy(_checkpoints.data(), bytes + bytes_size, checkpoints_size);
+        }
+        if (!validate()) {
+            clear();
+            return 0;
+        }
+        return sizeof(fields) + bytes_size + checkpoints_size;
+    }
+
+private:
+    static constexpr int CHECKPOINT_INTERVAL = 32;
+
+    struct Checkpoint {
+        int start;    // 第k*CHECKPOINT_INTERVAL段的起始偏移
+        int base;     // 上一段的行号，这一段的增量相对于它
+        uint32_t pos; // 这一段在_bytes里的位置
+    };
+
+    // 解码到某一段时的状态
+    struct Cursor {
+        int run;
+        uint32_t pos;
+        int start;
+        int base;
+        int line;
+    };
+
+    void close_run() {
+        if (_open_count == 0) {
+            return;
+        }
+        if (_runs % CHECKPOINT_INTERVAL == 0) {
+            _checkpoints.push_back({_open_start, _prev_line, static_cast<uint32_t>(_bytes.size())});
+        }
+        write_varint(_open_count);
+        int delta = _open_line - _prev_line;
+        write_varint((static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31));
+        _prev_line = _open_line;
+        _runs++;
+        _open_count = 0;
+    }
+
+    // 已编码的段里包含offset的那一段
+    Cursor find(int offset) const {
+        auto it = std::upper_bound(_checkpoints.begin(), _checkpoints.end(), offset,
+                                   [](int offset, const Checkpoint& cp) { return offset < cp.start; });
+        const Checkpoint& cp = *(it - 1);
+        Cursor cursor{static_cast<int>(it - 1 - _checkpoints.begin()) * CHECKPOINT_INTERVAL,
+                      cp.pos, cp.start, cp.base, 0};
+        while (true) {
+            uint32_t pos = cursor.pos;
+            int count = read_varint(&pos);
+            uint32_t zigzag = read_varint(&pos);
+            cursor.line = cursor.base + static_cast<int>((zigzag >> 1) ^ -(zigzag & 1));
+            if (offset < cursor.start + count) {
+                return cursor;
+            }
+            cursor.run++;
+            cursor.pos = pos;
+            cursor.start += count;
+            cursor.base = cursor.line;
+        }
+    }
+
+    // load之后逐段解码一遍：检查点的位置和编码对得上，各段的字节数加起来正好是最后一段的起点，
+    // 之后find从任意检查点开始解码都不会越界
+    bool validate() const {
+        if (_runs < 0 || _open_start < 0 || _open_count < 0 || _size != _open_start + _open_count) {
+            return false;
+        }
+        uint32_t pos = 0;
+        int start = 0;
+        int line = 0;
+        for (int run = 0; run < _runs; ++run) {
+            if (run % CHECKPOINT_INTERVAL == 0) {
+                const Checkpoint& cp = _checkpoints[run / CHECKPOINT_INTERVAL];
+                if (cp.start != start || cp.base != line || cp.pos != pos) {
+                    return false;
+                }
+            }
+            uint32_t count = 0;
+            uint32_t zigzag = 0;
+            if (!read_varint(&pos, &count) || !read_varint(&pos, &zigzag)
+                    || count == 0 || count > static_cast<uint32_t>(_open_start - start)) {
+                return false;
+            }
+            start += count;
+            line = static_cast<int>(static_cast<uint32_t>(line) + ((zigzag >> 1) ^ -(zigzag & 1)));
+        }
+        return pos == _bytes.size() && start == _open_start && line == _prev_line;
+    }
+
+    void write_varint(uint32_t value) {
+        while (value >= 0x80) {
+            _bytes.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        _bytes.push_back(static_cast<uint8_t>(value));
+    }
+
+    uint32_t read_varint(uint32_t* pos) const {
+        uint32_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t byte = _bytes[(*pos)++];
+            value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+    }
+
+    // 带边界检查的版本，只在validate里使用
+    bool read_varint(uint32_t* pos, uint32_t* value) const {
+        *value = 0;
+        for (int shift = 0; shift < 32; shift += 7) {
+            if (*pos >= _bytes.size()) {
+                return false;
+            }
+            uint8_t byte = _bytes[(*pos)++];
+            *value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::vector<uint8_t> _bytes;           // 已经结束的段
+    std::vector<Checkpoint> _checkpoints;
+    int _runs = 0;                         // _bytes里的段数
+    int _prev_line = 0;                    // _bytes里最后一段的行号
+    int _open_start = 0;                   // 最后一段(还在增长)
+    int _open_line = 0;
+    int _open_count = 0;
+    int _size = 0;
+};
+
+} // namespace
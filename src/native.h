@@ -0,0 +1,118 @@
+#pragma once
+
+#include <type_traits>
+#include <utility>
+
+#include "value.h"
+#include "object.h"
+
+namespace aankaa {
+
+// 注册原生函数时的选项
+enum NativeFlags {
+    NATIVE_EFFECT = 0, // 有副作用(默认)，比如clock、sleep
+    NATIVE_PURE = 1,   // 纯函数，比如sqrt
+};
+
+// 由C++函数的签名生成原生函数的通用入口和元数据：
+//   VM::define_native<math_sqrt>("sqrt", NATIVE_PURE);
+// 参数支持double(整数和double都可以)、int、bool、ObjString*和Value，
+// 返回值支持这几种再加上void(返回nil)。参数类型不对时通用入口返回Value::undefined()。
+// 签名是double()、double(double)、double(double, double)时，函数本身同时作为类型化入口
+namespace native {
+
+template <typename T>
+struct Arg;
+
+template <>
+struct Arg<double> {
+    static bool check(const Value& v) {
+        return v.is_numeric();
+    }
+    static double get(const Value& v) {
+        return v.to_double();
+    }
+};
+
+template <>
+struct Arg<int> {
+    static bool check(const Value& v) {
+        return v.is_integer();
+    }
+    static int get(const Value& v) {
+        return v.as_integer();
+    }
+};
+
+template <>
+struct Arg<bool> {
+    static bool check(const Value& v) {
+        return v.is_bool();
+    }
+    static bool get(const Value& v) {
+        return v.as_bool();
+    }
+};
+
+template <>
+struct Arg<ObjString*> {
+    static bool check(const Value& v) {
+        return v.is_string();
+    }
+    static ObjString* get(const Value& v) {
+        return v.as_string();
+    }
+};
+
+template <>
+struct Arg<Value> {
+    static bool check(const Value&) {
+        return true;
+    }
+    static Value get(const Value& v) {
+        return v;
+    }
+};
+
+template <auto FN, typename F = decltype(FN)>
+struct Binding;
+
+template <auto FN, typename R, typename... Args>
+struct Binding<FN, R (*)(Args...)> {
+    static constexpr int ARITY = sizeof...(Args);
+
+    static Value call(int, Value* args) {
+        return invoke(args, std::index_sequence_for<Args...>());
+    }
+
+    template <size_t... I>
+    static Value invoke(Value* args, std::index_sequence<I...>) {
+        if (!(Arg<std::decay_t<Args>>::check(args[I]) && ...)) {
+            return Value::undefined();
+        }
+        if constexpr (std::is_void_v<R>) {
+            FN(Arg<std::decay_t<Args>>::get(args[I])...);
+            return Value(nullptr);
+        } else {
+            return Value(FN(Arg<std::decay_t<Args>>::get(args[I])...));
+        }
+    }
+
+    static void bind_fast(ObjNative* native) {
+        using F = R (*)(Args...);
+        if constexpr (std::is_same_v<F, double (*)()>) {
+            native->kind = NATIVE_NUMBER_0;
+            native->fast.number0 = FN;
+        } else if constexpr (std::is_same_v<F, double (*)(double)>) {
+            native->kind = NATIVE_NUMBER_1;
+            native->fast.number1 = FN;
+        } else if constexpr (std::is_same_v<F, double (*)(double, double)>) {
+            native->kind = NATIVE_NUMBER_2;
+            native->fast.number2 = FN;
+        }
+    }
+};
+
+} // namespace native
+
+} // namespace
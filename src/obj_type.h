@@ -7,7 +7,10 @@ enum ObjType {
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_CLOSURE,
-    OBJ_STRING
+    OBJ_STRING,
+    OBJ_UPVALUE,
+    OBJ_INSTANCE,
+    OBJ_BOUND_METHOD
 };
 
 } // namespace
\ No newline at end of file
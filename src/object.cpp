@@ -1,5 +1,6 @@
 #include "object.h"
 #include "chunk.h"
+#include "reg_chunk.h"
 
 namespace aankaa {
 
@@ -10,6 +11,7 @@ ObjFunction::ObjFunction() {
 
 ObjFunction::~ObjFunction() {
     delete chunk;
+    delete reg_chunk;
 }
 
 } // namespace
\ No newline at end of file
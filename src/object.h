@@ -1,36 +1,78 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <new>
 #include <string.h>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 #include "value.h"
 #include "obj_type.h"
 
 namespace aankaa {
 
+// 所有堆对象通过next串成一个侵入式链表，垃圾回收的sweep阶段遍历这个链表
 struct Obj {
     ObjType type;
+    bool is_marked = false;
+    // 已经在GC的remembered set里，见VM::write_barrier
+    bool is_remembered = false;
     struct Obj* next = nullptr;
 };
 
+// FNV-1a，ObjString创建时算一次并缓存下来
+inline uint32_t hash_string(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// 所有ObjString都经过VM的字符串驻留表(StringTable)创建，内容相同的字符串只有一个对象，
+// 所以字符串相等可以直接比较指针，需要哈希的地方直接使用缓存的hash。
+// 字符内容紧跟在对象头后面(柔性数组，以'\0'结尾)，一个字符串只占一块连续内存，
+// 运行时产生的短命字符串可以直接在nursery里用bump-pointer分配。
 struct ObjString : public Obj {
-    ObjString(const char* src, int length) {
-        buffer.assign(src, length);
+    ObjString(int length_, uint32_t hash_) : length(length_), hash(hash_) {
         type = OBJ_STRING;
     }
-    ObjString(std::string src) {
-        buffer = std::move(src);
-        type = OBJ_STRING;
-    }    
-    ~ObjString() {
+    // 对象头加字符内容需要的字节数
+    static size_t alloc_size(int length) {
+        return sizeof(ObjString) + length + 1;
+    }
+    // 在memory上构造字符串，memory至少要有alloc_size(length)字节
+    static ObjString* init(void* memory, const char* src, int length, uint32_t hash) {
+        ObjString* str = new (memory) ObjString(length, hash);
+        memcpy(str->chars, src, length);
+        str->chars[length] = '\0';
+        return str;
+    }
+    std::string_view view() const {
+        return std::string_view(chars, length);
     }
     std::string to_string() {
-        return "\"" + buffer + "\"";
+        return "\"" + std::string(chars, length) + "\"";
     }
-    std::string buffer;
+
+    int length = 0;
+    uint32_t hash = 0;
+    char chars[];
 };
 
 class Chunk;
+class RegChunk;
+
+// 函数捕获的一个变量，创建闭包时按它取值
+struct UpvalueDesc {
+    uint8_t index = 0;
+    // true：外层函数的局部变量，index是槽位；false：外层函数捕获的变量，index是外层闭包的下标
+    bool is_local = false;
+    // 变量被赋值过，所有捕获它的闭包和外层函数共用一个ObjUpvalue，见OP_CLOSURE
+    bool boxed = false;
+};
 
 struct ObjFunction : public Obj {
     ObjFunction();
@@ -39,15 +81,166 @@ struct ObjFunction : public Obj {
     Obj obj;
     int arity = 0;
     Chunk* chunk = nullptr;
+    // 寄存器后端的字节码，只有VM选择了寄存器后端并且翻译成功时才有
+    RegChunk* reg_chunk = nullptr;
     ObjString* name = nullptr;
+    // 为空时函数本身就是值，不需要创建闭包
+    std::vector<UpvalueDesc> upvalues;
+};
+
+// 捕获了外层变量的函数。
+// 没有被赋值过的变量在创建闭包时直接复制进captures(扁平闭包)，读取时不需要间接访问；
+// 被赋值过的变量，captures里是它的ObjUpvalue。闭包执行时在栈帧的0号槽位，upvalue从那里读取。
+// captures紧跟在对象头后面，和ObjString一样整个闭包是一块内存
+struct ObjClosure : public Obj {
+    ObjClosure(ObjFunction* function_, int count_) : function(function_), count(count_) {
+        type = OBJ_CLOSURE;
+        for (int i = 0; i < count; ++i) {
+            new (&captures()[i]) Value(nullptr);
+        }
+    }
+    ~ObjClosure() {
+        for (int i = 0; i < count; ++i) {
+            captures()[i].~Value();
+        }
+    }
+    static size_t alloc_size(int count) {
+        return sizeof(ObjClosure) + count * sizeof(Value);
+    }
+    // Value不是平凡类型，不能直接做柔性数组成员
+    Value* captures() {
+        return reinterpret_cast<Value*>(_storage);
+    }
+
+    ObjFunction* function;
+    int count;
+
+private:
+    alignas(Value) char _storage[];
+};
+
+// 被闭包捕获并且被赋值过的变量放在堆上。
+// 外层函数第一次创建捕获它的闭包时，把栈槽位里的值换成ObjUpvalue，之后外层函数通过它读写，
+// 所以外层函数和各个闭包看到的是同一个变量。ObjUpvalue不会作为值出现在表达式里
+struct ObjUpvalue : public Obj {
+    ObjUpvalue(const Value& value_) : value(value_) {
+        type = OBJ_UPVALUE;
+    }
+    Value value;
+};
+
+struct ObjClass;
+
+// 实例的布局(hidden class)：字段名到实例字段数组下标的映射。
+// 同一个类的实例按相同的顺序添加字段时经过同一串shape，属性访问的内联缓存以shape为key，见PropertyCache。
+// 每个类有自己的根shape，所以shape同时确定了实例的类。shape树归类所有，随类一起释放；
+// 字段名都是编译期的常量字符串，不会在nursery里
+struct Shape {
+    explicit Shape(ObjClass* klass_) : klass(klass_) {}
+    Shape(Shape const&) = delete;
+    Shape& operator=(Shape const&) = delete;
+
+    // 字段name的下标，没有这个字段返回-1。字段一般很少，顺序查找就够了
+    int find(ObjString* name) const {
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (keys[i] == name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    // 添加字段name之后的shape，第一次添加时创建
+    Shape* add(ObjString* name) {
+        std::unique_ptr<Shape>& next = transitions[name];
+        if (next == nullptr) {
+            next.reset(new Shape(klass));
+            next->keys = keys;
+            next->keys.push_back(name);
+        }
+        return next.get();
+    }
+    // 对每个shape调用fn，GC用来标记字段名
+    template <typename Fn>
+    void for_each(Fn&& fn) const {
+        fn(*this);
+        for (const auto& transition : transitions) {
+            transition.second->for_each(fn);
+        }
+    }
+
+    ObjClass* klass;
+    // keys[i]是字段数组第i个位置的字段名
+    std::vector<ObjString*> keys;
+    std::unordered_map<ObjString*, std::unique_ptr<Shape>> transitions;
+};
+
+// 方法表只在类定义时写入(OP_INHERIT复制父类的方法，再由OP_METHOD逐个添加)，
+// 之后不再变化，所以按shape缓存的方法查找结果一直有效
+struct ObjClass : public Obj {
+    ObjClass(ObjString* name_) : name(name_), shape(this) {
+        type = OBJ_CLASS;
+    }
+    ObjString* name;
+    // 方法是函数或者闭包
+    std::unordered_map<ObjString*, Value> methods;
+    // init方法，没有时为nullptr
+    Obj* initializer = nullptr;
+    // 实例的根shape，还没有任何字段
+    Shape shape;
+    // 实例最多有过的字段数，新实例按它预留字段数组，逐个添加字段时不用反复扩容
+    uint32_t field_hint = 0;
 };
 
+// 没有每个实例自己的哈希表：字段值按shape给出的下标放在扁平的数组里
+struct ObjInstance : public Obj {
+    ObjInstance(ObjClass* klass) : shape(&klass->shape) {
+        type = OBJ_INSTANCE;
+        fields.reserve(klass->field_hint);
+    }
+    ObjClass* klass() const {
+        return shape->klass;
+    }
+    Shape* shape;
+    // fields.size()总是等于shape->keys.size()
+    std::vector<Value> fields;
+};
+
+// instance.method不直接调用时的结果，调用时receiver放回0号槽位作为this
+struct ObjBoundMethod : public Obj {
+    ObjBoundMethod(const Value& receiver_, const Value& method_) : receiver(receiver_), method(method_) {
+        type = OBJ_BOUND_METHOD;
+    }
+    Value receiver;
+    Value method;
+};
+
+// 原生函数的类型化入口，参数都是数值时VM直接调用，不经过Value的拆箱和装箱
+enum NativeKind : uint8_t {
+    NATIVE_GENERIC,  // 只有通用入口
+    NATIVE_NUMBER_0, // double()
+    NATIVE_NUMBER_1, // double(double)
+    NATIVE_NUMBER_2, // double(double, double)
+};
+
+// 原生函数一般通过模板版本的VM::define_native注册，元数据由函数签名自动生成，见native.h
 struct ObjNative : public Obj {
     ObjNative(NativeFn function_) : function(function_) {
         type = OBJ_NATIVE;
     }
     Obj obj;
+    // 通用入口。参数类型不对时返回Value::undefined()，由VM报告运行时错误
     NativeFn function;
+    ObjString* name = nullptr;
+    // 声明的参数个数，调用前由VM检查；-1表示参数个数不定，由function自己检查
+    int arity = -1;
+    // 没有副作用，结果只由参数决定
+    bool pure = false;
+    NativeKind kind = NATIVE_GENERIC;
+    union {
+        double (*number0)();
+        double (*number1)(double);
+        double (*number2)(double, double);
+    } fast = {nullptr};
 };
 
 } //namespace
\ No newline at end of file
@@ -1,7 +1,11 @@
 #include "parser.h"
 #include <iostream>
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
 #include <memory.h>
 #include "defer.h"
+#include "trace.h"
 
 namespace aankaa {
 
@@ -13,7 +17,7 @@ void Parser::init_rules() {
     rules[LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE}; 
     rules[RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE};
     rules[COMMA]         = {NULL,     NULL,   PREC_NONE};
-    rules[DOT]           = {NULL,     NULL,   PREC_NONE};
+    rules[DOT]           = {NULL,     &Parser::dot,   PREC_CALL};
 
     rules[MINUS]         = {&Parser::unary,    &Parser::binary, PREC_TERM};
     rules[PLUS]          = {NULL,     &Parser::binary, PREC_TERM};
@@ -47,8 +51,8 @@ void Parser::init_rules() {
     rules[NIL]           = {NULL,     NULL,   PREC_NONE};
     rules[PRINT]         = {NULL,     NULL,   PREC_NONE};
     rules[RETURN]        = {NULL,     NULL,   PREC_NONE};
-    rules[SUPER]         = {NULL,     NULL,   PREC_NONE};
-    rules[THIS]          = {NULL,     NULL,   PREC_NONE};
+    rules[SUPER]         = {&Parser::super_,     NULL,   PREC_NONE};
+    rules[THIS]          = {&Parser::this_,     NULL,   PREC_NONE};
     rules[TRUE]          = {NULL,     NULL,   PREC_NONE};
     rules[VAR]           = {NULL,     NULL,   PREC_NONE};
     rules[WHILE]         = {NULL,     NULL,   PREC_NONE};
@@ -56,17 +60,31 @@ void Parser::init_rules() {
     rules[EEOF]           = {NULL,     NULL,   PREC_NONE};
 }
 
-Parser::Parser(Scanner* scanner_) : scanner(scanner_) {
+Parser::Parser(Scanner* scanner_, VM* vm_) : scanner(scanner_), vm(vm_) {
+    if (vm == nullptr) {
+        _own_vm.reset(new VM());
+        vm = _own_vm.get();
+    }
     init_rules();
-    // 创建1个compiler用来编译main函数
-    compiler = new Compiler(nullptr, TYPE_SCRIPT);
-    compiler->function = fun_pool.get();
-    // main函数变成一个名字是空的字符串，这样就无法通过变量名来访问main函数了
-    compiler->function->name = string_pool.get(EMPTY_NAME); 
+    begin_script();
 }
 
 Parser::~Parser() {
-    delete compiler;
+    // end_compiler之后compiler已经变成nullptr，main函数的compiler需要单独释放
+    vm->remove_root(_script_compiler->function);
+    delete _script_compiler;
+}
+
+void Parser::begin_script() {
+    // 创建1个compiler用来编译main函数
+    compiler = new Compiler(nullptr, TYPE_SCRIPT);
+    compiler->function = vm->allocate<ObjFunction>();
+    // main函数在下一次begin_script或者parser析构之前都作为根，避免编译和执行之间被回收
+    vm->push_root(compiler->function);
+    _script_compiler = compiler;
+    // main函数变成一个名字是空的字符串，这样就无法通过变量名来访问main函数了
+    compiler->function->name = vm->copy_string(EMPTY_NAME, 0);
+    vm->write_barrier(compiler->function, Value(compiler->function->name));
 }
 
 void Parser::error_at(Token* token, const char* message) {
@@ -138,24 +156,41 @@ void Parser::emit_byte(uint8_t byte1, uint8_t byte2) {
 }
 
 void Parser::emit_return() {
-    emit_byte(OP_NIL);
+    if (compiler->type == TYPE_INITIALIZER) {
+        // init()返回this
+        emit_byte(OP_GET_LOCAL, 0);
+    } else {
+        emit_byte(OP_NIL);
+    }
     emit_byte(OP_RETURN);
 }
 
 void Parser::emit_constant(Value value) {
-    emit_byte(OP_CONSTANT, make_constant(value));
+    emit_operand(OP_CONSTANT, OP_CONSTANT_LONG, make_constant(value));
+}
+
+// 操作数放得进一个字节时用短格式op，否则用宽格式long_op加3字节操作数
+void Parser::emit_operand(uint8_t op, uint8_t long_op, int operand) {
+    if (operand <= UINT8_MAX) {
+        emit_byte(op, operand);
+        return;
+    }
+    emit_byte(long_op);
+    emit_byte((operand >> 16) & 0xff);
+    emit_byte((operand >> 8) & 0xff);
+    emit_byte(operand & 0xff);
 }
 
-// 返回常量所在的下标
-uint8_t Parser::make_constant(Value value) {
-    //std::cout << ">>>>>> make_constant " << value.to_string() << " to chunk:" << &current_chunk() << std::endl;
+// 返回常量所在的下标，相同的常量共用一个下标
+int Parser::make_constant(Value value) {
     int constant_idx = current_chunk().add_constant(value);
-    if (constant_idx > UINT8_MAX) {
-        fprintf(stderr, "Too many constants in one chunk.");
+    // 驻留表可能返回运行时分配在nursery里的同名字符串
+    vm->write_barrier(compiler->function, value);
+    if (constant_idx > MAX_LONG_OPERAND) {
+        error("Too many constants in one chunk.");
         return 0;
     }
-
-    return (uint8_t)constant_idx;
+    return constant_idx;
 }
 
 ParseRule* Parser::get_rule(TokenType type) {
@@ -180,6 +215,7 @@ void Parser::parse_expr(Precedence ctx_precedence) {
     }
 
     bool can_assign = (ctx_precedence <= PREC_ASSIGNMENT);
+    int start = current_chunk().count;
     (this->*prefix_fn)(can_assign);
 
     //    *3*4-5
@@ -194,6 +230,7 @@ void Parser::parse_expr(Precedence ctx_precedence) {
         }
         ParseFn infix_fn = rule->infix;
         advance();
+        _operand_start = start;
         (this->*infix_fn)(can_assign);
     }    
 
@@ -205,9 +242,21 @@ void Parser::parse_expr(Precedence ctx_precedence) {
 
 // We assume the token for the number literal has already been consumed and is stored in previous. 
 void Parser::number(bool can_assign) {
+    // 没有小数点并且在int32范围内的字面量编译成整数，其余的是double
+    const char* end = previous.start + previous.length;
+    bool integral = std::find(previous.start, end, '.') == end;
+    if (integral) {
+        errno = 0;
+        long long value = strtoll(previous.start, NULL, 10);
+        if (errno == 0 && value >= INT32_MIN && value <= INT32_MAX) {
+            emit_constant(Value(static_cast<int>(value)));
+            TRACE(TRACE_COMPILE, "number() -> int " << value);
+            return;
+        }
+    }
     double value = strtod(previous.start, NULL);
     emit_constant(value);
-    std::cout << "number() -> " << value << std::endl;
+    TRACE(TRACE_COMPILE, "number() -> " << value);
 }
 
 void Parser::grouping(bool can_assign) {
@@ -216,7 +265,7 @@ void Parser::grouping(bool can_assign) {
 }
 
 void Parser::expression() {
-    std::cout << "expression()" << std::endl;
+    TRACE(TRACE_COMPILE, "expression()");
     // a * b = 3 + 4
     // 要求返回优先级大于'='的子表达式
     // 所以解析结果为 a * b
@@ -224,12 +273,23 @@ void Parser::expression() {
 }
 
 void Parser::unary(bool can_assign) {
-    std::cout << "unary()" << std::endl;
+    TRACE(TRACE_COMPILE, "unary()");
 
     TokenType operator_type = previous.type;
 
+    int operand_start = current_chunk().count;
     parse_expr(PREC_UNARY);
 
+    Value operand;
+    Value result;
+    if (enable_folding && operator_type == MINUS && constant_at(operand_start, current_chunk().count, &operand)
+            && numeric_negate(operand, &result)) {
+        truncate(operand_start);
+        emit_constant(result);
+        fold_stats.unary++;
+        return;
+    }
+
     switch(operator_type) {
     case MINUS: 
         emit_byte(OP_NEGATE);
@@ -246,25 +306,27 @@ void Parser::binary(bool can_assign) {
     TokenType operator_type = previous.type;
     ParseRule* rule = get_rule(operator_type);
 
-    auto type_to_str = [](TokenType type) -> std::string {
-        if (type == PLUS) return "+";
-        if (type == MINUS) return "-";
-        if (type == STAR) return "*";
-        if (type == SLASH) return "/";
-
-        if (type == BANG_EQUAL) return "!=";
-        if (type == EQUAL_EQUAL) return "==";
-        if (type == GREATER) return ">";
-        if (type == GREATER_EQUAL) return ">=";
-        if (type == LESS) return "<";
-        if (type == LESS_EQUAL) return "<=";
-        return "?";
-    };
-
-    std::cout << "binary() operator:'" << type_to_str(operator_type) << "'" << std::endl;
+    // previous还是运算符本身，直接打印它的源码
+    TRACE(TRACE_COMPILE, "binary() operator:'" << previous.to_string() << "'");
 
+    int left_start = _operand_start;
+    int right_start = current_chunk().count;
     parse_expr(rule->precedence);
 
+    Value a;
+    Value b;
+    Value result;
+    if (enable_folding && constant_at(left_start, right_start, &a)
+            && constant_at(right_start, current_chunk().count, &b)
+            && fold_binary(operator_type, a, b, &result)) {
+        // 两个操作数都是常量，替换成一条constant指令
+        TRACE(TRACE_COMPILE, "binary() fold -> " << result.to_string());
+        truncate(left_start);
+        emit_constant(result);
+        fold_stats.binary++;
+        return;
+    }
+
     switch(operator_type) {
     case MINUS:         emit_byte(OP_SUBTRACT); break;
     case PLUS:          emit_byte(OP_ADD); break;
@@ -282,6 +344,78 @@ void Parser::binary(bool can_assign) {
     }
 }
 
+bool Parser::constant_at(int start, int end, Value* value) {
+    const std::vector<uint8_t>& code = current_chunk().code;
+    if (end - start == 2 && code[start] == OP_CONSTANT) {
+        *value = current_chunk().constants[code[start + 1]];
+        return true;
+    }
+    if (end - start == 4 && code[start] == OP_CONSTANT_LONG) {
+        *value = current_chunk().constants[current_chunk().read_long(start + 1)];
+        return true;
+    }
+    return false;
+}
+
+// 按运行时的语义计算，运行时会报错的组合(比如数字加字符串)不折叠，留到运行时报错
+bool Parser::fold_binary(TokenType operator_type, const Value& a, const Value& b, Value* result) {
+    switch (operator_type) {
+    case PLUS:
+        if (a.is_string() && b.is_string()) {
+            // a和b还在常量表里，分配新字符串触发的回收不会回收它们
+            std::string chars(a.as_string()->view());
+            chars.append(b.as_string()->view());
+            *result = Value(vm->copy_string(chars.data(), chars.size()));
+            fold_stats.concat++;
+            return true;
+        }
+        return numeric_binary<Arith::ADD>(a, b, result);
+    case MINUS:         return numeric_binary<Arith::SUBTRACT>(a, b, result);
+    case STAR:          return numeric_binary<Arith::MULTIPLY>(a, b, result);
+    case SLASH:         return numeric_binary<Arith::DIVIDE>(a, b, result);
+    case EQUAL_EQUAL:   *result = Value(a == b); return true;
+    case BANG_EQUAL:    *result = Value(!(a == b)); return true;
+    case GREATER:       return numeric_binary<Arith::GREATER>(a, b, result);
+    case LESS:          return numeric_binary<Arith::LESS>(a, b, result);
+    case GREATER_EQUAL:
+        if (!numeric_binary<Arith::LESS>(a, b, result)) {
+            return false;
+        }
+        *result = Value(!result->as_bool());
+        return true;
+    case LESS_EQUAL:
+        if (!numeric_binary<Arith::GREATER>(a, b, result)) {
+            return false;
+        }
+        *result = Value(!result->as_bool());
+        return true;
+    default:
+        return false;
+    }
+}
+
+// 丢弃的代码引用的常量留在常量表里
+void Parser::truncate(int pos) {
+    Chunk& chunk = current_chunk();
+    chunk.code.resize(pos);
+    chunk.lines.truncate(pos);
+    chunk.count = pos;
+    // 丢弃的跳转不再需要改宽
+    for (auto it = compiler->long_jumps.begin(); it != compiler->long_jumps.end();) {
+        it = it->first >= pos ? compiler->long_jumps.erase(it) : std::next(it);
+    }
+    // 丢弃的局部变量访问不再需要改写
+    for (int i = 0; i < compiler->local_count; ++i) {
+        std::vector<int>& sites = compiler->locals[i].access_sites;
+        sites.erase(std::remove_if(sites.begin(), sites.end(), [pos](int site) { return site >= pos; }),
+                    sites.end());
+    }
+    // 丢弃的调用不能再被return改成尾调用，否则之后恰好落在同一偏移量的指令会被改写
+    if (compiler->last_call >= pos) {
+        compiler->last_call = -1;
+    }
+}
+
 ObjFunction* Parser::compile() {
     had_error = false;
     while (!match(EEOF)) {
@@ -294,6 +428,26 @@ ObjFunction* Parser::compile() {
     return had_error ? nullptr : function;
 }
 
+ObjFunction* Parser::compile_next(size_t max_bytes) {
+    if (compiler == nullptr) {
+        // 上一批的main函数已经执行完，换一个新的
+        vm->remove_root(_script_compiler->function);
+        delete _script_compiler;
+        begin_script();
+        // 上一批的Token都不再使用，current是这一批的第一个Token，它在扫描器最新的缓冲区里
+        scanner->discard();
+    }
+    if (had_error || check(EEOF)) {
+        return nullptr;
+    }
+    // 一条声明本身很长时一批里只有它自己
+    do {
+        declaration();
+    } while (!check(EEOF) && current_chunk().code.size() < max_bytes && scanner->retained_bytes() < max_bytes);
+    ObjFunction* function = end_compiler();
+    return had_error ? nullptr : function;
+}
+
 
 void Parser::statement() {
     if (match(PRINT)) {
@@ -328,17 +482,20 @@ void Parser::block() {
 }
 
 void Parser::end_scope() {
-    std::cout << "end_scope()" << std::endl;
+    TRACE(TRACE_COMPILE, "end_scope()");
     compiler->current_depth--;
 
     while (compiler->local_count > 0 && compiler->is_top_local_expired()) {
         emit_byte(OP_POP);
+        close_local(compiler->top_local());
         compiler->pop_local();
     }
 }
 
 void Parser::declaration() {
-    if (match(FUN)) {
+    if (match(CLASS)) {
+        class_declaration();
+    } else if (match(FUN)) {
         fun_declaration();
     } else if (match(VAR)) {
         var_declaration();
@@ -348,34 +505,39 @@ void Parser::declaration() {
 }
 
 void Parser::fun_declaration() {
-    std::cout << "fun_declaration()" << std::endl;
-    uint8_t fun_idx = parse_variable_name("Expect function name.");
+    TRACE(TRACE_COMPILE, "fun_declaration()");
+    int fun_idx = parse_variable_name("Expect function name.");
 
     // 函数体内可以自己调用自己，只要解析完函数名，就把函数变量标记为已经初始化，这样在含树体内可以自己调用自己，实现递归。
     mark_initialized();
 
     function(TYPE_FUNCTION);
-    define_global_variable(fun_idx);
+    if (compiler->current_depth == 0) {
+        define_global_variable(fun_idx);
+    }
 }
 
 void Parser::function(FunctionType type) {
-    std::cout << "\n---- function() start" << std::endl;
+    TRACE(TRACE_COMPILE, "---- function() start");
 
     Compiler *new_compiler = new Compiler(compiler, type);
     DEFER({
         delete new_compiler;
     });
     
-    ObjFunction* fun = fun_pool.get();
+    ObjFunction* fun = vm->allocate<ObjFunction>();
+    // 编译完成存进外层函数的常量表之前，需要临时作为根
+    vm->push_root(fun);
     if (type != TYPE_SCRIPT) {
-        fun->name = string_pool.get(previous.start, previous.length);
+        fun->name = vm->copy_string(previous.start, previous.length);
+        vm->write_barrier(fun, Value(fun->name));
     }
     new_compiler->function = fun;
 
     // 设置新的compiler
     compiler = new_compiler;
-    std::cout << "function() change compiler [" << compiler << " -> " << new_compiler << "]" 
-                << " new_compiler_depth:" << new_compiler->current_depth << std::endl;
+    TRACE(TRACE_COMPILE, "function() change compiler [" << compiler << " -> " << new_compiler << "]"
+          << " new_compiler_depth:" << new_compiler->current_depth);
 
     begin_scope();
 
@@ -388,7 +550,7 @@ void Parser::function(FunctionType type) {
             if (compiler->function->arity > 255) {
                 error_at_current("Can't have more than 255 parameters");
             }
-            uint8_t cons_idx = parse_variable_name("Expect parameter name");
+            int cons_idx = parse_variable_name("Expect parameter name");
             // 形参不需要初始化，所以解析完变量名，就可以标记为初始化完成。
             mark_initialized();
         } while (match(COMMA));
@@ -402,12 +564,129 @@ void Parser::function(FunctionType type) {
 
     ObjFunction* function = end_compiler();
 
-    emit_byte(OP_CONSTANT, make_constant(Value(function)));
-    std::cout << "---- function() finish\n" << std::endl;
+    if (function->upvalues.empty()) {
+        // 没有捕获变量的函数本身就是值，不用创建闭包
+        emit_constant(Value(function));
+    } else {
+        emit_operand(OP_CLOSURE, OP_CLOSURE_LONG, make_constant(Value(function)));
+    }
+    vm->remove_root(function);
+    TRACE(TRACE_COMPILE, "---- function() finish");
+}
+
+// class B < A { ... }
+// 有父类时，父类作为名为super的局部变量放在一个新的作用域里，方法通过upvalue捕获它
+void Parser::class_declaration() {
+    int class_slot = parse_variable_name("Expect class name.");
+    Token class_name = previous;
+    emit_name(OP_CLASS, OP_CLASS_LONG, class_name);
+    if (compiler->current_depth == 0) {
+        define_global_variable(class_slot);
+    } else {
+        mark_initialized();
+    }
+
+    ClassCompiler class_compiler;
+    class_compiler.enclosing = current_class;
+    current_class = &class_compiler;
+
+    if (match(LESS)) {
+        must_and_consume(IDENTIFIER, "Expect superclass name.");
+        variable(false);
+        if (class_name.identifiers_equal(previous)) {
+            error("A class can't inherit from itself.");
+        }
+        begin_scope();
+        if (compiler->is_local_full()) {
+            error("Too many local variables in block.");
+        } else {
+            compiler->add_local(synthetic_token("super"));
+            mark_initialized();
+        }
+        named_variable(class_name, false);
+        emit_byte(OP_INHERIT);
+        class_compiler.has_superclass = true;
+    }
+
+    // 类留在栈顶，OP_METHOD把方法加到它上面
+    named_variable(class_name, false);
+    must_and_consume(LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(RIGHT_BRACE) && !check(EEOF)) {
+        method();
+    }
+    must_and_consume(RIGHT_BRACE, "Expect '}' after class body.");
+    emit_byte(OP_POP);
+
+    if (class_compiler.has_superclass) {
+        end_scope();
+    }
+    current_class = class_compiler.enclosing;
+}
+
+void Parser::method() {
+    must_and_consume(IDENTIFIER, "Expect method name.");
+    Token name = previous;
+    FunctionType type = TYPE_METHOD;
+    if (name.length == 4 && memcmp(name.start, "init", 4) == 0) {
+        type = TYPE_INITIALIZER;
+    }
+    function(type);
+    emit_name(OP_METHOD, OP_METHOD_LONG, name);
+}
+
+// a.b、a.b = c，以及a.b(args)编译成一条OP_INVOKE
+void Parser::dot(bool can_assign) {
+    must_and_consume(IDENTIFIER, "Expect property name after '.'.");
+    Token name = previous;
+    if (can_assign && match(EQUAL)) {
+        expression();
+        emit_name(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
+    } else if (match(LEFT_PAREN)) {
+        uint8_t arg_count = argument_list();
+        emit_name(OP_INVOKE, OP_INVOKE_LONG, name);
+        emit_byte(arg_count);
+    } else {
+        emit_name(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+    }
+}
+
+void Parser::this_(bool can_assign) {
+    if (current_class == nullptr) {
+        error("Can't use 'this' outside of a class.");
+        return;
+    }
+    named_variable(synthetic_token("this"), false);
+}
+
+void Parser::super_(bool can_assign) {
+    if (current_class == nullptr) {
+        error("Can't use 'super' outside of a class.");
+    } else if (!current_class->has_superclass) {
+        error("Can't use 'super' in a class with no superclass.");
+    }
+    must_and_consume(DOT, "Expect '.' after 'super'.");
+    must_and_consume(IDENTIFIER, "Expect superclass method name.");
+    Token name = previous;
+    named_variable(synthetic_token("this"), false);
+    if (match(LEFT_PAREN)) {
+        uint8_t arg_count = argument_list();
+        named_variable(synthetic_token("super"), false);
+        emit_name(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
+        emit_byte(arg_count);
+    } else {
+        named_variable(synthetic_token("super"), false);
+        emit_name(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
+    }
+}
+
+// 属性、方法和类名指令，名字常量的下标和其他常量一样按短格式和宽格式编码
+void Parser::emit_name(uint8_t op, uint8_t long_op, const Token& name) {
+    emit_operand(op, long_op, identifier_constant(name));
 }
 
 void Parser::call(bool can_assign) {
     uint8_t arg_count = argument_list();
+    compiler->last_call = current_chunk().count;
     emit_byte(OP_CALL, arg_count);
 }
 
@@ -430,12 +709,12 @@ uint8_t Parser::argument_list() {
 
 // var a = 3 * 4;
 void Parser::var_declaration() {
-    std::cout << "var_declaration()" << std::endl;
-    uint8_t var_name_idx = parse_variable_name("Expect variable name.");
+    TRACE(TRACE_COMPILE, "var_declaration()");
+    int var_name_idx = parse_variable_name("Expect variable name.");
     
     if (match(EQUAL)) {
         // var a = 3*2+1;
-        std::cout << "var_declaration() with initializer expression" << std::endl;
+        TRACE(TRACE_COMPILE, "var_declaration() with initializer expression");
         expression();
     } else {
         // var a;
@@ -445,18 +724,21 @@ void Parser::var_declaration() {
 
     if (compiler->current_depth == 0) {
         define_global_variable(var_name_idx);
+    } else {
+        mark_initialized();
     }
 }
 
-// var a = 5; 如何处理a(a在常量表中的idx已经确定了)
-void Parser::define_global_variable(uint8_t var_name_idx) {
-    printf("define_global_variable() var_name_idx:%hhu current_depth:%d\n", var_name_idx, compiler->current_depth);
-    emit_byte(OP_DEFINE_GLOBAL, var_name_idx);
+// var a = 5; 如何处理a(a在GlobalTable中的槽位已经确定了)
+void Parser::define_global_variable(int var_name_idx) {
+    TRACE(TRACE_COMPILE, "define_global_variable() var_name_idx:" << var_name_idx
+          << " current_depth:" << compiler->current_depth);
+    emit_operand(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, var_name_idx);
 }
 
 void Parser::mark_initialized() {
-    std::cout << "mark_initialized() top_local:[" << compiler->top_local().name.to_string() 
-                                << "] depth:" << compiler->current_depth << std::endl;
+    TRACE(TRACE_COMPILE, "mark_initialized() top_local:[" << compiler->top_local().name.to_string()
+          << "] depth:" << compiler->current_depth);
     if (compiler->current_depth == 0) {
         return;
     }
@@ -466,23 +748,23 @@ void Parser::mark_initialized() {
 }
 
 // var a = 5; 如何处理a，需要先把a添加到locals或者constants区域
-uint8_t Parser::parse_variable_name(const char* error_message) {
-    std::cout << "parse_variable_name() " << current.to_string() << " current_depth:" << compiler->current_depth << std::endl;
+int Parser::parse_variable_name(const char* error_message) {
+    TRACE(TRACE_COMPILE, "parse_variable_name() " << current.to_string() << " current_depth:" << compiler->current_depth);
     must_and_consume(IDENTIFIER, error_message);
 
     if (compiler->current_depth > 0) {
-        // 局部变量，不用添加到constants表，直接返回0，这个0不会使用
+        // 局部变量，不用分配全局槽位，直接返回0，这个0不会使用
         declare_local_variable();
         return 0;
     }
-    // 全局变量，添加到constants表
-    return identifier_constant(previous);
+    // 全局变量，解析成GlobalTable的槽位
+    return global_slot(previous);
 }
 
 // var a = 5; 遇到a怎么处理：把a添加到local区域
 void Parser::declare_local_variable() {
     const Token& name = previous;
-    std::cout << "declare_local_variable() add local " << name.to_string() << std::endl;
+    TRACE(TRACE_COMPILE, "declare_local_variable() add local " << name.to_string());
 
     if (compiler->is_local_exist(name)) {
         error("Already a variable with this name in this scope.");
@@ -496,15 +778,25 @@ void Parser::declare_local_variable() {
 }
 
 // 返回变量名在constants里面的下标
-uint8_t Parser::identifier_constant(const Token& name) {
-    std::cout << "identifier_constant() add global constants" << std::endl;
-    ObjString* obj_str = string_pool.get(name.start, name.length);
+int Parser::identifier_constant(const Token& name) {
+    TRACE(TRACE_COMPILE, "identifier_constant() add global constants");
+    ObjString* obj_str = vm->copy_string(name.start, name.length);
     Value v(obj_str);
     return make_constant(v);
 }
 
+// 返回全局变量在GlobalTable中的槽位，第一次出现的名字分配一个未定义的新槽位
+int Parser::global_slot(const Token& name) {
+    int slot = vm->globals.resolve(vm->copy_string(name.start, name.length));
+    if (slot > MAX_LONG_OPERAND) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
+}
+
 void Parser::print_statement() {
-    std::cout << "print_statement()" << std::endl;
+    TRACE(TRACE_COMPILE, "print_statement()");
     expression();
     must_and_consume(SEMICOLON, "Expect ';' after value.");
     emit_byte(OP_PRINT);
@@ -518,9 +810,31 @@ void Parser::expression_statement() {
 
 void Parser::if_statement() {
     must_and_consume(LEFT_PAREN, "Expect '(' after 'if'.");
+    int condition_start = current_chunk().count;
     expression();
     must_and_consume(RIGHT_PAREN, "Expect ')' after 'condition'.");
 
+    Value condition;
+    if (enable_folding && constant_at(condition_start, current_chunk().count, &condition)) {
+        // 条件是常量：只保留会执行的分支，另一个分支照常解析(报告语法错误)，生成的代码丢弃
+        truncate(condition_start);
+        fold_stats.dead_branches++;
+        bool taken = !condition.is_falsey();
+        int then_start = current_chunk().count;
+        statement();
+        if (!taken) {
+            truncate(then_start);
+        }
+        if (match(ELSE)) {
+            int else_start = current_chunk().count;
+            statement();
+            if (taken) {
+                truncate(else_start);
+            }
+        }
+        return;
+    }
+
     int if_jump_pos = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
     statement();
@@ -543,6 +857,21 @@ void Parser::while_statement() {
     expression();
     must_and_consume(RIGHT_PAREN, "Expect ')' after 'condition'.");
 
+    Value condition;
+    if (enable_folding && constant_at(loop_start, current_chunk().count, &condition)) {
+        truncate(loop_start);
+        statement();
+        if (condition.is_falsey()) {
+            // 循环体一次都不会执行
+            truncate(loop_start);
+            fold_stats.dead_loops++;
+        } else {
+            emit_loop(loop_start);
+            fold_stats.infinite_loops++;
+        }
+        return;
+    }
+
     int exit_jump_pos = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
     statement();
@@ -553,30 +882,44 @@ void Parser::while_statement() {
 }
 
 void Parser::return_statement() {
-    std::cout << "return_statement() compiler->type:" << compiler->type << std::endl;
+    TRACE(TRACE_COMPILE, "return_statement() compiler->type:" << compiler->type);
     if (compiler->type == TYPE_SCRIPT) {
         error("Can't return from top-level code.");
     }
     if (match(SEMICOLON)) {
-        std::cout << "emit return nil........" << std::endl;
+        TRACE(TRACE_COMPILE, "emit return nil........");
         emit_return();
     } else {
+        if (compiler->type == TYPE_INITIALIZER) {
+            error("Can't return a value from an initializer.");
+        }
         expression();
         must_and_consume(SEMICOLON, "Expect ';' after return value");
-        std::cout << "emit return expression........" << std::endl;
+        TRACE(TRACE_COMPILE, "emit return expression........");
+        // 返回值表达式的最后一条指令是调用时，改成尾调用。
+        // 后面的OP_RETURN保留下来：and/or短路时会跳到它，调用的是原生函数时也还要靠它返回
+        Chunk& chunk = current_chunk();
+        if (enable_tail_calls && compiler->last_call >= 0 && compiler->last_call == chunk.count - 2) {
+            chunk.code[compiler->last_call] = OP_TAIL_CALL;
+        }
         emit_byte(OP_RETURN);
     }
 }
 
+// 向后跳转的距离在生成时已经知道，直接选择短格式或宽格式
 void Parser::emit_loop(int loop_start) {
-    emit_byte(OP_LOOP);
-
-    int offset = current_chunk().count - loop_start + 2;
-    if (offset > UINT16_MAX) {
+    int offset = current_chunk().count - loop_start + 3;
+    if (offset <= UINT16_MAX) {
+        emit_byte(OP_LOOP);
+        emit_byte((offset >> 8) & 0xff);
+        emit_byte(offset & 0xff);
+        return;
+    }
+    offset++;
+    if (offset > MAX_LONG_OPERAND) {
         error("Loop body too large");
     }
-    emit_byte((offset >> 8) & 0xff);
-    emit_byte(offset & 0xff);
+    emit_operand(OP_LOOP, OP_LOOP_LONG, offset);
 }
 
 // 返回jump指令的绝对位置, 开始跳转，但是跳转到哪里还不确定
@@ -596,10 +939,13 @@ int Parser::emit_jump(uint8_t op) {
 // m+1: 
 // 在k处调用emit_jump，在m处调用patch_jump，会导致k和m之间生成的指令全部被跳过
 // 也就是说：从k直接跳转到m+1生成的指令
+// 偏移量超过16位时先记下跳转目标，函数编译完成后由relax_jumps改写成宽跳转
 void Parser::patch_jump(int jump_pos) {
     int offset = current_chunk().count - jump_pos - 3;
-    if (offset > UINT64_MAX) {
+    if (offset > MAX_LONG_OPERAND) {
         error("Too much code to jump over.");
+    } else if (offset > UINT16_MAX) {
+        compiler->long_jumps[jump_pos] = current_chunk().count;
     }
     // 分别存储offset的高8位和低8位
     current_chunk().code[jump_pos+1] = (offset >> 8) & 0xff;
@@ -617,15 +963,30 @@ void Parser::for_statement() {
     }
 
     int loop_start = current_chunk().count;
+    // 有increment时loop_start会变成increment的位置
+    int condition_start = loop_start;
 
     int exit_jump_pos = -1;
+    bool dead_loop = false;
 
     if (!match(SEMICOLON)) {
         expression();
         must_and_consume(SEMICOLON, "Expect ';' after loop condition");
 
-        exit_jump_pos = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP);
+        Value condition;
+        if (enable_folding && constant_at(condition_start, current_chunk().count, &condition)) {
+            // 条件为真时和没有条件一样；为假时照常解析，最后丢弃整个循环
+            truncate(condition_start);
+            dead_loop = condition.is_falsey();
+            if (dead_loop) {
+                fold_stats.dead_loops++;
+            } else {
+                fold_stats.infinite_loops++;
+            }
+        } else {
+            exit_jump_pos = emit_jump(OP_JUMP_IF_FALSE);
+            emit_byte(OP_POP);
+        }
     }
 
     if (!match(RIGHT_PAREN)) {
@@ -647,6 +1008,9 @@ void Parser::for_statement() {
         patch_jump(exit_jump_pos);
         emit_byte(OP_POP);
     }
+    if (dead_loop) {
+        truncate(condition_start);
+    }
 
     end_scope();
 }
@@ -655,13 +1019,29 @@ void Parser::for_statement() {
 // |             |
 // previous     current
 void Parser::string(bool can_assign) {
-    ObjString* obj_str = string_pool.get(previous.start + 1, previous.length - 2);
+    ObjString* obj_str = vm->copy_string(previous.start + 1, previous.length - 2);
     Value v(obj_str);
     emit_constant(v);
 }
 
 void Parser::and_(bool can_assign) {
-    std::cout << "logical_and" << std::endl;
+    TRACE(TRACE_COMPILE, "logical_and");
+    Value left;
+    if (enable_folding && constant_at(_operand_start, current_chunk().count, &left)) {
+        // 左操作数为假时结果就是它，右操作数不会执行；为真时结果是右操作数
+        int left_start = _operand_start;
+        int right_start = current_chunk().count;
+        if (!left.is_falsey()) {
+            truncate(left_start);
+            right_start = left_start;
+        }
+        parse_expr(PREC_AND);
+        if (left.is_falsey()) {
+            truncate(right_start);
+        }
+        fold_stats.logical++;
+        return;
+    }
     int end_jump_pos = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
 
@@ -671,7 +1051,23 @@ void Parser::and_(bool can_assign) {
 }
 
 void Parser::or_(bool can_assign) {
-    std::cout << "logical_or" << std::endl;
+    TRACE(TRACE_COMPILE, "logical_or");
+    Value left;
+    if (enable_folding && constant_at(_operand_start, current_chunk().count, &left)) {
+        // 左操作数为真时结果就是它，右操作数不会执行；为假时结果是右操作数
+        int left_start = _operand_start;
+        int right_start = current_chunk().count;
+        if (left.is_falsey()) {
+            truncate(left_start);
+            right_start = left_start;
+        }
+        parse_expr(PREC_OR);
+        if (!left.is_falsey()) {
+            truncate(right_start);
+        }
+        fold_stats.logical++;
+        return;
+    }
     int else_jump_pos = emit_jump(OP_JUMP_IF_FALSE);
     int end_jump_pos = emit_jump(OP_JUMP);
     patch_jump(else_jump_pos);
@@ -689,7 +1085,7 @@ void Parser::or_(bool can_assign) {
 // 这是Primary表达式的一个分支，例如 a = 3; a * 3; 遇到IDENTIFIER的token如何解析。
 // 注意变量声明不会走到这里，例如 var a = 9;
 void Parser::variable(bool can_assign) {
-    std::cout << "variable()" << std::endl;
+    TRACE(TRACE_COMPILE, "variable()");
     named_variable(previous, can_assign);
 }
 
@@ -698,41 +1094,160 @@ void Parser::variable(bool can_assign) {
 // a*2+2; 这是statement, 获取变量的值, a在前面的语句肯定被添加到constants或者locals了，emit OP_GET_XXX
 void Parser::named_variable(const Token& name, bool can_assign) {
     uint8_t get_op, set_op;
+    Local* local = nullptr;
     int var_idx = compiler->find_local(name);
-    if (compiler->get_local(var_idx).depth == UNINITIALIZED_FLAG) {
+    if (var_idx != -1 && compiler->get_local(var_idx).depth == UNINITIALIZED_FLAG) {
         error("Can't read local variable in its own initializer");
     }
-    std::cout << "named_variable() var_idx:" << var_idx << std::endl;
+    TRACE(TRACE_COMPILE, "named_variable() var_idx:" << var_idx);
     if (var_idx != -1) {
         // locals找到了，肯定是局部变量, var_idx为locals区域的下标
+        local = &compiler->get_local(var_idx);
         get_op = OP_GET_LOCAL;
         set_op = OP_SET_LOCAL;
+    } else if ((var_idx = resolve_upvalue(compiler, name)) != -1) {
+        // 外层函数的局部变量，var_idx为upvalue下标
+        local = compiler->upvalue_locals[var_idx];
+        get_op = OP_GET_UPVALUE;
+        set_op = OP_SET_UPVALUE;
     } else {
-        // locals没找到，当做全局变量处理, var_idx为constants区域的下标
-        var_idx = identifier_constant(name);
+        // 都没找到，当做全局变量处理, var_idx为GlobalTable的槽位
+        var_idx = global_slot(name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
 
     // a * b = c + d  can_assign = false
     // a = b = c + d  can_assign = true
-    if (can_assign && match(EQUAL)) {
+    bool is_set = can_assign && match(EQUAL);
+    if (is_set) {
         expression();
-        emit_byte(set_op, static_cast<uint8_t>(var_idx));
+    }
+    if (get_op == OP_GET_LOCAL) {
+        local->access_sites.push_back(current_chunk().count);
+    }
+    if (is_set && local != nullptr) {
+        local->assigned = true;
+    }
+    if (is_set) {
+        emit_operand(set_op, OP_SET_GLOBAL_LONG, var_idx);
     } else {
-        emit_byte(get_op, static_cast<uint8_t>(var_idx));
+        emit_operand(get_op, OP_GET_GLOBAL_LONG, var_idx);
+    }
+}
+
+int Parser::resolve_upvalue(Compiler* compiler, const Token& name) {
+    Compiler* enclosing = compiler->enclosing;
+    if (enclosing == nullptr) {
+        return -1;
+    }
+    int local = enclosing->find_local(name);
+    if (local != -1) {
+        return add_upvalue(compiler, local, true, &enclosing->get_local(local));
+    }
+    // 外层函数也要捕获它，一层层传下来
+    int upvalue = resolve_upvalue(enclosing, name);
+    if (upvalue != -1) {
+        return add_upvalue(compiler, upvalue, false, enclosing->upvalue_locals[upvalue]);
+    }
+    return -1;
+}
+
+int Parser::add_upvalue(Compiler* compiler, int index, bool is_local, Local* local) {
+    std::vector<UpvalueDesc>& upvalues = compiler->function->upvalues;
+    for (size_t i = 0; i < upvalues.size(); ++i) {
+        if (upvalues[i].index == index && upvalues[i].is_local == is_local) {
+            return i;
+        }
+    }
+    if (upvalues.size() == UINT8_COUNT) {
+        error("Too many closure variables in function.");
+        return 0;
+    }
+    UpvalueDesc desc;
+    desc.index = index;
+    desc.is_local = is_local;
+    upvalues.push_back(desc);
+    compiler->upvalue_locals.push_back(local);
+    local->captured = true;
+    local->captured_by.emplace_back(compiler->function, upvalues.size() - 1);
+    return upvalues.size() - 1;
+}
+
+// 被捕获并且被赋值过的变量要放到堆上：这时所有能访问它的代码都已经编译完，
+// 把声明它的函数里的局部变量指令、各个闭包里的upvalue读取原地改写成*_CELL版本。
+// 其余的变量保持原样，闭包创建时直接复制它的值
+void Parser::close_local(Local& local) {
+    if (!local.captured || !local.assigned) {
+        return;
+    }
+    std::vector<uint8_t>& code = current_chunk().code;
+    for (int pos : local.access_sites) {
+        code[pos] = code[pos] == OP_GET_LOCAL ? OP_GET_LOCAL_CELL : OP_SET_LOCAL_CELL;
+    }
+    for (const auto& capture : local.captured_by) {
+        ObjFunction* function = capture.first;
+        int index = capture.second;
+        if (function->upvalues[index].is_local) {
+            function->upvalues[index].boxed = true;
+        }
+        std::vector<uint8_t>& inner = function->chunk->code;
+        for (size_t pos = 0; pos < inner.size(); pos += op_size(inner[pos])) {
+            if (inner[pos] == OP_GET_UPVALUE && inner[pos + 1] == index) {
+                inner[pos] = OP_GET_UPVALUE_CELL;
+            }
+        }
+        // 内层函数已经翻译过寄存器字节码
+        if (function->reg_chunk != nullptr) {
+            for (RegInstr& ins : function->reg_chunk->code) {
+                if (ins.op == ROP_GET_UPVALUE && ins.b == index) {
+                    ins.op = ROP_GET_UPVALUE_CELL;
+                }
+            }
+        }
     }
 }
 
 ObjFunction* Parser::end_compiler() {
     emit_return();
     ObjFunction* function = compiler->function;
+    // 形参和函数体最外层的局部变量没有end_scope，在这里结束
+    for (int i = compiler->local_count - 1; i > 0; --i) {
+        close_local(compiler->get_local(i));
+    }
 
-    std::cout << "end_compiler() enclosing:" << compiler->enclosing << " chunk:" << function->chunk << std::endl;
-    std::cout << "----------- print func(" << function->name->to_string() << ") chunk in end_compiler() -> " << std::endl;
-    function->chunk->print();
+    TRACE(TRACE_COMPILE, "end_compiler() enclosing:" << compiler->enclosing << " chunk:" << function->chunk);
+    if (!had_error) {
+        relax_jumps(function->chunk, compiler->long_jumps);
+    }
+    // 寄存器字节码从未经窥孔优化的栈式字节码翻译，超级指令只给栈式后端用
+    if (vm->backend == BACKEND_REGISTER && !had_error && !_register_failed) {
+        RegisterEmitter emitter;
+        if (!emitter.emit(function)) {
+            // 有一个函数不能翻译，整个程序就用栈式后端执行，main函数不再翻译
+            TRACE(TRACE_COMPILE, "register emitter failed: " << emitter.error());
+            _register_failed = true;
+        }
+    }
+    if (enable_peephole && !had_error) {
+        peephole_optimize(function->chunk, &peephole_stats);
+    }
+    if (!had_error) {
+        // 最终的字节码确定之后再算，进入栈帧时按它保证栈空间
+        function->chunk->max_stack = max_stack_depth(*function->chunk, function->arity + 1);
+        assert(function->chunk->max_stack >= 0);
+    }
+#if AANKAA_TRACE
+    if (trace_enabled(TRACE_CHUNK)) {
+        std::cerr << "[chunk] " << Value(function).to_string() << std::endl;
+        function->chunk->print(std::cerr);
+        if (function->reg_chunk != nullptr) {
+            function->reg_chunk->print(function->chunk->constants, std::cerr);
+        }
+    }
+#endif
 
-    std::cout << "end_compiler() change compiler [" << compiler << " -> " << compiler->enclosing << "]" << std::endl;
+    TRACE(TRACE_COMPILE, "end_compiler() change compiler [" << compiler << " -> " << compiler->enclosing << "]");
     compiler = compiler->enclosing;
 
     return function;
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 #include <iostream>
 #include "value.h"
@@ -11,6 +12,9 @@
 #include "scanner.h"
 #include "chunk.h"
 #include "pool.h"
+#include "vm.h"
+#include "peephole.h"
+#include "reg_emitter.h"
 
 namespace aankaa {
 
@@ -20,13 +24,33 @@ static const char* EMPTY_NAME = "";
 struct Local {
     Token name;
     int depth = 0;
+    // 被内层函数捕获过
+    bool captured = false;
+    // 初始化之后被赋值过，包括在内层函数里赋值
+    bool assigned = false;
+    // 读写这个变量的OP_GET_LOCAL/OP_SET_LOCAL的位置，变量需要放到堆上时改写成*_CELL版本
+    std::vector<int> access_sites;
+    // 直接或者间接捕获了这个变量的函数，以及变量在这个函数里的upvalue下标
+    std::vector<std::pair<ObjFunction*, int>> captured_by;
 };
 
 enum FunctionType {
     TYPE_FUNCTION, // 函数内的body
+    TYPE_METHOD, // 方法，0号槽位是this
+    TYPE_INITIALIZER, // init方法，总是返回this
     TYPE_SCRIPT // 主body
 };
 
+// 编译器生成的局部变量名，this和super
+inline Token synthetic_token(const char* text) {
+    Token token;
+    token.type = IDENTIFIER;
+    token.start = text;
+    token.length = strlen(text);
+    token.line = 0;
+    return token;
+}
+
 struct Compiler {
     struct Compiler* enclosing = nullptr;
     // 函数是一等公民，Compiler存在的目的就是编译出function对象
@@ -37,6 +61,12 @@ struct Compiler {
     Local locals[UINT8_MAX];
     int local_count = 0;
     int current_depth = 0;
+    // 偏移量超过16位的前向跳转：跳转指令位置 -> 跳转目标
+    std::unordered_map<int, int> long_jumps;
+    // 最近一条OP_CALL的位置，return语句据此判断返回值是不是一次尾调用
+    int last_call = -1;
+    // function->upvalues里每一项对应的外层局部变量
+    std::vector<Local*> upvalue_locals;
 
     Compiler(Compiler* enclosing_, FunctionType type_) 
                     : type(type_)
@@ -48,6 +78,10 @@ struct Compiler {
         Local& local = locals[local_count++];
         local.name.start = EMPTY_NAME;
         local.name.length  = 0;
+        if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
+            // 方法调用时0号槽位是receiver
+            local.name = synthetic_token("this");
+        }
     }
 
     void print() {
@@ -63,6 +97,10 @@ struct Compiler {
         local.name = name;
         // -1 表示这个local变量没有完成初始化，不能使用
         local.depth = UNINITIALIZED_FLAG;
+        local.captured = false;
+        local.assigned = false;
+        local.access_sites.clear();
+        local.captured_by.clear();
     }
 
     Local& top_local() {
@@ -123,11 +161,36 @@ enum Precedence {
     PREC_PRIMARY
 };
 
+// 编译期常量折叠的统计
+struct FoldStats {
+    uint64_t binary = 0;        // 两个操作数都是常量的二元运算
+    uint64_t concat = 0;        // 其中的字符串拼接
+    uint64_t unary = 0;         // 常量取负
+    uint64_t logical = 0;       // 左操作数是常量的and/or
+    uint64_t dead_branches = 0; // 条件是常量的if，不会执行的分支被丢弃
+    uint64_t dead_loops = 0;    // 条件为假的while/for，整个循环被丢弃
+    uint64_t infinite_loops = 0; // 条件为真的while/for，去掉条件判断
+
+    void print(std::ostream& out = std::cout) const {
+        out << "fold binary:" << binary << " concat:" << concat << " unary:" << unary
+            << " logical:" << logical << " dead_branches:" << dead_branches
+            << " dead_loops:" << dead_loops << " infinite_loops:" << infinite_loops << std::endl;
+    }
+};
+
 struct ParseRule;
 
+// 正在编译的类，嵌套的类声明形成一个链表
+struct ClassCompiler {
+    ClassCompiler* enclosing = nullptr;
+    bool has_superclass = false;
+};
+
 class Parser {
 public:
-    Parser(Scanner* scanner_);
+    // 编译出的全局变量槽位属于vm的GlobalTable，执行时必须使用同一个vm；
+    // vm为空时parser自己创建一个，只适合单独测试编译结果
+    Parser(Scanner* scanner_, VM* vm_ = nullptr);
     ~Parser();
     void init_rules();
 
@@ -140,6 +203,11 @@ public:
     bool match(TokenType type);
 
     ObjFunction* compile();
+    // 流式编译：每次编译若干条完整的顶层声明，字节码或者扫描器占用的缓冲区超过max_bytes时
+    // 返回这一批的main函数，调用方交给VM执行之后再编译下一批，整个源码不需要同时在内存里。
+    // 源码结束或者编译出错时返回nullptr，出错时had_error为true
+    ObjFunction* compile_next(size_t max_bytes = STREAM_BATCH_BYTES);
+    static constexpr size_t STREAM_BATCH_BYTES = 256 * 1024;
 
     void number(bool can_assign);
     void grouping(bool can_assign);
@@ -162,6 +230,13 @@ public:
     void fun_declaration();
     void call(bool can_assign);
     uint8_t argument_list();
+    void class_declaration();
+    void method();
+    void dot(bool can_assign);
+    void this_(bool can_assign);
+    void super_(bool can_assign);
+    // 属性名、方法名和类名：op加上名字的2字节常量下标
+    void emit_name(uint8_t op, uint8_t long_op, const Token& name);
     void if_statement();
     void while_statement();
     void return_statement();
@@ -173,11 +248,17 @@ public:
     ObjFunction* end_compiler();
 
 
-    uint8_t parse_variable_name(const char* error_message);
+    int parse_variable_name(const char* error_message);
     void declare_local_variable();
-    void define_global_variable(uint8_t global);
+    void define_global_variable(int global);
     void mark_initialized();
-    uint8_t identifier_constant(const Token& name);
+    int identifier_constant(const Token& name);
+    int global_slot(const Token& name);
+    // 在外层函数里查找变量，找到时加到compiler捕获的变量里，返回upvalue下标，找不到返回-1
+    int resolve_upvalue(Compiler* compiler, const Token& name);
+    int add_upvalue(Compiler* compiler, int index, bool is_local, Local* local);
+    // 局部变量的作用域结束
+    void close_local(Local& local);
     void named_variable(const Token& name, bool can_assign);
     void variable(bool can_assign);
 
@@ -187,7 +268,13 @@ public:
 
     void emit_return();
     void emit_constant(Value value);
-    uint8_t make_constant(Value value);
+    int make_constant(Value value);
+    void emit_operand(uint8_t op, uint8_t long_op, int operand);
+    // 常量折叠：[start, end)正好是一条constant指令时取出常量
+    bool constant_at(int start, int end, Value* value);
+    bool fold_binary(TokenType operator_type, const Value& a, const Value& b, Value* result);
+    // 丢弃pos之后生成的代码
+    void truncate(int pos);
 
     void parse_expr(Precedence ctx_precedence);
     ParseRule* get_rule(TokenType type);
@@ -197,9 +284,25 @@ public:
     Token previous;
     bool had_error = false;
     Scanner* scanner = nullptr;
-    ObjectPool<ObjString> string_pool;
-    ObjectPool<ObjFunction> fun_pool;
     Compiler* compiler = nullptr;
+    ClassCompiler* current_class = nullptr;
+    VM* vm = nullptr;
+    // 每个函数编译完之后做窥孔优化，融合超级指令
+    bool enable_peephole = true;
+    PeepholeStats peephole_stats;
+    // 编译期计算常量表达式，丢弃条件是常量的分支
+    bool enable_folding = true;
+    FoldStats fold_stats;
+    // return f(...)编译成OP_TAIL_CALL，复用当前的栈帧
+    bool enable_tail_calls = true;
+private:
+    void begin_script();
+private:
+    // parse_expr调用中缀解析函数之前设置，左操作数的代码从这里开始
+    int _operand_start = 0;
+    std::unique_ptr<VM> _own_vm;
+    Compiler* _script_compiler = nullptr;
+    bool _register_failed = false;
 };
 
 typedef void (Parser::*ParseFn)(bool can_assign);
@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <vector>
+
+#include "peephole.h"
+
+namespace aankaa {
+
+namespace {
+
+struct JumpFixup {
+    int operand;    // 新代码里偏移量所在的位置
+    int end;        // 新代码里跳转指令结束的位置，偏移量相对于这里计算
+    int old_target; // 旧代码里的跳转目标
+    bool backward;
+};
+
+bool is_loop(uint8_t op) {
+    return op == OP_LOOP || op == OP_LOOP_LONG;
+}
+
+// 偏移量按大端写在operand开始的width个字节里
+void write_offset(std::vector<uint8_t>* code, int operand, int width, int offset) {
+    for (int i = width - 1; i >= 0; --i) {
+        (*code)[operand + i] = offset & 0xff;
+        offset >>= 8;
+    }
+}
+
+} // namespace
+
+void peephole_optimize(Chunk* chunk, PeepholeStats* stats) {
+    const std::vector<uint8_t>& code = chunk->code;
+    const int size = static_cast<int>(code.size());
+
+    // 指令的起始位置和跳转目标
+    std::vector<int> starts;
+    std::vector<bool> is_target(size + 1, false);
+    for (int pos = 0; pos < size; pos += op_size(code[pos])) {
+        starts.push_back(pos);
+        int target = jump_target(code, pos);
+        if (target >= 0 && target <= size) {
+            is_target[target] = true;
+        }
+    }
+
+    // 从第k条指令开始匹配ops，中间的指令不能是跳转目标
+    auto match = [&](size_t k, std::initializer_list<uint8_t> ops) {
+        if (k + ops.size() > starts.size()) {
+            return false;
+        }
+        size_t n = 0;
+        for (uint8_t op : ops) {
+            int pos = starts[k + n];
+            if (code[pos] != op || (n > 0 && is_target[pos])) {
+                return false;
+            }
+            n++;
+        }
+        return true;
+    };
+
+    std::vector<uint8_t> new_code;
+    LineTable new_lines;
+    new_code.reserve(size);
+    // 旧位置 -> 新位置，只有指令起始位置有意义
+    std::vector<int> position(size + 1, -1);
+    std::vector<JumpFixup> fixups;
+
+    auto emit = [&](uint8_t byte, int line) {
+        new_code.push_back(byte);
+        new_lines.add(line);
+    };
+
+    for (size_t k = 0; k < starts.size();) {
+        int pos = starts[k];
+        int line = chunk->lines.line_for_offset(pos);
+        position[pos] = static_cast<int>(new_code.size());
+
+        if (match(k, {OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP})
+                && code[pos + 1] == code[starts[k + 3] + 1]) {
+            emit(OP_INC_LOCAL, line);
+            emit(code[pos + 1], line);
+            emit(code[starts[k + 1] + 1], line);
+            stats->inc_local++;
+            k += 5;
+            continue;
+        }
+        if (match(k, {OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE, OP_POP})) {
+            int jump = starts[k + 3];
+            emit(OP_LESS_LOCAL_CONST_JUMP, line);
+            emit(code[pos + 1], line);
+            emit(code[starts[k + 1] + 1], line);
+            emit(0xff, line);
+            emit(0xff, line);
+            int end = static_cast<int>(new_code.size());
+            fixups.push_back({end - 2, end, jump_target(code, jump), false});
+            stats->less_local_const_jump++;
+            k += 5;
+            continue;
+        }
+        if (match(k, {OP_GET_LOCAL, OP_CONSTANT, OP_ADD})) {
+            emit(OP_ADD_LOCAL_CONST, line);
+            emit(code[pos + 1], line);
+            emit(code[starts[k + 1] + 1], line);
+            stats->add_local_const++;
+            k += 3;
+            continue;
+        }
+
+        // 原样复制，跳转指令的偏移量最后再修正
+        int op_len = op_size(code[pos]);
+        for (int i = 0; i < op_len; ++i) {
+            emit(code[pos + i], line);
+        }
+        int target = jump_target(code, pos);
+        if (target >= 0) {
+            // 所有跳转指令的偏移量都在最后几个字节
+            int end = static_cast<int>(new_code.size());
+            fixups.push_back({end - jump_operand_size(code[pos]), end, target, is_loop(code[pos])});
+        }
+        k++;
+    }
+    position[size] = static_cast<int>(new_code.size());
+
+    for (const JumpFixup& fixup : fixups) {
+        int target = position[fixup.old_target];
+        int offset = fixup.backward ? fixup.end - target : target - fixup.end;
+        write_offset(&new_code, fixup.operand, fixup.end - fixup.operand, offset);
+    }
+
+    stats->bytes_before += size;
+    stats->bytes_after += new_code.size();
+    chunk->code.swap(new_code);
+    chunk->lines = std::move(new_lines);
+    chunk->count = static_cast<int>(chunk->code.size());
+}
+
+void relax_jumps(Chunk* chunk, const std::unordered_map<int, int>& long_targets) {
+    if (long_targets.empty()) {
+        return;
+    }
+    const std::vector<uint8_t>& code = chunk->code;
+    const int size = static_cast<int>(code.size());
+
+    // 每条指令的起始位置、跳转目标，以及是否要改写成宽跳转
+    std::vector<int> starts;
+    std::vector<int> targets;
+    std::vector<bool> widen;
+    for (int pos = 0; pos < size; pos += op_size(code[pos])) {
+        auto it = long_targets.find(pos);
+        starts.push_back(pos);
+        targets.push_back(it != long_targets.end() ? it->second : jump_target(code, pos));
+        widen.push_back(it != long_targets.end());
+    }
+
+    // 改宽一条跳转会拉长跨过它的其他跳转，反复计算直到没有新的跳转需要改宽
+    std::vector<int> position(size + 1, -1);
+    for (bool changed = true; changed;) {
+        int new_pos = 0;
+        for (size_t k = 0; k < starts.size(); ++k) {
+            position[starts[k]] = new_pos;
+            new_pos += op_size(code[starts[k]]) + (widen[k] ? 1 : 0);
+        }
+        position[size] = new_pos;
+
+        changed = false;
+        for (size_t k = 0; k < starts.size(); ++k) {
+            uint8_t op = code[starts[k]];
+            if (targets[k] < 0 || widen[k] || long_jump_op(op) < 0) {
+                continue;
+            }
+            int end = position[starts[k]] + op_size(op);
+            if (std::abs(position[targets[k]] - end) > UINT16_MAX) {
+                widen[k] = true;
+                changed = true;
+            }
+        }
+    }
+
+    std::vector<uint8_t> new_code;
+    LineTable new_lines;
+    new_code.reserve(position[size]);
+    for (size_t k = 0; k < starts.size(); ++k) {
+        int pos = starts[k];
+        int op_len = op_size(code[pos]);
+        int line = chunk->lines.line_for_offset(pos);
+        if (widen[k]) {
+            new_code.push_back(long_jump_op(code[pos]));
+            new_code.insert(new_code.end(), 3, 0);
+            new_lines.add(line, 4);
+        } else {
+            new_code.insert(new_code.end(), code.begin() + pos, code.begin() + pos + op_len);
+            new_lines.add(line, op_len);
+        }
+        if (targets[k] >= 0) {
+            uint8_t op = new_code[position[pos]];
+            int end = static_cast<int>(new_code.size());
+            int target = position[targets[k]];
+            int width = jump_operand_size(op);
+            write_offset(&new_code, end - width, width, is_loop(op) ? end - target : target - end);
+        }
+    }
+
+    chunk->code.swap(new_code);
+    chunk->lines = std::move(new_lines);
+    chunk->count = static_cast<int>(chunk->code.size());
+}
+
+} // namespace
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <iostream>
+#include <unordered_map>
+
+#include "chunk.h"
+
+namespace aankaa {
+
+// 窥孔优化
+// 函数编译完成之后(Parser::end_compiler)扫描一遍字节码，把循环里最常见的几种指令序列融合成超级指令，
+// 减少分发次数和栈操作：
+//   get_local a, constant k, add, set_local a, pop      -> inc_local a k
+//   get_local a, constant k, add                        -> add_local_const a k
+//   get_local a, constant k, less, jmp_if_false off, pop -> less_local_const_jmp a k off
+// 被融合的指令除了第一条之外都不能是跳转目标，否则跳进序列中间会出错。
+// 融合之后代码变短，所有跳转的偏移量按新旧位置的映射重新计算。
+// 选择哪些序列来融合可以参考OpcodeProfiler统计出来的运行时指令序列频率。
+struct PeepholeStats {
+    uint64_t add_local_const = 0;
+    uint64_t inc_local = 0;
+    uint64_t less_local_const_jump = 0;
+    uint64_t bytes_before = 0;
+    uint64_t bytes_after = 0;
+
+    void print(std::ostream& out = std::cout) const {
+        out << "peephole add_local_const:" << add_local_const
+            << " inc_local:" << inc_local
+            << " less_local_const_jmp:" << less_local_const_jump
+            << " bytes:" << bytes_before << " -> " << bytes_after << std::endl;
+    }
+};
+
+void peephole_optimize(Chunk* chunk, PeepholeStats* stats);
+
+// 跳转松弛(relaxation)
+// 编译器先按16位偏移量生成跳转，只在函数里有跳转放不下时才调用：把这些跳转改写成宽跳转，
+// 所有跳转的偏移量按新旧位置的映射重新计算。改宽一条跳转可能让跨过它的另一条也放不下，所以反复迭代到稳定。
+// long_targets是短跳转位置 -> 跳转目标，记录patch_jump时偏移量已经放不下的跳转(这些跳转的操作数是无效的)
+void relax_jumps(Chunk* chunk, const std::unordered_map<int, int>& long_targets);
+
+} // namespace
@@ -1,123 +1,218 @@
 #pragma once
 #include <vector>
+#include <algorithm>
 #include <type_traits>
 #include <iostream>
+#include <iomanip>
+#include <memory>
 
 #ifndef DEFAULT_POOL_NUM
 #define DEFAULT_POOL_NUM 4
 #endif
 
-// 一种简单的对象池，适用于多次分配，最后统一回收的场景
-// 不支持单个对象的回收，不支持线程安全
+// 单个slab最多容纳的对象个数，超过之后slab大小不再翻倍
+#ifndef MAX_SLAB_NUM
+#define MAX_SLAB_NUM 4096
+#endif
+
+// 按slab分配的对象池，不支持线程安全
+// 对象从一块块连续的slab里切出来，slab用完之后申请一块新的，新slab的大小是上一块的两倍(几何增长)。
+// release()把单个对象析构后放回空闲链表，下次get()优先复用，GC或者宿主程序可以回收单个对象。
+// 空闲链表直接复用对象本身的内存，不需要额外的节点。
+// clear()析构所有活着的对象，slab保留下来继续复用；析构函数才真正释放slab。
 
 namespace aankaa {
 
 using Allocator = std::allocator<uint8_t>;
 
-template<typename NODE>
-class DoubleLinkedList {
-public:
-    void push_back(NODE* node) {
-        node->next = nullptr;
-        if (tail) {
-            tail->next = node;    
-        } else {
-            head = node;
-        }
-        tail = node;
-        count++;
-    }
-    NODE* pop_front() {
-        if (head) {
-            NODE* ret = head;
-            head = reinterpret_cast<NODE*>(head->next);
-            count--;
-            return ret;
-        } 
-        tail = nullptr;
-        return nullptr;
+struct PoolStats {
+    size_t slabs = 0;          // slab个数
+    size_t capacity = 0;       // 所有slab能容纳的对象总数
+    size_t live = 0;           // 正在使用的对象个数
+    size_t free = 0;           // 空闲链表里的对象个数
+    size_t untouched = 0;      // slab里还没切出去过的对象个数
+    size_t reserved_bytes = 0; // slab占用的内存
+    double min_slab_occupancy = 0;  // 占用率最低的slab
+    double max_slab_occupancy = 0;  // 占用率最高的slab
+
+    double occupancy() const {
+        return capacity == 0 ? 0 : static_cast<double>(live) / capacity;
     }
-    void clear() {
-        head = nullptr;
-        tail = nullptr;
-        count = 0;
+
+    void print() const {
+        std::cout << "pool slabs:" << slabs
+                  << " capacity:" << capacity
+                  << " live:" << live
+                  << " free:" << free
+                  << " untouched:" << untouched
+                  << " reserved:" << reserved_bytes
+                  << std::fixed << std::setprecision(2)
+                  << " occupancy:" << occupancy()
+                  << " slab_occupancy:[" << min_slab_occupancy << ", " << max_slab_occupancy << "]"
+                  << std::defaultfloat << std::endl;
     }
-public:
-    NODE* head = {nullptr};
-    NODE* tail = {nullptr};
-    int count = {0};
 };
 
 template<typename T>
 class ObjectPool {
 public:
-    ObjectPool() {
-        init(DEFAULT_POOL_NUM);
-    }
+    ObjectPool() : _next_slab_num(DEFAULT_POOL_NUM) {}
 
-    ObjectPool(size_t num) {
-        init(num);
-    }
+    // num是第一块slab的大小
+    ObjectPool(size_t num) : _next_slab_num(num > 0 ? num : 1) {}
 
     ObjectPool(ObjectPool const&) = delete;             // Copy construct
     ObjectPool(ObjectPool&&) = delete;                  // Move construct
     ObjectPool& operator=(ObjectPool const&) = delete;  // Copy assign
-    ObjectPool& operator=(ObjectPool &&) = delete;      // Move assign    
-
-    void init(size_t num) {
-        _elements = (T*)Allocator().allocate(sizeof(T) * num);
-        _capacity = num;
-    }
+    ObjectPool& operator=(ObjectPool &&) = delete;      // Move assign
 
     template<class... Args>
     T* get(Args&&... args) {
-        // 有先从数据缓存分配
-        if (_size < _capacity) {
-            new(_elements + _size) T{std::forward<Args>(args)...};
-            return (_elements + _size++);
+        Slot* slot = _free_list;
+        Slab* slab = nullptr;
+        if (slot != nullptr) {
+            // 优先复用release回来的对象
+            _free_list = slot->next_free;
+            _free_count--;
+            slab = find_slab(slot);
+        } else {
+            if (_slabs.empty() || _slabs[_current].used == _slabs[_current].capacity) {
+                next_slab();
+            }
+            slab = &_slabs[_current];
+            slot = slab->slots + slab->used++;
+        }
+        T* obj = new(slot->storage) T(std::forward<Args>(args)...);
+        slab->occupied[slot - slab->slots] = true;
+        slab->live++;
+        _live_count++;
+        return obj;
+    }
+
+    // 析构obj并把内存放回空闲链表。obj不是这个pool分配的或者已经释放过时什么都不做，返回false
+    bool release(T* obj) {
+        Slot* slot = reinterpret_cast<Slot*>(obj);
+        Slab* slab = find_slab(slot);
+        if (slab == nullptr || !slab->occupied[slot - slab->slots]) {
+            return false;
+        }
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            obj->~T();
         }
-        // 缓存不够用，动态创建一个对象，并挂载到链表中
-        T* new_obj = (T*)Allocator().allocate(sizeof(T));
-        new(new_obj) T{std::forward<Args>(args)...};
-        list.push_back(new_obj);
-        return new_obj;
+        slab->occupied[slot - slab->slots] = false;
+        slab->live--;
+        _live_count--;
+        slot->next_free = _free_list;
+        _free_list = slot;
+        _free_count++;
+        return true;
     }
 
+    bool owns(const T* obj) const {
+        return find_slab(reinterpret_cast<const Slot*>(obj)) != nullptr;
+    }
+
+    // 析构所有活着的对象，slab保留下来从头开始复用
     void clear() {
-        if (_size > 0) {
-            std::cout << "delete " << _size + list.count << " object<" << typeid(_elements[0]).name() << "> from pool" << std::endl;
-        }        
-        if constexpr (!std::is_trivial_v<T>) {
-            // 非平凡数据需要调用析构函数
-            // 析构数组缓存
-            for (int k = 0; k < _size; ++k) {
-                reinterpret_cast<T*>(&_elements[k])->~T();
+        for (Slab& slab : _slabs) {
+            if constexpr (!std::is_trivially_destructible_v<T>) {
+                for (size_t k = 0; k < slab.used; ++k) {
+                    if (slab.occupied[k]) {
+                        reinterpret_cast<T*>(slab.slots[k].storage)->~T();
+                    }
+                }
             }
+            std::fill(slab.occupied.begin(), slab.occupied.end(), false);
+            slab.used = 0;
+            slab.live = 0;
         }
-        _size = 0;
-        // if (list.count > 0) {
-        //     std::cout << "delete " << list.count << " object<" << typeid(*list.head).name() << "> from list" << std::endl;
-        // }
-        for (T* obj = list.pop_front(); obj != nullptr; obj = list.pop_front()) {
-            if constexpr (!std::is_trivial_v<T>) {
-                reinterpret_cast<T*>(obj)->~T();
-            }
-            Allocator().deallocate((uint8_t*)obj, sizeof(T));
+        _free_list = nullptr;
+        _free_count = 0;
+        _live_count = 0;
+        _current = 0;
+    }
+
+    size_t size() const {
+        return _live_count;
+    }
+
+    PoolStats stats() const {
+        PoolStats stats;
+        stats.slabs = _slabs.size();
+        stats.live = _live_count;
+        stats.free = _free_count;
+        stats.min_slab_occupancy = _slabs.empty() ? 0 : 1;
+        for (const Slab& slab : _slabs) {
+            stats.capacity += slab.capacity;
+            stats.untouched += slab.capacity - slab.used;
+            stats.reserved_bytes += slab.capacity * sizeof(Slot);
+            double occupancy = static_cast<double>(slab.live) / slab.capacity;
+            stats.min_slab_occupancy = std::min(stats.min_slab_occupancy, occupancy);
+            stats.max_slab_occupancy = std::max(stats.max_slab_occupancy, occupancy);
         }
+        return stats;
     }
+
     ~ObjectPool() {
         clear();
-        if (_elements != nullptr ) { 
-            Allocator().deallocate((uint8_t*)_elements, sizeof(T) * _capacity);
-        }        
-        _elements = nullptr;
-        _capacity = 0;
+        for (Slab& slab : _slabs) {
+            Allocator().deallocate(reinterpret_cast<uint8_t*>(slab.slots), sizeof(Slot) * slab.capacity);
+        }
+        _slabs.clear();
+        _order.clear();
     }
 private:
-    T* _elements = nullptr;  //数组缓存，预先创建好，容量有限
-    DoubleLinkedList<T> list; // 动态创建的对象，缓存不够用的时候启用
-    int _size = 0;
-    size_t _capacity = 0;
+    union Slot {
+        Slot* next_free;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    struct Slab {
+        Slot* slots;
+        size_t capacity;
+        size_t used;   // 已经切出去过的对象个数，之后的对象还没用过
+        size_t live;
+        std::vector<bool> occupied;
+    };
+
+    void next_slab() {
+        // clear()之后先复用已有的slab
+        if (_current + 1 < _slabs.size()) {
+            _current++;
+            return;
+        }
+        size_t num = _next_slab_num;
+        _next_slab_num = std::max<size_t>(std::min<size_t>(num * 2, MAX_SLAB_NUM), num);
+        Slot* slots = reinterpret_cast<Slot*>(Allocator().allocate(sizeof(Slot) * num));
+        _slabs.push_back(Slab{slots, num, 0, 0, std::vector<bool>(num, false)});
+        _current = _slabs.size() - 1;
+        auto iter = std::upper_bound(_order.begin(), _order.end(), slots,
+            [this](const Slot* s, size_t index) { return s < _slabs[index].slots; });
+        _order.insert(iter, _current);
+    }
+
+    Slab* find_slab(const Slot* slot) const {
+        // _order按slab的起始地址排序，二分找到最后一个起始地址不大于slot的slab
+        auto iter = std::upper_bound(_order.begin(), _order.end(), slot,
+            [this](const Slot* s, size_t index) { return s < _slabs[index].slots; });
+        if (iter == _order.begin()) {
+            return nullptr;
+        }
+        const Slab& slab = _slabs[*(iter - 1)];
+        if (slot >= slab.slots + slab.capacity) {
+            return nullptr;
+        }
+        return const_cast<Slab*>(&slab);
+    }
+
+private:
+    std::vector<Slab> _slabs;
+    std::vector<size_t> _order; // 按起始地址排序的slab下标，release时二分查找
+    size_t _current = 0;        // 当前正在切分的slab
+    size_t _next_slab_num;      // 下一块slab的大小
+    Slot* _free_list = nullptr; // release回来的对象
+    size_t _free_count = 0;
+    size_t _live_count = 0;
 };
 
-} // namespace
\ No newline at end of file
+} // namespace
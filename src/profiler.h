@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "chunk.h"
+
+namespace aankaa {
+
+// 指令序列频率统计，用来挑选值得融合成超级指令的序列
+// 记录实际执行的指令流里长度为2~MAX_PATTERN_LENGTH的连续opcode序列出现的次数，
+// 不关心操作数，也不区分函数调用边界。
+// 只有打开AANKAA_TRACE编译的VM才会调用record()，生产构建的分发循环里没有这部分代码。
+class OpcodeProfiler {
+public:
+    static constexpr int MAX_PATTERN_LENGTH = 4;
+
+    void record(uint8_t op) {
+        _window = (_window << 8) | op;
+        _length = std::min(_length + 1, MAX_PATTERN_LENGTH);
+        _instructions++;
+        for (int n = 2; n <= _length; ++n) {
+            // 最高字节放序列长度，不同长度的序列不会冲突
+            uint64_t mask = (1ull << (8 * n)) - 1;
+            _counts[(static_cast<uint64_t>(n) << 56) | (_window & mask)]++;
+        }
+    }
+
+    struct Pattern {
+        std::vector<uint8_t> ops;
+        uint64_t count;
+    };
+
+    // 按出现次数从高到低返回前top个序列，length为0表示所有长度
+    std::vector<Pattern> top(size_t top, int length = 0) const {
+        std::vector<Pattern> patterns;
+        for (auto& item : _counts) {
+            int n = static_cast<int>(item.first >> 56);
+            if (length != 0 && n != length) {
+                continue;
+            }
+            Pattern pattern;
+            for (int i = n - 1; i >= 0; --i) {
+                pattern.ops.push_back(static_cast<uint8_t>(item.first >> (8 * i)));
+            }
+            pattern.count = item.second;
+            patterns.push_back(std::move(pattern));
+        }
+        std::sort(patterns.begin(), patterns.end(), [](const Pattern& a, const Pattern& b) {
+            return a.count != b.count ? a.count > b.count : a.ops < b.ops;
+        });
+        if (patterns.size() > top) {
+            patterns.resize(top);
+        }
+        return patterns;
+    }
+
+    void report(std::ostream& out, size_t top_n = 20) const {
+        out << "instructions:" << _instructions << std::endl;
+        for (int n = 2; n <= MAX_PATTERN_LENGTH; ++n) {
+            out << "top " << n << "-op patterns:" << std::endl;
+            for (const Pattern& pattern : top(top_n, n)) {
+                std::string name;
+                for (uint8_t op : pattern.ops) {
+                    name += name.empty() ? "" : ", ";
+                    name += op_name[op];
+                }
+                out << "    " << std::left << std::setw(60) << name << std::right
+                    << std::setw(12) << pattern.count << std::fixed << std::setprecision(2)
+                    << std::setw(8) << 100.0 * pattern.count / _instructions << "%"
+                    << std::defaultfloat << std::endl;
+            }
+        }
+    }
+
+    uint64_t instructions() const {
+        return _instructions;
+    }
+
+    void clear() {
+        _counts.clear();
+        _window = 0;
+        _length = 0;
+        _instructions = 0;
+    }
+
+private:
+    std::unordered_map<uint64_t, uint64_t> _counts;
+    uint64_t _window = 0;
+    int _length = 0;
+    uint64_t _instructions = 0;
+};
+
+} // namespace
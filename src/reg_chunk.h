@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+#include "value.h"
+
+namespace aankaa {
+
+// 寄存器字节码
+// 寄存器就是frame里的栈槽位：R0是被调用的函数本身，接着是形参和局部变量，再往上是表达式的临时值，
+// 和栈式字节码里值所在的栈深度一一对应。指令是定长的三地址格式(dst, src1, src2)。
+// 源操作数使用RK编码：小于REG_CONST_BASE表示寄存器，否则表示常量表下标(加上REG_CONST_BASE)，
+// 常量表和栈式字节码共用Chunk::constants。
+// 由RegisterEmitter从栈式字节码翻译得到，见reg_emitter.cpp。
+enum RegOpCode : uint8_t {
+    ROP_MOVE,          // R[a] = RK(b)
+    ROP_GET_GLOBAL,    // R[a] = globals[b]
+    ROP_DEFINE_GLOBAL, // globals[a] = RK(b)
+    ROP_SET_GLOBAL,    // globals[a] = RK(b)，未定义报错
+    ROP_ADD,           // R[a] = RK(b) + RK(c)
+    ROP_SUBTRACT,
+    ROP_MULTIPLY,
+    ROP_DIVIDE,
+    ROP_EQUAL,
+    ROP_LESS,
+    ROP_GREATER,
+    ROP_NOT,           // R[a] = !RK(b)
+    ROP_NEGATE,        // R[a] = -RK(b)
+    ROP_PRINT,         // print RK(b)
+    ROP_JUMP,          // pc += jump
+    ROP_JUMP_IF_FALSE, // if falsey(RK(b)) pc += jump
+    ROP_JUMP_IF_NOT_EQUAL,   // if !(RK(b) == RK(c)) pc += jump
+    ROP_JUMP_IF_NOT_LESS,    // if !(RK(b) < RK(c)) pc += jump
+    ROP_JUMP_IF_NOT_GREATER, // if !(RK(b) > RK(c)) pc += jump
+    ROP_CALL,          // R[a] = R[a](R[a+1], ..., R[a+b])
+    ROP_RETURN,        // return RK(b)
+    ROP_TAIL_CALL,     // 复用当前栈帧调用R[a](R[a+1], ..., R[a+b])，后面总是跟着ROP_RETURN
+    ROP_GET_UPVALUE,      // R[a] = R0.captures[b]，R0是正在执行的闭包
+    ROP_GET_UPVALUE_CELL, // R[a] = R0.captures[b].value
+    ROP_SET_UPVALUE,      // R0.captures[a].value = RK(b)
+    ROP_GET_LOCAL_CELL,   // R[a] = R[b]，R[b]是ObjUpvalue时取它的值
+    ROP_SET_LOCAL_CELL,   // R[a] = RK(b)，R[a]是ObjUpvalue时写它的值
+    ROP_CLOSURE,          // R[a] = 常量表第b个函数的闭包
+    ROP_COUNT
+};
+
+extern const char* reg_op_name[];
+
+constexpr uint16_t REG_CONST_BASE = 256;
+
+struct RegInstr {
+    uint8_t op;
+    uint8_t a;     // 目标寄存器，或者全局变量槽位、调用的基址寄存器
+    uint16_t b;    // RK编码的源操作数，或者参数个数
+    uint16_t c;    // RK编码的源操作数
+    int16_t jump;  // 跳转偏移，相对于下一条指令，单位是指令条数
+};
+
+static_assert(sizeof(RegInstr) == 8, "RegInstr should be 8 bytes");
+
+class RegChunk {
+public:
+    void print(const std::vector<Value>& constants, std::ostream& out = std::cout) const {
+        out << "reg_chunk:" << this << " code[" << code.size() << "] registers:" << max_registers << " -> \n";
+        auto rk = [&](uint16_t x) {
+            return x < REG_CONST_BASE ? "r" + std::to_string(x)
+                                      : "[" + constants[x - REG_CONST_BASE].to_string() + "]";
+        };
+        for (size_t i = 0; i < code.size(); ++i) {
+            const RegInstr& ins = code[i];
+            out << std::setw(3) << i << "    " << reg_op_name[ins.op] << " ";
+            switch (ins.op) {
+            case ROP_MOVE:
+            case ROP_NOT:
+            case ROP_NEGATE:
+                out << "r" << static_cast<int>(ins.a) << ", " << rk(ins.b);
+                break;
+            case ROP_GET_GLOBAL:
+                out << "r" << static_cast<int>(ins.a) << ", #" << ins.b;
+                break;
+            case ROP_DEFINE_GLOBAL:
+            case ROP_SET_GLOBAL:
+                out << "#" << static_cast<int>(ins.a) << ", " << rk(ins.b);
+                break;
+            case ROP_PRINT:
+            case ROP_RETURN:
+                out << rk(ins.b);
+                break;
+            case ROP_JUMP:
+                out << "-> " << static_cast<int>(i + 1 + ins.jump);
+                break;
+            case ROP_JUMP_IF_FALSE:
+                out << rk(ins.b) << " -> " << static_cast<int>(i + 1 + ins.jump);
+                break;
+            case ROP_JUMP_IF_NOT_EQUAL:
+            case ROP_JUMP_IF_NOT_LESS:
+            case ROP_JUMP_IF_NOT_GREATER:
+                out << rk(ins.b) << ", " << rk(ins.c) << " -> " << static_cast<int>(i + 1 + ins.jump);
+                break;
+            case ROP_CALL:
+            case ROP_TAIL_CALL:
+                out << "r" << static_cast<int>(ins.a) << ", " << ins.b;
+                break;
+            case ROP_GET_UPVALUE:
+            case ROP_GET_UPVALUE_CELL:
+                out << "r" << static_cast<int>(ins.a) << ", up" << ins.b;
+                break;
+            case ROP_SET_UPVALUE:
+                out << "up" << static_cast<int>(ins.a) << ", " << rk(ins.b);
+                break;
+            case ROP_GET_LOCAL_CELL:
+            case ROP_SET_LOCAL_CELL:
+                out << "r" << static_cast<int>(ins.a) << ", " << rk(ins.b);
+                break;
+            case ROP_CLOSURE:
+                out << "r" << static_cast<int>(ins.a) << ", " << constants[ins.b].to_string();
+                break;
+            default:
+                out << "r" << static_cast<int>(ins.a) << ", " << rk(ins.b) << ", " << rk(ins.c);
+                break;
+            }
+            out << "\n";
+        }
+        out << std::flush;
+    }
+
+public:
+    std::vector<RegInstr> code;
+    std::vector<int> lines;
+    // 函数执行时需要的寄存器个数，进入函数时按这个数字预留栈空间
+    int max_registers = 0;
+};
+
+} // namespace
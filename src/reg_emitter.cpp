@@ -0,0 +1,508 @@
+#include <memory>
+
+#include "reg_emitter.h"
+#include "object.h"
+
+namespace aankaa {
+
+const char* reg_op_name[] = {
+    [ROP_MOVE] = "move",
+    [ROP_GET_GLOBAL] = "get_global",
+    [ROP_DEFINE_GLOBAL] = "def_global",
+    [ROP_SET_GLOBAL] = "set_global",
+    [ROP_ADD] = "add",
+    [ROP_SUBTRACT] = "sub",
+    [ROP_MULTIPLY] = "mul",
+    [ROP_DIVIDE] = "div",
+    [ROP_EQUAL] = "eq",
+    [ROP_LESS] = "lt",
+    [ROP_GREATER] = "gt",
+    [ROP_NOT] = "not",
+    [ROP_NEGATE] = "neg",
+    [ROP_PRINT] = "print",
+    [ROP_JUMP] = "jmp",
+    [ROP_JUMP_IF_FALSE] = "jmp_if_false",
+    [ROP_JUMP_IF_NOT_EQUAL] = "jmp_if_not_eq",
+    [ROP_JUMP_IF_NOT_LESS] = "jmp_if_not_lt",
+    [ROP_JUMP_IF_NOT_GREATER] = "jmp_if_not_gt",
+    [ROP_CALL] = "call",
+    [ROP_RETURN] = "return",
+    [ROP_TAIL_CALL] = "tail_call",
+    [ROP_GET_UPVALUE] = "get_upvalue",
+    [ROP_GET_UPVALUE_CELL] = "get_upvalue_cell",
+    [ROP_SET_UPVALUE] = "set_upvalue",
+    [ROP_GET_LOCAL_CELL] = "get_local_cell",
+    [ROP_SET_LOCAL_CELL] = "set_local_cell",
+    [ROP_CLOSURE] = "closure",
+};
+
+namespace {
+
+uint8_t binary_op(uint8_t op) {
+    switch (op) {
+    case OP_ADD: return ROP_ADD;
+    case OP_SUBTRACT: return ROP_SUBTRACT;
+    case OP_MULTIPLY: return ROP_MULTIPLY;
+    case OP_DIVIDE: return ROP_DIVIDE;
+    case OP_EQUAL: return ROP_EQUAL;
+    case OP_LESS: return ROP_LESS;
+    default: return ROP_GREATER;
+    }
+}
+
+// 指令对栈深度的影响，不支持的指令返回false
+bool stack_effect(const std::vector<uint8_t>& code, int pos, int* effect) {
+    switch (code[pos]) {
+    case OP_CONSTANT: case OP_NIL: case OP_TRUE: case OP_FALSE:
+    case OP_GET_LOCAL: case OP_GET_GLOBAL:
+    case OP_CONSTANT_LONG: case OP_GET_GLOBAL_LONG:
+    case OP_GET_UPVALUE: case OP_GET_UPVALUE_CELL: case OP_GET_LOCAL_CELL:
+    case OP_CLOSURE: case OP_CLOSURE_LONG:
+        *effect = 1;
+        return true;
+    case OP_POP: case OP_DEFINE_GLOBAL: case OP_PRINT: case OP_RETURN:
+    case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+    case OP_EQUAL: case OP_LESS: case OP_GREATER:
+        *effect = -1;
+        return true;
+    case OP_SET_LOCAL: case OP_SET_GLOBAL: case OP_NOT: case OP_NEGATE:
+    case OP_SET_UPVALUE: case OP_SET_LOCAL_CELL:
+    case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_LOOP:
+    case OP_JUMP_LONG: case OP_JUMP_IF_FALSE_LONG: case OP_LOOP_LONG:
+        *effect = 0;
+        return true;
+    case OP_CALL: case OP_TAIL_CALL:
+        *effect = -code[pos + 1];
+        return true;
+    default:
+        return false;
+    }
+}
+
+} // namespace
+
+bool RegisterEmitter::fail(const std::string& message) {
+    _error = message;
+    return false;
+}
+
+void RegisterEmitter::emit_instr(uint8_t op, uint8_t a, uint16_t b, uint16_t c) {
+    _out->code.push_back(RegInstr{op, a, b, c, 0});
+    _out->lines.push_back(_line);
+}
+
+int RegisterEmitter::constant(const Value& value) {
+    int* cached = value.is_nil() ? &_nil : (value.as_bool() ? &_true : &_false);
+    if (*cached < 0) {
+        *cached = _chunk->add_constant(value);
+    }
+    return REG_CONST_BASE + *cached;
+}
+
+bool RegisterEmitter::push(uint16_t rk) {
+    if (_stack.size() >= UINT8_MAX) {
+        return fail("too many registers");
+    }
+    _stack.push_back(rk);
+    _out->max_registers = std::max<int>(_out->max_registers, _stack.size());
+    return true;
+}
+
+uint16_t RegisterEmitter::pop() {
+    uint16_t rk = _stack.back();
+    _stack.pop_back();
+    return rk;
+}
+
+// 把位置index的值写进它自己的寄存器
+void RegisterEmitter::materialize(int index) {
+    uint16_t src = _stack[index];
+    if (src == index) {
+        return;
+    }
+    before_write(index);
+    emit_instr(ROP_MOVE, index, src);
+    _stack[index] = index;
+}
+
+void RegisterEmitter::materialize_all(int from, int to) {
+    for (int i = from; i < to; ++i) {
+        materialize(i);
+    }
+}
+
+// 寄存器reg马上要被覆盖，还引用着它的位置先物化
+void RegisterEmitter::before_write(int reg) {
+    for (int i = 0; i < static_cast<int>(_stack.size()); ++i) {
+        if (i != reg && _stack[i] == reg) {
+            materialize(i);
+        }
+    }
+}
+
+// 从入口开始沿所有控制流路径计算每条指令执行前的栈深度，汇合点的深度必须一致。
+// 循环的条件判断在循环体之后，顺序翻译到条件判断时还没有见过跳回来的loop，所以要先算一遍
+bool RegisterEmitter::compute_depths(int entry_depth) {
+    const std::vector<uint8_t>& code = _chunk->code;
+    const int size = code.size();
+    std::vector<int> worklist{0};
+    _labels[0].depth = entry_depth;
+    while (!worklist.empty()) {
+        int pos = worklist.back();
+        worklist.pop_back();
+        if (pos >= size) {
+            return fail("missing return");
+        }
+        int effect = 0;
+        if (!stack_effect(code, pos, &effect)) {
+            return fail(std::string("unsupported opcode ") + op_name[code[pos]]);
+        }
+        int depth = _labels[pos].depth + effect;
+        if (depth < 0 || depth > UINT8_MAX) {
+            return fail("invalid stack depth at " + std::to_string(pos));
+        }
+        auto visit = [&](int next) {
+            if (_labels[next].depth < 0) {
+                _labels[next].depth = depth;
+                worklist.push_back(next);
+            } else if (_labels[next].depth != depth) {
+                return fail("stack depth mismatch at " + std::to_string(next));
+            }
+            return true;
+        };
+        uint8_t op = code[pos];
+        int target = jump_target(code, pos);
+        if (target >= 0 && (target > size || !visit(target))) {
+            return target > size ? fail("invalid jump target") : false;
+        }
+        bool fallthrough = op != OP_RETURN && op != OP_JUMP && op != OP_LOOP
+                           && op != OP_JUMP_LONG && op != OP_LOOP_LONG;
+        if (fallthrough && !visit(pos + op_size(op))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 到达一个跳转目标
+bool RegisterEmitter::arrive(int pos) {
+    Label& label = _labels[pos];
+    if (_reachable) {
+        materialize_all(0, _stack.size());
+    } else if (label.depth >= 0) {
+        // 只能从跳转到达，所有值都在自己的寄存器里
+        _stack.resize(label.depth);
+        for (int i = 0; i < label.depth; ++i) {
+            _stack[i] = i;
+        }
+        _reachable = true;
+    }
+    label.target = _out->code.size();
+    return true;
+}
+
+bool RegisterEmitter::jump_to(uint8_t op, uint16_t b, uint16_t c, int old_target) {
+    _fixups.push_back({_out->code.size(), old_target});
+    emit_instr(op, 0, b, c);
+    return true;
+}
+
+bool RegisterEmitter::emit(ObjFunction* function) {
+    _chunk = function->chunk;
+    const std::vector<uint8_t>& code = _chunk->code;
+    const int size = code.size();
+    std::unique_ptr<RegChunk> out(new RegChunk());
+    _out = out.get();
+
+    _labels.assign(size + 1, Label());
+    _is_target.assign(size + 1, false);
+    for (int pos = 0; pos < size; pos += op_size(code[pos])) {
+        int target = jump_target(code, pos);
+        if (target < 0 || target > size) {
+            continue;
+        }
+        _is_target[target] = true;
+    }
+
+    if (!compute_depths(function->arity + 1)) {
+        return false;
+    }
+
+    // R0是函数本身，接着是形参
+    _stack.clear();
+    for (int i = 0; i <= function->arity; ++i) {
+        if (!push(i)) {
+            return false;
+        }
+    }
+
+    for (int pos = 0; pos < size; pos += op_size(code[pos])) {
+        if (_is_target[pos]) {
+            if (!arrive(pos)) {
+                return false;
+            }
+            _last_retargetable = false;
+        }
+        if (!_reachable || _labels[pos].depth < 0) {
+            // return之后的死代码
+            _reachable = false;
+            continue;
+        }
+        bool retargetable = _last_retargetable;
+        _last_retargetable = false;
+        _line = _chunk->lines.line_for_offset(pos);
+        uint8_t op = code[pos];
+        int depth = _stack.size();
+
+        switch (op) {
+        case OP_CONSTANT:
+            if (!push(REG_CONST_BASE + code[pos + 1])) {
+                return false;
+            }
+            break;
+        case OP_CONSTANT_LONG: {
+            int index = _chunk->read_long(pos + 1);
+            if (index > UINT16_MAX - REG_CONST_BASE) {
+                return fail("too many constants");
+            }
+            if (!push(REG_CONST_BASE + index)) {
+                return false;
+            }
+            break;
+        }
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE: {
+            Value value = op == OP_NIL ? Value(nullptr) : Value(op == OP_TRUE);
+            int rk = constant(value);
+            if (rk > UINT16_MAX) {
+                return fail("too many constants");
+            }
+            if (!push(rk)) {
+                return false;
+            }
+            break;
+        }
+        case OP_POP:
+            pop();
+            break;
+        case OP_GET_LOCAL: {
+            int slot = code[pos + 1];
+            if (slot >= depth) {
+                return fail("invalid local slot");
+            }
+            materialize(slot);
+            if (!push(slot)) {
+                return false;
+            }
+            break;
+        }
+        case OP_SET_LOCAL: {
+            int slot = code[pos + 1];
+            if (slot >= depth - 1) {
+                return fail("invalid local slot");
+            }
+            uint16_t src = _stack.back();
+            bool referenced = false;
+            for (int i = 0; i < depth; ++i) {
+                referenced |= (i != slot && _stack[i] == slot);
+            }
+            if (src == slot) {
+                // a = a
+            } else if (retargetable && src == depth - 1 && !referenced) {
+                // 上一条指令直接写到局部变量的寄存器，省掉一次move
+                _out->code.back().a = slot;
+            } else {
+                before_write(slot);
+                emit_instr(ROP_MOVE, slot, _stack.back());
+            }
+            _stack[slot] = slot;
+            _stack.back() = slot;
+            break;
+        }
+        case OP_GET_LOCAL_CELL: {
+            // 局部变量的寄存器里可能是ObjUpvalue，读之前先保证值在它自己的寄存器里
+            int slot = code[pos + 1];
+            if (slot >= depth) {
+                return fail("invalid local slot");
+            }
+            materialize(slot);
+            before_write(depth);
+            emit_instr(ROP_GET_LOCAL_CELL, depth, slot);
+            if (!push(depth)) {
+                return false;
+            }
+            _last_retargetable = true;
+            break;
+        }
+        case OP_SET_LOCAL_CELL: {
+            int slot = code[pos + 1];
+            if (slot >= depth - 1) {
+                return fail("invalid local slot");
+            }
+            materialize(slot);
+            before_write(slot);
+            emit_instr(ROP_SET_LOCAL_CELL, slot, _stack.back());
+            break;
+        }
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_CELL:
+            before_write(depth);
+            emit_instr(op == OP_GET_UPVALUE ? ROP_GET_UPVALUE : ROP_GET_UPVALUE_CELL, depth, code[pos + 1]);
+            if (!push(depth)) {
+                return false;
+            }
+            _last_retargetable = true;
+            break;
+        case OP_SET_UPVALUE:
+            emit_instr(ROP_SET_UPVALUE, code[pos + 1], _stack.back());
+            break;
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG: {
+            int index = op == OP_CLOSURE ? code[pos + 1] : _chunk->read_long(pos + 1);
+            if (index > UINT16_MAX) {
+                return fail("too many constants");
+            }
+            // 闭包直接从寄存器里捕获变量，被赋值过的变量还会被原地换成ObjUpvalue，
+            // 所以每个值都要先在自己的寄存器里，也不能再有别的位置引用这些寄存器
+            materialize_all(0, depth);
+            emit_instr(ROP_CLOSURE, depth, index);
+            if (!push(depth)) {
+                return false;
+            }
+            break;
+        }
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG: {
+            int slot = op == OP_GET_GLOBAL ? code[pos + 1] : _chunk->read_long(pos + 1);
+            if (slot > UINT16_MAX) {
+                return fail("too many globals");
+            }
+            before_write(depth);
+            emit_instr(ROP_GET_GLOBAL, depth, slot);
+            if (!push(depth)) {
+                return false;
+            }
+            _last_retargetable = true;
+            break;
+        }
+        case OP_DEFINE_GLOBAL:
+            emit_instr(ROP_DEFINE_GLOBAL, code[pos + 1], pop());
+            break;
+        case OP_SET_GLOBAL:
+            emit_instr(ROP_SET_GLOBAL, code[pos + 1], _stack.back());
+            break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_LESS:
+        case OP_GREATER: {
+            uint16_t c = pop();
+            uint16_t b = pop();
+            int dst = depth - 2;
+            before_write(dst);
+            emit_instr(binary_op(op), dst, b, c);
+            push(dst);
+            _last_retargetable = true;
+            break;
+        }
+        case OP_NOT:
+        case OP_NEGATE: {
+            uint16_t b = pop();
+            int dst = depth - 1;
+            before_write(dst);
+            emit_instr(op == OP_NOT ? ROP_NOT : ROP_NEGATE, dst, b);
+            push(dst);
+            _last_retargetable = true;
+            break;
+        }
+        case OP_PRINT:
+            emit_instr(ROP_PRINT, 0, pop());
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+            materialize_all(0, depth);
+            if (!jump_to(ROP_JUMP, 0, 0, jump_target(code, pos))) {
+                return false;
+            }
+            _reachable = false;
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG: {
+            int target = jump_target(code, pos);
+            int next = pos + op_size(op);
+            // 两条路径的第一条指令都是pop时，条件值用完就丢掉了，不需要写进寄存器
+            bool discarded = next < size && code[next] == OP_POP && !_is_target[next]
+                             && target < size && code[target] == OP_POP;
+            if (!discarded) {
+                materialize_all(0, depth);
+                if (!jump_to(ROP_JUMP_IF_FALSE, depth - 1, 0, target)) {
+                    return false;
+                }
+                break;
+            }
+            size_t before = _out->code.size();
+            materialize_all(0, depth - 1);
+            uint16_t cond = _stack.back();
+            uint8_t last_op = before > 0 ? _out->code.back().op : static_cast<uint8_t>(ROP_COUNT);
+            if (retargetable && _out->code.size() == before && cond == depth - 1
+                    && (last_op == ROP_LESS || last_op == ROP_GREATER || last_op == ROP_EQUAL)) {
+                // 比较和条件跳转融合成一条指令
+                RegInstr compare = _out->code.back();
+                _out->code.pop_back();
+                _out->lines.pop_back();
+                uint8_t jump_op = last_op == ROP_LESS ? ROP_JUMP_IF_NOT_LESS
+                                : last_op == ROP_GREATER ? ROP_JUMP_IF_NOT_GREATER
+                                : ROP_JUMP_IF_NOT_EQUAL;
+                if (!jump_to(jump_op, compare.b, compare.c, target)) {
+                    return false;
+                }
+            } else if (!jump_to(ROP_JUMP_IF_FALSE, cond, 0, target)) {
+                return false;
+            }
+            break;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL: {
+            int arg_count = code[pos + 1];
+            int base = depth - arg_count - 1;
+            if (base < 0) {
+                return fail("invalid call");
+            }
+            materialize_all(base, depth);
+            emit_instr(op == OP_TAIL_CALL ? ROP_TAIL_CALL : ROP_CALL, base, arg_count);
+            _stack.resize(base);
+            push(base);
+            break;
+        }
+        case OP_RETURN:
+            emit_instr(ROP_RETURN, 0, pop());
+            _reachable = false;
+            break;
+        default:
+            return fail(std::string("unsupported opcode ") + op_name[op]);
+        }
+    }
+
+    for (const Fixup& fixup : _fixups) {
+        const Label& label = _labels[fixup.old_target];
+        if (label.target < 0) {
+            return fail("unresolved jump target " + std::to_string(fixup.old_target));
+        }
+        int offset = label.target - static_cast<int>(fixup.instr) - 1;
+        if (offset < INT16_MIN || offset > INT16_MAX) {
+            return fail("jump too far");
+        }
+        _out->code[fixup.instr].jump = offset;
+    }
+
+    delete function->reg_chunk;
+    function->reg_chunk = out.release();
+    return true;
+}
+
+} // namespace
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "chunk.h"
+#include "reg_chunk.h"
+
+namespace aankaa {
+
+struct ObjFunction;
+
+// 把一个函数的栈式字节码翻译成寄存器字节码
+// 按顺序模拟执行栈式指令，栈深度d的值放在寄存器Rd里。模拟栈里记录每个位置的值当前在哪里(RK编码)：
+// get_local和常量只是把来源记下来，不生成指令，等到真正使用的时候直接作为三地址指令的源操作数，
+// 这样a = b + c只生成一条add。下面几种情况需要把记下来的值真正写进自己的寄存器(物化)：
+//   - 读写某个寄存器之前，引用了它的位置要先物化，保证读到的是旧值
+//   - 跳转之前和跳转目标处，所有位置都物化，不同路径汇合时每个值都在自己的寄存器里
+//   - 调用之前，被调用的函数和参数必须在连续的寄存器里
+// 翻译之前先沿控制流算出每条指令的栈深度。
+// 遇到不支持的指令，或者栈深度在汇合点不一致时翻译失败，这个函数只能用栈式VM执行。
+class RegisterEmitter {
+public:
+    // 成功时function->reg_chunk指向翻译结果
+    bool emit(ObjFunction* function);
+
+    const std::string& error() const {
+        return _error;
+    }
+
+private:
+    struct Label {
+        int depth = -1;      // 执行这条指令前的栈深度，-1表示不可达
+        int target = -1;     // 翻译后的指令下标
+    };
+    struct Fixup {
+        size_t instr;        // 需要回填跳转偏移的指令
+        int old_target;      // 栈式字节码里的跳转目标
+    };
+
+    bool fail(const std::string& message);
+    void emit_instr(uint8_t op, uint8_t a, uint16_t b, uint16_t c = 0);
+    // 返回RK编码，可能超出uint16，调用者负责检查
+    int constant(const Value& value);
+    bool push(uint16_t rk);
+    uint16_t pop();
+    void materialize(int index);
+    void materialize_all(int from, int to);
+    void before_write(int reg);
+    bool compute_depths(int entry_depth);
+    bool arrive(int pos);
+    bool jump_to(uint8_t op, uint16_t b, uint16_t c, int old_target);
+
+private:
+    Chunk* _chunk = nullptr;
+    RegChunk* _out = nullptr;
+    std::vector<uint16_t> _stack;   // 模拟栈，每个位置的值所在的RK
+    std::vector<Label> _labels;     // 栈式字节码位置 -> 栈深度和翻译后的位置
+    std::vector<bool> _is_target;
+    std::vector<Fixup> _fixups;
+    bool _reachable = true;
+    int _line = 0;
+    // 上一条指令的目标寄存器是栈顶的临时值，可以直接改写成别的目标寄存器
+    bool _last_retargetable = false;
+    int _nil = -1;
+    int _true = -1;
+    int _false = -1;
+    std::string _error;
+};
+
+} // namespace
@@ -0,0 +1,368 @@
+#include <string>
+
+#include "vm.h"
+#include "reg_chunk.h"
+#include "likely.h"
+#include "trace.h"
+
+namespace aankaa {
+
+// 寄存器后端的执行入口，function必须已经翻译成寄存器字节码
+bool VM::enter_register_script(ObjFunction* function) {
+    if (!ensure_frame(stack_top, function->reg_chunk->max_registers + 2)) {
+        return false;
+    }
+    push(Value(function));
+
+    CallFrame* frame = frames.new_frame();
+    frame->function = function;
+    frame->closure = function;
+    frame->pc = function->reg_chunk->code.data();
+    frame->slots = stack_bottom;
+    // 寄存器都在栈上，清成nil后GC扫描栈时不会看到上一次执行残留的值
+    for (int i = 1; i < function->reg_chunk->max_registers; ++i) {
+        frame->slots[i] = Value(nullptr);
+    }
+    stack_top = frame->slots + std::max(function->reg_chunk->max_registers, 1);
+    return true;
+}
+
+#define RK(x) ((x) < REG_CONST_BASE ? slots[(x)] : constants[(x) - REG_CONST_BASE])
+
+#define REG_BINARY_OP(arith) \
+    do { \
+        if (unlikely(!numeric_binary<arith>(RK(ins.b), RK(ins.c), &slots[ins.a]))) { \
+            frame->pc = pc; \
+            runtime_error("Operands must be two numbers or two strings."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+    } while (false)
+
+#define REG_JUMP_UNLESS_OP(arith) \
+    do { \
+        Value result; \
+        if (unlikely(!numeric_binary<arith>(RK(ins.b), RK(ins.c), &result))) { \
+            frame->pc = pc; \
+            runtime_error("Operands must be two numbers or two strings."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        if (!result.as_bool()) { \
+            pc += ins.jump; \
+        } \
+    } while (false)
+
+#if AANKAA_TRACE
+#define REG_TRACE_INSTRUCTION() \
+    do { \
+        if (trace_enabled(TRACE_EXEC)) { \
+            print_stack(std::cerr); \
+            std::cerr << "[exec] " << reg_op_name[pc->op] << std::endl; \
+        } \
+    } while (false)
+#else
+#define REG_TRACE_INSTRUCTION() do {} while (false)
+#endif
+
+// 和栈式VM一样，支持labels-as-values时每个handler末尾直接跳到下一条指令的handler
+#if AANKAA_COMPUTED_GOTO
+#define REG_TARGET(op) case op: L_##op
+#define REG_DISPATCH() \
+    do { \
+        REG_TRACE_INSTRUCTION(); \
+        ins = *pc++; \
+        goto *dispatch_table[ins.op]; \
+    } while (false)
+#else
+#define REG_TARGET(op) case op
+#define REG_DISPATCH() goto dispatch_loop
+#endif
+
+InterpretResult VM::run_register() {
+    CallFrame* frame = frames.current_frame();
+    const RegInstr* pc = frame->pc;
+    Value* slots = frame->slots;
+    const Value* constants = frame->function->chunk->constants.data();
+    RegInstr ins;
+
+#if AANKAA_COMPUTED_GOTO
+    // 下标必须和RegOpCode一一对应
+    static void* dispatch_table[] = {
+        [ROP_MOVE] = &&L_ROP_MOVE,
+        [ROP_GET_GLOBAL] = &&L_ROP_GET_GLOBAL,
+        [ROP_DEFINE_GLOBAL] = &&L_ROP_DEFINE_GLOBAL,
+        [ROP_SET_GLOBAL] = &&L_ROP_SET_GLOBAL,
+        [ROP_ADD] = &&L_ROP_ADD,
+        [ROP_SUBTRACT] = &&L_ROP_SUBTRACT,
+        [ROP_MULTIPLY] = &&L_ROP_MULTIPLY,
+        [ROP_DIVIDE] = &&L_ROP_DIVIDE,
+        [ROP_EQUAL] = &&L_ROP_EQUAL,
+        [ROP_LESS] = &&L_ROP_LESS,
+        [ROP_GREATER] = &&L_ROP_GREATER,
+        [ROP_NOT] = &&L_ROP_NOT,
+        [ROP_NEGATE] = &&L_ROP_NEGATE,
+        [ROP_PRINT] = &&L_ROP_PRINT,
+        [ROP_JUMP] = &&L_ROP_JUMP,
+        [ROP_JUMP_IF_FALSE] = &&L_ROP_JUMP_IF_FALSE,
+        [ROP_JUMP_IF_NOT_EQUAL] = &&L_ROP_JUMP_IF_NOT_EQUAL,
+        [ROP_JUMP_IF_NOT_LESS] = &&L_ROP_JUMP_IF_NOT_LESS,
+        [ROP_JUMP_IF_NOT_GREATER] = &&L_ROP_JUMP_IF_NOT_GREATER,
+        [ROP_CALL] = &&L_ROP_CALL,
+        [ROP_RETURN] = &&L_ROP_RETURN,
+        [ROP_TAIL_CALL] = &&L_ROP_TAIL_CALL,
+        [ROP_GET_UPVALUE] = &&L_ROP_GET_UPVALUE,
+        [ROP_GET_UPVALUE_CELL] = &&L_ROP_GET_UPVALUE_CELL,
+        [ROP_SET_UPVALUE] = &&L_ROP_SET_UPVALUE,
+        [ROP_GET_LOCAL_CELL] = &&L_ROP_GET_LOCAL_CELL,
+        [ROP_SET_LOCAL_CELL] = &&L_ROP_SET_LOCAL_CELL,
+        [ROP_CLOSURE] = &&L_ROP_CLOSURE,
+    };
+#endif
+
+    // labels-as-values时只有第一条指令经过这里的switch，之后都是直接跳转
+#if !AANKAA_COMPUTED_GOTO
+dispatch_loop:
+#endif
+    REG_TRACE_INSTRUCTION();
+    ins = *pc++;
+    switch (ins.op) {
+    REG_TARGET(ROP_MOVE):
+        slots[ins.a] = RK(ins.b);
+        REG_DISPATCH();
+    REG_TARGET(ROP_GET_GLOBAL): {
+        const Value& value = globals.values[ins.b];
+        if (unlikely(value.is_undefined())) {
+            frame->pc = pc;
+            runtime_error("Undefined variable '%s'.", globals.name_of(ins.b)->chars);
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        slots[ins.a] = value;
+        REG_DISPATCH();
+    }
+    REG_TARGET(ROP_DEFINE_GLOBAL):
+        globals.values[ins.a] = RK(ins.b);
+        REG_DISPATCH();
+    REG_TARGET(ROP_SET_GLOBAL): {
+        Value& value = globals.values[ins.a];
+        if (unlikely(value.is_undefined())) {
+            frame->pc = pc;
+            runtime_error("Undefined variable '%s'.", globals.name_of(ins.a)->chars);
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        value = RK(ins.b);
+        REG_DISPATCH();
+    }
+    REG_TARGET(ROP_ADD): {
+        const Value& b = RK(ins.b);
+        const Value& c = RK(ins.c);
+        if (unlikely(!numeric_binary<Arith::ADD>(b, c, &slots[ins.a]))) {
+            // 字符串拼接复用栈式VM的实现，操作数临时放到寄存器上方
+            frame->pc = pc;
+            push(b);
+            push(c);
+            if (!add_slow()) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            slots[ins.a] = pop();
+        }
+        REG_DISPATCH();
+    }
+    REG_TARGET(ROP_SUBTRACT): REG_BINARY_OP(Arith::SUBTRACT); REG_DISPATCH();
+    REG_TARGET(ROP_MULTIPLY): REG_BINARY_OP(Arith::MULTIPLY); REG_DISPATCH();
+    REG_TARGET(ROP_DIVIDE):   REG_BINARY_OP(Arith::DIVIDE); REG_DISPATCH();
+    REG_TARGET(ROP_LESS):     REG_BINARY_OP(Arith::LESS); REG_DISPATCH();
+    REG_TARGET(ROP_GREATER):  REG_BINARY_OP(Arith::GREATER); REG_DISPATCH();
+    REG_TARGET(ROP_EQUAL):
+        slots[ins.a] = Value(RK(ins.b) == RK(ins.c));
+        REG_DISPATCH();
+    REG_TARGET(ROP_NOT):
+        slots[ins.a] = Value(RK(ins.b).is_falsey());
+        REG_DISPATCH();
+    REG_TARGET(ROP_NEGATE):
+        if (!numeric_negate(RK(ins.b), &slots[ins.a])) {
+            frame->pc = pc;
+            runtime_error("Operand must be a number.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        REG_DISPATCH();
+    REG_TARGET(ROP_PRINT):
+        std::cout << RK(ins.b).to_string() << std::endl;
+        REG_DISPATCH();
+    REG_TARGET(ROP_JUMP):
+        pc += ins.jump;
+        REG_DISPATCH();
+    REG_TARGET(ROP_JUMP_IF_FALSE):
+        if (RK(ins.b).is_falsey()) {
+            pc += ins.jump;
+        }
+        REG_DISPATCH();
+    REG_TARGET(ROP_JUMP_IF_NOT_EQUAL):
+        if (!(RK(ins.b) == RK(ins.c))) {
+            pc += ins.jump;
+        }
+        REG_DISPATCH();
+    REG_TARGET(ROP_JUMP_IF_NOT_LESS):    REG_JUMP_UNLESS_OP(Arith::LESS); REG_DISPATCH();
+    REG_TARGET(ROP_JUMP_IF_NOT_GREATER): REG_JUMP_UNLESS_OP(Arith::GREATER); REG_DISPATCH();
+    REG_TARGET(ROP_CALL): {
+        Value callee = slots[ins.a];
+        int arg_count = ins.b;
+        // 出错时报告行号，调用成功时返回地址也是它
+        frame->pc = pc;
+        if (callee.is_obj_type(OBJ_NATIVE)) {
+            // 原生函数不创建栈帧，结果直接写回R[a]
+            if (!call_native(static_cast<ObjNative*>(callee.as_obj()), arg_count, slots + ins.a + 1,
+                             &slots[ins.a])) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            REG_DISPATCH();
+        }
+        ObjFunction* function;
+        if (callee.is_obj_type(OBJ_FUNCTION)) {
+            function = callee.as_function();
+        } else if (callee.is_obj_type(OBJ_CLOSURE)) {
+            function = callee.as_closure()->function;
+        } else {
+            runtime_error("Can only call function");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        if (arg_count != function->arity) {
+            runtime_error("Expected %d arguments but got %d.", function->arity, arg_count);
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        // 整个程序翻译成功时才会走寄存器后端，这里只是防御
+        const RegChunk* reg_chunk = function->reg_chunk;
+        Value* new_slots = slots + ins.a;
+        if (reg_chunk == nullptr) {
+            runtime_error("Function was not compiled for the register backend.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        if (!ensure_frame(new_slots, reg_chunk->max_registers + 2)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = frames.new_frame();
+        frame->function = function;
+        frame->closure = callee.as_obj();
+        frame->slots = new_slots;
+        for (int i = arg_count + 1; i < reg_chunk->max_registers; ++i) {
+            new_slots[i] = Value(nullptr);
+        }
+        stack_top = new_slots + reg_chunk->max_registers;
+        slots = new_slots;
+        pc = reg_chunk->code.data();
+        constants = function->chunk->constants.data();
+        REG_DISPATCH();
+    }
+    REG_TARGET(ROP_TAIL_CALL): {
+        Value callee = slots[ins.a];
+        int arg_count = ins.b;
+        frame->pc = pc;
+        if (callee.is_obj_type(OBJ_NATIVE)) {
+            // 原生函数没有栈帧可以复用，按普通调用执行，结果由后面的ROP_RETURN返回
+            if (!call_native(static_cast<ObjNative*>(callee.as_obj()), arg_count, slots + ins.a + 1,
+                             &slots[ins.a])) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            REG_DISPATCH();
+        }
+        ObjFunction* function;
+        if (callee.is_obj_type(OBJ_FUNCTION)) {
+            function = callee.as_function();
+        } else if (callee.is_obj_type(OBJ_CLOSURE)) {
+            function = callee.as_closure()->function;
+        } else {
+            runtime_error("Can only call function");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        if (arg_count != function->arity) {
+            runtime_error("Expected %d arguments but got %d.", function->arity, arg_count);
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        const RegChunk* reg_chunk = function->reg_chunk;
+        if (reg_chunk == nullptr) {
+            runtime_error("Function was not compiled for the register backend.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        if (!ensure_slots(slots, reg_chunk->max_registers + 2)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        // 被调函数和参数挪到当前栈帧的R0开始的位置，ins.a总是大于0，从前往后复制不会覆盖还没复制的值
+        for (int i = 0; i <= arg_count; ++i) {
+            slots[i] = slots[ins.a + i];
+        }
+        for (int i = arg_count + 1; i < reg_chunk->max_registers; ++i) {
+            slots[i] = Value(nullptr);
+        }
+        frame->function = function;
+        frame->closure = callee.as_obj();
+        stack_top = slots + reg_chunk->max_registers;
+        pc = reg_chunk->code.data();
+        constants = function->chunk->constants.data();
+        REG_DISPATCH();
+    }
+    REG_TARGET(ROP_GET_UPVALUE):
+        // 正在执行的闭包在R0
+        slots[ins.a] = static_cast<ObjClosure*>(slots[0].as_obj())->captures()[ins.b];
+        REG_DISPATCH();
+    REG_TARGET(ROP_GET_UPVALUE_CELL): {
+        ObjClosure* closure = static_cast<ObjClosure*>(slots[0].as_obj());
+        slots[ins.a] = static_cast<ObjUpvalue*>(closure->captures()[ins.b].as_obj())->value;
+        REG_DISPATCH();
+    }
+    REG_TARGET(ROP_SET_UPVALUE): {
+        ObjClosure* closure = static_cast<ObjClosure*>(slots[0].as_obj());
+        ObjUpvalue* upvalue = static_cast<ObjUpvalue*>(closure->captures()[ins.a].as_obj());
+        upvalue->value = RK(ins.b);
+        write_barrier(upvalue, upvalue->value);
+        REG_DISPATCH();
+    }
+    REG_TARGET(ROP_GET_LOCAL_CELL): {
+        const Value& slot = slots[ins.b];
+        slots[ins.a] = slot.is_obj_type(OBJ_UPVALUE) ? static_cast<ObjUpvalue*>(slot.as_obj())->value : slot;
+        REG_DISPATCH();
+    }
+    REG_TARGET(ROP_SET_LOCAL_CELL): {
+        Value& slot = slots[ins.a];
+        if (slot.is_obj_type(OBJ_UPVALUE)) {
+            ObjUpvalue* upvalue = static_cast<ObjUpvalue*>(slot.as_obj());
+            upvalue->value = RK(ins.b);
+            write_barrier(upvalue, upvalue->value);
+        } else {
+            slot = RK(ins.b);
+        }
+        REG_DISPATCH();
+    }
+    REG_TARGET(ROP_CLOSURE):
+        // 分配可能触发GC，寄存器都在栈上，不需要额外保护
+        make_closure(constants[ins.b].as_function(), slots[0].as_obj(), slots, &slots[ins.a]);
+        REG_DISPATCH();
+    REG_TARGET(ROP_RETURN): {
+        Value result = RK(ins.b);
+        frames.destroy_frame();
+        if (frames.frame_count() == 0) {
+            // main函数
+            stack_top = stack_bottom;
+            return INTERPRET_OK;
+        }
+        // 返回值写到调用者的基址寄存器，也就是被调用函数的R0
+        slots[0] = result;
+        frame = frames.current_frame();
+        slots = frame->slots;
+        pc = frame->pc;
+        constants = frame->function->chunk->constants.data();
+        stack_top = slots + frame->function->reg_chunk->max_registers;
+        REG_DISPATCH();
+    }
+    default:
+        frame->pc = pc;
+        runtime_error("Unknown register opcode %d.", ins.op);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+}
+
+#undef RK
+#undef REG_BINARY_OP
+#undef REG_JUMP_UNLESS_OP
+#undef REG_TRACE_INSTRUCTION
+#undef REG_TARGET
+#undef REG_DISPATCH
+
+} // namespace
@@ -0,0 +1,169 @@
+#include <stdint.h>
+
+#include "scan_kernels.h"
+#include "keywords.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AANKAA_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace aankaa {
+
+// ---------------- 标量版本，也是不支持向量指令时的退路 ----------------
+
+static const char* scalar_skip_blank(const char* p, int* newlines) {
+    for (; char_is(*p, CHAR_BLANK); ++p) {
+        *newlines += *p == '\n';
+    }
+    return p;
+}
+
+static const char* scalar_skip_ident(const char* p) {
+    while (char_is(*p, CHAR_IDENT)) {
+        ++p;
+    }
+    return p;
+}
+
+static const char* scalar_skip_digits(const char* p) {
+    while (char_is(*p, CHAR_DIGIT)) {
+        ++p;
+    }
+    return p;
+}
+
+static const char* scalar_find_line_end(const char* p) {
+    while (*p != '\n' && *p != '\0') {
+        ++p;
+    }
+    return p;
+}
+
+static const char* scalar_find_quote(const char* p, int* newlines) {
+    for (; *p != '"' && *p != '\0'; ++p) {
+        *newlines += *p == '\n';
+    }
+    return p;
+}
+
+#if AANKAA_SCAN_X86
+
+// ---------------- 向量版本 ----------------
+// 每个指令集定义自己的Isa(取一块、按字节比较得到位掩码)，再包含scan_kernels_impl.h生成这一套kernel。
+// 对齐块的末尾可能超出源码所在的内存分配(但不会跨页)，所以关掉ASAN对它的检查
+
+#define SCAN_NO_ASAN __attribute__((no_sanitize_address))
+
+// SSE2是x86_64的基线，直接编译
+namespace sse2 {
+
+struct Isa {
+    using Vec = __m128i;
+    static constexpr int WIDTH = 16;
+
+    SCAN_NO_ASAN static Vec load(const char* p) {
+        return _mm_load_si128(reinterpret_cast<const Vec*>(p));
+    }
+    static uint32_t eq(Vec v, char ch) {
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(ch)));
+    }
+    // lo <= ch <= hi，lo和hi都在0x01~0x7f，有符号比较下0x80以上的字节是负数，不会落进区间
+    static uint32_t in_range(Vec v, char lo, char hi) {
+        Vec ge = _mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1));
+        Vec le = _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1));
+        return _mm_movemask_epi8(_mm_and_si128(ge, le));
+    }
+    // ch | 0x20把大写字母变成小写，其他字符不会因此落进'a'~'z'
+    static uint32_t alpha(Vec v) {
+        return in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+    }
+};
+
+#include "scan_kernels_impl.h"
+
+} // namespace sse2
+
+// AVX2的版本整段用target("avx2")编译，运行时由detect_simd_level确认CPU支持之后才会调用
+#pragma GCC push_options
+#pragma GCC target("avx2")
+namespace avx2 {
+
+struct Isa {
+    using Vec = __m256i;
+    static constexpr int WIDTH = 32;
+
+    SCAN_NO_ASAN static Vec load(const char* p) {
+        return _mm256_load_si256(reinterpret_cast<const Vec*>(p));
+    }
+    static uint32_t eq(Vec v, char ch) {
+        return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(ch)));
+    }
+    static uint32_t in_range(Vec v, char lo, char hi) {
+        Vec ge = _mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1));
+        Vec le = _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v);
+        return _mm256_movemask_epi8(_mm256_and_si256(ge, le));
+    }
+    static uint32_t alpha(Vec v) {
+        return in_range(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z');
+    }
+};
+
+#include "scan_kernels_impl.h"
+
+} // namespace avx2
+#pragma GCC pop_options
+
+#endif // AANKAA_SCAN_X86
+
+static const ScanKernels SCALAR_KERNELS = {
+    scalar_skip_blank, scalar_skip_ident, scalar_skip_digits, scalar_find_line_end, scalar_find_quote,
+};
+
+#if AANKAA_SCAN_X86
+static const ScanKernels SSE2_KERNELS = {
+    sse2::skip_blank, sse2::skip_ident, sse2::skip_digits, sse2::find_line_end, sse2::find_quote,
+};
+
+static const ScanKernels AVX2_KERNELS = {
+    avx2::skip_blank, avx2::skip_ident, avx2::skip_digits, avx2::find_line_end, avx2::find_quote,
+};
+#endif
+
+SimdLevel detect_simd_level() {
+#if AANKAA_SCAN_X86
+    static const SimdLevel level = __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+    return level;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+const ScanKernels& scan_kernels(SimdLevel level) {
+    if (level > detect_simd_level()) {
+        level = detect_simd_level();
+    }
+    switch (level) {
+#if AANKAA_SCAN_X86
+    case SIMD_AVX2:
+        return AVX2_KERNELS;
+    case SIMD_SSE2:
+        return SSE2_KERNELS;
+#endif
+    default:
+        return SCALAR_KERNELS;
+    }
+}
+
+const char* simd_level_name(SimdLevel level) {
+    switch (level) {
+    case SIMD_AVX2:
+        return "avx2";
+    case SIMD_SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+} // namespace
@@ -0,0 +1,36 @@
+#pragma once
+
+namespace aankaa {
+
+// 扫描器的批量字符分类
+// 每个函数从p开始往后找第一个不属于某一类的字符，一次处理16(SSE2)或32(AVX2)个字节。
+// 依赖SourceBuffer的'\0'哨兵：'\0'不属于任何一类，总会停在它上面。
+// 向量版本只做对齐的读取，对齐的16/32字节不会跨页，读到哨兵后面也不会越界访问
+enum SimdLevel {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+};
+
+struct ScanKernels {
+    // 跳过空格、\t、\r、\n，*newlines加上跳过的换行数
+    const char* (*skip_blank)(const char* p, int* newlines);
+    // 跳过标识符的字符[A-Za-z0-9_]
+    const char* (*skip_ident)(const char* p);
+    // 跳过数字[0-9]
+    const char* (*skip_digits)(const char* p);
+    // 找到行尾：第一个\n或者\0
+    const char* (*find_line_end)(const char* p);
+    // 找到字符串的结尾：第一个"或者\0，*newlines加上中间的换行数
+    const char* (*find_quote)(const char* p, int* newlines);
+};
+
+// 按CPUID选出的最高级别，只检测一次
+SimdLevel detect_simd_level();
+
+// level高于当前CPU支持的级别时退回到支持的最高级别
+const ScanKernels& scan_kernels(SimdLevel level = detect_simd_level());
+
+const char* simd_level_name(SimdLevel level);
+
+} // namespace
@@ -0,0 +1,61 @@
+// 没有#pragma once：scan_kernels.cpp在每个指令集的namespace里包含一次，
+// 用前面定义好的Isa生成一套kernel，AVX2那一次处在target("avx2")的范围里
+
+// find从p所在的对齐块开始，每次取一块算出"停下"的字节的位掩码，p之前的字节用skip掩掉，
+// 有停下的字节就返回第一个；newlines不为空时统计停下位置之前的换行
+template <typename Stop>
+SCAN_NO_ASAN static inline const char* find(const char* p, Stop stop, int* newlines) {
+    constexpr uint32_t FULL = Isa::WIDTH == 32 ? ~0u : (1u << Isa::WIDTH) - 1;
+    const char* block = reinterpret_cast<const char*>(
+            reinterpret_cast<uintptr_t>(p) & ~static_cast<uintptr_t>(Isa::WIDTH - 1));
+    uint32_t skip = (FULL << (p - block)) & FULL;
+    for (;;) {
+        Isa::Vec v = Isa::load(block);
+        uint32_t mask = stop(v) & skip;
+        if (newlines != nullptr) {
+            uint32_t lines = Isa::eq(v, '\n') & skip;
+            if (mask != 0) {
+                lines &= (mask & -mask) - 1;
+            }
+            // 一块里的换行很少，逐个清掉最低位比SSE2下没有popcnt指令的__builtin_popcount快
+            for (; lines != 0; lines &= lines - 1) {
+                ++*newlines;
+            }
+        }
+        if (mask != 0) {
+            return block + __builtin_ctz(mask);
+        }
+        block += Isa::WIDTH;
+        skip = FULL;
+    }
+}
+
+static const char* skip_blank(const char* p, int* newlines) {
+    return find(p, [](Isa::Vec v) {
+        return ~(Isa::eq(v, ' ') | Isa::eq(v, '\t') | Isa::eq(v, '\r') | Isa::eq(v, '\n'));
+    }, newlines);
+}
+
+static const char* skip_ident(const char* p) {
+    return find(p, [](Isa::Vec v) {
+        return ~(Isa::alpha(v) | Isa::in_range(v, '0', '9') | Isa::eq(v, '_'));
+    }, nullptr);
+}
+
+static const char* skip_digits(const char* p) {
+    return find(p, [](Isa::Vec v) {
+        return ~Isa::in_range(v, '0', '9');
+    }, nullptr);
+}
+
+static const char* find_line_end(const char* p) {
+    return find(p, [](Isa::Vec v) {
+        return Isa::eq(v, '\n') | Isa::eq(v, '\0');
+    }, nullptr);
+}
+
+static const char* find_quote(const char* p, int* newlines) {
+    return find(p, [](Isa::Vec v) {
+        return Isa::eq(v, '"') | Isa::eq(v, '\0');
+    }, newlines);
+}
@@ -1,4 +1,8 @@
+#include <errno.h>
+#include <algorithm>
+#include <unistd.h>
 #include "scanner.h"
+#include "keywords.h"
 #include <iostream>
 #include <memory.h>
 
@@ -7,12 +11,104 @@ namespace aankaa {
 Scanner::Scanner() {
 }
 
-void Scanner::reset(const std::string& source) {
-    _source = source;
-    _start = nullptr;
-    _current = _source.c_str();
+void Scanner::reset(SourceBuffer source) {
+    _source = std::move(source);
+    _start = _source.data();
+    _current = _source.data();
+    _end = _source.data() + _source.size();
     _line = 0;
     _tokens.clear();
+    _fd = -1;
+    _buffer.reset();
+    _capacity = 0;
+    discard();
+    _stream_error.clear();
+}
+
+void Scanner::reset_stream(int fd, size_t chunk_size) {
+    reset(SourceBuffer());
+    _fd = fd;
+    _chunk_size = std::max<size_t>(chunk_size, 1);
+    _capacity = 2 * _chunk_size + 1;
+    _buffer.reset(new char[_capacity]);
+    _buffer[0] = '\0';
+    _start = _current = _end = _buffer.get();
+}
+
+void Scanner::discard() {
+    _retired.clear();
+    _retired_bytes = 0;
+}
+
+size_t Scanner::retained_bytes() const {
+    return _capacity + _retired_bytes;
+}
+
+//  buffer                 start       current      end    capacity
+//    |  已经返回的token     |  正在扫描的token  |  空闲   |
+// 空闲空间不够一块时换一个新的缓冲区，只把正在扫描的token复制过去；
+// 已经返回的Token还指向旧缓冲区，所以旧缓冲区不能马上释放，等discard()
+bool Scanner::refill() {
+    if (_fd < 0) {
+        return false;
+    }
+    size_t used = _end - _buffer.get();
+    if (_capacity - used - 1 < _chunk_size) {
+        size_t kept = _end - _start;
+        size_t capacity = std::max(2 * _chunk_size, 2 * kept + _chunk_size) + 1;
+        std::unique_ptr<char[]> buffer(new char[capacity]);
+        memcpy(buffer.get(), _start, kept);
+        buffer[kept] = '\0';
+        _current = buffer.get() + (_current - _start);
+        _start = buffer.get();
+        _end = buffer.get() + kept;
+        _retired_bytes += _capacity;
+        _retired.push_back(std::move(_buffer));
+        _buffer = std::move(buffer);
+        _capacity = capacity;
+        used = kept;
+    }
+    char* tail = _buffer.get() + used;
+    ssize_t n = 0;
+    do {
+        n = read(_fd, tail, _capacity - used - 1);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        if (n < 0) {
+            _stream_error = std::string("read source failed: ") + strerror(errno);
+        }
+        _fd = -1;
+        return false;
+    }
+    tail[n] = '\0';
+    _end = tail + n;
+    return true;
+}
+
+// 大部分标识符、数字和空白都很短，前SHORT_RUN个字节逐个判断，还没结束才交给向量kernel。
+// 短的token不需要经过函数指针调用，也省掉对齐和生成掩码的开销
+static constexpr int SHORT_RUN = 8;
+
+static inline const char* skip_ident(const ScanKernels* kernels, const char* p) {
+    for (int i = 0; i < SHORT_RUN; ++i, ++p) {
+        if (!char_is(*p, CHAR_IDENT)) {
+            return p;
+        }
+    }
+    return kernels->skip_ident(p);
+}
+
+static inline const char* skip_digits(const ScanKernels* kernels, const char* p) {
+    for (int i = 0; i < SHORT_RUN; ++i, ++p) {
+        if (!char_is(*p, CHAR_DIGIT)) {
+            return p;
+        }
+    }
+    return kernels->skip_digits(p);
+}
+
+void Scanner::set_simd_level(SimdLevel level) {
+    _kernels = &scan_kernels(level);
 }
 
 char Scanner::advance() {
@@ -27,55 +123,15 @@ std::vector<Token>& Scanner::scan() {
 }
 
 
-// X X X X X X X X X X X X _
-// |           |           |
-// start     offset      current
-TokenType Scanner::check_keyword(int offset, int length, const char* rest, TokenType type) {
-    if ((_current - _start == offset + length) && memcmp(_start + offset, rest, length) == 0) {
-        return type;
-    }
-    return IDENTIFIER;
-}
-
+// 关键字用编译期生成的完美哈希查找(keywords.h)，一次哈希加一次memcmp
 TokenType Scanner::identifier_type() {
-    switch (_start[0]) {
-        case 'a': 
-            return check_keyword(1, 2, "nd", AND);
-        case 'c' :
-            return check_keyword(1, 4, "lass", CLASS);
-        case 'e': return check_keyword(1, 3, "lse", ELSE);
-        case 'f':
-        if (_current - _start > 1) {
-            switch (_start[1]) {
-            case 'a': return check_keyword(2, 3, "lse", FALSE);
-            case 'o': return check_keyword(2, 1, "r", FOR);
-            case 'u': return check_keyword(2, 1, "n", FUN);
-            }
-        }
-        break;
-        case 'i': return check_keyword(1, 1, "f", IF);
-        case 'n': return check_keyword(1, 2, "il", NIL);
-        case 'o': return check_keyword(1, 1, "r", OR);
-        case 'p': return check_keyword(1, 4, "rint", PRINT);
-        case 'r': return check_keyword(1, 5, "eturn", RETURN);
-        case 's': return check_keyword(1, 4, "uper", SUPER);
-        case 't':
-        if (_current - _start > 1) {
-            switch (_start[1]) {
-            case 'h': return check_keyword(2, 2, "is", THIS);
-            case 'r': return check_keyword(2, 2, "ue", TRUE);
-            }
-        }
-        break;
-        case 'v': return check_keyword(1, 2, "ar", VAR);
-        case 'w': return check_keyword(1, 4, "hile", WHILE);
-    }
-    return IDENTIFIER;
+    return keyword_type(_start, static_cast<int>(_current - _start));
 }
 
 Token Scanner::identifier() {
-    while (is_alpha(peek()) || is_digit(peek())) {
-        advance();
+    _current = skip_ident(_kernels, _current);
+    while (_current == _end && refill()) {
+        _current = skip_ident(_kernels, _current);
     }
     TokenType t = identifier_type();
     return make_token(t);
@@ -87,6 +143,8 @@ Token Scanner::scan_token() {
     if (is_at_end()) {
         return make_token(EEOF);
     }
+    // 双字符的运算符要看下一个字节
+    ensure(2);
     char ch = advance();
     switch(ch) {
     case '(': 
@@ -144,36 +202,35 @@ Token Scanner::scan_token() {
 
 void Scanner::skip_whitespace() {
     for (;;) {
-        char c = peek();
-        switch(c) {
-        case ' ':
-        case '\r':
-        case '\t':
-            advance();
-            break;
-        case '\n':
-            _line++;
-            advance();
-            break;
-        case '/':
-            if (peek_next() == '/') {
-                while (peek() != '\n' && !is_at_end()) {
-                    advance();
-                }
-            } else {
-                return;
+        int i = 0;
+        for (; i < SHORT_RUN; ++i, ++_current) {
+            char ch = *_current;
+            if (!char_is(ch, CHAR_BLANK)) {
+                break;
             }
-            break;
-        default:
+            _line += ch == '\n';
+        }
+        if (i == SHORT_RUN) {
+            _current = _kernels->skip_blank(_current, &_line);
+        }
+        // 空白和注释不用保留，流式扫描换缓冲区时不复制它们
+        _start = _current;
+        if (_current == _end && refill()) {
+            continue;
+        }
+        ensure(2);
+        if (_current[0] != '/' || _current[1] != '/') {
             return;
         }
+        _current = _kernels->find_line_end(_current + 2);
+        for (_start = _current; _current == _end && refill(); _start = _current) {
+            _current = _kernels->find_line_end(_current);
+        }
     }
 }
 
 void Scanner::comment() {
-    while (!is_at_end() && peek() != '\n') {
-        advance();
-    }
+    _current = _kernels->find_line_end(_current);
 }
 //  current(执行前)
 //     |
@@ -181,11 +238,9 @@ void Scanner::comment() {
 //   |                   |
 //  start             current(执行后)
 Token Scanner::string() {
-    while (!is_at_end() && peek() != '"') {
-        char ch = advance();
-        if (ch == '\n') {
-            _line++;
-        }
+    _current = _kernels->find_quote(_current, &_line);
+    while (_current == _end && refill()) {
+        _current = _kernels->find_quote(_current, &_line);
     }
     if (is_at_end()) {
         return error_token("expected quote");
@@ -209,28 +264,26 @@ Token Scanner::error_token(const char* message) {
 //   |                   |
 //  start             current(执行后)
 Token Scanner::number() {
-    bool is_int = true;
-    while (is_digit(peek())) {
-        advance();
+    _current = skip_digits(_kernels, _current);
+    while (_current == _end && refill()) {
+        _current = skip_digits(_kernels, _current);
     }
+    ensure(2);
     if (peek() == '.' && is_digit(peek_next())) {
-        is_int = false;
-        advance();
-        while (is_digit(peek())) {
-            advance();
-        } 
+        _current = skip_digits(_kernels, _current + 1);
+        while (_current == _end && refill()) {
+            _current = skip_digits(_kernels, _current);
+        }
     }
     return make_token(NUMBER);
 }
 
 bool Scanner::is_alpha(char ch) {
-    return (ch >= 'a' && ch <= 'z') ||
-            (ch >= 'A' && ch <= 'Z') ||
-            ch == '_'; 
+    return char_is(ch, CHAR_ALPHA);
 }
 
 bool Scanner::is_digit(char ch) {
-    return ch >= '0' && ch <= '9';
+    return char_is(ch, CHAR_DIGIT);
 }
 
 void Scanner::error(const std::string msg) {
@@ -247,8 +300,9 @@ Token Scanner::make_token(TokenType type) {
     return token;
 }
 
+// 缓冲区中间的'\0'就是结尾；流式扫描到了缓冲区末尾的哨兵时先读下一块
 bool Scanner::is_at_end() {
-    return *_current == '\0';
+    return *_current == '\0' && (_current != _end || !refill());
 }
 
 // 如果下一个字符match，吃掉它，同时返回true
@@ -1,24 +1,42 @@
 #pragma once
 
+#include <memory>
 #include <vector>
 #include <string>
 #include <unordered_map>
 
 #include "token.h"
+#include "source_buffer.h"
+#include "scan_kernels.h"
 
 namespace aankaa {
 
 class Scanner {
 public:
     Scanner();
-    void reset(const std::string& source);
+    // 扫描source，Token::start直接指向source的内存。
+    // 传入std::string或者字符串字面量时只是借用，调用方要保证它在扫描和编译期间有效
+    void reset(SourceBuffer source);
+    // 流式扫描：从fd每次读chunk_size字节，源码不需要整个放进内存，fd由调用方关闭。
+    // 跨块的token会被复制到新的缓冲区，之前返回的Token仍然指向旧缓冲区，旧缓冲区保留到discard()
+    void reset_stream(int fd, size_t chunk_size = STREAM_CHUNK_SIZE);
+    // 流式扫描时释放旧的缓冲区，之后只有最近返回的那个Token仍然有效。
+    // Parser在一批顶层声明编译执行完之后调用，这时编译器已经不再引用之前的Token
+    void discard();
+    // 流式扫描当前占用的缓冲区字节数
+    size_t retained_bytes() const;
+    // 流式扫描读fd出错时的错误信息
+    const std::string& stream_error() const {
+        return _stream_error;
+    }
+    // 跳过空白、注释和扫描标识符、数字、字符串时使用的向量指令级别，默认按CPUID选最高的
+    void set_simd_level(SimdLevel level);
     char advance();
     std::vector<Token>& scan();
     Token scan_token();
     Token make_token(TokenType type);
     void skip_whitespace();
 
-    TokenType check_keyword(int offset, int length, const char* rest, TokenType type);
     TokenType identifier_type();
     Token identifier();
     bool is_at_end();
@@ -32,12 +50,33 @@ public:
     bool is_digit(char ch);
     void error(const std::string msg);
     Token error_token(const char* message);
+
+    static constexpr size_t STREAM_CHUNK_SIZE = 64 * 1024;
+private:
+    // 流式扫描读到缓冲区末尾时读入下一块，成功时_start、_current可能被挪到新的缓冲区
+    bool refill();
+    // 保证_current之后至少有n个字节可读(源码结束时除外)
+    void ensure(int n) {
+        while (_end - _current < n && refill()) {
+        }
+    }
 private:
-    std::string _source;
+    SourceBuffer _source;
     const char* _current = nullptr;
     const char* _start = nullptr;
     int _line = 0;
+    const ScanKernels* _kernels = &scan_kernels();
     std::vector<Token> _tokens; 
+    // 缓冲区里有效数据的结尾，*_end是'\0'哨兵
+    const char* _end = nullptr;
+    // 流式扫描的状态
+    int _fd = -1;
+    size_t _chunk_size = STREAM_CHUNK_SIZE;
+    std::unique_ptr<char[]> _buffer;
+    size_t _capacity = 0;
+    std::vector<std::unique_ptr<char[]>> _retired;
+    size_t _retired_bytes = 0;
+    std::string _stream_error;
 };
 
 } // namespace
\ No newline at end of file
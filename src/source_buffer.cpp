@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "source_buffer.h"
+#include "defer.h"
+
+namespace aankaa {
+
+SourceBuffer& SourceBuffer::operator=(SourceBuffer&& other) noexcept {
+    if (this == &other) {
+        return *this;
+    }
+    release();
+    _data = other._data;
+    _size = other._size;
+    _copy = std::move(other._copy);
+    _map = other._map;
+    _map_size = other._map_size;
+    other._data = "";
+    other._size = 0;
+    other._map = nullptr;
+    other._map_size = 0;
+    return *this;
+}
+
+void SourceBuffer::release() {
+    if (_map != nullptr) {
+        munmap(_map, _map_size);
+    }
+    _copy.reset();
+    _data = "";
+    _size = 0;
+    _map = nullptr;
+    _map_size = 0;
+}
+
+SourceBuffer SourceBuffer::borrow(std::string_view text) {
+    assert(text.data() != nullptr && text.data()[text.size()] == '\0');
+    SourceBuffer buffer;
+    buffer._data = text.data();
+    buffer._size = text.size();
+    return buffer;
+}
+
+SourceBuffer SourceBuffer::copy(std::string_view text) {
+    SourceBuffer buffer;
+    buffer._copy.reset(new char[text.size() + 1]);
+    memcpy(buffer._copy.get(), text.data(), text.size());
+    buffer._copy[text.size()] = '\0';
+    buffer._data = buffer._copy.get();
+    buffer._size = text.size();
+    return buffer;
+}
+
+bool SourceBuffer::map_file(const std::string& path, std::string* error) {
+    release();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *error = "cannot open " + path + ": " + strerror(errno);
+        return false;
+    }
+    DEFER({
+        close(fd);
+    });
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        *error = "cannot stat " + path + ": " + strerror(errno);
+        return false;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        std::string content;
+        char block[64 * 1024];
+        ssize_t n = 0;
+        while ((n = read(fd, block, sizeof(block))) > 0) {
+            content.append(block, n);
+        }
+        if (n < 0) {
+            *error = "cannot read " + path + ": " + strerror(errno);
+            return false;
+        }
+        *this = copy(content);
+        return true;
+    }
+    if (st.st_size == 0) {
+        return true;
+    }
+    // 先占住文件大小加一个字节(按页取整)的匿名内存，再把文件映射到开头。
+    // 文件最后一页里超出文件大小的部分内核会填0，文件大小是页的整数倍时哨兵落在后面的匿名页上
+    size_t size = st.st_size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t map_size = (size + 1 + page - 1) / page * page;
+    void* reserved = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED) {
+        *error = "cannot mmap " + path + ": " + strerror(errno);
+        return false;
+    }
+    if (mmap(reserved, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        *error = "cannot mmap " + path + ": " + strerror(errno);
+        munmap(reserved, map_size);
+        return false;
+    }
+    madvise(reserved, size, MADV_SEQUENTIAL);
+    _map = reserved;
+    _map_size = map_size;
+    _data = static_cast<const char*>(reserved);
+    _size = size;
+    return true;
+}
+
+} // namespace
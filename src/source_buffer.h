@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace aankaa {
+
+// 扫描器读取的源码
+// 要么mmap整个源码文件，要么借用调用方的一段内存，都不会再复制一份。
+// 源码后面保证有一个'\0'哨兵，Scanner靠它判断结尾，不需要另外比较结束位置；
+// Token::start直接指向这块内存，所以SourceBuffer要比扫描出来的Token活得久。
+class SourceBuffer {
+public:
+    SourceBuffer() = default;
+    ~SourceBuffer() {
+        release();
+    }
+    SourceBuffer(SourceBuffer&& other) noexcept {
+        *this = std::move(other);
+    }
+    SourceBuffer& operator=(SourceBuffer&& other) noexcept;
+    SourceBuffer(const SourceBuffer&) = delete;
+    SourceBuffer& operator=(const SourceBuffer&) = delete;
+
+    // 借用std::string和字符串字面量，它们本身就以'\0'结尾
+    SourceBuffer(const std::string& text) : _data(text.c_str()), _size(text.size()) {}
+    SourceBuffer(const char* text) : _data(text), _size(strlen(text)) {}
+
+    // 借用text，调用方保证text.data()[text.size()]是'\0'，不能保证时用copy
+    static SourceBuffer borrow(std::string_view text);
+
+    // 复制text，自己在后面补上哨兵
+    static SourceBuffer copy(std::string_view text);
+
+    // mmap文件。文件大小正好是页的整数倍时，后面多映射一页匿名内存作为哨兵。
+    // 管道、字符设备这类不能mmap的文件改为读进来
+    bool map_file(const std::string& path, std::string* error);
+
+    const char* data() const {
+        return _data;
+    }
+    size_t size() const {
+        return _size;
+    }
+    std::string_view view() const {
+        return std::string_view(_data, _size);
+    }
+    bool is_mapped() const {
+        return _map != nullptr;
+    }
+
+private:
+    void release();
+
+private:
+    const char* _data = "";
+    size_t _size = 0;
+    std::unique_ptr<char[]> _copy;
+    void* _map = nullptr;
+    size_t _map_size = 0;
+};
+
+} // namespace
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <new>
+
+namespace aankaa {
+
+// VM的值栈和调用栈用的内存
+// 构造时一次mmap预留max_capacity个元素的地址空间，权限是PROT_NONE，不占物理内存也不计入commit；
+// 用到哪里再grow把前面一段改成可读写(按页，每次至少翻倍)，所以地址不会变，栈上的指针不用重定位。
+// 没有commit的部分，以及预留空间末尾额外的一页，都是保护页：越界的访问直接SIGSEGV，不会踩坏别的内存，
+// 因此push/pop不检查边界，只在进入新的栈帧时检查一次剩余空间。
+// 元素不会被构造和析构，第一次写入之前的内容是全0
+template <typename T>
+class StackRegion {
+public:
+    StackRegion(size_t max_capacity, size_t initial_capacity) {
+        size_t page = page_size();
+        _max_bytes = round_up(max_capacity * sizeof(T), page);
+        _map_size = _max_bytes + page;
+        void* map = mmap(nullptr, _map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (map == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        _data = static_cast<T*>(map);
+        if (!grow(initial_capacity)) {
+            munmap(map, _map_size);
+            throw std::bad_alloc();
+        }
+    }
+    ~StackRegion() {
+        munmap(_data, _map_size);
+    }
+    StackRegion(const StackRegion&) = delete;
+    StackRegion& operator=(const StackRegion&) = delete;
+
+    T* data() const {
+        return _data;
+    }
+    // 已经commit、可以直接读写的元素个数
+    size_t capacity() const {
+        return _committed_bytes / sizeof(T);
+    }
+    size_t max_capacity() const {
+        return _max_bytes / sizeof(T);
+    }
+    size_t committed_bytes() const {
+        return _committed_bytes;
+    }
+
+    // 保证前min_capacity个元素可以读写，超过max_capacity或者mprotect失败时返回false
+    bool grow(size_t min_capacity) {
+        size_t need = round_up(min_capacity * sizeof(T), page_size());
+        if (need <= _committed_bytes) {
+            return true;
+        }
+        if (need > _max_bytes) {
+            return false;
+        }
+        size_t bytes = _committed_bytes * 2 > need ? _committed_bytes * 2 : need;
+        bytes = bytes < _max_bytes ? bytes : _max_bytes;
+        char* base = reinterpret_cast<char*>(_data);
+        if (mprotect(base + _committed_bytes, bytes - _committed_bytes, PROT_READ | PROT_WRITE) != 0) {
+            return false;
+        }
+        _committed_bytes = bytes;
+        return true;
+    }
+
+    // 只保留前keep个元素(按页取整)，后面的物理页还给系统并恢复成保护页
+    void shrink(size_t keep) {
+        size_t bytes = round_up(keep * sizeof(T), page_size());
+        if (bytes >= _committed_bytes) {
+            return;
+        }
+        char* base = reinterpret_cast<char*>(_data);
+        madvise(base + bytes, _committed_bytes - bytes, MADV_DONTNEED);
+        mprotect(base + bytes, _committed_bytes - bytes, PROT_NONE);
+        _committed_bytes = bytes;
+    }
+
+private:
+    static size_t page_size() {
+        static const size_t page = sysconf(_SC_PAGESIZE);
+        return page;
+    }
+    static size_t round_up(size_t bytes, size_t page) {
+        return (bytes + page - 1) / page * page;
+    }
+
+private:
+    T* _data = nullptr;
+    size_t _committed_bytes = 0;
+    size_t _max_bytes = 0;
+    size_t _map_size = 0;
+};
+
+} // namespace
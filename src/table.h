@@ -0,0 +1,135 @@
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+#include "object.h"
+
+namespace aankaa {
+
+// 字符串驻留表，开放寻址(线性探测)的哈希集合
+// 以ObjString缓存的hash为键，容量总是2的幂，负载因子超过3/4时扩容。
+// 删除的位置放一个墓碑，保证探测链不断开，扩容时顺便清理掉。
+class StringTable {
+public:
+    StringTable() = default;
+    StringTable(StringTable const&) = delete;
+    StringTable& operator=(StringTable const&) = delete;
+
+    ObjString* find(const char* chars, int length, uint32_t hash) const {
+        if (_size == 0) {
+            return nullptr;
+        }
+        uint32_t mask = _entries.size() - 1;
+        for (uint32_t index = hash & mask; ; index = (index + 1) & mask) {
+            ObjString* entry = _entries[index];
+            if (entry == nullptr) {
+                return nullptr;
+            }
+            if (entry != tombstone()
+                    && entry->hash == hash
+                    && entry->length == length
+                    && memcmp(entry->chars, chars, length) == 0) {
+                return entry;
+            }
+        }
+    }
+
+    // 调用方保证str不在表里
+    void insert(ObjString* str) {
+        if ((_used + 1) * 4 > _entries.size() * 3) {
+            grow();
+        }
+        uint32_t mask = _entries.size() - 1;
+        uint32_t index = str->hash & mask;
+        while (_entries[index] != nullptr && _entries[index] != tombstone()) {
+            index = (index + 1) & mask;
+        }
+        if (_entries[index] == nullptr) {
+            _used++;
+        }
+        _entries[index] = str;
+        _size++;
+    }
+
+    bool remove(ObjString* str) {
+        if (_size == 0) {
+            return false;
+        }
+        uint32_t mask = _entries.size() - 1;
+        for (uint32_t index = str->hash & mask; ; index = (index + 1) & mask) {
+            ObjString* entry = _entries[index];
+            if (entry == nullptr) {
+                return false;
+            }
+            if (entry == str) {
+                _entries[index] = tombstone();
+                _size--;
+                return true;
+            }
+        }
+    }
+
+    // 删除所有满足pred的字符串，给垃圾回收清理弱引用使用
+    template <typename Pred>
+    void remove_if(Pred pred) {
+        for (auto& entry : _entries) {
+            if (entry != nullptr && entry != tombstone() && pred(entry)) {
+                entry = tombstone();
+                _size--;
+            }
+        }
+    }
+
+    // 用fn的返回值替换每个字符串，返回nullptr表示删除。
+    // nursery回收时用它把晋升的字符串换成新地址，hash不变所以不需要重新插入
+    template <typename Fn>
+    void rewrite(Fn fn) {
+        for (auto& entry : _entries) {
+            if (entry == nullptr || entry == tombstone()) {
+                continue;
+            }
+            ObjString* replaced = fn(entry);
+            if (replaced == nullptr) {
+                entry = tombstone();
+                _size--;
+            } else {
+                entry = replaced;
+            }
+        }
+    }
+
+    int size() const { return _size; }
+    int capacity() const { return static_cast<int>(_entries.size()); }
+
+private:
+    static ObjString* tombstone() {
+        return reinterpret_cast<ObjString*>(uintptr_t(1));
+    }
+
+    void grow() {
+        std::vector<ObjString*> old;
+        old.swap(_entries);
+        size_t capacity = old.empty() ? 16 : old.size();
+        // 大部分位置是墓碑时只需要原地重建，有效元素超过一半才翻倍
+        if ((static_cast<size_t>(_size) + 1) * 2 > capacity) {
+            capacity *= 2;
+        }
+        _entries.assign(capacity, nullptr);
+        _size = 0;
+        _used = 0;
+        for (ObjString* entry : old) {
+            if (entry != nullptr && entry != tombstone()) {
+                insert(entry);
+            }
+        }
+    }
+
+private:
+    std::vector<ObjString*> _entries;
+    int _size = 0;  // 有效的字符串个数
+    size_t _used = 0;  // 有效字符串 + 墓碑，用来决定什么时候扩容
+};
+
+} // namespace
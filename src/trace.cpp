@@ -0,0 +1,55 @@
+#include <string.h>
+
+#include "trace.h"
+
+namespace aankaa {
+
+uint32_t trace_flags = TRACE_NONE;
+
+static const struct {
+    const char* name;
+    uint32_t flag;
+} TRACE_NAMES[] = {
+    {"compile", TRACE_COMPILE},
+    {"chunk", TRACE_CHUNK},
+    {"exec", TRACE_EXEC},
+    {"gc", TRACE_GC},
+    {"all", TRACE_ALL},
+};
+
+bool parse_trace_flags(const char* spec, uint32_t* flags) {
+    uint32_t result = TRACE_NONE;
+    const char* start = spec;
+    while (*start != '\0') {
+        const char* end = strchr(start, ',');
+        size_t length = end == nullptr ? strlen(start) : end - start;
+        bool found = false;
+        for (auto& entry : TRACE_NAMES) {
+            if (strlen(entry.name) == length && strncmp(entry.name, start, length) == 0) {
+                result |= entry.flag;
+                found = true;
+                break;
+            }
+        }
+        if (!found && length > 0) {
+            return false;
+        }
+        if (end == nullptr) {
+            break;
+        }
+        start = end + 1;
+    }
+    *flags = result;
+    return true;
+}
+
+const char* trace_flag_name(uint32_t flag) {
+    for (auto& entry : TRACE_NAMES) {
+        if (entry.flag == flag) {
+            return entry.name;
+        }
+    }
+    return "trace";
+}
+
+} // namespace
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <iostream>
+
+#include "likely.h"
+
+// 调试跟踪
+// 编译期开关AANKAA_TRACE，默认关闭：TRACE()展开成空语句，参数不会被求值，生产构建没有任何开销。
+// 打开之后由运行时的trace_flags决定输出哪些类别，例如命令行参数--trace=compile,exec。
+// 输出统一写到stderr，不会和脚本自己的print混在一起。
+// 兼容原来的DEBUG_TRACE_EXECUTION开关。
+#ifndef AANKAA_TRACE
+#ifdef DEBUG_TRACE_EXECUTION
+#define AANKAA_TRACE 1
+#else
+#define AANKAA_TRACE 0
+#endif
+#endif
+
+namespace aankaa {
+
+enum TraceFlag : uint32_t {
+    TRACE_NONE = 0,
+    TRACE_COMPILE = 1 << 0,  // 编译器的解析过程
+    TRACE_CHUNK = 1 << 1,    // 每个函数编译完之后打印字节码
+    TRACE_EXEC = 1 << 2,     // 每条指令执行前打印栈
+    TRACE_GC = 1 << 3,       // 垃圾回收统计
+    TRACE_ALL = TRACE_COMPILE | TRACE_CHUNK | TRACE_EXEC | TRACE_GC,
+};
+
+extern uint32_t trace_flags;
+
+inline bool trace_enabled(uint32_t flag) {
+    return unlikely((trace_flags & flag) != 0);
+}
+
+// 解析逗号分隔的类别列表，例如"compile,chunk"，"all"表示全部
+// 有不认识的类别返回false
+bool parse_trace_flags(const char* spec, uint32_t* flags);
+
+const char* trace_flag_name(uint32_t flag);
+
+} // namespace
+
+#if AANKAA_TRACE
+#define TRACE(flag, expr) \
+    do { \
+        if (::aankaa::trace_enabled(flag)) { \
+            std::cerr << "[" << ::aankaa::trace_flag_name(flag) << "] " << expr << std::endl; \
+        } \
+    } while (false)
+#else
+#define TRACE(flag, expr) do {} while (false)
+#endif
@@ -11,16 +11,25 @@ Value::Value(Obj* obj) {
 }
 
 ObjString* Value::as_string() const {
-    return (ObjString*)(as.obj);
+    return (ObjString*)(as_obj());
 }        
+#ifdef AANKAA_NAN_BOXING
+Obj* Value::as_obj() const {
+    return (Obj*)(uintptr_t)(bits & ~(SIGN_BIT | QNAN));
+}
+#else
 Obj* Value::as_obj() const {
     return as.obj;
 }
+#endif
 NativeFn Value::as_native() const {
     return ((ObjNative*)as_obj())->function;
 }
 ObjFunction* Value::as_function() const {
-    return (ObjFunction*)(as.obj);
+    return (ObjFunction*)(as_obj());
+}
+ObjClosure* Value::as_closure() const {
+    return (ObjClosure*)(as_obj());
 }    
 ObjType Value::obj_type() const {
     return as_obj()->type;
@@ -30,18 +39,26 @@ bool Value::is_obj_type(ObjType type) const {
 }    
 const char* Value::as_cstring() const {
     ObjString* objs = (ObjString*)(as_obj());
-    return objs->buffer.c_str();
+    return objs->chars;
+}
+#ifdef AANKAA_NAN_BOXING
+void Value::set_obj(Obj* obj) {
+    bits = (obj != nullptr ? (SIGN_BIT | QNAN | (uint64_t)(uintptr_t)obj) : NIL_VAL);
 }
+#else
 void Value::set_obj(Obj* obj) {
     as.obj = obj;
     type = (obj != nullptr ? VAL_OBJ : VAL_NIL);
 }    
+#endif
 bool Value::is_string() const {
     return is_obj_type(OBJ_STRING);
 }        
 std::string Value::to_string() const {
     if (is_nil()) {
         return "nil";
+    } else if (is_undefined()) {
+        return "undefined";
     } else if (is_bool()) {
         return as_bool() ? "true" : "false";
     } else if (is_number()) {
@@ -51,27 +68,51 @@ std::string Value::to_string() const {
     } else if (is_obj_type(OBJ_STRING)) {
         return as_string()->to_string();
     } else if (is_obj_type(OBJ_FUNCTION)){
-        return "fun(" + as_function()->name->buffer + ")";
+        return "fun(" + std::string(as_function()->name->view()) + ")";
+    } else if (is_obj_type(OBJ_CLOSURE)){
+        return "fun(" + std::string(as_closure()->function->name->view()) + ")";
     } else if (is_obj_type(OBJ_NATIVE)){
         return "native()";
+    } else if (is_obj_type(OBJ_CLASS)){
+        return "class(" + std::string(static_cast<ObjClass*>(as_obj())->name->view()) + ")";
+    } else if (is_obj_type(OBJ_INSTANCE)){
+        return "instance(" + std::string(static_cast<ObjInstance*>(as_obj())->klass()->name->view()) + ")";
+    } else if (is_obj_type(OBJ_BOUND_METHOD)){
+        return static_cast<ObjBoundMethod*>(as_obj())->method.to_string();
     }
     return "unknown_value";
 }    
 
+#ifdef AANKAA_NAN_BOXING
+bool operator==(const Value& a, const Value& b) {
+    if (a.is_number() && b.is_number()) {
+        // NaN != NaN, 0.0 == -0.0，需要按double比较
+        return a.as_number() == b.as_number();
+    }
+    if (a.is_numeric() && b.is_numeric() && a.is_integer() != b.is_integer()) {
+        // 整数和double按数值比较，1 == 1.0
+        return a.to_double() == b.to_double();
+    }
+    return a.bits == b.bits;
+}
+#else
 bool operator==(const Value& a, const Value& b) { 
     if (a.type != b.type) {
-        return false;
+        // 整数和double按数值比较，1 == 1.0
+        return a.is_numeric() && b.is_numeric() && a.to_double() == b.to_double();
     }
 
     switch (a.type) {
     case VAL_BOOL:   return a.as_bool() == b.as_bool();
     case VAL_NIL:    return true;
     case VAL_NUMBER: return a.as_number() == b.as_number();
+    case VAL_INTEGER: return a.as_integer() == b.as_integer();
     case VAL_OBJ:    return a.as_obj() == b.as_obj();
     default:         return false; // Unreachable.
     }
 
     return false;
 }
+#endif
 
 } // namespace
\ No newline at end of file
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <string>
+#include <string.h>
+#include <stdint.h>
 #include <type_traits>
 #include <iostream>
 #include "obj_type.h"
@@ -34,16 +36,134 @@ enum ValueType {
     VAL_NIL,
     VAL_NUMBER,
     VAL_INTEGER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_UNDEFINED // 内部哨兵，标记还没有定义的全局变量槽位，脚本里访问不到
 };
 
 class Obj;
 class ObjString;
 class ObjFunction;
+class ObjClosure;
 class Value;
 
 typedef Value (*NativeFn)(int arg_count, Value* args);
 
+#ifdef AANKAA_NAN_BOXING
+
+// NaN-boxing：Value只占一个64位字。
+// 非NaN的double原样保存；quiet NaN空间里的其他位用来编码别的类型：
+//   nil/false/true   QNAN | 1/2/3
+//   undefined        QNAN | 4，全局变量槽位的哨兵
+//   int32            QNAN | INTEGER_TAG | 32位补码
+//   Obj*             SIGN_BIT | QNAN | 48位指针
+// 计算产生的NaN（0x7ff8.../0xfff8...）不会和上面的编码冲突。
+class Value {
+public:
+    static constexpr uint64_t SIGN_BIT = 0x8000000000000000ULL;
+    static constexpr uint64_t QNAN = 0x7ffc000000000000ULL;
+    static constexpr uint64_t INTEGER_TAG = 0x0001000000000000ULL;
+    static constexpr uint64_t TAG_NIL = 1;
+    static constexpr uint64_t TAG_FALSE = 2;
+    static constexpr uint64_t TAG_TRUE = 3;
+    static constexpr uint64_t TAG_UNDEFINED = 4;
+    static constexpr uint64_t NIL_VAL = QNAN | TAG_NIL;
+    static constexpr uint64_t FALSE_VAL = QNAN | TAG_FALSE;
+    static constexpr uint64_t TRUE_VAL = QNAN | TAG_TRUE;
+    static constexpr uint64_t UNDEFINED_VAL = QNAN | TAG_UNDEFINED;
+
+    Value() = default;
+    Value(const Value& other) = default;
+    Value& operator=(const Value& other) = default;
+    void swap(Value& other) {
+        std::swap(bits, other.bits);
+    }
+    Value(bool v) {
+        set_bool(v);
+    }
+    Value(double v) {
+        set_number(v);
+    }
+    Value(int v) {
+        set_integer(v);
+    }
+    Value(Obj* obj);
+
+    static Value undefined() {
+        Value v;
+        v.bits = UNDEFINED_VAL;
+        return v;
+    }
+    bool is_undefined() const {
+        return bits == UNDEFINED_VAL;
+    }
+    bool is_bool() const {
+        return (bits | 1) == TRUE_VAL;
+    }
+    bool is_nil() const {
+        return bits == NIL_VAL;
+    }
+    bool is_obj() const {
+        return (bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT);
+    }
+    // 只有nil和false是假值。整数只是数值的内部表示，0和0.0一样是真值
+    bool is_falsey() const {
+        return is_nil() || bits == FALSE_VAL;
+    }
+    bool is_number() const {
+        return (bits & QNAN) != QNAN;
+    }
+    bool is_integer() const {
+        return (bits & (SIGN_BIT | QNAN | INTEGER_TAG)) == (QNAN | INTEGER_TAG);
+    }
+    bool is_numeric() const {
+        return is_number() || is_integer();
+    }
+    // 整数或者double转成double，调用前要保证is_numeric()
+    double to_double() const {
+        return is_integer() ? as_integer() : as_number();
+    }
+    bool as_bool() const {
+        return bits == TRUE_VAL;
+    }
+    double as_number() const {
+        double v;
+        memcpy(&v, &bits, sizeof(v));
+        return v;
+    }
+    int as_integer() const {
+        return static_cast<int32_t>(static_cast<uint32_t>(bits));
+    }
+    void set_bool(bool v) {
+        bits = v ? TRUE_VAL : FALSE_VAL;
+    }
+    void set_number(double v) {
+        memcpy(&bits, &v, sizeof(v));
+    }
+    void set_integer(int v) {
+        bits = QNAN | INTEGER_TAG | static_cast<uint32_t>(v);
+    }
+    void set_nil() {
+        bits = NIL_VAL;
+    }
+
+    ObjString* as_string() const;
+    Obj* as_obj() const;
+    const char* as_cstring() const;
+    ObjFunction* as_function() const;
+    ObjClosure* as_closure() const;
+    NativeFn as_native() const;
+    bool is_string() const;
+    ObjType obj_type() const;
+    bool is_obj_type(ObjType type) const;
+    void set_obj(Obj* obj);
+    std::string to_string() const;
+
+public:
+    uint64_t bits;
+};
+
+#else
+
 class Value {
 public:
     Value() = default;
@@ -77,6 +197,14 @@ public:
     }                           
     Value(Obj* obj);
 
+    static Value undefined() {
+        Value v;
+        v.type = VAL_UNDEFINED;
+        return v;
+    }
+    bool is_undefined() const {
+        return type == VAL_UNDEFINED;
+    }
     bool is_bool() const {
         return type == VAL_BOOL;
     }
@@ -86,8 +214,9 @@ public:
     bool is_obj() const {
         return type == VAL_OBJ;
     }    
+    // 只有nil和false是假值。整数只是数值的内部表示，0和0.0一样是真值
     bool is_falsey() const {
-        return is_nil() || (is_bool() && as_bool() == false) || (is_integer() && as_integer() == 0);
+        return is_nil() || (is_bool() && as_bool() == false);
     }
     bool is_number() const {
         return type == VAL_NUMBER;
@@ -95,6 +224,13 @@ public:
     bool is_integer() const {
         return type == VAL_INTEGER;
     }    
+    bool is_numeric() const {
+        return is_number() || is_integer();
+    }
+    // 整数或者double转成double，调用前要保证is_numeric()
+    double to_double() const {
+        return is_integer() ? as_integer() : as_number();
+    }
     bool as_bool() const {
         return as.boolean;
     }
@@ -112,7 +248,7 @@ public:
         as.number = v;
         type = VAL_NUMBER;
     }
-    void set_integer(double v) {
+    void set_integer(int v) {
         as.integer = v;
         type = VAL_INTEGER;
     }    
@@ -124,6 +260,7 @@ public:
     Obj* as_obj() const;
     const char* as_cstring() const;
     ObjFunction* as_function() const;
+    ObjClosure* as_closure() const;
     NativeFn as_native() const;
     bool is_string() const;
     ObjType obj_type() const;
@@ -141,6 +278,75 @@ public:
     } as;     
 };
 
+#endif
+
 bool operator==(const Value& a, const Value& b);
 
+enum class Arith {
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    DIVIDE,
+    LESS,
+    GREATER
+};
+
+// 数值运算的通用实现：两个整数按int32计算，溢出时提升为double；有一个是double时按double计算；
+// 除法的结果总是double。操作数不全是数值时返回false，由调用方拼接字符串或者报错
+template <Arith OP>
+inline bool numeric_binary(const Value& a, const Value& b, Value* result) {
+    if (a.is_integer() && b.is_integer()) {
+        int x = a.as_integer();
+        int y = b.as_integer();
+        int r = 0;
+        if constexpr (OP == Arith::ADD) {
+            *result = __builtin_add_overflow(x, y, &r) ? Value(static_cast<double>(x) + y) : Value(r);
+        } else if constexpr (OP == Arith::SUBTRACT) {
+            *result = __builtin_sub_overflow(x, y, &r) ? Value(static_cast<double>(x) - y) : Value(r);
+        } else if constexpr (OP == Arith::MULTIPLY) {
+            *result = __builtin_mul_overflow(x, y, &r) ? Value(static_cast<double>(x) * y) : Value(r);
+        } else if constexpr (OP == Arith::DIVIDE) {
+            *result = Value(static_cast<double>(x) / y);
+        } else if constexpr (OP == Arith::LESS) {
+            *result = Value(x < y);
+        } else {
+            *result = Value(x > y);
+        }
+        return true;
+    }
+    if (!a.is_numeric() || !b.is_numeric()) {
+        return false;
+    }
+    double x = a.to_double();
+    double y = b.to_double();
+    if constexpr (OP == Arith::ADD) {
+        *result = Value(x + y);
+    } else if constexpr (OP == Arith::SUBTRACT) {
+        *result = Value(x - y);
+    } else if constexpr (OP == Arith::MULTIPLY) {
+        *result = Value(x * y);
+    } else if constexpr (OP == Arith::DIVIDE) {
+        *result = Value(x / y);
+    } else if constexpr (OP == Arith::LESS) {
+        *result = Value(x < y);
+    } else {
+        *result = Value(x > y);
+    }
+    return true;
+}
+
+// 取负，INT_MIN取负溢出时提升为double
+inline bool numeric_negate(const Value& a, Value* result) {
+    if (a.is_integer()) {
+        int r = 0;
+        *result = __builtin_sub_overflow(0, a.as_integer(), &r) ? Value(-static_cast<double>(a.as_integer())) : Value(r);
+        return true;
+    }
+    if (!a.is_number()) {
+        return false;
+    }
+    *result = Value(-a.as_number());
+    return true;
+}
+
 } // namespace
\ No newline at end of file
@@ -7,9 +7,23 @@
 #include "value.h"
 #include "token.h"
 #include "object.h"
+#include "likely.h"
+#include "trace.h"
 
 namespace aankaa {
 
+// 栈帧正在执行的指令所在的行号。ip/pc已经越过了这条指令，往回退一个字节(一条指令)就落在它上面
+static int frame_line(const CallFrame* frame) {
+    const ObjFunction* function = frame->function;
+    if (frame->pc != nullptr) {
+        const RegChunk* reg_chunk = function->reg_chunk;
+        size_t instruction = frame->pc - reg_chunk->code.data();
+        return instruction > 0 ? reg_chunk->lines[instruction - 1] : 0;
+    }
+    size_t instruction = frame->ip - function->chunk->code.data();
+    return function->chunk->lines.line_for_offset(instruction > 0 ? instruction - 1 : 0);
+}
+
 void VM::runtime_error(const char* format, ...) {
     fprintf(stderr, "\n-----------------  Runtime Error -----------------\n");
     va_list args;
@@ -22,13 +36,14 @@ void VM::runtime_error(const char* format, ...) {
     for (int i = frames.frame_count() - 1; i >= 0; i--) {
         CallFrame* frame = frames.at(i);
         ObjFunction* function = frame->function;
-        size_t instruction = frame->ip - &function->chunk->code[0] - 1;
+        // 扫描器的行号从0开始，报告给用户时从1开始
+        int line = frame_line(frame) + 1;
         if (function->name == nullptr) {
-            fprintf(stderr, "#%d    script\n", idx);
-        } else if (function->name->buffer == "") {
-            fprintf(stderr, "#%d    script\n", idx);
+            fprintf(stderr, "#%d    [line %d] script\n", idx, line);
+        } else if (function->name->length == 0) {
+            fprintf(stderr, "#%d    [line %d] script\n", idx, line);
         } else {
-            fprintf(stderr, "#%d    %s()\n", idx, function->name->buffer.c_str());
+            fprintf(stderr, "#%d    [line %d] %s()\n", idx, line, function->name->chars);
         }
         idx++;
     }
@@ -39,7 +54,10 @@ void VM::runtime_error(const char* format, ...) {
 void VM::concatenate() {
     ObjString* b = peek(0).as_string();
     ObjString* a = peek(1).as_string();
-    ObjString* result = string_pool.get(a->buffer + b->buffer);
+    scratch.assign(a->chars, a->length);
+    scratch.append(b->chars, b->length);
+    // 分配可能触发回收，a和b还在栈上，不会被回收
+    ObjString* result = copy_string(scratch.data(), scratch.size(), true);
     pop();
     pop();
     push(Value(result));
@@ -52,206 +70,1020 @@ InterpretResult VM::interpret(ObjFunction* function) {
 
     //function->chunk->print();
 
+    if (function->reg_chunk != nullptr) {
+        if (!enter_register_script(function)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        return run_register();
+    }
+    if (!enter_script(function)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    return run();
+}
+
+bool VM::enter_script(ObjFunction* function) {
+    if (!ensure_frame(stack_top, function->chunk->max_stack)) {
+        return false;
+    }
     // 把main函数push进去，作用是？
     push(Value(function));
 
     CallFrame* frame = frames.new_frame();
     frame->function = function;
+    frame->closure = function;
     frame->ip = &function->chunk->code[0];
+    frame->pc = nullptr;
     frame->slots = stack_bottom;
-
-    return run();
+    return true;
 }
 
 bool VM::call_value(Value callee, int arg_count) {
     if (callee.is_obj_type(OBJ_FUNCTION)) {
-        return call(callee.as_function(), arg_count);
+        return call(callee.as_function(), arg_count, callee.as_obj());
+    }
+    if (callee.is_obj_type(OBJ_CLOSURE)) {
+        return call(callee.as_closure()->function, arg_count, callee.as_obj());
     }
     if (callee.is_obj_type(OBJ_NATIVE)) {
-        //std::cout << "obj_native ============= arg_count:" << arg_count << std::endl;
-        NativeFn native = callee.as_native();
-        Value result = native(arg_count, stack_top - arg_count);
+        Value result;
+        if (!call_native(static_cast<ObjNative*>(callee.as_obj()), arg_count, stack_top - arg_count, &result)) {
+            return false;
+        }
         stack_top -= arg_count + 1;
         push(result);
         return true;
     }
+    if (callee.is_obj_type(OBJ_CLASS)) {
+        // 创建实例替换掉类，有init时再以实例为this调用它
+        ObjClass* klass = static_cast<ObjClass*>(callee.as_obj());
+        stack_top[-arg_count - 1] = Value(allocate<ObjInstance>(klass));
+        if (klass->initializer != nullptr) {
+            return call_method(Value(klass->initializer), arg_count);
+        }
+        if (arg_count != 0) {
+            runtime_error("Expected 0 arguments but got %d.", arg_count);
+            return false;
+        }
+        return true;
+    }
+    if (callee.is_obj_type(OBJ_BOUND_METHOD)) {
+        ObjBoundMethod* bound = static_cast<ObjBoundMethod*>(callee.as_obj());
+        stack_top[-arg_count - 1] = bound->receiver;
+        return call_method(bound->method, arg_count);
+    }
     runtime_error("Can only call function");
     return false;
 }
 
-bool VM::call(ObjFunction* function, int arg_count) {
+bool VM::call_method(const Value& method, int arg_count) {
+    if (method.is_obj_type(OBJ_CLOSURE)) {
+        return call(method.as_closure()->function, arg_count, method.as_obj());
+    }
+    return call(method.as_function(), arg_count, method.as_obj());
+}
+
+bool VM::bind_method(ObjClass* klass, ObjString* name) {
+    auto iter = klass->methods.find(name);
+    if (iter == klass->methods.end()) {
+        runtime_error("Undefined property '%s'.", name->chars);
+        return false;
+    }
+    // receiver还在栈顶，分配触发回收时不会被回收
+    ObjBoundMethod* bound = allocate<ObjBoundMethod>(peek(0), iter->second);
+    stack_top[-1] = Value(bound);
+    return true;
+}
+
+bool VM::invoke_from_class(ObjClass* klass, ObjString* name, int arg_count) {
+    auto iter = klass->methods.find(name);
+    if (iter == klass->methods.end()) {
+        runtime_error("Undefined property '%s'.", name->chars);
+        return false;
+    }
+    return call_method(iter->second, arg_count);
+}
+
+PropertyCacheEntry VM::property_cache_lookup(PropertyCache* cache, Shape* shape, ObjString* name, bool for_set) {
+    // 第一个位置调用方已经检查过了
+    for (int i = 1; i < cache->count; ++i) {
+        if (cache->entries[i].shape == shape) {
+            cache->hits++;
+            return cache->entries[i];
+        }
+    }
+    cache->misses++;
+    PropertyCacheEntry entry;
+    entry.shape = shape;
+    entry.slot = shape->find(name);
+    if (entry.slot < 0 && for_set) {
+        // 新字段追加到字段数组末尾
+        entry.slot = shape->keys.size();
+        entry.transition = shape->add(name);
+    } else if (entry.slot < 0) {
+        auto iter = shape->klass->methods.find(name);
+        if (iter == shape->klass->methods.end()) {
+            // 没有这个属性，不缓存，由调用方报错
+            return entry;
+        }
+        const Value& method = iter->second;
+        entry.method = method.as_obj();
+        entry.function = method.is_obj_type(OBJ_CLOSURE) ? method.as_closure()->function : method.as_function();
+    }
+    if (cache->count < PROPERTY_CACHE_WAYS) {
+        cache->entries[cache->count++] = entry;
+    }
+    return entry;
+}
+
+bool VM::call(ObjFunction* function, int arg_count, Obj* closure) {
     //function->chunk->print();
     if (arg_count != function->arity) {
         runtime_error("Expected %d arguments but got %d.", function->arity, arg_count);
         return false;
     }
-    if (frames.frame_count() == FRAMES_MAX) {
-        runtime_error("Stack overflow");
+    if (!ensure_frame(stack_top - arg_count - 1, function->chunk->max_stack)) {
         return false;
     }
     CallFrame* frame = frames.new_frame();
     frame->function = function;
+    frame->closure = closure;
     frame->ip = &function->chunk->code[0];
+    frame->pc = nullptr;
     frame->slots = stack_top - arg_count - 1;
     return true;
 }
 
+bool VM::grow_stack(Value* frame_slots, size_t new_slots) {
+    if (frames.is_full() && !frames.grow()) {
+        runtime_error("Stack overflow");
+        return false;
+    }
+    if (frame_slots + new_slots > stack_limit) {
+        return grow_slots(frame_slots, new_slots);
+    }
+    return true;
+}
+
+bool VM::grow_slots(Value* frame_slots, size_t new_slots) {
+    if (!stack.grow(frame_slots + new_slots - stack_bottom)) {
+        runtime_error("Stack overflow");
+        return false;
+    }
+    stack_limit = stack_bottom + stack.capacity();
+    return true;
+}
+
+void VM::shrink_stack() {
+    // 栈顶之后留一些空间，下一次执行不用马上重新commit
+    stack.shrink(stack_top - stack_bottom + FRAME_SLOTS);
+    stack_limit = stack_bottom + stack.capacity();
+    frames.shrink();
+}
+
+int VM::call_cache_lookup(CallSiteCache* cache, const Value& callee, int arg_count) {
+    ObjFunction* function = nullptr;
+    if (callee.is_obj_type(OBJ_FUNCTION)) {
+        function = callee.as_function();
+    } else if (callee.is_obj_type(OBJ_CLOSURE)) {
+        // 同一个函数每次创建的闭包都不同，按函数缓存，回调类的调用点仍然是单态的
+        function = callee.as_closure()->function;
+    } else {
+        return -1;
+    }
+    for (int i = 0; i < cache->count; ++i) {
+        if (cache->functions[i] == function) {
+            return i;
+        }
+    }
+    // 没见过的函数：参数个数对得上并且还有空位时记下来，这一次仍然走通用路径
+    if (function->arity == arg_count && cache->count < CALL_CACHE_WAYS) {
+        cache->functions[cache->count] = function;
+        cache->entries[cache->count] = function->chunk->code.data();
+        cache->count++;
+    }
+    return -1;
+}
+
+void VM::make_closure(ObjFunction* function, Obj* enclosing, Value* frame_slots, Value* dst) {
+    ObjClosure* closure = allocate_closure(function);
+    *dst = Value(closure);
+    for (size_t i = 0; i < function->upvalues.size(); ++i) {
+        const UpvalueDesc& desc = function->upvalues[i];
+        Value* captured = nullptr;
+        if (!desc.is_local) {
+            // 外层函数捕获的变量，外层函数这时一定是闭包
+            captured = &static_cast<ObjClosure*>(enclosing)->captures()[desc.index];
+        } else {
+            captured = &frame_slots[desc.index];
+            if (desc.boxed && !captured->is_obj_type(OBJ_UPVALUE)) {
+                // 第一次被捕获，换成ObjUpvalue，外层函数之后通过OP_GET_LOCAL_CELL读写
+                ObjUpvalue* upvalue = allocate<ObjUpvalue>(*captured);
+                write_barrier(upvalue, upvalue->value);
+                *captured = Value(upvalue);
+            }
+        }
+        closure->captures()[i] = *captured;
+        write_barrier(closure, *captured);
+    }
+}
+
+// 函数名，脚本顶层没有名字
+static const char* function_name(const ObjFunction* function) {
+    return function->name == nullptr || function->name->length == 0 ? "script" : function->name->chars;
+}
+
+void print_call_site_stats(ObjFunction* function, std::ostream& out) {
+    Chunk* chunk = function->chunk;
+    for (size_t pos = 0; pos < chunk->code.size() && !chunk->call_site_index.empty();
+            pos += op_size(chunk->code[pos])) {
+        uint8_t op = chunk->code[pos];
+        if (op != OP_CALL && op != OP_CALL_NATIVE && op != OP_CALL_CACHED) {
+            continue;
+        }
+        const CallSiteCache* cache = chunk->call_cache(pos);
+        out << function_name(function) << "@" << pos << " [line " << chunk->lines.line_for_offset(pos) + 1
+            << "] " << op_name[op] << " hits:" << cache->hits << " misses:" << cache->misses << " targets:";
+        for (int i = 0; i < cache->count; ++i) {
+            out << (i == 0 ? "" : ",") << function_name(cache->functions[i]);
+        }
+        out << std::endl;
+    }
+    for (size_t pos = 0; pos < chunk->code.size() && !chunk->property_site_index.empty();
+            pos += op_size(chunk->code[pos])) {
+        uint8_t op = chunk->code[pos];
+        if (!is_property_site(op)) {
+            continue;
+        }
+        const PropertyCache* cache = chunk->property_cache(pos);
+        out << function_name(function) << "@" << pos << " [line " << chunk->lines.line_for_offset(pos) + 1
+            << "] " << op_name[op] << "(" << chunk->constants[chunk->name_operand(pos)].as_string()->chars
+            << ") hits:" << cache->hits << " misses:" << cache->misses << " shapes:" << cache->count << std::endl;
+    }
+    for (const Value& constant : chunk->constants) {
+        if (constant.is_obj_type(OBJ_FUNCTION)) {
+            print_call_site_stats(constant.as_function(), out);
+        }
+    }
+}
+
+void VM::print_stack(std::ostream& out) {
+    out << "    stack -> [";
+    for (Value* slot = stack_bottom; slot < stack_top; slot++) {
+        out << slot->to_string() << ",";
+    }
+    out << "]" << std::endl;
+}
+
 InterpretResult VM::run() {
+#if AANKAA_COMPUTED_GOTO
+    return run_threaded();
+#else
+    return run_switch();
+#endif
+}
+
+InterpretResult VM::run_switch() {
+    return run_loop<false>();
+}
+
+#if AANKAA_COMPUTED_GOTO
+InterpretResult VM::run_threaded() {
+    return run_loop<true>();
+}
+#endif
+
+// 每条指令执行前的调试输出和指令序列统计，只有打开AANKAA_TRACE编译时才会生成代码
+#if AANKAA_TRACE
+#define TRACE_INSTRUCTION() \
+    do { \
+        if (trace_enabled(TRACE_EXEC)) { \
+            print_stack(std::cerr); \
+            std::cerr << "[exec] " << op_name[*frame->ip] << std::endl; \
+        } \
+        if (unlikely(profiler != nullptr)) { \
+            profiler->record(*frame->ip); \
+        } \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do {} while (false)
+#endif
+
+// TARGET(op)同时生成switch的case和threaded dispatch的跳转标签，两种分发方式共用一份handler代码。
+// DISPATCH()在handler末尾执行：threaded模式下按下一条指令的opcode直接间接跳转，
+// 每个handler都有自己的间接跳转指令，分支预测器可以按opcode学习跳转规律；
+// switch模式下回到循环顶部，由唯一的一个switch跳转分发。
+// THREADED是编译期常量，用普通的if让两个分支都实例化，dispatch_loop标签在两个实例里都被引用，
+// 不会产生unused-label警告；不成立的分支编译器直接丢掉。
+#if AANKAA_COMPUTED_GOTO
+#define TARGET(op) case op: L_##op
+#define DISPATCH() \
+    do { \
+        if (THREADED) { \
+            TRACE_INSTRUCTION(); \
+            goto *dispatch_table[READ_BYTE()]; \
+        } else { \
+            goto dispatch_loop; \
+        } \
+    } while (false)
+#else
+#define TARGET(op) case op
+#define DISPATCH() goto dispatch_loop
+#endif
+
+template <bool THREADED>
+InterpretResult VM::run_loop() {
     CallFrame* frame = frames.current_frame();
     //std::cout << "    change frame to -> " << frame << std::endl;
 
-    for (;;) {
-        std::cout << "    stack -> [";
-        for (Value* slot = stack_bottom; slot < stack_top; slot++) {
-            std::cout << slot->to_string() << ",";
-        }
-        printf("]\n");
-
-        uint8_t instruction = READ_BYTE();
-
-        std::cout << ">>>>>>>>>> " << op_name[instruction] << std::endl;
-
-        switch(instruction) {
-        case OP_CONSTANT: {
-            Value constant = READ_CONSTANT();
-            push(constant);
-            break;
-        }
-        case OP_NIL:  push(Value(nullptr)); break;
-        case OP_TRUE:  push(Value(true)); break;
-        case OP_FALSE:  push(Value(false)); break;   
-        case OP_POP:  pop();  break;
-        case OP_PRINT: 
-            std::cout << pop().to_string() << std::endl;
-            break;        
-        case OP_ADD: {
-            if (peek(0).is_string() && peek(1).is_string()) {
-                concatenate();
-            } else if (peek(0).is_number() && peek(1).is_number()) {
-                double b = pop().as_number();
-                double a = pop().as_number();
-                push(Value(a + b));
-            } else if (peek(0).is_integer() && peek(1).is_integer()) {
-                int b = pop().as_integer();
-                int a = pop().as_integer();
-                push(Value(a + b));
-            } else {
-                runtime_error(
-                    "Operands must be two numbers or two strings.");
+#if AANKAA_COMPUTED_GOTO
+    // 下标必须和OpCode一一对应，新增opcode时要同步修改这里
+    static void* dispatch_table[] = {
+        [OP_CONSTANT] = &&L_OP_CONSTANT,
+        [OP_NIL] = &&L_OP_NIL,
+        [OP_TRUE] = &&L_OP_TRUE,
+        [OP_FALSE] = &&L_OP_FALSE,
+        [OP_POP] = &&L_OP_POP,
+        [OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&L_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE] = &&L_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&L_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY] = &&L_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&L_OP_SET_PROPERTY,
+        [OP_GET_SUPER] = &&L_OP_GET_SUPER,
+        [OP_EQUAL] = &&L_OP_EQUAL,
+        [OP_GREATER] = &&L_OP_GREATER,
+        [OP_LESS] = &&L_OP_LESS,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUBTRACT] = &&L_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&L_OP_MULTIPLY,
+        [OP_DIVIDE] = &&L_OP_DIVIDE,
+        [OP_NOT] = &&L_OP_NOT,
+        [OP_NEGATE] = &&L_OP_NEGATE,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&L_OP_LOOP,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_INVOKE] = &&L_OP_INVOKE,
+        [OP_SUPER_INVOKE] = &&L_OP_SUPER_INVOKE,
+        [OP_CLOSURE] = &&L_OP_CLOSURE,
+        [OP_RETURN] = &&L_OP_RETURN,
+        [OP_CLASS] = &&L_OP_CLASS,
+        [OP_INHERIT] = &&L_OP_INHERIT,
+        [OP_METHOD] = &&L_OP_METHOD,
+        [OP_ADD_LOCAL_CONST] = &&L_OP_ADD_LOCAL_CONST,
+        [OP_INC_LOCAL] = &&L_OP_INC_LOCAL,
+        [OP_LESS_LOCAL_CONST_JUMP] = &&L_OP_LESS_LOCAL_CONST_JUMP,
+        [OP_ADD_INT] = &&L_OP_ADD_INT,
+        [OP_ADD_NUM] = &&L_OP_ADD_NUM,
+        [OP_SUBTRACT_INT] = &&L_OP_SUBTRACT_INT,
+        [OP_SUBTRACT_NUM] = &&L_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_INT] = &&L_OP_MULTIPLY_INT,
+        [OP_MULTIPLY_NUM] = &&L_OP_MULTIPLY_NUM,
+        [OP_LESS_INT] = &&L_OP_LESS_INT,
+        [OP_LESS_NUM] = &&L_OP_LESS_NUM,
+        [OP_GREATER_INT] = &&L_OP_GREATER_INT,
+        [OP_GREATER_NUM] = &&L_OP_GREATER_NUM,
+        [OP_CONSTANT_LONG] = &&L_OP_CONSTANT_LONG,
+        [OP_GET_GLOBAL_LONG] = &&L_OP_GET_GLOBAL_LONG,
+        [OP_DEFINE_GLOBAL_LONG] = &&L_OP_DEFINE_GLOBAL_LONG,
+        [OP_SET_GLOBAL_LONG] = &&L_OP_SET_GLOBAL_LONG,
+        [OP_JUMP_LONG] = &&L_OP_JUMP_LONG,
+        [OP_JUMP_IF_FALSE_LONG] = &&L_OP_JUMP_IF_FALSE_LONG,
+        [OP_LOOP_LONG] = &&L_OP_LOOP_LONG,
+        [OP_CALL_NATIVE] = &&L_OP_CALL_NATIVE,
+        [OP_CALL_CACHED] = &&L_OP_CALL_CACHED,
+        [OP_TAIL_CALL] = &&L_OP_TAIL_CALL,
+        [OP_GET_UPVALUE_CELL] = &&L_OP_GET_UPVALUE_CELL,
+        [OP_GET_LOCAL_CELL] = &&L_OP_GET_LOCAL_CELL,
+        [OP_SET_LOCAL_CELL] = &&L_OP_SET_LOCAL_CELL,
+        [OP_CLOSURE_LONG] = &&L_OP_CLOSURE_LONG,
+        [OP_GET_PROPERTY_LONG] = &&L_OP_GET_PROPERTY_LONG,
+        [OP_SET_PROPERTY_LONG] = &&L_OP_SET_PROPERTY_LONG,
+        [OP_GET_SUPER_LONG] = &&L_OP_GET_SUPER_LONG,
+        [OP_INVOKE_LONG] = &&L_OP_INVOKE_LONG,
+        [OP_SUPER_INVOKE_LONG] = &&L_OP_SUPER_INVOKE_LONG,
+        [OP_CLASS_LONG] = &&L_OP_CLASS_LONG,
+        [OP_METHOD_LONG] = &&L_OP_METHOD_LONG,
+    };
+#endif
+    // 名字指令的短格式和宽格式只是常量下标的宽度不同：读完名字后跳到共用的handler。
+    // prop_site是指令的起始位置，属性缓存按它查找
+    ObjString* prop_name = nullptr;
+    const uint8_t* prop_site = nullptr;
+
+dispatch_loop:
+    TRACE_INSTRUCTION();
+    switch (READ_BYTE()) {
+    TARGET(OP_CONSTANT): {
+        Value constant = READ_CONSTANT();
+        push(constant);
+        DISPATCH();
+    }
+    TARGET(OP_CONSTANT_LONG): {
+        Value constant = frame->function->chunk->constants[READ_LONG()];
+        push(constant);
+        DISPATCH();
+    }
+    TARGET(OP_NIL):  push(Value(nullptr)); DISPATCH();
+    TARGET(OP_TRUE):  push(Value(true)); DISPATCH();
+    TARGET(OP_FALSE):  push(Value(false)); DISPATCH();
+    TARGET(OP_POP):  pop(); DISPATCH();
+    TARGET(OP_PRINT):
+        std::cout << pop().to_string() << std::endl;
+        DISPATCH();
+    TARGET(OP_ADD): {
+        if (peek(0).is_integer() && peek(1).is_integer()) {
+            frame->ip[-1] = OP_ADD_INT;
+        } else if (peek(0).is_number() && peek(1).is_number()) {
+            frame->ip[-1] = OP_ADD_NUM;
+        }
+        if (!add_slow()) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        DISPATCH();
+    }
+    TARGET(OP_GREATER):  QUICKEN_BINARY_OP(Arith::GREATER, OP_GREATER_INT, OP_GREATER_NUM); DISPATCH();
+    TARGET(OP_LESS):     QUICKEN_BINARY_OP(Arith::LESS, OP_LESS_INT, OP_LESS_NUM); DISPATCH();
+    TARGET(OP_SUBTRACT): QUICKEN_BINARY_OP(Arith::SUBTRACT, OP_SUBTRACT_INT, OP_SUBTRACT_NUM); DISPATCH();
+    TARGET(OP_MULTIPLY): QUICKEN_BINARY_OP(Arith::MULTIPLY, OP_MULTIPLY_INT, OP_MULTIPLY_NUM); DISPATCH();
+    TARGET(OP_DIVIDE): {
+        Value result;
+        if (!numeric_binary<Arith::DIVIDE>(peek(1), peek(0), &result)) {
+            runtime_error("Operands must be two numbers or two strings.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        stack_top[-2] = result;
+        stack_top--;
+        DISPATCH();
+    }
+    TARGET(OP_ADD_INT):      INT_ARITH_OP(__builtin_add_overflow, OP_ADD); DISPATCH();
+    TARGET(OP_SUBTRACT_INT): INT_ARITH_OP(__builtin_sub_overflow, OP_SUBTRACT); DISPATCH();
+    TARGET(OP_MULTIPLY_INT): INT_ARITH_OP(__builtin_mul_overflow, OP_MULTIPLY); DISPATCH();
+    TARGET(OP_LESS_INT):     TYPED_BINARY_OP(is_integer, as_integer, <, OP_LESS); DISPATCH();
+    TARGET(OP_GREATER_INT):  TYPED_BINARY_OP(is_integer, as_integer, >, OP_GREATER); DISPATCH();
+    TARGET(OP_ADD_NUM):      TYPED_BINARY_OP(is_number, as_number, +, OP_ADD); DISPATCH();
+    TARGET(OP_SUBTRACT_NUM): TYPED_BINARY_OP(is_number, as_number, -, OP_SUBTRACT); DISPATCH();
+    TARGET(OP_MULTIPLY_NUM): TYPED_BINARY_OP(is_number, as_number, *, OP_MULTIPLY); DISPATCH();
+    TARGET(OP_LESS_NUM):     TYPED_BINARY_OP(is_number, as_number, <, OP_LESS); DISPATCH();
+    TARGET(OP_GREATER_NUM):  TYPED_BINARY_OP(is_number, as_number, >, OP_GREATER); DISPATCH();
+    TARGET(OP_EQUAL): {
+        Value b = pop();
+        Value a = pop();
+        push(Value(a == b));
+        DISPATCH();
+    }
+    TARGET(OP_NOT):
+        push(Value(pop().is_falsey()));
+        DISPATCH();
+    TARGET(OP_NEGATE):
+        if (!numeric_negate(peek(0), &stack_top[-1])) {
+            runtime_error("Operand must be a number.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        DISPATCH();
+    TARGET(OP_GET_LOCAL): {
+        uint8_t slot = READ_BYTE();
+        push(frame->slots[slot]);
+        DISPATCH();
+    }
+    TARGET(OP_SET_LOCAL): {
+        uint8_t slot = READ_BYTE();
+        frame->slots[slot] = peek(0);
+        DISPATCH();
+    }
+    TARGET(OP_GET_LOCAL_CELL): {
+        // 还没有闭包捕获过它时，值仍然直接在槽位里
+        const Value& slot = frame->slots[READ_BYTE()];
+        push(slot.is_obj_type(OBJ_UPVALUE) ? static_cast<ObjUpvalue*>(slot.as_obj())->value : slot);
+        DISPATCH();
+    }
+    TARGET(OP_SET_LOCAL_CELL): {
+        Value& slot = frame->slots[READ_BYTE()];
+        if (slot.is_obj_type(OBJ_UPVALUE)) {
+            ObjUpvalue* upvalue = static_cast<ObjUpvalue*>(slot.as_obj());
+            upvalue->value = peek(0);
+            write_barrier(upvalue, upvalue->value);
+        } else {
+            slot = peek(0);
+        }
+        DISPATCH();
+    }
+    TARGET(OP_GET_UPVALUE): {
+        ObjClosure* closure = static_cast<ObjClosure*>(frame->closure);
+        push(closure->captures()[READ_BYTE()]);
+        DISPATCH();
+    }
+    TARGET(OP_GET_UPVALUE_CELL): {
+        ObjClosure* closure = static_cast<ObjClosure*>(frame->closure);
+        push(static_cast<ObjUpvalue*>(closure->captures()[READ_BYTE()].as_obj())->value);
+        DISPATCH();
+    }
+    TARGET(OP_SET_UPVALUE): {
+        ObjClosure* closure = static_cast<ObjClosure*>(frame->closure);
+        ObjUpvalue* upvalue = static_cast<ObjUpvalue*>(closure->captures()[READ_BYTE()].as_obj());
+        upvalue->value = peek(0);
+        write_barrier(upvalue, upvalue->value);
+        DISPATCH();
+    }
+    TARGET(OP_CLOSURE): {
+        ObjFunction* function = READ_CONSTANT().as_function();
+        push(Value(nullptr));
+        make_closure(function, frame->closure, frame->slots, stack_top - 1);
+        DISPATCH();
+    }
+    TARGET(OP_CLOSURE_LONG): {
+        ObjFunction* function = frame->function->chunk->constants[READ_LONG()].as_function();
+        push(Value(nullptr));
+        make_closure(function, frame->closure, frame->slots, stack_top - 1);
+        DISPATCH();
+    }
+    TARGET(OP_CLASS):
+        push(Value(allocate<ObjClass>(READ_NAME())));
+        DISPATCH();
+    TARGET(OP_CLASS_LONG):
+        push(Value(allocate<ObjClass>(READ_NAME_LONG())));
+        DISPATCH();
+    TARGET(OP_INHERIT): {
+        Value superclass = peek(1);
+        if (unlikely(!superclass.is_obj_type(OBJ_CLASS))) {
+            runtime_error("Superclass must be a class.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        // 父类的方法复制下来，之后子类的方法覆盖同名的方法，查找方法时不用沿着继承链往上找
+        ObjClass* subclass = static_cast<ObjClass*>(peek(0).as_obj());
+        subclass->methods = static_cast<ObjClass*>(superclass.as_obj())->methods;
+        subclass->initializer = static_cast<ObjClass*>(superclass.as_obj())->initializer;
+        pop();
+        DISPATCH();
+    }
+    TARGET(OP_METHOD_LONG):
+        prop_name = READ_NAME_LONG();
+        goto method;
+    TARGET(OP_METHOD):
+        prop_name = READ_NAME();
+    method: {
+        ObjString* name = prop_name;
+        ObjClass* klass = static_cast<ObjClass*>(peek(1).as_obj());
+        klass->methods[name] = peek(0);
+        if (name->length == 4 && memcmp(name->chars, "init", 4) == 0) {
+            klass->initializer = peek(0).as_obj();
+        }
+        pop();
+        DISPATCH();
+    }
+    TARGET(OP_GET_PROPERTY_LONG):
+        prop_site = frame->ip - 1;
+        prop_name = READ_NAME_LONG();
+        goto get_property;
+    TARGET(OP_GET_PROPERTY):
+        prop_site = frame->ip - 1;
+        prop_name = READ_NAME();
+    get_property: {
+        ObjString* name = prop_name;
+        Value receiver = peek(0);
+        if (unlikely(!receiver.is_obj_type(OBJ_INSTANCE))) {
+            runtime_error("Only instances have properties.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjInstance* instance = static_cast<ObjInstance*>(receiver.as_obj());
+        Chunk* chunk = frame->function->chunk;
+        if (unlikely(chunk->property_site_index.empty())) {
+            chunk->build_property_caches();
+        }
+        PropertyCache* cache = chunk->property_cache(prop_site - chunk->code.data());
+        const PropertyCacheEntry* entry = &cache->entries[0];
+        PropertyCacheEntry resolved;
+        if (likely(entry->shape == instance->shape)) {
+            cache->hits++;
+        } else {
+            resolved = property_cache_lookup(cache, instance->shape, name, false);
+            entry = &resolved;
+        }
+        if (likely(entry->slot >= 0)) {
+            stack_top[-1] = instance->fields[entry->slot];
+            DISPATCH();
+        }
+        if (entry->method != nullptr) {
+            // 方法的值没有被直接调用，绑定receiver
+            stack_top[-1] = Value(allocate<ObjBoundMethod>(receiver, Value(entry->method)));
+            DISPATCH();
+        }
+        runtime_error("Undefined property '%s'.", name->chars);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    TARGET(OP_SET_PROPERTY_LONG):
+        prop_site = frame->ip - 1;
+        prop_name = READ_NAME_LONG();
+        goto set_property;
+    TARGET(OP_SET_PROPERTY):
+        prop_site = frame->ip - 1;
+        prop_name = READ_NAME();
+    set_property: {
+        ObjString* name = prop_name;
+        Value receiver = peek(1);
+        if (unlikely(!receiver.is_obj_type(OBJ_INSTANCE))) {
+            runtime_error("Only instances have fields.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjInstance* instance = static_cast<ObjInstance*>(receiver.as_obj());
+        Chunk* chunk = frame->function->chunk;
+        if (unlikely(chunk->property_site_index.empty())) {
+            chunk->build_property_caches();
+        }
+        PropertyCache* cache = chunk->property_cache(prop_site - chunk->code.data());
+        const PropertyCacheEntry* entry = &cache->entries[0];
+        PropertyCacheEntry resolved;
+        if (likely(entry->shape == instance->shape)) {
+            cache->hits++;
+        } else {
+            resolved = property_cache_lookup(cache, instance->shape, name, true);
+            entry = &resolved;
+        }
+        const Value& value = stack_top[-1];
+        if (entry->transition != nullptr) {
+            // 新字段：追加到字段数组末尾，实例换到下一个shape
+            instance->fields.push_back(value);
+            instance->shape = entry->transition;
+            ObjClass* klass = instance->klass();
+            if (klass->field_hint < instance->fields.size()) {
+                klass->field_hint = instance->fields.size();
+            }
+        } else {
+            instance->fields[entry->slot] = value;
+        }
+        write_barrier(instance, value);
+        stack_top[-2] = value;
+        stack_top--;
+        DISPATCH();
+    }
+    TARGET(OP_GET_SUPER_LONG):
+        prop_name = READ_NAME_LONG();
+        goto get_super;
+    TARGET(OP_GET_SUPER):
+        prop_name = READ_NAME();
+    get_super: {
+        ObjClass* superclass = static_cast<ObjClass*>(pop().as_obj());
+        if (!bind_method(superclass, prop_name)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        DISPATCH();
+    }
+    TARGET(OP_INVOKE_LONG):
+        prop_site = frame->ip - 1;
+        prop_name = READ_NAME_LONG();
+        goto invoke;
+    TARGET(OP_INVOKE):
+        prop_site = frame->ip - 1;
+        prop_name = READ_NAME();
+    invoke: {
+        ObjString* name = prop_name;
+        int arg_count = READ_BYTE();
+        Value receiver = peek(arg_count);
+        if (unlikely(!receiver.is_obj_type(OBJ_INSTANCE))) {
+            runtime_error("Only instances have methods.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjInstance* instance = static_cast<ObjInstance*>(receiver.as_obj());
+        Chunk* chunk = frame->function->chunk;
+        if (unlikely(chunk->property_site_index.empty())) {
+            chunk->build_property_caches();
+        }
+        PropertyCache* cache = chunk->property_cache(prop_site - chunk->code.data());
+        const PropertyCacheEntry* entry = &cache->entries[0];
+        PropertyCacheEntry resolved;
+        if (likely(entry->shape == instance->shape)) {
+            cache->hits++;
+        } else {
+            resolved = property_cache_lookup(cache, instance->shape, name, false);
+            entry = &resolved;
+        }
+        if (likely(entry->function != nullptr)) {
+            // 方法：receiver留在0号槽位作为this，不创建绑定方法，直接建立栈帧
+            ObjFunction* function = entry->function;
+            if (unlikely(function->arity != arg_count)) {
+                runtime_error("Expected %d arguments but got %d.", function->arity, arg_count);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
-        }
-        case OP_GREATER:  BINARY_OP(>); break;
-        case OP_LESS:     BINARY_OP(<); break;            
-        case OP_SUBTRACT: BINARY_OP(-); break;        
-        case OP_DIVIDE:   BINARY_OP(/); break;
-        case OP_MULTIPLY: BINARY_OP(*); break;
-        case OP_EQUAL: {
-            Value b = pop();
-            Value a = pop();
-            push(Value(a == b));
-            break;
-        }
-        case OP_NEGATE:
-            if (!peek(0).is_number()) {
-                runtime_error("Operand must be a number.");
+            Value* slots = stack_top - arg_count - 1;
+            if (unlikely(!ensure_frame(slots, function->chunk->max_stack))) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(Value(-pop().as_number()));
-            break;        
-        case OP_GET_LOCAL: {
-            uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
-            break;
-        }
-        case OP_SET_LOCAL: {
-            uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
-            break;
-        }
-        case OP_GET_GLOBAL: {
-            ObjString* name = READ_CONSTANT().as_string();
-            auto iter = globals.find(name->buffer);
-            if (iter == globals.end()) {
-                runtime_error("Undefined variable '%s'.", name->buffer.c_str());
+            Obj* method = entry->method;
+            frame = frames.new_frame();
+            frame->function = function;
+            frame->closure = method;
+            frame->ip = function->chunk->code.data();
+            frame->pc = nullptr;
+            frame->slots = slots;
+            DISPATCH();
+        }
+        if (entry->slot >= 0) {
+            // 字段里存的函数，按普通的值调用
+            Value field = instance->fields[entry->slot];
+            stack_top[-arg_count - 1] = field;
+            if (!call_value(field, arg_count)) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(iter->second);
-            break;
+            frame = frames.current_frame();
+            DISPATCH();
         }
-        case OP_DEFINE_GLOBAL: {
-            ObjString* name = READ_CONSTANT().as_string();
-            globals[name->buffer] = peek(0);
-            pop();
-            break;
+        runtime_error("Undefined property '%s'.", name->chars);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    TARGET(OP_SUPER_INVOKE_LONG):
+        prop_name = READ_NAME_LONG();
+        goto super_invoke;
+    TARGET(OP_SUPER_INVOKE):
+        prop_name = READ_NAME();
+    super_invoke: {
+        int arg_count = READ_BYTE();
+        ObjClass* superclass = static_cast<ObjClass*>(pop().as_obj());
+        if (!invoke_from_class(superclass, prop_name, arg_count)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = frames.current_frame();
+        DISPATCH();
+    }
+    TARGET(OP_GET_GLOBAL):      GET_GLOBAL_OP(READ_BYTE()); DISPATCH();
+    TARGET(OP_GET_GLOBAL_LONG): GET_GLOBAL_OP(READ_LONG()); DISPATCH();
+    TARGET(OP_DEFINE_GLOBAL):      globals.values[READ_BYTE()] = pop(); DISPATCH();
+    TARGET(OP_DEFINE_GLOBAL_LONG): globals.values[READ_LONG()] = pop(); DISPATCH();
+    TARGET(OP_SET_GLOBAL):      SET_GLOBAL_OP(READ_BYTE()); DISPATCH();
+    TARGET(OP_SET_GLOBAL_LONG): SET_GLOBAL_OP(READ_LONG()); DISPATCH();
+    TARGET(OP_JUMP_IF_FALSE): {
+        uint16_t offset = READ_SHORT();
+        if (peek(0).is_falsey()) {
+            frame->ip += offset;
+        }
+        DISPATCH();
+    }
+    TARGET(OP_JUMP_IF_FALSE_LONG): {
+        uint32_t offset = READ_LONG();
+        if (peek(0).is_falsey()) {
+            frame->ip += offset;
         }
-        case OP_SET_GLOBAL: {
-            ObjString* name = READ_CONSTANT().as_string();
-            auto iter = globals.find(name->buffer);
-            if (iter == globals.end()) {
-                runtime_error("Undefined variable '%s'.", name->buffer.c_str());
+        DISPATCH();
+    }
+    TARGET(OP_JUMP): {
+        uint16_t offset = READ_SHORT();
+        frame->ip += offset;
+        DISPATCH();
+    }
+    TARGET(OP_JUMP_LONG): {
+        uint32_t offset = READ_LONG();
+        frame->ip += offset;
+        DISPATCH();
+    }
+    TARGET(OP_LOOP): {
+        uint16_t offset = READ_SHORT();
+        frame->ip -= offset;
+        DISPATCH();
+    }
+    TARGET(OP_LOOP_LONG): {
+        uint32_t offset = READ_LONG();
+        frame->ip -= offset;
+        DISPATCH();
+    }
+    TARGET(OP_CALL): {
+        int arg_count = READ_BYTE();
+        // 调用的是原生函数时改写成OP_CALL_NATIVE，下次执行跳过通用的类型分派；
+        // 调用的是脚本函数时改写成OP_CALL_CACHED重新执行，由它填充调用点缓存
+        if (peek(arg_count).is_obj_type(OBJ_NATIVE)) {
+            frame->ip[-2] = OP_CALL_NATIVE;
+        } else if (peek(arg_count).is_obj_type(OBJ_FUNCTION) || peek(arg_count).is_obj_type(OBJ_CLOSURE)) {
+            Chunk* chunk = frame->function->chunk;
+            if (chunk->call_site_index.empty()) {
+                chunk->build_call_caches();
+            }
+            frame->ip[-2] = OP_CALL_CACHED;
+            frame->ip -= 2;
+            DISPATCH();
+        }
+        if (!call_value(peek(arg_count), arg_count)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        // call_value成功，增加了一个新的frame，当前的frame需要更新一下
+        frame = frames.current_frame();
+        //std::cout << "    change frame to -> " << frame << std::endl;
+        DISPATCH();
+    }
+    TARGET(OP_CALL_NATIVE): {
+        int arg_count = READ_BYTE();
+        const Value& callee = peek(arg_count);
+        if (unlikely(!callee.is_obj_type(OBJ_NATIVE))) {
+            // 同一个调用点换成了别的函数，改写回OP_CALL重新执行
+            frame->ip[-2] = OP_CALL;
+            frame->ip -= 2;
+            DISPATCH();
+        }
+        Value* args = stack_top - arg_count;
+        if (unlikely(!call_native(static_cast<ObjNative*>(callee.as_obj()), arg_count, args, &args[-1]))) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        stack_top = args;
+        DISPATCH();
+    }
+    TARGET(OP_CALL_CACHED): {
+        int arg_count = READ_BYTE();
+        Value callee = peek(arg_count);
+        Chunk* chunk = frame->function->chunk;
+        CallSiteCache* cache = chunk->call_cache(frame->ip - 2 - chunk->code.data());
+        int way = 0;
+        if (unlikely(!callee.is_obj() || callee.as_obj() != cache->functions[0])) {
+            way = call_cache_lookup(cache, callee, arg_count);
+        }
+        if (likely(way >= 0)) {
+            // 命中：缓存里的函数参数个数一定对得上，直接建立栈帧
+            cache->hits++;
+            Value* slots = stack_top - arg_count - 1;
+            if (unlikely(!ensure_frame(slots, cache->functions[way]->chunk->max_stack))) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            iter->second = peek(0);
-
-            break;
+            frame = frames.new_frame();
+            frame->function = cache->functions[way];
+            frame->closure = callee.as_obj();
+            frame->ip = cache->entries[way];
+            frame->pc = nullptr;
+            frame->slots = slots;
+            DISPATCH();
+        }
+        cache->misses++;
+        if (!call_value(callee, arg_count)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_JUMP_IF_FALSE: {
-            uint16_t offset = READ_SHORT();
-            if (peek(0).is_falsey()) {
-                frame->ip += offset;
+        frame = frames.current_frame();
+        DISPATCH();
+    }
+    TARGET(OP_TAIL_CALL): {
+        int arg_count = READ_BYTE();
+        Value callee = peek(arg_count);
+        ObjFunction* function = nullptr;
+        if (likely(callee.is_obj_type(OBJ_FUNCTION))) {
+            function = callee.as_function();
+        } else if (callee.is_obj_type(OBJ_CLOSURE)) {
+            function = callee.as_closure()->function;
+        } else {
+            // 原生函数没有栈帧可以复用，类和绑定方法的0号槽位要换成this，都按普通调用执行，
+            // 结果由后面的OP_RETURN返回
+            if (!call_value(callee, arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            frame = frames.current_frame();
+            DISPATCH();
         }
-        case OP_JUMP: {
-            uint16_t offset = READ_SHORT();
-            frame->ip += offset;
-            break;
+        if (unlikely(function->arity != arg_count)) {
+            runtime_error("Expected %d arguments but got %d.", function->arity, arg_count);
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        // 被调函数和参数挪到当前栈帧的底部，当前函数的局部变量就此作废。
+        // 被调函数用的栈可能比当前函数多，按它的max_stack再检查一次
+        if (unlikely(!ensure_slots(frame->slots, function->chunk->max_stack))) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_LOOP: {
-            uint16_t offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
+        Value* args = stack_top - arg_count - 1;
+        for (int i = 0; i <= arg_count; ++i) {
+            frame->slots[i] = args[i];
+        }
+        stack_top = frame->slots + arg_count + 1;
+        frame->function = function;
+        frame->closure = callee.as_obj();
+        frame->ip = function->chunk->code.data();
+        DISPATCH();
+    }
+    TARGET(OP_RETURN): {
+        Value result = pop();
+        frames.destroy_frame();
+        if (frames.frame_count() == 0) {
+            // main函数
+            pop();
+            return INTERPRET_OK;
         }
-        case OP_CALL: {
-            int arg_count = READ_BYTE();
-            if (!call_value(peek(arg_count), arg_count)) {
+        // 非main函数，上一个frame的栈底变成栈顶了，相当于作废了上一个frame
+        stack_top = frame->slots;
+        push(result);
+        frame = frames.current_frame();
+        //std::cout << "    change frame to -> " << frame << std::endl;
+        DISPATCH();
+    }
+    TARGET(OP_ADD_LOCAL_CONST): {
+        const Value& a = frame->slots[READ_BYTE()];
+        const Value& b = READ_CONSTANT();
+        Value result;
+        if (likely(numeric_binary<Arith::ADD>(a, b, &result))) {
+            push(result);
+        } else {
+            push(a);
+            push(b);
+            if (!add_slow()) {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            // call_value成功，增加了一个新的frame，当前的frame需要更新一下
-            frame = frames.current_frame();
-            //std::cout << "    change frame to -> " << frame << std::endl;
-            break;
-        }
-        case OP_RETURN: {
-            Value result = pop();
-            frames.destroy_frame();
-            if (frames.frame_count() == 0) {
-                // main函数
-                pop();
-                return INTERPRET_OK;
+        }
+        DISPATCH();
+    }
+    TARGET(OP_INC_LOCAL): {
+        Value& a = frame->slots[READ_BYTE()];
+        const Value& b = READ_CONSTANT();
+        int r;
+        // 循环计数器通常是整数
+        if (likely(a.is_integer() && b.is_integer()
+                   && !__builtin_add_overflow(a.as_integer(), b.as_integer(), &r))) {
+            a = Value(r);
+        } else if (!numeric_binary<Arith::ADD>(a, b, &a)) {
+            push(a);
+            push(b);
+            if (!add_slow()) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            // 非main函数，上一个frame的栈底变成栈顶了，相当于作废了上一个frame
-            stack_top = frame->slots;
-            push(result);
-            frame = frames.current_frame();
-            //std::cout << "    change frame to -> " << frame << std::endl;
-            break;
+            a = pop();
         }
-        default:
-            break;         
+        DISPATCH();
+    }
+    TARGET(OP_LESS_LOCAL_CONST_JUMP): {
+        const Value& a = frame->slots[READ_BYTE()];
+        const Value& b = READ_CONSTANT();
+        uint16_t offset = READ_SHORT();
+        bool less;
+        if (likely(a.is_integer() && b.is_integer())) {
+            less = a.as_integer() < b.as_integer();
+        } else if (likely(a.is_numeric() && b.is_numeric())) {
+            less = a.to_double() < b.to_double();
+        } else {
+            runtime_error("Operands must be two numbers or two strings.");
+            return INTERPRET_RUNTIME_ERROR;
         }
+        // 条件成立时融合掉的pop正好抵消less的结果；不成立时跳转目标处的pop需要弹出false
+        if (!less) {
+            push(Value(false));
+            frame->ip += offset;
+        }
+        DISPATCH();
+    }
+    default:
+        runtime_error("Unknown opcode %d.", frame->ip[-1]);
+        return INTERPRET_RUNTIME_ERROR;
     }
 }
 
-void VM::define_native(const char* name, NativeFn function) {
-    ObjString* obj_str = string_pool.get(name);
+#undef TARGET
+#undef DISPATCH
+#undef TRACE_INSTRUCTION
+
+// 栈顶两个值相加的通用实现：字符串拼接，以及整数、double和混合类型的数值相加
+bool VM::add_slow() {
+    if (peek(0).is_string() && peek(1).is_string()) {
+        concatenate();
+    } else if (numeric_binary<Arith::ADD>(peek(1), peek(0), &stack_top[-2])) {
+        stack_top--;
+    } else {
+        runtime_error(
+            "Operands must be two numbers or two strings.");
+        return false;
+    }
+    return true;
+}
+
+ObjString* VM::copy_string(const char* chars, int length, bool young) {
+    uint32_t hash = hash_string(chars, length);
+    ObjString* interned = strings.find(chars, length, hash);
+    if (interned != nullptr) {
+        return interned;
+    }
+    ObjString* str = allocate_string(chars, length, hash, young);
+    strings.insert(str);
+    return str;
+}
+
+int VM::find_global(const std::string& name) {
+    ObjString* interned = strings.find(name.data(), name.size(), hash_string(name.data(), name.size()));
+    return interned == nullptr ? -1 : globals.find(interned);
+}
+
+bool VM::get_global(const std::string& name, Value* value) {
+    int slot = find_global(name);
+    if (slot < 0 || globals.values[slot].is_undefined()) {
+        return false;
+    }
+    *value = globals.values[slot];
+    return true;
+}
+
+ObjNative* VM::define_native(const char* name, NativeFn function, int arity) {
+    ObjString* obj_str = copy_string(name, strlen(name));
     push(Value(obj_str));
-    push(Value(native_pool.get(function)));
-    globals.emplace(std::string(name), stack_bottom[1]);
+    ObjNative* native = allocate<ObjNative>(function);
+    native->name = obj_str;
+    native->arity = arity;
+    push(Value(native));
+    globals.define(obj_str, stack_top[-1]);
     pop();
     pop();
+    return native;
 }
 
 
@@ -7,17 +7,41 @@
 #include <unordered_map>
 #include <chrono>
 #include <thread>
+#include <tuple>
 
 #include "value.h"
 #include "chunk.h"
+#include "reg_chunk.h"
 #include "object.h"
 #include "pool.h"
+#include "globals.h"
+#include "table.h"
+#include "gc.h"
+#include "profiler.h"
+#include "stack_region.h"
+#include "native.h"
+#include "likely.h"
 
 namespace aankaa {
 
+// 解释器主循环的分发方式在编译期选择：
+// GCC/Clang支持labels-as-values，每个opcode的handler末尾直接跳转到下一个handler（threaded dispatch），
+// 其他编译器回退到可移植的switch循环。可以通过 -DAANKAA_COMPUTED_GOTO=0 强制使用switch。
+#ifndef AANKAA_COMPUTED_GOTO
+#if defined(__GNUC__)
+#define AANKAA_COMPUTED_GOTO 1
+#else
+#define AANKAA_COMPUTED_GOTO 0
+#endif
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
-constexpr uint32_t FRAMES_MAX = 64;
-constexpr uint32_t STACK_MAX = FRAMES_MAX * UINT8_COUNT;
+// 默认的最大调用深度，可以在构造VM时指定。
+// 值栈按每层UINT8_COUNT个槽位预留地址空间，只有真正用到的部分才会commit
+constexpr uint32_t DEFAULT_MAX_FRAMES = 16384;
+// 值栈一开始commit的槽位，shrink_stack之后栈顶以上也保留这么多。
+// 每个栈帧实际要用的槽位由编译器算出来，见Chunk::max_stack
+constexpr uint32_t FRAME_SLOTS = 2 * UINT8_COUNT;
 
 typedef enum {
     INTERPRET_OK,
@@ -27,20 +51,30 @@ typedef enum {
 
 struct CallFrame {
     ObjFunction* function = nullptr;
+    // 被调用的值：闭包，或者没有捕获变量的函数本身。方法调用时0号槽位是this，
+    // 所以栈式后端的upvalue指令从这里读取闭包；寄存器后端不支持类，闭包总在R0
+    Obj* closure = nullptr;
     uint8_t* ip = nullptr;
+    // 寄存器后端使用pc，栈式后端使用ip
+    const RegInstr* pc = nullptr;
     Value* slots = nullptr;
 };
 
+// 调用栈，和值栈一样只预留地址空间，按需commit
 class FrameList {
 public:
+    explicit FrameList(uint32_t max_frames) : frames(max_frames, 1), _max_frames(max_frames) {
+        update_capacity();
+    }
+
     CallFrame* current_frame() {
-        return &frames[_frame_count - 1];
+        return &frames.data()[_frame_count - 1];
     }
     CallFrame* new_frame() {
-        return &frames[_frame_count++];
+        return &frames.data()[_frame_count++];
     }
     CallFrame* at(int i) {
-        return &frames[i];
+        return &frames.data()[i];
     }    
     void destroy_frame() {
         _frame_count--;
@@ -51,8 +85,38 @@ public:
     int frame_count() const {
         return _frame_count;
     }
+    // 已经commit的frame都用完了，new_frame之前要先grow
+    bool is_full() const {
+        return static_cast<size_t>(_frame_count) == _capacity;
+    }
+    // 再commit一批frame，达到最大深度时返回false
+    bool grow() {
+        if (_capacity == _max_frames || !frames.grow(_capacity + 1)) {
+            return false;
+        }
+        update_capacity();
+        return true;
+    }
+    size_t max_frames() const {
+        return _max_frames;
+    }
+    size_t committed_bytes() const {
+        return frames.committed_bytes();
+    }
+    void shrink() {
+        // 至少留一个frame给enter_script
+        frames.shrink(_frame_count + 1);
+        update_capacity();
+    }
+private:
+    // 按页commit，最后一页可能超过最大深度，超出的部分不用
+    void update_capacity() {
+        _capacity = frames.capacity() < _max_frames ? frames.capacity() : _max_frames;
+    }
 private:
-    CallFrame frames[FRAMES_MAX];
+    StackRegion<CallFrame> frames;
+    size_t _max_frames = 0;
+    size_t _capacity = 0;
     int _frame_count = 0;
 };
 
@@ -63,43 +127,120 @@ private:
 #define READ_SHORT()  \
     (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 
-#define BINARY_OP(op)  \
+// 宽操作数指令的3字节操作数
+#define READ_LONG()  \
+    (frame->ip += 3, (uint32_t)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+
+// 属性名、方法名和类名，短格式和宽格式的常量下标
+#define READ_NAME() (frame->function->chunk->constants[READ_BYTE()].as_string())
+#define READ_NAME_LONG() (frame->function->chunk->constants[READ_LONG()].as_string())
+
+// 全局变量的读写，短格式和宽格式只是槽位的编码不同
+#define GET_GLOBAL_OP(read_slot)  \
     do { \
-        if (!peek(0).is_number() || !peek(1).is_number()) { \
+        uint32_t slot = read_slot; \
+        const Value& value = globals.values[slot]; \
+        if (unlikely(value.is_undefined())) { \
+            runtime_error("Undefined variable '%s'.", globals.name_of(slot)->chars); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        push(value); \
+    } while (false)
+
+#define SET_GLOBAL_OP(read_slot)  \
+    do { \
+        uint32_t slot = read_slot; \
+        Value& value = globals.values[slot]; \
+        if (unlikely(value.is_undefined())) { \
+            runtime_error("Undefined variable '%s'.", globals.name_of(slot)->chars); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        value = peek(0); \
+    } while (false)
+
+// 通用的算术和比较指令：先按两个操作数的类型把自己改写成特化版本(都是整数/都是double)，
+// 类型混合的不改写，再按通用规则计算
+#define QUICKEN_BINARY_OP(arith, int_op, num_op)  \
+    do { \
+        const Value& b = peek(0); \
+        const Value& a = peek(1); \
+        if (a.is_integer() && b.is_integer()) { \
+            frame->ip[-1] = int_op; \
+        } else if (a.is_number() && b.is_number()) { \
+            frame->ip[-1] = num_op; \
+        } \
+        Value result; \
+        if (unlikely(!numeric_binary<arith>(a, b, &result))) { \
             runtime_error( \
                 "Operands must be two numbers or two strings."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = pop().as_number(); \
-        double a = pop().as_number(); \
-        push(Value(a op b)); \
+        stack_top[-2] = result; \
+        stack_top--; \
+    } while(false)
+
+// 特化指令的类型检查失败(或者整数溢出)：改写回通用指令，回退ip重新执行
+#define DEOPTIMIZE(generic_op)  \
+    do { \
+        frame->ip[-1] = generic_op; \
+        frame->ip--; \
+        DISPATCH(); \
+    } while(false)
+
+#define INT_ARITH_OP(overflow_builtin, generic_op)  \
+    do { \
+        int r; \
+        if (unlikely(!peek(0).is_integer() || !peek(1).is_integer() \
+                     || overflow_builtin(peek(1).as_integer(), peek(0).as_integer(), &r))) { \
+            DEOPTIMIZE(generic_op); \
+        } \
+        stack_top[-2] = Value(r); \
+        stack_top--; \
+    } while(false)
+
+#define TYPED_BINARY_OP(is_type, as_type, op, generic_op)  \
+    do { \
+        if (unlikely(!peek(0).is_type() || !peek(1).is_type())) { \
+            DEOPTIMIZE(generic_op); \
+        } \
+        stack_top[-2] = Value(peek(1).as_type() op peek(0).as_type()); \
+        stack_top--; \
     } while(false)
 
 
 
-inline Value clock_native(int arg_count, Value* args) {
-    printf("clock_native()...\n");
+// 微秒
+inline double clock_native() {
     struct timeval tv;
     gettimeofday(&tv, nullptr);
-    double res = tv.tv_usec + (uint64_t)tv.tv_sec * 1000000;
-
-    return Value(res);
+    return tv.tv_usec + (uint64_t)tv.tv_sec * 1000000;
 }
-inline Value sleep_native(int arg_count, Value* args) {
-    printf("sleep_native()...\n");
-    int sleep_ms = args[0].as_number();
-    std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
-    return Value(nullptr);
+inline void sleep_native(double sleep_ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(sleep_ms)));
 }
 
+// 执行后端：栈式字节码，或者由栈式字节码翻译得到的寄存器字节码
+enum Backend {
+    BACKEND_STACK,
+    BACKEND_REGISTER
+};
+
 class VM {
 public:
-    VM() {
+    explicit VM(uint32_t max_frames = DEFAULT_MAX_FRAMES)
+        : frames(max_frames), stack(static_cast<size_t>(max_frames) * UINT8_COUNT + FRAME_SLOTS, FRAME_SLOTS),
+          stack_bottom(stack.data()), stack_limit(stack.data() + stack.capacity()) {
         reset_stack();
-        define_native("clock", clock_native);
-        define_native("sleep", sleep_native);
+        define_native<clock_native>("clock");
+        define_native<sleep_native>("sleep");
     }
+    ~VM();
+    VM(VM const&) = delete;
+    VM& operator=(VM const&) = delete;
     InterpretResult interpret(ObjFunction* function);
+    // 把main函数压栈并创建第一个frame，之后调用run()系列函数就可以执行了。
+    // 栈空间不够main函数用时报告Stack overflow并返回false
+    bool enter_script(ObjFunction* function);
 
     void reset_stack() {
         stack_top = stack_bottom;
@@ -117,20 +258,202 @@ public:
     Value peek(int offset) {
         return stack_top[-1 - offset];
     }
+    // 进入新栈帧之前调用：frame用完了，或者frame_slots之后剩下的槽位不够new_slots个时
+    // commit更多的栈空间，超过最大深度时报告Stack overflow并返回false。
+    // 栈式后端的new_slots是被调函数的chunk->max_stack
+    bool ensure_frame(Value* frame_slots, size_t new_slots) {
+        if (likely(!frames.is_full() && frame_slots + new_slots <= stack_limit)) {
+            return true;
+        }
+        return grow_stack(frame_slots, new_slots);
+    }
+    // 尾调用复用当前的frame，只需要保证值栈的槽位
+    bool ensure_slots(Value* frame_slots, size_t new_slots) {
+        if (likely(frame_slots + new_slots <= stack_limit)) {
+            return true;
+        }
+        return grow_slots(frame_slots, new_slots);
+    }
+    bool grow_stack(Value* frame_slots, size_t new_slots);
+    bool grow_slots(Value* frame_slots, size_t new_slots);
+    // 把超出当前栈顶的已commit内存还给系统，宿主可以在深递归之后、VM空闲时调用
+    void shrink_stack();
+    // OP_CALL_CACHED单态缓存没有命中时按callee的函数(闭包按它的函数)查找所有位置，
+    // 返回命中的位置；找不到返回-1，并在有空位时记下这个函数
+    int call_cache_lookup(CallSiteCache* cache, const Value& callee, int arg_count);
     bool call_value(Value callee, int arg_count);
-    bool call(ObjFunction* function, int arg_count);
+    // 创建function的闭包写到dst，enclosing和frame_slots是正在执行的外层函数的闭包和栈帧。
+    // dst必须是栈上的槽位，后面分配ObjUpvalue触发回收时闭包已经是根
+    void make_closure(ObjFunction* function, Obj* enclosing, Value* frame_slots, Value* dst);
+    // closure是被调用的值，见CallFrame::closure
+    bool call(ObjFunction* function, int arg_count, Obj* closure);
+    // 调用方法，receiver已经在被调用者的槽位上。method是函数或者闭包
+    bool call_method(const Value& method, int arg_count);
+    // 属性访问点的单态缓存没有命中时查找所有位置，找不到时按shape解析一次，有空位时记下来。
+    // for_set为true时解析的是写操作，没有这个字段时添加字段(shape转换)
+    PropertyCacheEntry property_cache_lookup(PropertyCache* cache, Shape* shape, ObjString* name, bool for_set);
+    // 把receiver和它的类里名为name的方法绑定起来替换栈顶，没有这个方法时报错返回false
+    bool bind_method(ObjClass* klass, ObjString* name);
+    // 在klass的方法表里查找name，以receiver为this调用，receiver已经在被调用者的槽位上
+    bool invoke_from_class(ObjClass* klass, ObjString* name, int arg_count);
     InterpretResult run();
+    InterpretResult run_switch();
+#if AANKAA_COMPUTED_GOTO
+    InterpretResult run_threaded();
+#endif
+    template <bool THREADED>
+    InterpretResult run_loop();
+    bool add_slow();
+    // reg_vm.cpp
+    bool enter_register_script(ObjFunction* function);
+    InterpretResult run_register();
+    void print_stack(std::ostream& out = std::cout);
     InterpretResult interpret();
     void runtime_error(const char* format, ...);
     void concatenate();
-    void define_native(const char* name, NativeFn function);
+    // 注册原生函数，arity为-1时参数个数由function自己检查
+    ObjNative* define_native(const char* name, NativeFn function, int arity = -1);
+    // 按C++函数的签名自动生成参数拆箱的通用入口、参数个数和类型化入口，见native.h
+    template <auto FN>
+    ObjNative* define_native(const char* name, int flags = NATIVE_EFFECT) {
+        using Binding = native::Binding<FN>;
+        ObjNative* native = define_native(name, &Binding::call, Binding::ARITY);
+        native->pure = (flags & NATIVE_PURE) != 0;
+        Binding::bind_fast(native);
+        return native;
+    }
+    // 调用原生函数，不创建栈帧。参数是args开始的arg_count个值，结果写到result
+    bool call_native(ObjNative* native, int arg_count, Value* args, Value* result) {
+        if (unlikely(native->arity >= 0 && arg_count != native->arity)) {
+            runtime_error("Expected %d arguments but got %d.", native->arity, arg_count);
+            return false;
+        }
+        switch (native->kind) {
+        case NATIVE_NUMBER_0:
+            *result = Value(native->fast.number0());
+            return true;
+        case NATIVE_NUMBER_1:
+            if (likely(args[0].is_numeric())) {
+                *result = Value(native->fast.number1(args[0].to_double()));
+                return true;
+            }
+            break;
+        case NATIVE_NUMBER_2:
+            if (likely(args[0].is_numeric() && args[1].is_numeric())) {
+                *result = Value(native->fast.number2(args[0].to_double(), args[1].to_double()));
+                return true;
+            }
+            break;
+        default:
+            break;
+        }
+        *result = native->function(arg_count, args);
+        if (unlikely(result->is_undefined())) {
+            runtime_error("Invalid arguments for native function %s().", native->name->chars);
+            return false;
+        }
+        return true;
+    }
+
+    // 字符串驻留：内容相同的字符串只创建一次
+    // young为true时新字符串分配在nursery里，只用于运行时产生的临时字符串；
+    // 编译期的常量、名字等长期存活的字符串直接分配到老年代
+    ObjString* copy_string(const char* chars, int length, bool young = false);
+
+    // 按名字访问全局变量，给宿主程序嵌入使用
+    int find_global(const std::string& name);
+    bool get_global(const std::string& name, Value* value);
+
+    // 所有堆对象都从这里分配并挂到objects链表上，分配前按阈值触发垃圾回收，
+    // 所以调用方要保证之前分配、还没有挂到根上的对象已经通过push_root保护起来
+    template <typename T, class... Args>
+    T* allocate(Args&&... args) {
+        if (gc_stress || bytes_allocated + sizeof(T) > next_gc) {
+            collect_garbage();
+        }
+        T* obj = std::get<ObjectPool<T>>(pools).get(std::forward<Args>(args)...);
+        obj->next = objects;
+        objects = obj;
+        bytes_allocated += object_size(obj);
+        object_count++;
+        return obj;
+    }
+    // 编译期间还没有存到常量表里的对象，需要临时作为根
+    void push_root(Obj* obj) {
+        roots.push_back(obj);
+    }
+    void remove_root(Obj* obj);
+
+    // 老对象里存入了一个nursery里的值时调用，把老对象记录到remembered set，
+    // minor回收时把它当作根扫描
+    void write_barrier(Obj* owner, const Value& value) {
+        if (value.is_obj() && nursery.contains(value.as_obj())
+                && !owner->is_remembered && !nursery.contains(owner)) {
+            owner->is_remembered = true;
+            remembered.push_back(owner);
+        }
+    }
+
+    // gc.cpp
+    ObjString* allocate_string(const char* chars, int length, uint32_t hash, bool young);
+    ObjClosure* allocate_closure(ObjFunction* function);
+    ObjString* promote(ObjString* str);
+    void forward_value(Value& value);
+    void minor_collect();
+    void collect_garbage();
+    void mark_roots();
+    void mark_value(const Value& value);
+    void mark_object(Obj* obj);
+    void trace_references();
+    void blacken_object(Obj* obj);
+    void prune_property_caches();
+    void sweep();
+    static size_t object_size(Obj* obj);
+    void free_object(Obj* obj);
 public:
     FrameList frames;
-    Value stack_bottom[STACK_MAX];
+    StackRegion<Value> stack;
+    Value* const stack_bottom;
+    // 已经commit的值栈的末尾，grow_stack会把它往后移，地址本身不会变
+    Value* stack_limit;
     Value* stack_top = nullptr;
-    ObjectPool<ObjString> string_pool;
-    ObjectPool<ObjNative> native_pool;
-    std::unordered_map<std::string, Value> globals;
+    StringTable strings;
+    GlobalTable globals;
+
+    Obj* objects = nullptr;
+    // 定长的对象从各自的slab对象池里分配，回收时release回空闲链表复用；字符串和闭包是变长的，不走对象池
+    std::tuple<ObjectPool<ObjFunction>, ObjectPool<ObjNative>, ObjectPool<ObjUpvalue>,
+               ObjectPool<ObjClass>, ObjectPool<ObjInstance>, ObjectPool<ObjBoundMethod>> pools;
+    size_t bytes_allocated = 0;
+    size_t object_count = 0;
+    size_t next_gc = GC_INITIAL_THRESHOLD;
+    // 压力测试模式：每次分配都触发一次完整的回收，用来暴露漏标的根
+#ifdef DEBUG_STRESS_GC
+    bool gc_stress = true;
+#else
+    bool gc_stress = false;
+#endif
+    GCStats gc_stats;
+    std::vector<Obj*> gray_stack;
+    std::vector<Obj*> roots;
+    // 标记时遇到的带属性缓存的函数，清除之前去掉缓存里已经死掉的类
+    std::vector<ObjFunction*> property_cache_owners;
+
+    Nursery nursery;
+    // 关闭后运行时字符串也直接分配到老年代
+    bool use_nursery = true;
+    std::vector<Obj*> remembered;
+    // 字符串拼接用的临时缓冲区，先拼好再到驻留表里查找
+    std::string scratch;
+    // 编译时按这个选项决定是否翻译成寄存器字节码，要在编译之前设置。
+    // 有函数翻译失败时整个程序仍然用栈式后端执行
+    Backend backend = BACKEND_STACK;
+    // 非空时统计执行过的指令序列，只在AANKAA_TRACE构建里生效
+    OpcodeProfiler* profiler = nullptr;
 };
 
+// 输出function和它嵌套的函数里每个调用点缓存的命中次数和缓存的函数，
+// 以及每个属性访问点缓存的命中次数和缓存的shape个数，用于性能分析
+void print_call_site_stats(ObjFunction* function, std::ostream& out);
+
 } //namespace
\ No newline at end of file
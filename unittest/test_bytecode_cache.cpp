@@ -0,0 +1,264 @@
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "scanner.h"
+#include "parser.h"
+#include "vm.h"
+#include "bytecode_cache.h"
+
+using aankaa::Scanner;
+using aankaa::Parser;
+using aankaa::VM;
+using aankaa::Value;
+using aankaa::ObjFunction;
+
+namespace test {
+
+class BytecodeCacheTest : public ::testing::Test {
+private:
+    virtual void SetUp() {
+        _path = testing::TempDir() + "aankaa_cache_test_" + std::to_string(getpid()) + ".bc";
+    }
+    virtual void TearDown() {
+        unlink(_path.c_str());
+    }
+protected:
+    ObjFunction* compile(VM& vm, const std::string& source) {
+        Scanner s;
+        s.reset(source);
+        Parser parser(&s, &vm);
+        parser.advance();
+        return parser.compile();
+    }
+    // 编译source写成缓存文件
+    void write_cache(const std::string& source) {
+        VM vm;
+        ObjFunction* script = compile(vm, source);
+        ASSERT_NE(script, nullptr);
+        std::string error;
+        ASSERT_TRUE(aankaa::write_bytecode(&vm, script, hash(source), _path, &error)) << error;
+    }
+    uint64_t hash(const std::string& source) {
+        return aankaa::hash_source(source.data(), source.size());
+    }
+    std::vector<std::string> run_globals(VM& vm, ObjFunction* script, const std::vector<std::string>& names) {
+        EXPECT_EQ(vm.interpret(script), aankaa::INTERPRET_OK);
+        std::vector<std::string> values;
+        for (const std::string& name : names) {
+            Value v;
+            EXPECT_TRUE(vm.get_global(name, &v)) << name;
+            values.push_back(v.to_string());
+        }
+        return values;
+    }
+protected:
+    std::string _path;
+};
+
+TEST_F(BytecodeCacheTest, test_round_trip) {
+    const std::string source =
+        "fun fib(n) { if (n < 2) return n; return fib(n - 2) + fib(n - 1); }\n"
+        "fun greet(name) { return \"hello \" + name; }\n"
+        "var f = fib(15);\n"
+        "var s = greet(\"aankaa\");\n"
+        "var d = 1.5 / 2;\n"
+        "var b = 1 < 2;\n"
+        "var i = 0;\n"
+        "while (i < 10) { i = i + 1; }\n"
+        "fun counter() { var n = 0; fun inc(k) { n = n + k; return n; } return inc; }\n"
+        "var c = counter(); c(1);\n"
+        "var n = c(i);\n";
+    const std::vector<std::string> names = {"f", "s", "d", "b", "i", "n"};
+    write_cache(source);
+
+    VM expected_vm;
+    std::vector<std::string> expected = run_globals(expected_vm, compile(expected_vm, source), names);
+
+    VM vm;
+    std::string error;
+    ObjFunction* script = aankaa::load_bytecode(&vm, _path, hash(source), &error);
+    ASSERT_NE(script, nullptr) << error;
+    EXPECT_EQ(run_globals(vm, script, names), expected);
+    // 字符串经过驻留表，和运行时创建的同名字符串是同一个对象
+    Value s;
+    ASSERT_TRUE(vm.get_global("s", &s));
+    EXPECT_EQ(s.as_string(), vm.copy_string("hello aankaa", 12));
+}
+
+TEST_F(BytecodeCacheTest, test_stale_and_corrupted) {
+    const std::string source = "var a = 1;\n";
+    write_cache(source);
+    VM vm;
+    std::string error;
+    // 源码变了
+    EXPECT_EQ(aankaa::load_bytecode(&vm, _path, hash("var a = 2;\n"), &error), nullptr);
+    EXPECT_EQ(error, "source changed");
+
+    // 文件被截断
+    std::ifstream in(_path, std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    for (size_t size : {size_t(0), size_t(10), content.size() / 2, content.size() - 1}) {
+        std::ofstream(_path, std::ios::binary | std::ios::trunc).write(content.data(), size);
+        EXPECT_EQ(aankaa::load_bytecode(&vm, _path, hash(source), &error), nullptr) << size;
+    }
+
+    // 格式版本不一致
+    std::string old_version = content;
+    old_version[4] = static_cast<char>(aankaa::BYTECODE_VERSION + 1);
+    std::ofstream(_path, std::ios::binary | std::ios::trunc) << old_version;
+    EXPECT_EQ(aankaa::load_bytecode(&vm, _path, hash(source), &error), nullptr);
+
+    unlink(_path.c_str());
+    EXPECT_EQ(aankaa::load_bytecode(&vm, _path, hash(source), &error), nullptr);
+}
+
+TEST_F(BytecodeCacheTest, test_wide_operands) {
+    // 宽操作数、嵌套函数和运行时错误的行号都要保留下来
+    std::string source;
+    for (int i = 0; i < 300; ++i) {
+        source += "var g" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+    }
+    source += "fun add(a) { return a + g299; }\n"
+              "var total = 0;\n"
+              "for (var i = 0; i < 10; i = i + 1) { total = add(total); }\n"
+              "fun bad() {\n"
+              "    return g1 - \"x\";\n"
+              "}\n";
+    write_cache(source);
+
+    VM vm;
+    std::string error;
+    ObjFunction* script = aankaa::load_bytecode(&vm, _path, hash(source), &error);
+    ASSERT_NE(script, nullptr) << error;
+    std::vector<std::string> values = run_globals(vm, script, {"g0", "g255", "g299", "total"});
+    EXPECT_EQ(values, std::vector<std::string>({"0", "255", "299", "2990"}));
+
+    testing::internal::CaptureStderr();
+    EXPECT_EQ(vm.interpret(compile(vm, "bad();")), aankaa::INTERPRET_RUNTIME_ERROR);
+    std::string output = testing::internal::GetCapturedStderr();
+    EXPECT_NE(output.find("[line 305] bad()"), std::string::npos) << output;
+
+    // 短格式的操作数放不下加载时的新槽位，放弃缓存
+    VM crowded;
+    ASSERT_EQ(crowded.interpret(compile(crowded, "var before;")), aankaa::INTERPRET_OK);
+    EXPECT_EQ(aankaa::load_bytecode(&crowded, _path, hash(source), &error), nullptr);
+    EXPECT_EQ(error, "global slots changed");
+}
+
+TEST_F(BytecodeCacheTest, test_relocate_globals) {
+    const std::string source =
+        "var a = 1;\n"
+        "fun inc() { a = a + 1; return a; }\n"
+        "inc();\n"
+        "var b = inc() * 10;\n";
+    write_cache(source);
+
+    // 加载之前VM里已经有别的全局变量，槽位整体后移，字节码里的操作数要跟着改写
+    VM vm;
+    ASSERT_EQ(vm.interpret(compile(vm, "var before1 = 1; var before2 = 2;")), aankaa::INTERPRET_OK);
+    std::string error;
+    ObjFunction* script = aankaa::load_bytecode(&vm, _path, hash(source), &error);
+    ASSERT_NE(script, nullptr) << error;
+    std::vector<std::string> values = run_globals(vm, script, {"a", "b", "before1", "before2"});
+    EXPECT_EQ(values, std::vector<std::string>({"3", "30", "1", "2"}));
+}
+
+TEST_F(BytecodeCacheTest, test_loaded_script_rooted) {
+    const std::string source =
+        "fun greet(name) { return \"hello \" + name; }\n"
+        "var s = greet(\"aankaa\");\n";
+    write_cache(source);
+
+    // 加载之后、执行之前还会有分配(比如构造Parser)，每次分配都回收，加载的main函数要作为根才不会被释放
+    VM vm;
+    vm.gc_stress = true;
+    std::string error;
+    ObjFunction* script = aankaa::load_bytecode(&vm, _path, hash(source), &error);
+    ASSERT_NE(script, nullptr) << error;
+    vm.push_root(script);
+    {
+        Scanner s;
+        Parser parser(&s, &vm);
+    }
+    for (int i = 0; i < 10; ++i) {
+        vm.copy_string("garbage", 7);
+    }
+    EXPECT_EQ(run_globals(vm, script, {"s"}), std::vector<std::string>({"\"hello aankaa\""}));
+    vm.remove_root(script);
+}
+
+TEST_F(BytecodeCacheTest, test_invalid_bytecode) {
+    const std::string source =
+        "var a = 1;\n"
+        "fun f(x) { return x + 1; }\n"
+        "fun g(x) { if (x) x = 2; return x; }\n"
+        "var b = f(a) + g(a);\n";
+    write_cache(source);
+    std::ifstream in(_path, std::ios::binary);
+    const std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    // 文件开头是40字节的CacheHeader，最后8字节是后面所有内容的校验和
+    const size_t header_size = 40;
+    const size_t checksum_offset = 32;
+    auto load = [&](std::string bytes, bool restamp) {
+        if (restamp) {
+            uint64_t checksum = aankaa::hash_source(bytes.data() + header_size, bytes.size() - header_size);
+            memcpy(&bytes[checksum_offset], &checksum, sizeof(checksum));
+        }
+        std::ofstream(_path, std::ios::binary | std::ios::trunc) << bytes;
+        VM vm;
+        std::string error;
+        ObjFunction* script = aankaa::load_bytecode(&vm, _path, hash(source), &error);
+        return script == nullptr ? error : std::string("loaded");
+    };
+    ASSERT_EQ(load(content, false), "loaded");
+
+    // 内容被改过，校验和对不上
+    std::string flipped = content;
+    flipped.back() ^= 1;
+    EXPECT_EQ(load(flipped, false), "checksum mismatch");
+
+    // 校验和也一起改过的字节码要通过逐条检查才能执行。f的函数体是add_local_const(1, 1), return
+    const char f_body[] = {aankaa::OP_ADD_LOCAL_CONST, 1};
+    size_t f_pos = content.find(std::string(f_body, sizeof(f_body)), header_size);
+    ASSERT_NE(f_pos, std::string::npos);
+    ASSERT_EQ(content[f_pos + 3], aankaa::OP_RETURN);
+    auto corrupt = [&](size_t pos, uint8_t byte) {
+        std::string bytes = content;
+        bytes[pos] = static_cast<char>(byte);
+        return load(bytes, true);
+    };
+    EXPECT_EQ(corrupt(f_pos, aankaa::OP_COUNT).find("invalid bytecode: unknown opcode"), 0u);
+    EXPECT_EQ(corrupt(f_pos, aankaa::OP_CALL_CACHED).find("invalid bytecode: unknown opcode"), 0u);
+    EXPECT_EQ(corrupt(f_pos + 2, 200).find("invalid bytecode: constant out of range"), 0u);
+    EXPECT_EQ(corrupt(f_pos + 1, 9).find("invalid bytecode: inconsistent stack depth"), 0u);
+    // inc_local不压栈，return没有返回值可以弹出
+    EXPECT_EQ(corrupt(f_pos, aankaa::OP_INC_LOCAL).find("invalid bytecode: inconsistent stack depth"), 0u);
+    EXPECT_EQ(corrupt(f_pos, aankaa::OP_GET_UPVALUE).find("invalid bytecode: upvalue out of range"), 0u);
+    EXPECT_EQ(corrupt(f_pos, aankaa::OP_GET_GLOBAL_LONG).find("invalid bytecode: global slot out of range"), 0u);
+    EXPECT_EQ(corrupt(f_pos, aankaa::OP_GET_PROPERTY).find("invalid bytecode: name is not a string constant"), 0u);
+    EXPECT_EQ(corrupt(f_pos, aankaa::OP_CLOSURE).find("invalid bytecode: closure of a non-function constant"), 0u);
+
+    // g的条件跳转：get_local(1), jump_if_false(offset)，跳转目标是else分支开头的pop，它前面是jmp的操作数
+    const char g_body[] = {aankaa::OP_GET_LOCAL, 1, aankaa::OP_JUMP_IF_FALSE, 0};
+    size_t g_pos = content.find(std::string(g_body, sizeof(g_body)), header_size);
+    ASSERT_NE(g_pos, std::string::npos);
+    EXPECT_EQ(corrupt(g_pos + 4, 0xff).find("invalid bytecode: jump target out of range"), 0u);
+    EXPECT_EQ(corrupt(g_pos + 4, content[g_pos + 4] - 1).find("invalid bytecode: jump target out of range"), 0u);
+
+    // 随便改一个字节都不能让加载越界或者崩溃
+    std::mt19937 random(20261017);
+    for (int i = 0; i < 2000; ++i) {
+        std::string bytes = content;
+        size_t pos = header_size + random() % (bytes.size() - header_size);
+        bytes[pos] = static_cast<char>(random());
+        load(bytes, true);
+    }
+}
+
+} // namespace
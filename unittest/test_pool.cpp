@@ -0,0 +1,132 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <set>
+
+#include "gtest/gtest.h"
+
+#define private public
+#define protected public
+#include "pool.h"
+#undef private
+#undef protected
+
+using aankaa::ObjectPool;
+using aankaa::PoolStats;
+
+namespace test {
+
+class PoolTest : public ::testing::Test {
+private:
+    virtual void SetUp() {
+    }
+    virtual void TearDown() {
+    }
+protected:
+};
+
+struct Counted {
+    static int alive;
+    Counted(int v, std::string n) : value(v), name(std::move(n)) {
+        alive++;
+    }
+    ~Counted() {
+        alive--;
+    }
+    int value;
+    std::string name;
+};
+
+int Counted::alive = 0;
+
+TEST_F(PoolTest, test_slab_growth) {
+    {
+        ObjectPool<Counted> pool(4);
+        std::vector<Counted*> objs;
+        for (int i = 0; i < 100; ++i) {
+            objs.push_back(pool.get(i, std::to_string(i)));
+        }
+        EXPECT_EQ(Counted::alive, 100);
+        for (int i = 0; i < 100; ++i) {
+            EXPECT_EQ(objs[i]->value, i);
+            EXPECT_EQ(objs[i]->name, std::to_string(i));
+        }
+        // 4 + 8 + 16 + 32 + 64
+        PoolStats stats = pool.stats();
+        EXPECT_EQ(stats.slabs, 5u);
+        EXPECT_EQ(stats.capacity, 124u);
+        EXPECT_EQ(stats.live, 100u);
+        EXPECT_EQ(stats.untouched, 24u);
+        EXPECT_DOUBLE_EQ(stats.max_slab_occupancy, 1.0);
+        stats.print();
+    }
+    // 析构时所有活着的对象都被析构
+    EXPECT_EQ(Counted::alive, 0);
+}
+
+TEST_F(PoolTest, test_release_reuse) {
+    ObjectPool<Counted> pool(8);
+    std::vector<Counted*> objs;
+    for (int i = 0; i < 8; ++i) {
+        objs.push_back(pool.get(i, "x"));
+    }
+    EXPECT_TRUE(pool.owns(objs[3]));
+    int outside = 0;
+    EXPECT_FALSE(pool.owns(reinterpret_cast<Counted*>(&outside)));
+
+    EXPECT_TRUE(pool.release(objs[3]));
+    EXPECT_TRUE(pool.release(objs[5]));
+    EXPECT_EQ(Counted::alive, 6);
+    EXPECT_EQ(pool.size(), 6u);
+    EXPECT_EQ(pool.stats().free, 2u);
+    // 重复释放和不是pool分配的对象会被忽略
+    EXPECT_FALSE(pool.release(objs[5]));
+    EXPECT_FALSE(pool.release(reinterpret_cast<Counted*>(&outside)));
+    EXPECT_EQ(pool.stats().free, 2u);
+
+    // 空闲链表是后进先出的，不会申请新的slab
+    EXPECT_EQ(pool.get(100, "y"), objs[5]);
+    EXPECT_EQ(pool.get(101, "z"), objs[3]);
+    EXPECT_EQ(objs[3]->value, 101);
+    EXPECT_EQ(pool.stats().slabs, 1u);
+    EXPECT_EQ(pool.stats().free, 0u);
+
+    pool.get(102, "w");
+    EXPECT_EQ(pool.stats().slabs, 2u);
+    EXPECT_EQ(Counted::alive, 9);
+
+    // clear之后slab保留下来继续使用
+    pool.clear();
+    EXPECT_EQ(Counted::alive, 0);
+    EXPECT_EQ(pool.get(0, "a"), objs[0]);
+    EXPECT_EQ(pool.stats().slabs, 2u);
+    pool.clear();
+}
+
+TEST_F(PoolTest, test_random_release) {
+    ObjectPool<Counted> pool(2);
+    std::vector<Counted*> live;
+    std::set<Counted*> released;
+    unsigned seed = 12345;
+    for (int round = 0; round < 20000; ++round) {
+        seed = seed * 1103515245 + 12345;
+        if (!live.empty() && (seed >> 16) % 3 == 0) {
+            size_t index = (seed >> 8) % live.size();
+            pool.release(live[index]);
+            live[index] = live.back();
+            live.pop_back();
+        } else {
+            live.push_back(pool.get(round, ""));
+        }
+    }
+    EXPECT_EQ(pool.size(), live.size());
+    EXPECT_EQ(static_cast<size_t>(Counted::alive), live.size());
+    PoolStats stats = pool.stats();
+    EXPECT_EQ(stats.live + stats.free + stats.untouched, stats.capacity);
+    for (Counted* obj : live) {
+        EXPECT_TRUE(pool.owns(obj));
+    }
+}
+
+}
@@ -0,0 +1,93 @@
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "scanner.h"
+#include "scan_kernels.h"
+
+using aankaa::Scanner;
+using aankaa::Token;
+using aankaa::SimdLevel;
+
+namespace test {
+
+class ScanKernelsTest : public ::testing::Test {
+private:
+    virtual void SetUp() {
+    }
+    virtual void TearDown() {
+    }
+protected:
+    std::vector<SimdLevel> levels() {
+        std::vector<SimdLevel> result;
+        for (int level = aankaa::SIMD_SCALAR; level <= aankaa::detect_simd_level(); ++level) {
+            result.push_back(static_cast<SimdLevel>(level));
+        }
+        return result;
+    }
+    std::vector<std::string> scan(const std::string& source, SimdLevel level) {
+        Scanner s;
+        s.set_simd_level(level);
+        s.reset(source);
+        std::vector<std::string> tokens;
+        for (Token token = s.scan_token(); token.type != aankaa::EEOF; token = s.scan_token()) {
+            tokens.push_back(std::to_string(token.line) + ":" + std::to_string(token.type) + ":"
+                             + token.to_string());
+        }
+        return tokens;
+    }
+};
+
+// 向量版本和标量版本在每个起始位置(覆盖各种对齐)上结果一致
+TEST_F(ScanKernelsTest, test_kernels_match_scalar) {
+    const char alphabet[] = "  \t\r\n\n//\"\"aZ_09x.;+\x80\xff";
+    std::mt19937 rng(42);
+    const aankaa::ScanKernels& scalar = aankaa::scan_kernels(aankaa::SIMD_SCALAR);
+    for (int round = 0; round < 200; ++round) {
+        // 每一轮偏向一种字符，造出长短不一的连续段
+        char bias = alphabet[rng() % (sizeof(alphabet) - 1)];
+        std::string text;
+        size_t size = rng() % 200;
+        for (size_t i = 0; i < size; ++i) {
+            text += rng() % 4 != 0 ? bias : alphabet[rng() % (sizeof(alphabet) - 1)];
+        }
+        for (SimdLevel level : levels()) {
+            const aankaa::ScanKernels& kernels = aankaa::scan_kernels(level);
+            for (size_t start = 0; start <= text.size(); ++start) {
+                const char* p = text.c_str() + start;
+                int expected_lines = 0;
+                int lines = 0;
+                EXPECT_EQ(kernels.skip_blank(p, &lines), scalar.skip_blank(p, &expected_lines));
+                EXPECT_EQ(lines, expected_lines);
+                EXPECT_EQ(kernels.skip_ident(p), scalar.skip_ident(p));
+                EXPECT_EQ(kernels.skip_digits(p), scalar.skip_digits(p));
+                EXPECT_EQ(kernels.find_line_end(p), scalar.find_line_end(p));
+                expected_lines = lines = 0;
+                EXPECT_EQ(kernels.find_quote(p, &lines), scalar.find_quote(p, &expected_lines));
+                EXPECT_EQ(lines, expected_lines);
+            }
+        }
+    }
+}
+
+TEST_F(ScanKernelsTest, test_scanner_levels) {
+    std::string source =
+        "// comment line that is longer than one vector block, still a comment\n"
+        "var                                        spaced = 12345678901234567890.5;\n"
+        "var a_very_long_identifier_name_that_crosses_blocks = \"a string\n"
+        "with two\n"
+        "newlines inside\";\n"
+        "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\tprint a;\n"
+        "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\nprint 1;\n"
+        "var unterminated = \"no closing quote";
+    std::vector<std::string> expected = scan(source, aankaa::SIMD_SCALAR);
+    EXPECT_EQ(expected[1], "1:" + std::to_string(aankaa::IDENTIFIER) + ":spaced");
+    EXPECT_EQ(expected.back(), "42:" + std::to_string(aankaa::ERROR) + ":expected quote");
+    for (SimdLevel level : levels()) {
+        EXPECT_EQ(scan(source, level), expected) << aankaa::simd_level_name(level);
+    }
+}
+
+} // namespace
@@ -16,6 +16,7 @@
 #define private public
 #define protected public
 #include "scanner.h"
+#include "keywords.h"
 #undef private
 #undef protected
 
@@ -52,4 +53,41 @@ TEST_F(ScannerTest, test_scan) {
     }
 }
 
-}
\ No newline at end of file
+TEST_F(ScannerTest, test_keywords) {
+    for (const aankaa::Keyword& keyword : aankaa::KEYWORDS) {
+        EXPECT_EQ(aankaa::keyword_type(keyword.name, keyword.length), keyword.type) << keyword.name;
+        // 前缀、加一个字符、改大小写都不是关键字
+        std::string name(keyword.name);
+        for (const std::string& other : {name.substr(0, name.size() - 1), name + "s", "_" + name,
+                                         std::string(1, name[0] - 'a' + 'A') + name.substr(1)}) {
+            if (other.empty()) {
+                continue;
+            }
+            EXPECT_EQ(aankaa::keyword_type(other.c_str(), other.size()), aankaa::IDENTIFIER) << other;
+        }
+    }
+    Scanner s;
+    std::string source = "class classic this thistle super superb fun funny var variance";
+    s.reset(source);
+    std::vector<aankaa::TokenType> types;
+    for (Token token = s.scan_token(); token.type != aankaa::EEOF; token = s.scan_token()) {
+        types.push_back(token.type);
+    }
+    EXPECT_EQ(types, std::vector<aankaa::TokenType>({aankaa::CLASS, aankaa::IDENTIFIER, aankaa::THIS,
+              aankaa::IDENTIFIER, aankaa::SUPER, aankaa::IDENTIFIER, aankaa::FUN, aankaa::IDENTIFIER,
+              aankaa::VAR, aankaa::IDENTIFIER}));
+}
+
+TEST_F(ScannerTest, test_char_class) {
+    for (int ch = 0; ch < 256; ++ch) {
+        bool alpha = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_';
+        bool digit = ch >= '0' && ch <= '9';
+        bool blank = ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+        EXPECT_EQ(aankaa::char_is(ch, aankaa::CHAR_ALPHA), alpha) << ch;
+        EXPECT_EQ(aankaa::char_is(ch, aankaa::CHAR_DIGIT), digit) << ch;
+        EXPECT_EQ(aankaa::char_is(ch, aankaa::CHAR_IDENT), alpha || digit) << ch;
+        EXPECT_EQ(aankaa::char_is(ch, aankaa::CHAR_BLANK), blank) << ch;
+    }
+}
+
+}
@@ -0,0 +1,90 @@
+#include <string>
+#include <fstream>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "scanner.h"
+#include "source_buffer.h"
+
+using aankaa::Scanner;
+using aankaa::SourceBuffer;
+using aankaa::Token;
+
+namespace test {
+
+class SourceBufferTest : public ::testing::Test {
+private:
+    virtual void SetUp() {
+        _path = testing::TempDir() + "aankaa_source_test_" + std::to_string(getpid()) + ".js";
+    }
+    virtual void TearDown() {
+        unlink(_path.c_str());
+    }
+protected:
+    void write_file(const std::string& content) {
+        std::ofstream(_path, std::ios::binary | std::ios::trunc) << content;
+    }
+    std::vector<std::string> scan(SourceBuffer source) {
+        Scanner s;
+        s.reset(std::move(source));
+        std::vector<std::string> tokens;
+        for (Token token = s.scan_token(); token.type != aankaa::EEOF; token = s.scan_token()) {
+            tokens.push_back(token.to_string());
+        }
+        return tokens;
+    }
+protected:
+    std::string _path;
+};
+
+TEST_F(SourceBufferTest, test_borrow_and_copy) {
+    std::string text = "var a = 1;";
+    SourceBuffer borrowed(text);
+    EXPECT_EQ(borrowed.data(), text.data());
+    EXPECT_EQ(borrowed.size(), text.size());
+
+    // 只借用"var a"这一段时没有哨兵，要复制
+    SourceBuffer copied = SourceBuffer::copy(std::string_view(text).substr(0, 5));
+    EXPECT_NE(copied.data(), text.data());
+    EXPECT_EQ(copied.view(), "var a");
+    EXPECT_EQ(copied.data()[copied.size()], '\0');
+
+    // 移动之后数据的地址不变
+    const char* data = copied.data();
+    SourceBuffer moved(std::move(copied));
+    EXPECT_EQ(moved.data(), data);
+    EXPECT_EQ(copied.size(), 0u);
+    EXPECT_EQ(scan(std::move(moved)), std::vector<std::string>({"var", "a"}));
+}
+
+TEST_F(SourceBufferTest, test_map_file) {
+    // 文件大小正好是一页时哨兵在多映射的匿名页上
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (size_t size : {size_t(1), page - 1, page, 2 * page}) {
+        std::string content(size, ' ');
+        content[size - 1] = 'x';
+        write_file(content);
+        SourceBuffer buffer;
+        std::string error;
+        ASSERT_TRUE(buffer.map_file(_path, &error)) << error;
+        EXPECT_TRUE(buffer.is_mapped());
+        ASSERT_EQ(buffer.size(), size);
+        EXPECT_EQ(buffer.view(), content);
+        EXPECT_EQ(buffer.data()[size], '\0');
+        EXPECT_EQ(scan(std::move(buffer)), std::vector<std::string>({"x"}));
+    }
+
+    write_file("");
+    SourceBuffer empty;
+    std::string error;
+    ASSERT_TRUE(empty.map_file(_path, &error)) << error;
+    EXPECT_EQ(empty.size(), 0u);
+    EXPECT_EQ(empty.data()[0], '\0');
+
+    unlink(_path.c_str());
+    EXPECT_FALSE(empty.map_file(_path, &error));
+    EXPECT_NE(error.find("cannot open"), std::string::npos);
+}
+
+} // namespace
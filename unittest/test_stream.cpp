@@ -0,0 +1,130 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "scanner.h"
+#include "parser.h"
+#include "vm.h"
+
+using aankaa::Scanner;
+using aankaa::Parser;
+using aankaa::VM;
+using aankaa::Value;
+using aankaa::Token;
+using aankaa::ObjFunction;
+
+namespace test {
+
+class StreamTest : public ::testing::Test {
+private:
+    virtual void SetUp() {
+        _path = testing::TempDir() + "aankaa_stream_test_" + std::to_string(getpid()) + ".js";
+    }
+    virtual void TearDown() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+        unlink(_path.c_str());
+    }
+protected:
+    int open_source(const std::string& source) {
+        std::ofstream(_path, std::ios::binary | std::ios::trunc) << source;
+        if (_fd >= 0) {
+            close(_fd);
+        }
+        _fd = open(_path.c_str(), O_RDONLY);
+        return _fd;
+    }
+    static std::vector<std::string> tokens(Scanner* s) {
+        std::vector<std::string> result;
+        for (;;) {
+            Token token = s->scan_token();
+            result.push_back(std::to_string(token.line) + ":" + std::to_string(token.type) + ":"
+                             + token.to_string());
+            if (token.type == aankaa::EEOF) {
+                return result;
+            }
+        }
+    }
+protected:
+    std::string _path;
+    int _fd = -1;
+};
+
+// 各种token跨块的时候和一次读进内存扫描的结果一样
+TEST_F(StreamTest, test_tokens_across_chunks) {
+    std::string source =
+        "// a comment that is longer than several chunks\n"
+        "var name_longer_than_a_chunk = 12345.678 >= 3 == 4 != 5 <= 6;\n"
+        "  \t  \n"
+        "var s = \"a string\n"
+        "spanning lines\"; // tail comment\n"
+        "a = b / c;\n"
+        "var unterminated = \"no closing quote";
+    Scanner expected_scanner;
+    expected_scanner.reset(source);
+    std::vector<std::string> expected = tokens(&expected_scanner);
+    for (size_t chunk_size : {1, 2, 3, 7, 16, 1024}) {
+        Scanner s;
+        s.reset_stream(open_source(source), chunk_size);
+        EXPECT_EQ(tokens(&s), expected) << chunk_size;
+    }
+}
+
+// 分批编译执行，扫描器占用的内存不随源码变大
+TEST_F(StreamTest, test_compile_batches) {
+    std::string source = "var total = 0;\n";
+    for (int i = 0; i < 20000; ++i) {
+        source += "var row = " + std::to_string(i) + "; total = total + row;\n";
+        if (i % 1000 == 0) {
+            source += "fun f" + std::to_string(i) + "(a) {\n    var local = a * 2;\n    return local;\n}\n";
+        }
+    }
+    source += "var last = f19000(total);\n";
+
+    VM vm;
+    Scanner s;
+    s.reset_stream(open_source(source), 256);
+    Parser parser(&s, &vm);
+    parser.advance();
+    int batches = 0;
+    size_t max_retained = 0;
+    while (ObjFunction* function = parser.compile_next(1024)) {
+        ASSERT_EQ(vm.interpret(function), aankaa::INTERPRET_OK);
+        max_retained = std::max(max_retained, s.retained_bytes());
+        batches++;
+    }
+    EXPECT_FALSE(parser.had_error);
+    EXPECT_GT(batches, 100);
+    EXPECT_LT(max_retained, 4096u);
+    Value v;
+    ASSERT_TRUE(vm.get_global("total", &v));
+    EXPECT_EQ(v.to_string(), std::to_string(19999 * 20000 / 2));
+    ASSERT_TRUE(vm.get_global("last", &v));
+    EXPECT_EQ(v.to_string(), std::to_string(19999 * 20000));
+}
+
+TEST_F(StreamTest, test_compile_error) {
+    VM vm;
+    Scanner s;
+    s.reset_stream(open_source("var a = 1;\nvar b = ;\nvar c = 3;\n"), 4);
+    Parser parser(&s, &vm);
+    parser.advance();
+    testing::internal::CaptureStderr();
+    ObjFunction* function = nullptr;
+    while ((function = parser.compile_next(1)) != nullptr) {
+        ASSERT_EQ(vm.interpret(function), aankaa::INTERPRET_OK);
+    }
+    std::string output = testing::internal::GetCapturedStderr();
+    EXPECT_TRUE(parser.had_error);
+    EXPECT_NE(output.find("line 1 Error at ';'"), std::string::npos) << output;
+    Value v;
+    EXPECT_TRUE(vm.get_global("a", &v));
+    EXPECT_FALSE(vm.get_global("c", &v));
+}
+
+} // namespace
@@ -0,0 +1,45 @@
+#include <iostream>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "trace.h"
+
+namespace test {
+
+class TraceTest : public ::testing::Test {
+private:
+    virtual void SetUp() {
+    }
+    virtual void TearDown() {
+        aankaa::trace_flags = aankaa::TRACE_NONE;
+    }
+protected:
+};
+
+TEST_F(TraceTest, test_parse_flags) {
+    uint32_t flags = 0;
+    EXPECT_TRUE(aankaa::parse_trace_flags("compile,exec", &flags));
+    EXPECT_EQ(flags, aankaa::TRACE_COMPILE | aankaa::TRACE_EXEC);
+    EXPECT_TRUE(aankaa::parse_trace_flags("gc", &flags));
+    EXPECT_EQ(flags, aankaa::TRACE_GC);
+    EXPECT_TRUE(aankaa::parse_trace_flags("all", &flags));
+    EXPECT_EQ(flags, aankaa::TRACE_ALL);
+    EXPECT_TRUE(aankaa::parse_trace_flags("", &flags));
+    EXPECT_EQ(flags, aankaa::TRACE_NONE);
+    // 不认识的类别不修改原来的值
+    flags = aankaa::TRACE_CHUNK;
+    EXPECT_FALSE(aankaa::parse_trace_flags("compile,foo", &flags));
+    EXPECT_EQ(flags, aankaa::TRACE_CHUNK);
+    EXPECT_FALSE(aankaa::parse_trace_flags("comp", &flags));
+}
+
+TEST_F(TraceTest, test_disabled_by_default) {
+    EXPECT_FALSE(aankaa::trace_enabled(aankaa::TRACE_COMPILE));
+    int evaluated = 0;
+    // 没有打开的类别不会对参数求值
+    TRACE(aankaa::TRACE_COMPILE, ++evaluated);
+    EXPECT_EQ(evaluated, 0);
+}
+
+}
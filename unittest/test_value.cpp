@@ -56,4 +56,41 @@ TEST_F(ValueTest, test_value) {
 
 }
 
+TEST_F(ValueTest, test_encoding) {
+#ifdef AANKAA_NAN_BOXING
+    EXPECT_EQ(sizeof(Value), 8u);
+#endif
+    Value d(3.25);
+    EXPECT_TRUE(d.is_number());
+    EXPECT_FALSE(d.is_integer() || d.is_bool() || d.is_nil() || d.is_obj());
+    EXPECT_EQ(d.as_number(), 3.25);
+
+    Value i(-7);
+    EXPECT_TRUE(i.is_integer());
+    EXPECT_FALSE(i.is_number() || i.is_bool() || i.is_nil() || i.is_obj());
+    EXPECT_EQ(i.as_integer(), -7);
+    // 数值都是真值，包括整数0
+    EXPECT_FALSE(Value(0).is_falsey());
+    EXPECT_FALSE(Value(0.0).is_falsey());
+
+    Value t(true);
+    Value f(false);
+    EXPECT_TRUE(t.is_bool() && f.is_bool());
+    EXPECT_TRUE(t.as_bool());
+    EXPECT_FALSE(f.as_bool());
+    EXPECT_TRUE(f.is_falsey());
+    EXPECT_FALSE(t.is_falsey());
+
+    Value n(nullptr);
+    EXPECT_TRUE(n.is_nil());
+    EXPECT_FALSE(n.is_bool() || n.is_number() || n.is_obj());
+    EXPECT_TRUE(n.is_falsey());
+
+    Value nan(0.0 / 0.0);
+    EXPECT_TRUE(nan.is_number());
+    EXPECT_FALSE(nan == nan);
+    EXPECT_TRUE(Value(0.0) == Value(-0.0));
+    EXPECT_TRUE(Value(5) == Value(5));
+}
+
 }
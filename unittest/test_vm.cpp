@@ -0,0 +1,1258 @@
+#include <iostream>
+#include <chrono>
+#include <future>
+#include <atomic>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <set>
+#include <cmath>
+
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <memory>
+#include "gtest/gtest.h"
+
+#define private public
+#define protected public
+#include "scanner.h"
+#include "parser.h"
+#include "vm.h"
+#include "bytecode_cache.h"
+#undef private
+#undef protected
+
+#include <typeinfo>       // operator typeid
+
+using aankaa::Scanner;
+using aankaa::Parser;
+using aankaa::VM;
+using aankaa::Value;
+using aankaa::InterpretResult;
+
+namespace test {
+
+class VMTest : public ::testing::Test {
+private:
+    virtual void SetUp() {
+    }
+    virtual void TearDown() {
+    }
+protected:
+    InterpretResult run(VM& vm, const std::string& source) {
+        Scanner s;
+        s.reset(source);
+        Parser parser(&s, &vm);
+        parser.advance();
+        return vm.interpret(parser.compile());
+    }
+    // 只编译不执行。返回的main函数在vm析构之前一直作为根，执行之后还可以检查它的字节码。
+    // configure在编译之前调整parser的开关，inspect在编译之后读取parser的统计
+    aankaa::ObjFunction* compile(VM& vm, const std::string& source,
+                                 const std::function<void(Parser&)>& configure = nullptr,
+                                 const std::function<void(Parser&)>& inspect = nullptr) {
+        Scanner s;
+        s.reset(source);
+        Parser parser(&s, &vm);
+        if (configure) {
+            configure(parser);
+        }
+        parser.advance();
+        aankaa::ObjFunction* script = parser.compile();
+        if (inspect) {
+            inspect(parser);
+        }
+        if (script != nullptr) {
+            vm.push_root(script);
+        }
+        return script;
+    }
+    // 在栈式和寄存器两个后端上分别用新的VM编译执行source，执行成功之后调用check。
+    // register_compiled是寄存器后端能否翻译整个程序，不能时整个程序退回栈式VM执行
+    void run_backends(const std::string& source, const std::function<void(VM&, aankaa::ObjFunction*)>& check,
+                      bool register_compiled = true, uint32_t max_frames = aankaa::DEFAULT_MAX_FRAMES,
+                      bool gc_stress = false) {
+        for (aankaa::Backend backend : {aankaa::BACKEND_STACK, aankaa::BACKEND_REGISTER}) {
+            SCOPED_TRACE(backend == aankaa::BACKEND_STACK ? "stack backend" : "register backend");
+            VM vm(max_frames);
+            // DEBUG_STRESS_GC构建里默认就是每次分配都回收
+            vm.gc_stress = vm.gc_stress || gc_stress;
+            vm.backend = backend;
+            aankaa::ObjFunction* script = compile(vm, source);
+            ASSERT_NE(script, nullptr);
+            EXPECT_EQ(script->reg_chunk != nullptr, register_compiled && backend == aankaa::BACKEND_REGISTER);
+            ASSERT_EQ(vm.interpret(script), aankaa::INTERPRET_OK);
+            EXPECT_EQ(vm.stack_top, vm.stack_bottom);
+            check(vm, script);
+        }
+    }
+    Value global(VM& vm, const std::string& name) {
+        Value v;
+        EXPECT_TRUE(vm.get_global(name, &v)) << name;
+        return v;
+    }
+};
+
+TEST_F(VMTest, test_global_slots) {
+    VM vm;
+    ASSERT_EQ(run(vm, "var a = 1; var b = 2; a = a + b; var c = a * 10;"), aankaa::INTERPRET_OK);
+    EXPECT_EQ(global(vm, "a").as_integer(), 3);
+    EXPECT_EQ(global(vm, "c").as_integer(), 30);
+    // 同一个名字只占一个槽位
+    EXPECT_EQ(vm.find_global("a"), vm.globals.resolve(vm.copy_string("a", 1)));
+    // native函数也在同一张表里
+    EXPECT_TRUE(global(vm, "clock").is_obj_type(aankaa::OBJ_NATIVE));
+}
+
+TEST_F(VMTest, test_undefined_global) {
+    VM vm;
+    EXPECT_EQ(run(vm, "print x;"), aankaa::INTERPRET_RUNTIME_ERROR);
+    VM vm2;
+    EXPECT_EQ(run(vm2, "y = 3;"), aankaa::INTERPRET_RUNTIME_ERROR);
+    Value v;
+    EXPECT_FALSE(vm2.get_global("y", &v));
+}
+
+TEST_F(VMTest, test_locals_and_functions) {
+    VM vm;
+    ASSERT_EQ(run(vm,
+        "fun add(a, b) { return a + b; }\n"
+        "var total = 0;\n"
+        "{ var x = 4; var y = 5; total = add(x, y); }\n"
+        "for (var i = 0; i < 3; i = i + 1) { total = total + i; }\n"),
+        aankaa::INTERPRET_OK);
+    EXPECT_EQ(global(vm, "total").as_integer(), 12);
+}
+
+TEST_F(VMTest, test_string_interning) {
+    VM vm;
+    // 下面直接往驻留表里塞没有根引用的字符串，不能被stress模式回收掉
+    vm.gc_stress = false;
+    ASSERT_EQ(run(vm,
+        "var a = \"hello world\";\n"
+        "var b = \"hello\" + \" \" + \"world\";\n"
+        "var same = a == b;\n"),
+        aankaa::INTERPRET_OK);
+    // 运行时拼接出来的字符串和字面量是同一个对象
+    EXPECT_EQ(global(vm, "a").as_obj(), global(vm, "b").as_obj());
+    EXPECT_TRUE(global(vm, "same").as_bool());
+    EXPECT_EQ(vm.copy_string("hello world", 11), global(vm, "a").as_string());
+
+    aankaa::StringTable& table = vm.strings;
+    int size = table.size();
+    for (int i = 0; i < 1000; ++i) {
+        std::string str = "s" + std::to_string(i);
+        vm.copy_string(str.data(), str.size());
+    }
+    EXPECT_EQ(table.size(), size + 1000);
+    EXPECT_EQ(vm.copy_string("s999", 4, true), vm.copy_string("s999", 4));
+    EXPECT_TRUE(table.remove(vm.copy_string("s10", 3)));
+    EXPECT_EQ(table.find("s10", 3, aankaa::hash_string("s10", 3)), nullptr);
+    EXPECT_NE(table.find("s11", 3, aankaa::hash_string("s11", 3)), nullptr);
+    EXPECT_EQ(table.size(), size + 999);
+}
+
+TEST_F(VMTest, test_gc_reclaims_garbage) {
+    VM vm;
+    vm.gc_stress = false;
+    ASSERT_EQ(run(vm,
+        "var s = \"\";\n"
+        "var i = 0;\n"
+        "while (i < 200) { s = s + \"x\"; i = i + 1; }\n"),
+        aankaa::INTERPRET_OK);
+    // 拼接过程中的中间字符串都分配在nursery里，回收时只有最后的结果被晋升
+    EXPECT_GT(vm.nursery.used(), 0u);
+    vm.collect_garbage();
+    EXPECT_EQ(vm.nursery.used(), 0u);
+    EXPECT_EQ(vm.gc_stats.minor_collections, 1u);
+    EXPECT_EQ(vm.gc_stats.bytes_promoted, aankaa::ObjString::alloc_size(200));
+    EXPECT_EQ(global(vm, "s").as_string()->view(), std::string(200, 'x'));
+    // 驻留表里被回收的字符串也删掉了
+    EXPECT_EQ(vm.strings.find("xx", 2, aankaa::hash_string("xx", 2)), nullptr);
+}
+
+TEST_F(VMTest, test_gc_stress) {
+    VM vm;
+    vm.gc_stress = true;
+    ASSERT_EQ(run(vm,
+        "fun join(a, b) { return a + \"-\" + b; }\n"
+        "var s = \"a\";\n"
+        "for (var i = 0; i < 20; i = i + 1) { s = join(s, \"b\"); }\n"
+        "var t = \"a\";\n"
+        "{ var k = 0; while (k < 20) { t = t + \"-b\"; k = k + 1; } }\n"
+        "var same = s == t;\n"),
+        aankaa::INTERPRET_OK);
+    EXPECT_TRUE(global(vm, "same").as_bool());
+    EXPECT_GT(vm.gc_stats.collections, 50u);
+    Value join;
+    EXPECT_TRUE(vm.get_global("join", &join));
+    EXPECT_TRUE(join.is_obj_type(aankaa::OBJ_FUNCTION));
+}
+
+TEST_F(VMTest, test_nursery_promotion) {
+    VM vm;
+    ASSERT_EQ(run(vm,
+        "var keep = \"\";\n"
+        "var i = 0;\n"
+        "while (i < 20000) {\n"
+        "    var tmp = \"item\" + \"-\" + \"value\";\n"
+        "    keep = keep + \"k\";\n"
+        "    if (i == 9999) { keep = \"\"; }\n"
+        "    i = i + 1;\n"
+        "}\n"),
+        aankaa::INTERPRET_OK);
+    // 字符串越来越长，nursery会被填满很多次
+    EXPECT_GT(vm.gc_stats.minor_collections, 0u);
+    vm.collect_garbage();
+    aankaa::ObjString* keep = global(vm, "keep").as_string();
+    EXPECT_FALSE(vm.nursery.contains(keep));
+    EXPECT_EQ(keep->view(), std::string(10000, 'k'));
+    // 晋升之后驻留表里还是同一个对象
+    EXPECT_EQ(vm.copy_string("item-value", 10), vm.copy_string("item-value", 10, true));
+
+    // 编译期的常量可能和nursery里的字符串是同一个对象，需要通过write barrier保护
+    VM vm2;
+    ASSERT_EQ(run(vm2, "var x = \"x\"; var a = x + \"y\";"), aankaa::INTERPRET_OK);
+    EXPECT_TRUE(vm2.nursery.contains(global(vm2, "a").as_obj()));
+    ASSERT_EQ(run(vm2, "var b = \"xy\"; var same = a == b;"), aankaa::INTERPRET_OK);
+    EXPECT_TRUE(global(vm2, "same").as_bool());
+    vm2.collect_garbage();
+    EXPECT_EQ(global(vm2, "a").as_obj(), global(vm2, "b").as_obj());
+    EXPECT_FALSE(vm2.nursery.contains(global(vm2, "b").as_obj()));
+}
+
+TEST_F(VMTest, test_promoted_global_name) {
+    // foo第一次驻留时是运行时拼出来的nursery字符串，之后定义的全局变量直接用它作为名字
+    VM vm;
+    // 晋升之前要先检查名字还在nursery里，不能被stress模式提前回收
+    vm.gc_stress = false;
+    ASSERT_EQ(run(vm, "var a = \"fo\"; var s = a + \"o\";"), aankaa::INTERPRET_OK);
+    ASSERT_EQ(run(vm, "var foo = 1;"), aankaa::INTERPRET_OK);
+    int slot = vm.find_global("foo");
+    ASSERT_GE(slot, 0);
+    EXPECT_TRUE(vm.nursery.contains(vm.globals.name_of(slot)));
+    int count = vm.globals.size();
+
+    // 名字晋升之后，按名字还能找到原来的槽位，不会再分配一个未定义的槽位
+    vm.collect_garbage();
+    EXPECT_FALSE(vm.nursery.contains(vm.globals.name_of(slot)));
+    EXPECT_EQ(vm.find_global("foo"), slot);
+    ASSERT_EQ(run(vm, "var r = foo + 1;"), aankaa::INTERPRET_OK);
+    EXPECT_EQ(global(vm, "r").as_integer(), 2);
+    EXPECT_EQ(vm.globals.size(), count + 1);
+}
+
+TEST_F(VMTest, test_superinstructions) {
+    const std::string source =
+        "var result = 0;\n"
+        "var text = \"\";\n"
+        "fun loop(n) {\n"
+        "    var a = 0;\n"
+        "    var sum = 0;\n"
+        "    var s = \"\";\n"
+        "    while (a < n) {\n"
+        "        a = a + 1;\n"
+        "        sum = sum + a;\n"
+        "        if (a < 4) { s = s + \"x\"; }\n"
+        "    }\n"
+        "    for (var i = 0; i < 3; i = i + 1) { sum = sum + i; }\n"
+        "    text = s;\n"
+        "    return sum + 1;\n"
+        "}\n"
+        "result = loop(100);\n";
+    for (bool peephole : {true, false}) {
+        VM vm;
+        aankaa::PeepholeStats stats;
+        aankaa::ObjFunction* script = compile(vm, source,
+            [&](Parser& parser) { parser.enable_peephole = peephole; },
+            [&](Parser& parser) { stats = parser.peephole_stats; });
+        ASSERT_NE(script, nullptr);
+        ASSERT_EQ(vm.interpret(script), aankaa::INTERPRET_OK);
+        EXPECT_EQ(global(vm, "result").as_integer(), 5050 + 3 + 1);
+        EXPECT_EQ(global(vm, "text").as_string()->view(), "xxx");
+
+        aankaa::ObjFunction* loop = global(vm, "loop").as_function();
+        std::vector<uint8_t>& code = loop->chunk->code;
+        int fused = 0;
+        for (size_t i = 0; i < code.size(); i += aankaa::op_size(code[i])) {
+            fused += code[i] >= aankaa::OP_ADD_LOCAL_CONST && code[i] <= aankaa::OP_LESS_LOCAL_CONST_JUMP;
+        }
+        EXPECT_EQ(fused > 0, peephole);
+        if (peephole) {
+            EXPECT_EQ(stats.inc_local, 3u);
+            EXPECT_EQ(stats.less_local_const_jump, 2u);
+            EXPECT_EQ(stats.add_local_const, 1u);
+            EXPECT_LT(stats.bytes_after, stats.bytes_before);
+        }
+    }
+
+    // 融合之后类型错误的报错和原来一样
+    VM vm;
+    EXPECT_EQ(run(vm, "fun f() { var a = \"x\"; while (a < 3) { } } f();"),
+              aankaa::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run(vm, "fun g() { var a = \"s\"; a = a + 1; } g();"),
+              aankaa::INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_F(VMTest, test_opcode_profiler) {
+    aankaa::OpcodeProfiler profiler;
+    const uint8_t ops[] = {aankaa::OP_GET_LOCAL, aankaa::OP_CONSTANT, aankaa::OP_ADD,
+                           aankaa::OP_GET_LOCAL, aankaa::OP_CONSTANT, aankaa::OP_ADD};
+    for (uint8_t op : ops) {
+        profiler.record(op);
+    }
+    EXPECT_EQ(profiler.instructions(), 6u);
+    auto pairs = profiler.top(1, 2);
+    ASSERT_EQ(pairs.size(), 1u);
+    EXPECT_EQ(pairs[0].count, 2u);
+    auto triples = profiler.top(10, 3);
+    ASSERT_EQ(triples.size(), 3u);
+    EXPECT_EQ(triples[0].ops, std::vector<uint8_t>({aankaa::OP_GET_LOCAL, aankaa::OP_CONSTANT, aankaa::OP_ADD}));
+    EXPECT_EQ(triples[0].count, 2u);
+    EXPECT_EQ(profiler.top(10, 4).size(), 3u);
+}
+
+
+TEST_F(VMTest, test_register_backend) {
+    const std::string source =
+        "fun fib(n) { if (n < 2) return n; return fib(n - 2) + fib(n - 1); }\n"
+        "fun loop(n) {\n"
+        "    var sum = 0;\n"
+        "    var s = \"\";\n"
+        "    for (var i = 0; i < n; i = i + 1) {\n"
+        "        var t = i * 2;\n"
+        "        sum = sum + t - i / 2;\n"
+        "        if (i == 3 or i > n - 2) { s = s + \"x\"; }\n"
+        "        if (i >= 5 and i != 7) { sum = sum + 1; }\n"
+        "    }\n"
+        "    return s + \"|\" + \"\" ;\n"
+        "}\n"
+        "var f = fib(15);\n"
+        "var text = loop(20);\n"
+        "var neg = -f;\n"
+        "var swap = 1; var other = 2;\n"
+        "{ var a = swap; var b = other; a = b = a + b; swap = a; other = b; }\n"
+        "var t = clock() > 0;\n"
+        "var sum = 0;\n"
+        "var i = 0;\n"
+        "while (i < 100) { sum = sum + i; i = i + 1; }\n";
+    const char* names[] = {"f", "text", "neg", "swap", "other", "t", "sum", "i"};
+    std::vector<std::string> expected;
+    run_backends(source, [&](VM& vm, aankaa::ObjFunction*) {
+        std::vector<std::string> values;
+        for (const char* name : names) {
+            values.push_back(global(vm, name).to_string());
+        }
+        if (expected.empty()) {
+            expected = values;
+            EXPECT_EQ(global(vm, "f").as_integer(), 610);
+            EXPECT_EQ(global(vm, "text").as_string()->view(), "xx|");
+            return;
+        }
+        EXPECT_EQ(values, expected);
+        // 三地址指令比栈式指令少
+        aankaa::ObjFunction* fib = global(vm, "fib").as_function();
+        ASSERT_NE(fib->reg_chunk, nullptr);
+        size_t stack_instructions = 0;
+        std::vector<uint8_t>& code = fib->chunk->code;
+        for (size_t i = 0; i < code.size(); i += aankaa::op_size(code[i])) {
+            stack_instructions++;
+        }
+        EXPECT_LT(fib->reg_chunk->code.size(), stack_instructions);
+    });
+
+    // 运行时错误和栈式后端一样
+    for (const char* bad : {"var a = \"x\" - 1;", "fun f(a) {} f();", "print -\"s\";", "x = 1;",
+                            "fun r(n) { return r(n + 1) + 1; } r(0);"}) {
+        VM vm;
+        vm.backend = aankaa::BACKEND_REGISTER;
+        EXPECT_EQ(run(vm, bad), aankaa::INTERPRET_RUNTIME_ERROR) << bad;
+    }
+}
+
+TEST_F(VMTest, test_register_fallback) {
+    // 不支持的指令翻译失败，函数保持只有栈式字节码
+    VM vm;
+    aankaa::ObjFunction* function = vm.allocate<aankaa::ObjFunction>();
+    vm.push_root(function);
+    aankaa::Chunk* chunk = function->chunk;
+    chunk->write(aankaa::OP_NIL, 1);
+    chunk->write(aankaa::OP_GET_PROPERTY, 1);
+    chunk->write(0, 1);
+    chunk->write(aankaa::OP_RETURN, 1);
+    aankaa::RegisterEmitter emitter;
+    EXPECT_FALSE(emitter.emit(function));
+    EXPECT_EQ(function->reg_chunk, nullptr);
+    EXPECT_FALSE(emitter.error().empty());
+    vm.remove_root(function);
+}
+
+TEST_F(VMTest, test_integer_arithmetic) {
+    VM vm;
+    ASSERT_EQ(run(vm,
+        "var a = 7; var b = 1.5; var big = 3000000000;\n"
+        "var sum = a + 2; var mixed = a + b; var half = a / 2; var exact = 8 / 2;\n"
+        "var overflow = 2147483647 + 1; var product = 65536 * 65536; var neg = -a;\n"
+        "var same = 1 == 1.0; var less = 2 < 2.5;\n"), aankaa::INTERPRET_OK);
+    EXPECT_TRUE(global(vm, "a").is_integer());
+    EXPECT_TRUE(global(vm, "b").is_number());
+    EXPECT_TRUE(global(vm, "big").is_number());
+    EXPECT_EQ(global(vm, "big").as_number(), 3000000000.0);
+    EXPECT_EQ(global(vm, "sum").as_integer(), 9);
+    EXPECT_EQ(global(vm, "mixed").as_number(), 8.5);
+    EXPECT_EQ(global(vm, "half").as_number(), 3.5);
+    EXPECT_EQ(global(vm, "exact").to_double(), 4);
+    // 溢出时提升为double
+    EXPECT_EQ(global(vm, "overflow").as_number(), 2147483648.0);
+    EXPECT_EQ(global(vm, "product").as_number(), 4294967296.0);
+    EXPECT_EQ(global(vm, "neg").as_integer(), -7);
+    EXPECT_TRUE(global(vm, "same").as_bool());
+    EXPECT_TRUE(global(vm, "less").as_bool());
+}
+
+TEST_F(VMTest, test_numeric_truthiness) {
+    // 整数和double的区分只在VM内部，条件判断里数值都是真值，包括整数0、0.0和溢出后算出来的0
+    const std::string source =
+        "var z = 0; var zf = 0.0; var m = 2147483647; var promoted = m + 1 - 2147483648;\n"
+        "var literal = 0; if (0) literal = 1;\n"
+        "var int_zero = 0; if (z) int_zero = 1;\n"
+        "var double_zero = 0; if (zf) double_zero = 1;\n"
+        "var promoted_zero = 0; if (promoted) promoted_zero = 1;\n"
+        "var and_zero = z and 5; var or_zero = zf or 5;\n"
+        "var loops = 0; while (z) { loops = loops + 1; if (loops > 2) z = 2 < 1; }\n";
+    for (aankaa::Backend backend : {aankaa::BACKEND_STACK, aankaa::BACKEND_REGISTER}) {
+        VM vm;
+        vm.backend = backend;
+        ASSERT_EQ(run(vm, source), aankaa::INTERPRET_OK);
+        EXPECT_TRUE(global(vm, "promoted").is_number());
+        EXPECT_EQ(global(vm, "literal").as_integer(), 1);
+        EXPECT_EQ(global(vm, "int_zero").as_integer(), 1);
+        EXPECT_EQ(global(vm, "double_zero").as_integer(), 1);
+        EXPECT_EQ(global(vm, "promoted_zero").as_integer(), 1);
+        EXPECT_EQ(global(vm, "and_zero").as_integer(), 5);
+        EXPECT_EQ(global(vm, "or_zero").as_number(), 0.0);
+        EXPECT_EQ(global(vm, "loops").as_integer(), 3);
+    }
+}
+
+TEST_F(VMTest, test_quickening) {
+    VM vm;
+    ASSERT_EQ(run(vm,
+        "fun add(a, b) { return a + b; }\n"
+        "fun lt(a, b) { return a < b; }\n"
+        "var r1 = add(1, 2); var l1 = lt(1, 2);\n"),
+        aankaa::INTERPRET_OK);
+    aankaa::ObjFunction* add = global(vm, "add").as_function();
+    aankaa::ObjFunction* lt = global(vm, "lt").as_function();
+    auto has_op = [](aankaa::ObjFunction* function, uint8_t op) {
+        std::vector<uint8_t>& code = function->chunk->code;
+        for (size_t i = 0; i < code.size(); i += aankaa::op_size(code[i])) {
+            if (code[i] == op) {
+                return true;
+            }
+        }
+        return false;
+    };
+    // 第一次执行之后改写成整数版本
+    EXPECT_TRUE(has_op(add, aankaa::OP_ADD_INT));
+    EXPECT_TRUE(has_op(lt, aankaa::OP_LESS_INT));
+    EXPECT_EQ(global(vm, "r1").as_integer(), 3);
+    EXPECT_TRUE(global(vm, "l1").as_bool());
+
+    // 类型不符时退回通用指令重新执行，再按新的类型改写
+    vm.reset_stack();
+    ASSERT_EQ(run(vm, "var r2 = add(1.5, 2.25); var l2 = lt(3.5, 2.5);"), aankaa::INTERPRET_OK);
+    EXPECT_EQ(global(vm, "r2").as_number(), 3.75);
+    EXPECT_FALSE(global(vm, "l2").as_bool());
+    EXPECT_TRUE(has_op(add, aankaa::OP_ADD_NUM));
+    EXPECT_TRUE(has_op(lt, aankaa::OP_LESS_NUM));
+
+    // 整数溢出和混合类型留在通用指令
+    ASSERT_EQ(run(vm, "var r3 = add(2147483647, 1); var r4 = add(1, 0.5); var r5 = add(\"a\", \"b\");"),
+              aankaa::INTERPRET_OK);
+    EXPECT_EQ(global(vm, "r3").as_number(), 2147483648.0);
+    EXPECT_EQ(global(vm, "r4").as_number(), 1.5);
+    EXPECT_EQ(global(vm, "r5").as_string()->view(), "ab");
+    EXPECT_TRUE(has_op(add, aankaa::OP_ADD));
+    EXPECT_EQ(run(vm, "add(1, \"b\");"), aankaa::INTERPRET_RUNTIME_ERROR);
+}
+
+static double native_square(double x) {
+    return x * x;
+}
+
+static double native_hypot2(double a, double b) {
+    return a * a + b * b;
+}
+
+static int native_add_int(int a, int b) {
+    return a + b;
+}
+
+static bool native_is_empty(aankaa::ObjString* str) {
+    return str->length == 0;
+}
+
+TEST_F(VMTest, test_native_binding) {
+    for (aankaa::Backend backend : {aankaa::BACKEND_STACK, aankaa::BACKEND_REGISTER}) {
+        VM vm;
+        vm.backend = backend;
+        aankaa::ObjNative* square = vm.define_native<native_square>("square", aankaa::NATIVE_PURE);
+        aankaa::ObjNative* hypot2 = vm.define_native<native_hypot2>("hypot2", aankaa::NATIVE_PURE);
+        aankaa::ObjNative* add_int = vm.define_native<native_add_int>("add_int");
+        vm.define_native<native_is_empty>("is_empty");
+        // 签名自动生成的元数据
+        EXPECT_EQ(square->arity, 1);
+        EXPECT_TRUE(square->pure);
+        EXPECT_EQ(square->kind, aankaa::NATIVE_NUMBER_1);
+        EXPECT_EQ(hypot2->kind, aankaa::NATIVE_NUMBER_2);
+        EXPECT_EQ(add_int->arity, 2);
+        EXPECT_FALSE(add_int->pure);
+        EXPECT_EQ(add_int->kind, aankaa::NATIVE_GENERIC);
+
+        ASSERT_EQ(run(vm, "var s = square(3); var h = hypot2(1.5, 2);\n"
+                          "var i = add_int(40, 2); var e = is_empty(\"\"); var n = is_empty(\"x\");\n"
+                          "var t = clock() > 0;\n"
+                          "var sum = 0; var k = 0;\n"
+                          "while (k < 100) { sum = sum + square(k); k = k + 1; }\n"),
+                  aankaa::INTERPRET_OK);
+        EXPECT_EQ(global(vm, "s").as_number(), 9.0);
+        EXPECT_EQ(global(vm, "h").as_number(), 6.25);
+        EXPECT_EQ(global(vm, "i").as_integer(), 42);
+        EXPECT_TRUE(global(vm, "e").as_bool());
+        EXPECT_FALSE(global(vm, "n").as_bool());
+        EXPECT_TRUE(global(vm, "t").as_bool());
+        EXPECT_EQ(global(vm, "sum").to_double(), 328350.0);
+
+        // 参数个数和类型在调用前检查
+        EXPECT_EQ(run(vm, "square(1, 2);"), aankaa::INTERPRET_RUNTIME_ERROR);
+        EXPECT_EQ(run(vm, "square(\"a\");"), aankaa::INTERPRET_RUNTIME_ERROR);
+        EXPECT_EQ(run(vm, "add_int(1.5, 2);"), aankaa::INTERPRET_RUNTIME_ERROR);
+        EXPECT_EQ(run(vm, "is_empty(1);"), aankaa::INTERPRET_RUNTIME_ERROR);
+        EXPECT_EQ(vm.stack_top, vm.stack_bottom);
+    }
+
+    // 栈式后端：调用原生函数的OP_CALL改写成OP_CALL_NATIVE，调用点换成脚本函数时改写回OP_CALL，
+    // 再由OP_CALL改写成OP_CALL_CACHED
+    VM vm;
+    vm.define_native<native_square>("square", aankaa::NATIVE_PURE);
+    ASSERT_EQ(run(vm, "fun apply(f, x) { var r = f(x); return r; }\n"
+                      "fun twice(x) { return x + x; }\n"
+                      "var a = apply(square, 4);\n"), aankaa::INTERPRET_OK);
+    aankaa::ObjFunction* apply = global(vm, "apply").as_function();
+    auto has_op = [](aankaa::ObjFunction* function, uint8_t op) {
+        std::vector<uint8_t>& code = function->chunk->code;
+        for (size_t i = 0; i < code.size(); i += aankaa::op_size(code[i])) {
+            if (code[i] == op) {
+                return true;
+            }
+        }
+        return false;
+    };
+    EXPECT_EQ(global(vm, "a").as_number(), 16.0);
+    EXPECT_TRUE(has_op(apply, aankaa::OP_CALL_NATIVE));
+    ASSERT_EQ(run(vm, "var b = apply(twice, 4);"), aankaa::INTERPRET_OK);
+    EXPECT_EQ(global(vm, "b").as_integer(), 8);
+    EXPECT_TRUE(has_op(apply, aankaa::OP_CALL_CACHED));
+    EXPECT_FALSE(has_op(apply, aankaa::OP_CALL_NATIVE));
+}
+
+TEST_F(VMTest, test_constant_folding) {
+    const std::string source =
+        "var a = 8 + 9 * 2;\n"
+        "var s = \"ab\" + \"cd\" + \"e\";\n"
+        "var neg = -(3 * 4);\n"
+        "var cmp = 1 + 1 == 2;\n"
+        "var ge = 2 >= 3;\n"
+        "var x = 5;\n"
+        "var partial = x + 2 * 3;\n"
+        "var logic = 0 and x;\n"
+        "var logic2 = 1 and x;\n"
+        "var branch = 0;\n"
+        "if (1 < 2) { branch = 1; } else { branch = 2; }\n"
+        "if (2 < 1) { branch = branch + 10; }\n"
+        "var loops = 0;\n"
+        "while (2 < 1) { loops = loops + 1; }\n"
+        "for (var i = 0; 1 > 2; i = i + 1) { loops = loops + 1; }\n"
+        "fun f() { while (1) { return 7; } }\n"
+        "var forever = f();\n";
+    std::vector<std::string> expected;
+    for (bool folding : {false, true}) {
+        VM vm;
+        aankaa::FoldStats stats;
+        aankaa::ObjFunction* script = compile(vm, source,
+            [&](Parser& parser) { parser.enable_folding = folding; },
+            [&](Parser& parser) { stats = parser.fold_stats; });
+        ASSERT_NE(script, nullptr);
+        ASSERT_EQ(vm.interpret(script), aankaa::INTERPRET_OK);
+        std::vector<std::string> values;
+        for (const char* name : {"a", "s", "neg", "cmp", "ge", "partial", "logic", "logic2",
+                                 "branch", "loops", "forever"}) {
+            values.push_back(global(vm, name).to_string());
+        }
+        if (!folding) {
+            expected = values;
+            EXPECT_EQ(stats.binary, 0u);
+            continue;
+        }
+        // 折叠前后执行结果一样
+        EXPECT_EQ(values, expected);
+        EXPECT_EQ(global(vm, "a").as_integer(), 26);
+        EXPECT_EQ(global(vm, "s").as_string()->view(), "abcde");
+        EXPECT_EQ(global(vm, "branch").as_integer(), 1);
+        EXPECT_EQ(global(vm, "loops").as_integer(), 0);
+        EXPECT_EQ(stats.binary, 13u);
+        EXPECT_EQ(stats.concat, 2u);
+        EXPECT_EQ(stats.unary, 1u);
+        EXPECT_EQ(stats.logical, 2u);
+        EXPECT_EQ(stats.dead_branches, 2u);
+        EXPECT_EQ(stats.dead_loops, 2u);
+        EXPECT_EQ(stats.infinite_loops, 1u);
+
+        // var a = 8 + 9 * 2 只剩一条constant
+        std::vector<uint8_t>& code = script->chunk->code;
+        EXPECT_EQ(code[0], aankaa::OP_CONSTANT);
+        EXPECT_EQ(code[2], aankaa::OP_DEFINE_GLOBAL);
+    }
+
+    // 运行时才会出错的表达式不折叠
+    VM vm;
+    EXPECT_EQ(run(vm, "var bad = 1 + \"a\";"), aankaa::INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_F(VMTest, test_line_table) {
+    aankaa::LineTable lines;
+    lines.add(1, 3);
+    lines.add(1);
+    lines.add(2, 2);
+    lines.add(5);
+    EXPECT_EQ(lines.size(), 7);
+    EXPECT_EQ(lines.run_count(), 3u);
+    const int expected[] = {1, 1, 1, 1, 2, 2, 5};
+    for (int offset = 0; offset < 7; ++offset) {
+        EXPECT_EQ(lines.line_for_offset(offset), expected[offset]) << offset;
+    }
+    lines.truncate(5);
+    EXPECT_EQ(lines.size(), 5);
+    EXPECT_EQ(lines.line_for_offset(4), 2);
+    lines.add(7);
+    EXPECT_EQ(lines.line_for_offset(5), 7);
+
+    // 和每个字节一个行号的做法对照，覆盖检查点、行号回退和截断
+    aankaa::LineTable table;
+    std::vector<int> reference;
+    srand(7);
+    int line = 0;
+    for (int i = 0; i < 5000; ++i) {
+        line += rand() % 5 == 0 ? -(rand() % 300) : rand() % 3;
+        int count = 1 + rand() % (i % 100 == 0 ? 400 : 6);
+        table.add(line, count);
+        reference.insert(reference.end(), count, line);
+        if (rand() % 50 == 0) {
+            int size = rand() % reference.size();
+            table.truncate(size);
+            reference.resize(size);
+        }
+    }
+    ASSERT_EQ(table.size(), static_cast<int>(reference.size()));
+    for (size_t offset = 0; offset < reference.size(); ++offset) {
+        ASSERT_EQ(table.line_for_offset(offset), reference[offset]) << offset;
+    }
+
+    // 运行时错误报告出错指令所在的行，两个后端一致
+    const std::string source =
+        "fun f(a) {\n"
+        "    var b = a + 1;\n"
+        "    return b - \"x\";\n"
+        "}\n"
+        "var r = 0;\n"
+        "r = f(1);\n";
+    for (aankaa::Backend backend : {aankaa::BACKEND_STACK, aankaa::BACKEND_REGISTER}) {
+        VM vm;
+        vm.backend = backend;
+        testing::internal::CaptureStderr();
+        EXPECT_EQ(run(vm, source), aankaa::INTERPRET_RUNTIME_ERROR);
+        std::string output = testing::internal::GetCapturedStderr();
+        EXPECT_NE(output.find("#0    [line 3] f()"), std::string::npos) << output;
+        EXPECT_NE(output.find("#1    [line 6] script"), std::string::npos) << output;
+    }
+
+    // 每行源码只占一条记录
+    std::string big;
+    for (int i = 0; i < 1000; ++i) {
+        big += "var v" + std::to_string(i) + " = " + std::to_string(i) + " * 2 + 1;\n";
+    }
+    VM vm;
+    aankaa::ObjFunction* script = compile(vm, big);
+    ASSERT_NE(script, nullptr);
+    EXPECT_LE(script->chunk->lines.run_count(), 1001u);
+    EXPECT_EQ(script->chunk->lines.size(), static_cast<int>(script->chunk->code.size()));
+}
+
+TEST_F(VMTest, test_constant_dedup) {
+    VM vm;
+    aankaa::ObjFunction* script = compile(vm,
+        "var a = 1.5; var b = 1.5; var c = \"s\"; var d = \"s\";\n"
+        "var e = 1; var f = 1.0; var g = 0.0; var h = -0.0; var i = 1;\n");
+    ASSERT_NE(script, nullptr);
+    // 1.5、"s"、1各保存一份；1和1.0、0.0和-0.0是不同的常量
+    EXPECT_EQ(script->chunk->constants.size(), 6u);
+    ASSERT_EQ(vm.interpret(script), aankaa::INTERPRET_OK);
+    EXPECT_EQ(global(vm, "b").as_number(), 1.5);
+    EXPECT_EQ(global(vm, "d").as_string(), global(vm, "c").as_string());
+    EXPECT_TRUE(global(vm, "f").is_number());
+    EXPECT_TRUE(std::signbit(global(vm, "h").as_number()));
+    EXPECT_FALSE(std::signbit(global(vm, "g").as_number()));
+}
+
+TEST_F(VMTest, test_wide_operands) {
+    auto ops_of = [](aankaa::ObjFunction* function) {
+        std::set<uint8_t> ops;
+        std::vector<uint8_t>& code = function->chunk->code;
+        for (size_t i = 0; i < code.size(); i += aankaa::op_size(code[i])) {
+            ops.insert(code[i]);
+        }
+        return ops;
+    };
+    const std::set<uint8_t> long_ops = {
+        aankaa::OP_CONSTANT_LONG, aankaa::OP_GET_GLOBAL_LONG, aankaa::OP_DEFINE_GLOBAL_LONG,
+        aankaa::OP_SET_GLOBAL_LONG, aankaa::OP_JUMP_LONG, aankaa::OP_JUMP_IF_FALSE_LONG,
+        aankaa::OP_LOOP_LONG};
+
+    // 超过256个常量和全局变量，循环体和分支超过64KB
+    std::string source;
+    for (int i = 0; i < 300; ++i) {
+        source += "var g" + std::to_string(i) + " = " + std::to_string(i) + ".5;\n";
+    }
+    std::string body;
+    for (int i = 0; i < 5000; ++i) {
+        body += "sum = sum + g299;\n";
+    }
+    source += "var sum = 0;\n";
+    source += "if (sum == 0) {\n" + body + "} else { sum = -1; }\n";
+    source += "if (sum < 0) { sum = -1; } else {\n" + body + "}\n";
+    source += "var n = 0;\n";
+    source += "while (n < 3) {\n n = n + 1;\n" + body + "}\n";
+
+    // 寄存器后端不翻译宽格式的指令，整个程序退回栈式VM
+    run_backends(source, [&](VM& vm, aankaa::ObjFunction* script) {
+        std::set<uint8_t> ops = ops_of(script);
+        for (uint8_t op : long_ops) {
+            EXPECT_TRUE(ops.count(op)) << aankaa::op_name[op];
+        }
+        EXPECT_EQ(global(vm, "g299").as_number(), 299.5);
+        EXPECT_EQ(global(vm, "n").as_integer(), 3);
+        EXPECT_EQ(global(vm, "sum").as_number(), 299.5 * 5000 * 5);
+    }, false);
+
+    // 属性、方法和类名的常量下标超过65535时用宽格式
+    std::string names;
+    for (int i = 0; i < 70000; ++i) {
+        names += "var c" + std::to_string(i) + " = " + std::to_string(i) + ".5;\n";
+    }
+    std::string padding;
+    for (int i = 0; i < 300; ++i) {
+        padding += "        " + std::to_string(i) + ".25;\n";
+    }
+    names += "class A { get() { return this.v; } }\n"
+             "class B < A {\n"
+             "    init() { this.v = 1; }\n"
+             "    get() {\n" + padding +
+             "        var m = super.get;\n"
+             "        return m() + super.get();\n"
+             "    }\n"
+             "}\n"
+             "var b = B();\n"
+             "b.w = 2;\n"
+             "var r = b.get() + b.w + b.v;\n";
+    {
+        VM vm;
+        aankaa::ObjFunction* script = compile(vm, names);
+        ASSERT_NE(script, nullptr);
+        std::set<uint8_t> ops = ops_of(script);
+        for (const aankaa::Value& constant : script->chunk->constants) {
+            if (constant.is_obj_type(aankaa::OBJ_FUNCTION)) {
+                std::set<uint8_t> method_ops = ops_of(constant.as_function());
+                ops.insert(method_ops.begin(), method_ops.end());
+            }
+        }
+        for (uint8_t op : {aankaa::OP_CLASS_LONG, aankaa::OP_METHOD_LONG, aankaa::OP_GET_PROPERTY_LONG,
+                           aankaa::OP_SET_PROPERTY_LONG, aankaa::OP_INVOKE_LONG, aankaa::OP_GET_SUPER_LONG,
+                           aankaa::OP_SUPER_INVOKE_LONG}) {
+            EXPECT_TRUE(ops.count(op)) << aankaa::op_name[op];
+        }
+        ASSERT_EQ(vm.interpret(script), aankaa::INTERPRET_OK);
+        EXPECT_EQ(global(vm, "r").as_integer(), 5);
+    }
+
+    // 小脚本仍然只用短格式
+    VM vm;
+    aankaa::ObjFunction* script = compile(vm, "var a = 1; if (a) { a = 2; } else { a = 3; } while (a < 5) a = a + 1;");
+    ASSERT_NE(script, nullptr);
+    for (uint8_t op : ops_of(script)) {
+        EXPECT_FALSE(long_ops.count(op)) << aankaa::op_name[op];
+    }
+}
+
+TEST_F(VMTest, test_growable_stack) {
+    // 值栈和调用栈不再内嵌在VM里
+    EXPECT_LT(sizeof(VM), 4096u);
+
+    const std::string source =
+        "fun depth(n) { if (n < 1) return 0; return depth(n - 1) + 1; }\n"
+        "var d = depth(10000);\n";
+    for (aankaa::Backend backend : {aankaa::BACKEND_STACK, aankaa::BACKEND_REGISTER}) {
+        VM vm;
+        vm.backend = backend;
+        size_t initial = vm.stack.committed_bytes();
+        ASSERT_EQ(run(vm, source), aankaa::INTERPRET_OK);
+        EXPECT_EQ(global(vm, "d").as_integer(), 10000);
+        EXPECT_EQ(vm.stack_top, vm.stack_bottom);
+        EXPECT_GT(vm.stack.committed_bytes(), initial);
+        EXPECT_GE(vm.frames.committed_bytes(), 10000 * sizeof(aankaa::CallFrame));
+
+        // 深递归之后把内存还回去，再跑一次还能重新commit
+        vm.shrink_stack();
+        EXPECT_EQ(vm.stack.committed_bytes(), initial);
+        EXPECT_LT(vm.frames.committed_bytes(), 10000 * sizeof(aankaa::CallFrame));
+        ASSERT_EQ(run(vm, source), aankaa::INTERPRET_OK);
+        EXPECT_EQ(global(vm, "d").as_integer(), 10000);
+    }
+
+    // 最大深度可以配置，超过时是运行时错误而不是崩溃
+    for (aankaa::Backend backend : {aankaa::BACKEND_STACK, aankaa::BACKEND_REGISTER}) {
+        VM vm(100);
+        vm.backend = backend;
+        EXPECT_EQ(vm.frames.max_frames(), 100u);
+        ASSERT_EQ(run(vm, "fun depth(n) { if (n < 1) return 0; return depth(n - 1) + 1; }\n"
+                          "var d = depth(98);\n"), aankaa::INTERPRET_OK);
+        EXPECT_EQ(global(vm, "d").as_integer(), 98);
+        EXPECT_EQ(run(vm, "fun depth(n) { if (n < 1) return 0; return depth(n - 1) + 1; }\n"
+                          "var d = depth(99);\n"), aankaa::INTERPRET_RUNTIME_ERROR);
+        EXPECT_EQ(vm.frames.frame_count(), 0);
+        EXPECT_EQ(vm.stack_top, vm.stack_bottom);
+    }
+}
+
+TEST_F(VMTest, test_deep_expression) {
+    // 嵌套很深的表达式的临时值超过FRAME_SLOTS，进入栈帧时按编译器算出的栈深度commit
+    std::string nested = "1";
+    for (int i = 0; i < 1000; ++i) {
+        nested = "(x + " + nested + ")";
+    }
+    const std::string source =
+        "var x = 1;\n"
+        "var top = " + nested + ";\n"
+        "fun deep(x) { return " + nested + "; }\n"
+        "fun shallow(x) { return deep(x); }\n"
+        "class C { deep(x) { return " + nested + "; } }\n"
+        "var called = deep(2);\n"
+        "var tail = shallow(3);\n"
+        "var invoked = C().deep(4);\n";
+    for (aankaa::Backend backend : {aankaa::BACKEND_STACK, aankaa::BACKEND_REGISTER}) {
+        VM vm;
+        vm.backend = backend;
+        ASSERT_EQ(run(vm, source), aankaa::INTERPRET_OK);
+        EXPECT_EQ(global(vm, "top").as_integer(), 1001);
+        EXPECT_EQ(global(vm, "called").as_integer(), 2001);
+        EXPECT_EQ(global(vm, "tail").as_integer(), 3001);
+        EXPECT_EQ(global(vm, "invoked").as_integer(), 4001);
+        EXPECT_GT(global(vm, "deep").as_function()->chunk->max_stack, static_cast<int>(aankaa::FRAME_SLOTS));
+        EXPECT_EQ(vm.stack_top, vm.stack_bottom);
+    }
+
+    // 栈的最大容量放不下时是运行时错误而不是崩溃
+    for (int i = 0; i < 2000; ++i) {
+        nested = "(x + " + nested + ")";
+    }
+    VM small(2);
+    EXPECT_EQ(run(small, "var x = 1; var top = " + nested + ";"), aankaa::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(small.frames.frame_count(), 0);
+    EXPECT_EQ(small.stack_top, small.stack_bottom);
+    EXPECT_EQ(run(small, "fun deep(x) { return " + nested + "; } var top = deep(1);"),
+              aankaa::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(small.frames.frame_count(), 0);
+}
+
+TEST_F(VMTest, test_call_site_cache) {
+    VM vm;
+    aankaa::ObjFunction* script = compile(vm,
+        "fun inc(x) { return x + 1; }\n"
+        "fun dec(x) { return x - 1; }\n"
+        "fun twice(x) { return x + x; }\n"
+        "fun half(x) { return x / 2; }\n"
+        "fun neg(x) { return -x; }\n"
+        "fun apply(f, x) { var r = f(x); return r; }\n"
+        "var n = 0;\n"
+        "var i = 0;\n"
+        "while (i < 100) { n = inc(n); i = i + 1; }\n"
+        "var r = 0;\n"
+        "i = 0;\n"
+        "while (i < 10) {\n"
+        "    r = r + apply(inc, 1) + apply(dec, 1) + apply(twice, 1) + apply(half, 2) + apply(neg, 1);\n"
+        "    i = i + 1;\n"
+        "}\n");
+    ASSERT_NE(script, nullptr);
+    ASSERT_EQ(vm.interpret(script), aankaa::INTERPRET_OK);
+    EXPECT_EQ(global(vm, "n").as_integer(), 100);
+    EXPECT_EQ(global(vm, "r").to_double(), 40.0);
+
+    auto call_sites = [](aankaa::ObjFunction* function) {
+        std::vector<aankaa::CallSiteCache*> sites;
+        aankaa::Chunk* chunk = function->chunk;
+        for (size_t pos = 0; pos < chunk->code.size(); pos += aankaa::op_size(chunk->code[pos])) {
+            if (chunk->code[pos] == aankaa::OP_CALL_CACHED) {
+                sites.push_back(chunk->call_cache(pos));
+            }
+        }
+        return sites;
+    };
+    aankaa::ObjFunction* inc = global(vm, "inc").as_function();
+    // 单态：第一次调用填充缓存，之后都命中
+    std::vector<aankaa::CallSiteCache*> sites = call_sites(script);
+    ASSERT_EQ(sites.size(), 6u);
+    EXPECT_EQ(sites[0]->count, 1);
+    EXPECT_EQ(sites[0]->functions[0], inc);
+    EXPECT_EQ(sites[0]->entries[0], inc->chunk->code.data());
+    EXPECT_EQ(sites[0]->hits, 99u);
+    EXPECT_EQ(sites[0]->misses, 1u);
+
+    // 多态：apply里的调用点缓存前4个函数，第5个一直走通用路径
+    sites = call_sites(global(vm, "apply").as_function());
+    ASSERT_EQ(sites.size(), 1u);
+    EXPECT_EQ(sites[0]->count, aankaa::CALL_CACHE_WAYS);
+    EXPECT_EQ(sites[0]->hits, 36u);
+    EXPECT_EQ(sites[0]->misses, 14u);
+
+    std::ostringstream stats;
+    aankaa::print_call_site_stats(script, stats);
+    EXPECT_NE(stats.str().find("script@"), std::string::npos) << stats.str();
+    EXPECT_NE(stats.str().find("hits:36 misses:14 targets:inc,dec,twice,half"), std::string::npos) << stats.str();
+
+    // 参数个数不对的函数不进缓存
+    ASSERT_EQ(run(vm, "fun two(a, b) { return a; }\n"
+                      "fun one(a) { return a; }\n"
+                      "fun call1(f) { var r = f(1); return r; }\n"
+                      "var c = call1(one);\n"), aankaa::INTERPRET_OK);
+    EXPECT_EQ(run(vm, "call1(two);"), aankaa::INTERPRET_RUNTIME_ERROR);
+    sites = call_sites(global(vm, "call1").as_function());
+    ASSERT_EQ(sites.size(), 1u);
+    EXPECT_EQ(sites[0]->count, 1);
+
+    // 执行过的函数写进字节码缓存时改写回OP_CALL，加载之后仍然可以执行
+    std::string path = testing::TempDir() + "aankaa_call_cache_" + std::to_string(getpid()) + ".bc";
+    std::string error;
+    ASSERT_TRUE(aankaa::write_bytecode(&vm, script, 1, path, &error)) << error;
+    VM loaded_vm;
+    aankaa::ObjFunction* loaded = aankaa::load_bytecode(&loaded_vm, path, 1, &error);
+    unlink(path.c_str());
+    ASSERT_NE(loaded, nullptr) << error;
+    EXPECT_TRUE(call_sites(loaded).empty());
+    ASSERT_EQ(loaded_vm.interpret(loaded), aankaa::INTERPRET_OK);
+    EXPECT_EQ(global(loaded_vm, "r").to_double(), 40.0);
+}
+
+TEST_F(VMTest, test_tail_call) {
+    const std::string source =
+        "fun count(n, acc) { if (n < 1) return acc; return count(n - 1, acc + 1); }\n"
+        "fun is_even(n) { if (n < 1) return 1 < 2; return is_odd(n - 1); }\n"
+        "fun is_odd(n) { if (n < 1) return 2 < 1; return is_even(n - 1); }\n"
+        "fun guard(n) { return n > 0 and count(n, 0); }\n"
+        "fun now() { return clock(); }\n"
+        "var c = count(3000000, 0);\n"
+        "var e = is_even(1000001);\n"
+        "var g = guard(10);\n"
+        "var z = guard(0);\n"
+        "var t = now() > 0;\n"
+        // 折叠掉的分支里的调用不会让后面的return被当成尾调用
+        "fun one() { return 1; }\n"
+        "fun dead_call() { var a = 0; if (1 > 2) one(); return a = 7; }\n"
+        "var d = dead_call();\n";
+    // 尾递归只占用常数个栈帧，最大深度很小也能跑完
+    run_backends(source, [&](VM& vm, aankaa::ObjFunction*) {
+        EXPECT_EQ(global(vm, "c").as_integer(), 3000000);
+        EXPECT_FALSE(global(vm, "e").as_bool());
+        EXPECT_EQ(global(vm, "g").as_integer(), 10);
+        EXPECT_FALSE(global(vm, "z").as_bool());
+        EXPECT_TRUE(global(vm, "t").as_bool());
+        EXPECT_EQ(global(vm, "d").as_integer(), 7);
+        EXPECT_EQ(vm.frames.committed_bytes(), static_cast<size_t>(getpagesize()));
+
+        // 尾调用的参数个数不对仍然报错
+        EXPECT_EQ(run(vm, "fun one(a) { return a; } fun bad() { return one(); } bad();"),
+                  aankaa::INTERPRET_RUNTIME_ERROR);
+    }, true, 8);
+
+    auto has_op = [](aankaa::ObjFunction* function, uint8_t op) {
+        std::vector<uint8_t>& code = function->chunk->code;
+        for (size_t i = 0; i < code.size(); i += aankaa::op_size(code[i])) {
+            if (code[i] == op) {
+                return true;
+            }
+        }
+        return false;
+    };
+    // 只有返回值本身就是调用结果时才是尾调用
+    VM vm;
+    ASSERT_EQ(run(vm, "fun id(x) { return x; }\n"
+                      "fun tail(x) { return id(x); }\n"
+                      "fun not_tail(x) { return id(x) + 1; }\n"
+                      "fun nested(x) { return id(id(x)); }\n"), aankaa::INTERPRET_OK);
+    EXPECT_TRUE(has_op(global(vm, "tail").as_function(), aankaa::OP_TAIL_CALL));
+    EXPECT_FALSE(has_op(global(vm, "not_tail").as_function(), aankaa::OP_TAIL_CALL));
+    aankaa::ObjFunction* nested = global(vm, "nested").as_function();
+    EXPECT_TRUE(has_op(nested, aankaa::OP_TAIL_CALL));
+    EXPECT_TRUE(has_op(nested, aankaa::OP_CALL));
+
+    // 关掉之后深递归会超过最大深度
+    VM no_tail_vm(1000);
+    aankaa::ObjFunction* script = compile(no_tail_vm, source,
+        [](Parser& parser) { parser.enable_tail_calls = false; });
+    ASSERT_NE(script, nullptr);
+    EXPECT_EQ(no_tail_vm.interpret(script), aankaa::INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_F(VMTest, test_closures) {
+    const std::string source =
+        "fun make_counter() {\n"
+        "    var n = 0;\n"
+        "    fun inc() { n = n + 1; return n; }\n"
+        "    return inc;\n"
+        "}\n"
+        "fun adder(k) { fun add(x) { return x + k; } return add; }\n"
+        "fun outer() {\n"
+        "    var x = 1;\n"
+        "    fun mid() { fun inner() { return x + 100; } return inner; }\n"
+        "    x = 7;\n"
+        "    return mid();\n"
+        "}\n"
+        "fun fib_local(n) {\n"
+        "    fun fib(k) { if (k < 2) return k; return fib(k - 1) + fib(k - 2); }\n"
+        "    return fib(n);\n"
+        "}\n"
+        "fun each_scope() {\n"
+        "    var sum = 0;\n"
+        "    for (var i = 0; i < 3; i = i + 1) { var j = i * 10; fun g() { return j; } sum = sum + g(); }\n"
+        "    return sum;\n"
+        "}\n"
+        "fun shared() {\n"
+        "    var v = 1;\n"
+        "    fun get() { return v; }\n"
+        "    fun set(x) { v = x; }\n"
+        "    set(42);\n"
+        "    return get() + v;\n"
+        "}\n"
+        "fun plain() { fun h() { return 3; } return h; }\n"
+        "var counter = make_counter();\n"
+        "counter(); counter();\n"
+        "var count = counter();\n"
+        "var add5 = adder(5);\n"
+        "var added = add5(10);\n"
+        "var transitive = outer()();\n"
+        "var fib = fib_local(15);\n"
+        "var scoped = each_scope();\n"
+        "var both = shared();\n"
+        "var h = plain();\n";
+    for (bool stress : {false, true}) {
+        run_backends(source, [&](VM& vm, aankaa::ObjFunction*) {
+            EXPECT_EQ(global(vm, "count").as_integer(), 3);
+            EXPECT_EQ(global(vm, "added").as_integer(), 15);
+            EXPECT_EQ(global(vm, "transitive").as_integer(), 107);
+            EXPECT_EQ(global(vm, "fib").as_integer(), 610);
+            EXPECT_EQ(global(vm, "scoped").as_integer(), 30);
+            EXPECT_EQ(global(vm, "both").as_integer(), 84);
+
+            // 被赋值过的变量通过ObjUpvalue共享，只读的变量直接复制进闭包
+            Value counter = global(vm, "counter");
+            ASSERT_TRUE(counter.is_obj_type(aankaa::OBJ_CLOSURE));
+            ASSERT_EQ(counter.as_closure()->count, 1);
+            EXPECT_TRUE(counter.as_closure()->captures()[0].is_obj_type(aankaa::OBJ_UPVALUE));
+            Value add5 = global(vm, "add5");
+            ASSERT_TRUE(add5.is_obj_type(aankaa::OBJ_CLOSURE));
+            EXPECT_EQ(add5.as_closure()->captures()[0].as_integer(), 5);
+            // 没有捕获变量的函数不创建闭包
+            EXPECT_TRUE(global(vm, "h").is_obj_type(aankaa::OBJ_FUNCTION));
+        }, true, aankaa::DEFAULT_MAX_FRAMES, stress);
+    }
+
+    // 只读捕获的函数只用OP_GET_UPVALUE，被赋值的捕获改成间接访问
+    auto count_op = [](aankaa::ObjFunction* function, uint8_t op) {
+        std::vector<uint8_t>& code = function->chunk->code;
+        int count = 0;
+        for (size_t i = 0; i < code.size(); i += aankaa::op_size(code[i])) {
+            count += code[i] == op;
+        }
+        return count;
+    };
+    VM vm;
+    ASSERT_EQ(run(vm, source), aankaa::INTERPRET_OK);
+    aankaa::ObjFunction* add = global(vm, "add5").as_closure()->function;
+    EXPECT_EQ(count_op(add, aankaa::OP_GET_UPVALUE), 1);
+    EXPECT_EQ(count_op(add, aankaa::OP_GET_UPVALUE_CELL), 0);
+    EXPECT_FALSE(add->upvalues[0].boxed);
+    aankaa::ObjFunction* inc = global(vm, "counter").as_closure()->function;
+    EXPECT_EQ(count_op(inc, aankaa::OP_GET_UPVALUE), 0);
+    EXPECT_EQ(count_op(inc, aankaa::OP_GET_UPVALUE_CELL), 2);
+    EXPECT_EQ(count_op(inc, aankaa::OP_SET_UPVALUE), 1);
+    EXPECT_TRUE(inc->upvalues[0].boxed);
+    EXPECT_EQ(count_op(global(vm, "make_counter").as_function(), aankaa::OP_CLOSURE), 1);
+    // 外层函数自己读写被捕获的变量时也要经过ObjUpvalue
+    EXPECT_EQ(count_op(global(vm, "shared").as_function(), aankaa::OP_GET_LOCAL_CELL), 1);
+    EXPECT_EQ(count_op(global(vm, "plain").as_function(), aankaa::OP_CLOSURE), 0);
+
+    EXPECT_EQ(run(vm, "fun f() { var a = 1; fun g() { return a(); } return g(); } f();"),
+              aankaa::INTERPRET_RUNTIME_ERROR);
+}
+TEST_F(VMTest, test_classes) {
+    const std::string source =
+        "class Point {\n"
+        "    init(x, y) { this.x = x; this.y = y; }\n"
+        "    sum() { return this.x + this.y; }\n"
+        "    scale(k) { this.x = this.x * k; this.y = this.y * k; return this; }\n"
+        "    getter() { fun get() { return this.x; } return get; }\n"
+        "}\n"
+        "class Point3 < Point {\n"
+        "    init(x, y, z) { super.init(x, y); this.z = z; }\n"
+        "    sum() { return super.sum() + this.z; }\n"
+        "    base() { var m = super.sum; return m(); }\n"
+        "}\n"
+        "fun seven() { return 7; }\n"
+        "var p = Point(1, 2);\n"
+        "var q = Point(3, 4);\n"
+        "var r = Point3(1, 2, 3);\n"
+        "var sum = p.sum() + q.sum();\n"
+        "var scaled = p.scale(10).sum();\n"
+        "var sum3 = r.sum();\n"
+        "var base = r.base();\n"
+        "var bound = q.sum;\n"
+        "var bound_sum = bound();\n"
+        "var get = q.getter();\n"
+        "var captured = get();\n"
+        "q.f = seven;\n"
+        "var field_call = q.f();\n"
+        "var reinit = p.init(5, 6).sum();\n"
+        "var i = 0;\n"
+        "var loop = 0;\n"
+        "while (i < 100) { loop = loop + q.x + q.sum(); i = i + 1; }\n";
+    for (bool stress : {false, true}) {
+        // 寄存器后端不翻译类相关的指令，整个程序退回栈式VM
+        run_backends(source, [&](VM& vm, aankaa::ObjFunction*) {
+            EXPECT_EQ(global(vm, "sum").as_integer(), 10);
+            EXPECT_EQ(global(vm, "scaled").as_integer(), 30);
+            EXPECT_EQ(global(vm, "sum3").as_integer(), 6);
+            EXPECT_EQ(global(vm, "base").as_integer(), 3);
+            EXPECT_EQ(global(vm, "bound_sum").as_integer(), 7);
+            EXPECT_EQ(global(vm, "captured").as_integer(), 3);
+            EXPECT_EQ(global(vm, "field_call").as_integer(), 7);
+            EXPECT_EQ(global(vm, "reinit").as_integer(), 11);
+            EXPECT_EQ(global(vm, "loop").as_integer(), 1000);
+            EXPECT_TRUE(global(vm, "bound").is_obj_type(aankaa::OBJ_BOUND_METHOD));
+
+            // 按同样顺序添加字段的实例共享同一个shape，字段按下标存放
+            Value p = global(vm, "p");
+            Value q = global(vm, "q");
+            ASSERT_TRUE(p.is_obj_type(aankaa::OBJ_INSTANCE));
+            aankaa::ObjInstance* pi = static_cast<aankaa::ObjInstance*>(p.as_obj());
+            aankaa::ObjInstance* qi = static_cast<aankaa::ObjInstance*>(q.as_obj());
+            EXPECT_EQ(pi->fields.size(), 2u);
+            EXPECT_EQ(pi->fields.size(), pi->shape->keys.size());
+            EXPECT_EQ(qi->fields.size(), 3u);
+            EXPECT_EQ(qi->shape->keys.size(), 3u);
+            EXPECT_EQ(qi->shape->find(vm.copy_string("f", 1)), 2);
+            EXPECT_EQ(pi->klass(), qi->klass());
+            EXPECT_EQ(pi->klass()->field_hint, 3u);
+            aankaa::ObjInstance* ri = static_cast<aankaa::ObjInstance*>(global(vm, "r").as_obj());
+            EXPECT_NE(ri->klass(), pi->klass());
+            EXPECT_EQ(ri->fields.size(), 3u);
+        }, false, aankaa::DEFAULT_MAX_FRAMES, stress);
+    }
+
+    auto property_sites = [](aankaa::ObjFunction* function, uint8_t op) {
+        std::vector<aankaa::PropertyCache*> sites;
+        aankaa::Chunk* chunk = function->chunk;
+        for (size_t pos = 0; pos < chunk->code.size(); pos += aankaa::op_size(chunk->code[pos])) {
+            if (chunk->code[pos] == op) {
+                sites.push_back(chunk->property_cache(pos));
+            }
+        }
+        return sites;
+    };
+    VM vm;
+    aankaa::ObjFunction* script = compile(vm, source);
+    ASSERT_NE(script, nullptr);
+    ASSERT_EQ(vm.interpret(script), aankaa::INTERPRET_OK);
+    // 循环里的字段读取和方法调用：第一次填充缓存，之后都命中
+    std::vector<aankaa::PropertyCache*> gets = property_sites(script, aankaa::OP_GET_PROPERTY);
+    ASSERT_FALSE(gets.empty());
+    EXPECT_EQ(gets.back()->count, 1);
+    EXPECT_EQ(gets.back()->hits, 99u);
+    EXPECT_EQ(gets.back()->misses, 1u);
+    std::vector<aankaa::PropertyCache*> invokes = property_sites(script, aankaa::OP_INVOKE);
+    ASSERT_FALSE(invokes.empty());
+    EXPECT_EQ(invokes.back()->hits, 99u);
+    EXPECT_EQ(invokes.back()->misses, 1u);
+    ASSERT_NE(invokes.back()->entries[0].function, nullptr);
+    EXPECT_EQ(invokes.back()->entries[0].slot, -1);
+
+    // 多态：同一个访问点见到的shape超过缓存路数后，多出来的一直走查找
+    ASSERT_EQ(run(vm, "class S {}\n"
+                      "fun make(n) {\n"
+                      "    var o = S();\n"
+                      "    if (n < 1) o.a = 0; if (n < 2) o.b = 0; if (n < 3) o.c = 0;\n"
+                      "    if (n < 4) o.d = 0; if (n < 5) o.e = 0;\n"
+                      "    o.v = n;\n"
+                      "    return o;\n"
+                      "}\n"
+                      "fun read(o) { return o.v; }\n"
+                      "var objs0 = make(0); var objs1 = make(1); var objs2 = make(2);\n"
+                      "var objs3 = make(3); var objs4 = make(4);\n"
+                      "var total = 0;\n"
+                      "for (var k = 0; k < 10; k = k + 1) {\n"
+                      "    total = total + read(objs0) + read(objs1) + read(objs2) + read(objs3) + read(objs4);\n"
+                      "}\n"), aankaa::INTERPRET_OK);
+    EXPECT_EQ(global(vm, "total").as_integer(), 100);
+    gets = property_sites(global(vm, "read").as_function(), aankaa::OP_GET_PROPERTY);
+    ASSERT_EQ(gets.size(), 1u);
+    EXPECT_EQ(gets[0]->count, aankaa::PROPERTY_CACHE_WAYS);
+    EXPECT_EQ(gets[0]->hits, 36u);
+    EXPECT_EQ(gets[0]->misses, 14u);
+
+    std::ostringstream stats;
+    aankaa::print_call_site_stats(global(vm, "read").as_function(), stats);
+    EXPECT_NE(stats.str().find("get_property(v) hits:36 misses:14 shapes:4"), std::string::npos) << stats.str();
+
+    // 缓存不保留类：每次执行都定义新的类，回收后旧的shape从缓存里去掉，新的shape还能进缓存
+    ASSERT_EQ(run(vm, "fun get_a(o) { return o.a; }"), aankaa::INTERPRET_OK);
+    for (int k = 0; k < aankaa::PROPERTY_CACHE_WAYS * 2; ++k) {
+        ASSERT_EQ(run(vm, "class K { init() { this.a = 1; } }\n"
+                          "var a2 = get_a(K()) + get_a(K());\n"), aankaa::INTERPRET_OK);
+        vm.collect_garbage();
+    }
+    gets = property_sites(global(vm, "get_a").as_function(), aankaa::OP_GET_PROPERTY);
+    ASSERT_EQ(gets.size(), 1u);
+    EXPECT_LT(gets[0]->count, aankaa::PROPERTY_CACHE_WAYS);
+    EXPECT_EQ(gets[0]->hits, uint64_t(aankaa::PROPERTY_CACHE_WAYS * 2));
+
+    EXPECT_EQ(run(vm, "var n = 1; n.x;"), aankaa::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run(vm, "var n = 1; n.x = 2;"), aankaa::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run(vm, "p.missing;"), aankaa::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run(vm, "p.missing();"), aankaa::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run(vm, "Point(1);"), aankaa::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run(vm, "class E {} E(1);"), aankaa::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run(vm, "var n = 1; class E < n {}"), aankaa::INTERPRET_RUNTIME_ERROR);
+
+    for (const char* bad : {"print this;", "fun f() { return super.x; }", "class E { f() { return super.x; } }",
+                            "class E < E {}", "class E { init() { return 1; } }"}) {
+        VM compile_vm;
+        Scanner bad_scanner;
+        bad_scanner.reset(bad);
+        Parser bad_parser(&bad_scanner, &compile_vm);
+        bad_parser.advance();
+        EXPECT_EQ(bad_parser.compile(), nullptr) << bad;
+    }
+}
+}